@@ -0,0 +1,76 @@
+// Main module of the benchmark suite (see main.mm). The bridge benchmarks run
+// from native code once this module has loaded; the event loop benchmarks
+// below generate synthetic load and run once native code hands control to the
+// loop.
+var net = require('net');
+
+// Run the loop scenarios one after the other, calling
+// report(name, operations, seconds) for each. |now| returns monotonic seconds.
+exports.runLoopScenarios = function (options, report, now) {
+  var scenarios = [timerChain, timerBurst, pingPong, channelMessages];
+  (function next() {
+    var scenario = scenarios.shift();
+    if (scenario) scenario(options, report, now, next);
+  })();
+};
+
+// setTimeout(1) re-armed from its own callback
+function timerChain(options, report, now, done) {
+  var remaining = options.timers, start = now();
+  (function tick() {
+    if (--remaining > 0) return setTimeout(tick, 1);
+    report('loop.timers.chain', options.timers, now() - start);
+    done();
+  })();
+}
+
+// Many zero-delay timers armed at once
+function timerBurst(options, report, now, done) {
+  var remaining = options.timers, start = now();
+  function fired() {
+    if (--remaining > 0) return;
+    report('loop.timers.burst', options.timers, now() - start);
+    done();
+  }
+  for (var i = 0; i < options.timers; i++) setTimeout(fired, 0);
+}
+
+// One-byte round trips over a loopback TCP connection
+function pingPong(options, report, now, done) {
+  var server = net.createServer(function (socket) {
+    socket.setNoDelay(true);
+    socket.on('data', function (data) { socket.write(data); });
+  });
+  server.listen(options.port, '127.0.0.1', function () {
+    var client = net.createConnection(options.port, '127.0.0.1');
+    var remaining = options.roundTrips, start;
+    client.setNoDelay(true);
+    client.on('connect', function () {
+      start = now();
+      client.write('x');
+    });
+    client.on('data', function () {
+      if (--remaining > 0) return client.write('x');
+      report('loop.socket.roundtrip', options.roundTrips, now() - start);
+      client.end();
+      server.close();
+      done();
+    });
+  });
+}
+
+// Small messages posted from a native thread through process.host's channel
+function channelMessages(options, report, now, done) {
+  var remaining = options.messages, start = now();
+  // the channel doesn't keep the loop alive by itself
+  var keepAlive = setInterval(function () {}, 1000);
+  function received(message) {
+    if (--remaining > 0) return;
+    clearInterval(keepAlive);
+    process.host.removeListener('message', received);
+    report('loop.channel.messages', options.messages, now() - start);
+    done();
+  }
+  process.host.on('message', received);
+  options.postMessages(options.messages);
+}
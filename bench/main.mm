@@ -0,0 +1,757 @@
+// Benchmarks of the bridge hot paths: compiling and evaluating scripts, calling
+// functions, converting values and pumping the event loop.
+//
+// Runs headless (no AppKit event loop -- node is driven by the poll(2) host of
+// NodeJSLoop) and writes its results as JSON to stdout:
+//
+//   nodecocoa-bench [--filter <substring>] [--time <seconds>] [--samples <n>]
+//                   [--main <main.js>]
+//
+//   --filter   Only run benchmarks whose name contains <substring>.
+//   --time     Approximate duration of each sample. Defaults to 0.1.
+//   --samples  Samples per benchmark. Defaults to 5.
+//   --main     Path to main.js. Defaults to main.js next to the executable.
+//
+// Every benchmark is calibrated to run for about --time seconds per sample and
+// reports nanoseconds per operation (min, median, mean and max over the
+// samples). The event loop benchmarks run once and also report the loop's
+// latency histograms. Counters of the caches involved are included at the end
+// so that before/after comparisons can tell hits from misses.
+//
+// Record conversions run twice, with and without the intern table, and both
+// runs also report how much a single conversion allocates ("allocations").
+//
+// Set NODECOCOA_ALLOCATOR=system to run the event loop on CFAllocator instead
+// of the pool allocator (see NodeJSAllocator.h).
+
+#import <NodeCocoa/NodeCocoa.h>
+#import <ev.h>
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+
+using namespace v8;
+
+typedef void (^BenchBlock)(NSUInteger iterations);
+
+static const char* gFilter = NULL;
+static double gSampleTime = 0.1;
+static int gSamples = 5;
+static NSMutableArray* gResults = nil;  // JSON objects (strings)
+static NSMutableArray* gAllocations = nil;  // ditto, of allocation counts
+
+// -----------------------------------------------------------------------------
+// JSON output
+
+static NSString* JSONString(NSString* s) {
+  NSMutableString* out = [NSMutableString stringWithString:@"\""];
+  for (NSUInteger i = 0; i < s.length; ++i) {
+    unichar c = [s characterAtIndex:i];
+    if (c == '"' || c == '\\') [out appendFormat:@"\\%C", c];
+    else if (c < 0x20) [out appendFormat:@"\\u%04x", c];
+    else [out appendFormat:@"%C", c];
+  }
+  [out appendString:@"\""];
+  return out;
+}
+
+static NSString* JSONHistogram(const NodeJSHistogram& h) {
+  return [NSString stringWithFormat:
+      @"{\"count\": %llu, \"mean_us\": %.3f, \"min_us\": %.3f, "
+       "\"max_us\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, "
+       "\"p99_us\": %.3f}",
+      (unsigned long long)h.count, h.count ? h.sum / h.count * 1e6 : 0.0,
+      h.min * 1e6, h.max * 1e6,
+      NodeJSHistogramPercentile(&h, 0.5) * 1e6,
+      NodeJSHistogramPercentile(&h, 0.9) * 1e6,
+      NodeJSHistogramPercentile(&h, 0.99) * 1e6];
+}
+
+// -----------------------------------------------------------------------------
+// Harness
+
+static BOOL Selected(const char* name) {
+  return !gFilter || strstr(name, gFilter) != NULL;
+}
+
+
+static double Measure(BenchBlock block, NSUInteger iterations) {
+  NSAutoreleasePool* pool = [NSAutoreleasePool new];
+  HandleScope scope;
+  double start = NodeJSLoopNow();
+  block(iterations);
+  double elapsed = NodeJSLoopNow() - start;
+  [pool drain];
+  return elapsed;
+}
+
+
+static int CompareDoubles(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+static void Bench(const char* name, BenchBlock block) {
+  if (!Selected(name)) return;
+  // start from a clean heap so that garbage of the previous benchmark isn't
+  // collected on this one's time
+  V8::LowMemoryNotification();
+
+  // calibrate: grow |iterations| until a run takes a tenth of a sample
+  NSUInteger iterations = 1;
+  double elapsed = Measure(block, iterations);
+  while (elapsed < gSampleTime / 10 && iterations < (1U << 30)) {
+    double factor = elapsed > 0 ? gSampleTime / 10 / elapsed : 10;
+    iterations = (NSUInteger)(iterations * MIN(10, MAX(2, factor)));
+    elapsed = Measure(block, iterations);
+  }
+  iterations = MAX(1, (NSUInteger)(iterations * gSampleTime /
+                                   MAX(elapsed, 1e-9)));
+
+  double* ns = (double*)malloc(gSamples * sizeof(double));
+  double sum = 0;
+  for (int i = 0; i < gSamples; ++i) {
+    ns[i] = Measure(block, iterations) * 1e9 / iterations;
+    sum += ns[i];
+  }
+  qsort(ns, gSamples, sizeof(double), &CompareDoubles);
+  double median = gSamples % 2 ? ns[gSamples / 2] :
+      (ns[gSamples / 2 - 1] + ns[gSamples / 2]) / 2;
+  [gResults addObject:[NSString stringWithFormat:
+      @"{\"name\": %@, \"iterations\": %lu, \"samples\": %d, "
+       "\"ns_per_op\": {\"min\": %.2f, \"median\": %.2f, \"mean\": %.2f, "
+       "\"max\": %.2f}, \"ops_per_sec\": %.0f}",
+      JSONString([NSString stringWithUTF8String:name]),
+      (unsigned long)iterations, gSamples, ns[0], median, sum / gSamples,
+      ns[gSamples - 1], median > 0 ? 1e9 / median : 0.0]];
+  free(ns);
+}
+
+
+static void Fail(const char* name, NSError* error) {
+  fprintf(stderr, "%s: %s\n", name, [[error localizedDescription] UTF8String]);
+  exit(1);
+}
+
+// -----------------------------------------------------------------------------
+// +[NodeJS eval:] and compile:
+
+static void EvalBenchmarks() {
+  Bench("eval.cached", ^(NSUInteger n) {
+    for (NSUInteger i = 0; i < n; ++i) {
+      HandleScope scope;
+      [NodeJS eval:@"1 + 2" origin:@"bench" context:nil error:nil];
+    }
+  });
+  Bench("eval.unique", ^(NSUInteger n) {
+    for (NSUInteger i = 0; i < n; ++i) {
+      NSAutoreleasePool* pool = [NSAutoreleasePool new];
+      HandleScope scope;
+      NSString* source = [NSString stringWithFormat:@"%lu + 2",
+                          (unsigned long)i];
+      [NodeJS eval:source origin:nil context:nil error:nil];
+      [pool drain];
+    }
+  });
+  Bench("compile.cached", ^(NSUInteger n) {
+    for (NSUInteger i = 0; i < n; ++i) {
+      HandleScope scope;
+      [NodeJS compile:@"(function (a, b) { return a + b })"
+               origin:@"bench" context:nil error:nil];
+    }
+  });
+  Bench("compile.unique", ^(NSUInteger n) {
+    for (NSUInteger i = 0; i < n; ++i) {
+      NSAutoreleasePool* pool = [NSAutoreleasePool new];
+      HandleScope scope;
+      NSString* source = [NSString stringWithFormat:
+          @"(function (a, b) { return a + b + %lu })", (unsigned long)i];
+      [NodeJS compile:source origin:nil context:nil error:nil];
+      [pool drain];
+    }
+  });
+
+  // Scripts which throw, with each error detail
+  static const struct {
+    const char* name;
+    NodeJSErrorDetail detail;
+  } throws[] = {
+    { "eval.throw.full", NodeJSErrorDetailFull },
+    { "eval.throw.lazy", NodeJSErrorDetailLazy },
+    { "eval.throw.message", NodeJSErrorDetailMessage },
+  };
+  for (size_t t = 0; t < sizeof(throws) / sizeof(throws[0]); ++t) {
+    [NodeJS setErrorDetail:throws[t].detail];
+    Bench(throws[t].name, ^(NSUInteger n) {
+      for (NSUInteger i = 0; i < n; ++i) {
+        NSAutoreleasePool* pool = [NSAutoreleasePool new];
+        HandleScope scope;
+        NSError* error = nil;
+        [NodeJS eval:@"throw new Error('invalid')" origin:@"bench"
+             context:nil error:&error];
+        [pool drain];
+      }
+    });
+  }
+  [NodeJS setErrorDetail:NodeJSErrorDetailFull];
+}
+
+// -----------------------------------------------------------------------------
+// NodeJSFunction
+
+static Handle<Value> Identity(const Arguments& args) {
+  return args[0];
+}
+
+static int32_t AddInt32(int32_t a, int32_t b) {
+  return a + b;
+}
+
+
+static void CallBenchmarks() {
+  NSError* error = nil;
+  NodeJSFunction* cfunction =
+      [[NodeJSFunction alloc] initWithCFunction:&Identity data:(void*)1];
+  NodeJSFunction* block = [[NodeJSFunction alloc] initWithBlock:
+      ^(const Arguments& args) { return Handle<Value>(args[0]); }];
+  NodeJSFunction* bound =
+      [[NodeJSFunction alloc] initWithFunction:NodeJSFunctionBind(&AddInt32)];
+  NodeJSFunction* js = [[NodeJSFunction functionFromString:
+      @"function (x) { return x }" error:&error] retain];
+  if (!js) Fail("call", error);
+  // calls |f| |n| times from JavaScript
+  NodeJSFunction* loop = [[NodeJSFunction functionFromString:
+      @"function (f, n) { for (var i = 0; i < n; i++) f(i, i); }"
+      error:&error] retain];
+  if (!loop) Fail("call", error);
+
+  struct {
+    const char* name;
+    const char* fromJS;
+    NodeJSFunction* f;
+  } calls[] = {
+    { "call.cfunction", "call.from_js.cfunction", cfunction },
+    { "call.block", "call.from_js.block", block },
+    { "call.bound", "call.from_js.bound", bound },
+    { "call.js", "call.from_js.js", js },
+  };
+  for (size_t c = 0; c < sizeof(calls) / sizeof(calls[0]); ++c) {
+    NodeJSFunction* f = calls[c].f;
+    Bench(calls[c].name, ^(NSUInteger n) {
+      Handle<Value> argv[] = { Integer::New(1), Integer::New(2) };
+      for (NSUInteger i = 0; i < n; ++i) {
+        HandleScope scope;
+        [f callWithV8Arguments:argv count:2 error:nil];
+      }
+    });
+    Bench(calls[c].fromJS, ^(NSUInteger n) {
+      Handle<Value> argv[] = { [f v8Value], Integer::New((int32_t)n) };
+      [loop callWithV8Arguments:argv count:2 error:nil];
+    });
+  }
+
+  Bench("function.create.block", ^(NSUInteger n) {
+    for (NSUInteger i = 0; i < n; ++i) {
+      HandleScope scope;
+      NodeJSFunctionWithBlock(^(const Arguments& args) {
+        return Handle<Value>(Integer::New((int32_t)i));
+      });
+    }
+  });
+  Bench("function.create.cfunction", ^(NSUInteger n) {
+    for (NSUInteger i = 0; i < n; ++i) {
+      HandleScope scope;
+      NodeJSFunctionWithCallback(&Identity, (void*)1);
+    }
+  });
+
+  [cfunction release];
+  [block release];
+  [bound release];
+  [js release];
+  [loop release];
+}
+
+// -----------------------------------------------------------------------------
+// v8Value and fromV8Value:
+
+static NSDictionary* NestedDictionary(int depth) {
+  NSMutableDictionary* dict = [NSMutableDictionary dictionary];
+  for (int i = 0; i < 10; ++i) {
+    NSString* key = [NSString stringWithFormat:@"key%d", i];
+    if (depth > 1) {
+      [dict setObject:NestedDictionary(depth - 1) forKey:key];
+    } else {
+      [dict setObject:[NSNumber numberWithInt:i] forKey:key];
+    }
+  }
+  [dict setObject:[NSArray arrayWithObjects:@"a", @"b", @"c", nil]
+           forKey:@"list"];
+  return dict;
+}
+
+
+// [[[... [1] ...]]] nested |depth| arrays deep
+static NSArray* DeepArray(int depth) {
+  NSArray* array = [NSArray arrayWithObject:[NSNumber numberWithInt:1]];
+  while (--depth > 0)
+    array = [NSArray arrayWithObject:array];
+  return array;
+}
+
+
+// {key0: 0, key1: 1, ...}
+static NSDictionary* WideDictionary(int count) {
+  NSMutableDictionary* dict = [NSMutableDictionary dictionary];
+  for (int i = 0; i < count; ++i) {
+    [dict setObject:[NSNumber numberWithInt:i]
+             forKey:[NSString stringWithFormat:@"key%d", i]];
+  }
+  return dict;
+}
+
+
+// |count| references to the same dictionary
+static NSArray* SharedReferences(int count) {
+  NSDictionary* shared = NestedDictionary(1);
+  NSMutableArray* array = [NSMutableArray array];
+  for (int i = 0; i < count; ++i)
+    [array addObject:shared];
+  return array;
+}
+
+
+static void ConversionBenchmarks() {
+  NSMutableString* largeString = [NSMutableString string];
+  while (largeString.length < 64 * 1024)
+    [largeString appendString:@"The quick brown fox jumps over the lazy dog. "];
+  NSMutableData* bytes = [NSMutableData dataWithLength:64 * 1024];
+  NSMutableArray* numbers = [NSMutableArray array];
+  NSMutableData* floats = [NSMutableData dataWithLength:100000 * sizeof(float)];
+  for (int i = 0; i < 100000; ++i) {
+    [numbers addObject:[NSNumber numberWithDouble:i * 0.5]];
+    ((float*)[floats mutableBytes])[i] = i * 0.5f;
+  }
+
+  struct { const char* name; id object; } values[] = {
+    { "int", [NSNumber numberWithInt:42] },
+    { "double", [NSNumber numberWithDouble:3.14159] },
+    { "string.short", @"hello, world" },
+    { "string.64k", [[largeString copy] autorelease] },
+    { "data.64k", [[bytes copy] autorelease] },
+    { "dictionary.nested", NestedDictionary(3) },
+    { "dictionary.wide.10k", WideDictionary(10000) },
+    { "array.deep.10k", DeepArray(10000) },  // far past the old 512 limit
+    { "array.shared.1k", SharedReferences(1000) },
+    { "array.numbers.100k", [[numbers copy] autorelease] },
+  };
+  for (size_t v = 0; v < sizeof(values) / sizeof(values[0]); ++v) {
+    id object = values[v].object;
+    char name[128];
+    snprintf(name, sizeof(name), "convert.to_v8.%s", values[v].name);
+    Bench(name, ^(NSUInteger n) {
+      for (NSUInteger i = 0; i < n; ++i) {
+        HandleScope scope;
+        [object v8Value];
+      }
+    });
+    HandleScope scope;
+    Persistent<Value> value = Persistent<Value>::New([object v8Value]);
+    snprintf(name, sizeof(name), "convert.from_v8.%s", values[v].name);
+    Bench(name, ^(NSUInteger n) {
+      for (NSUInteger i = 0; i < n; ++i) {
+        NSAutoreleasePool* pool = [NSAutoreleasePool new];
+        HandleScope scope;
+        [NSObject fromV8Value:Local<Value>::New(value)];
+        [pool drain];
+      }
+    });
+    value.Dispose();
+  }
+
+  // cycles are reported as errors once found, after walking the structure
+  NSMutableArray* cyclic = [NSMutableArray arrayWithObject:DeepArray(100)];
+  [cyclic addObject:cyclic];
+  Bench("convert.to_v8.array.cyclic", ^(NSUInteger n) {
+    for (NSUInteger i = 0; i < n; ++i) {
+      HandleScope scope;
+      [cyclic v8Value];
+    }
+  });
+  [cyclic removeLastObject];  // break the cycle so the array can be freed
+  {
+    HandleScope scope;
+    Persistent<Value> value = Persistent<Value>::New(
+        [NodeJS eval:@"var o = {a: [1, 2, 3], b: {c: 'd'}}; o.b.self = o; o"
+              origin:@"bench" context:nil error:nil]);
+    Bench("convert.from_v8.object.cyclic", ^(NSUInteger n) {
+      for (NSUInteger i = 0; i < n; ++i) {
+        NSAutoreleasePool* pool = [NSAutoreleasePool new];
+        HandleScope scope;
+        [NSObject fromV8Value:Local<Value>::New(value)];
+        [pool drain];
+      }
+    });
+    value.Dispose();
+  }
+
+  // shared-memory and typed variants of the above
+  NSData* data = [[bytes copy] autorelease];
+  Bench("convert.to_v8.data.64k.nocopy", ^(NSUInteger n) {
+    for (NSUInteger i = 0; i < n; ++i) {
+      HandleScope scope;
+      [data v8ValueNoCopy];
+    }
+  });
+  {
+    HandleScope scope;
+    Persistent<Object> buffer =
+        Persistent<Object>::New([data v8Value]->ToObject());
+    Bench("convert.from_v8.data.64k.nocopy", ^(NSUInteger n) {
+      for (NSUInteger i = 0; i < n; ++i) {
+        NSAutoreleasePool* pool = [NSAutoreleasePool new];
+        HandleScope scope;
+        [NSData dataWithNodeBufferNoCopy:Local<Object>::New(buffer)];
+        [pool drain];
+      }
+    });
+    buffer.Dispose();
+  }
+  NSData* floatData = [[floats copy] autorelease];
+  Bench("convert.to_v8.typed.float.100k", ^(NSUInteger n) {
+    for (NSUInteger i = 0; i < n; ++i) {
+      HandleScope scope;
+      [floatData v8ArrayWithElementType:NodeJSFloatElements];
+    }
+  });
+  HandleScope scope;
+  Persistent<Object> typed = Persistent<Object>::New(
+      [floatData v8ArrayWithElementType:NodeJSFloatElements]);
+  Bench("convert.from_v8.typed.float.100k", ^(NSUInteger n) {
+    for (NSUInteger i = 0; i < n; ++i) {
+      NSAutoreleasePool* pool = [NSAutoreleasePool new];
+      HandleScope scope;
+      [NSData dataWithV8Array:Local<Value>::New(typed)
+                  elementType:NodeJSFloatElements];
+      [pool drain];
+    }
+  });
+  typed.Dispose();
+}
+
+// -----------------------------------------------------------------------------
+// Event loop
+
+static void ReportScenario(NSString* name, double operations,
+                           double seconds) {
+  if (!Selected([name UTF8String])) return;
+  [gResults addObject:[NSString stringWithFormat:
+      @"{\"name\": %@, \"iterations\": %.0f, \"samples\": 1, "
+       "\"ns_per_op\": {\"min\": %.2f, \"median\": %.2f, \"mean\": %.2f, "
+       "\"max\": %.2f}, \"ops_per_sec\": %.0f}",
+      JSONString(name), operations, seconds * 1e9 / operations,
+      seconds * 1e9 / operations, seconds * 1e9 / operations,
+      seconds * 1e9 / operations, seconds > 0 ? operations / seconds : 0.0]];
+}
+
+
+// Posts |count| small messages to JavaScript from a background thread
+static void PostMessages(int32_t count) {
+  dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                 ^{
+    NSAutoreleasePool* pool = [NSAutoreleasePool new];
+    NodeJSChannel* channel = [NodeJSChannel sharedChannel];
+    NSString* name = @"tick";
+    for (int32_t i = 0; i < count; ++i) {
+      NSDictionary* message = [NSDictionary dictionaryWithObjectsAndKeys:
+          name, @"name", [NSNumber numberWithInt:i], @"seq", nil];
+      while (![channel postMessage:message])
+        usleep(50);  // ring full: let node catch up
+      if (i % 256 == 255) {
+        [pool drain];
+        pool = [NSAutoreleasePool new];
+      }
+    }
+    [pool drain];
+  });
+}
+
+
+// Runs node until the scenarios of main.js are done. Returns the loop's
+// statistics as JSON, or nil if the loop benchmarks are filtered out.
+static NSString* LoopBenchmarks() {
+  static const char* scenarios[] = {
+    "loop.timers.chain", "loop.timers.burst", "loop.socket.roundtrip",
+    "loop.channel.messages"
+  };
+  BOOL selected = NO;
+  for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); ++i)
+    selected = selected || Selected(scenarios[i]);
+  if (!selected) return nil;
+  HandleScope scope;
+  Local<Value> exports =
+      Context::GetCurrent()->Global()->Get(String::NewSymbol("exports"));
+  Local<Value> run = exports->IsObject() ?
+      exports->ToObject()->Get(String::NewSymbol("runLoopScenarios")) :
+      Local<Value>();
+  if (run.IsEmpty() || !run->IsFunction()) {
+    Fail("loop", [NSError nodeErrorWithLocalizedDescription:
+        @"main.js does not export runLoopScenarios"]);
+  }
+  const char* port = getenv("NODECOCOA_BENCH_PORT");
+  Local<Object> options = Object::New();
+  options->Set(String::New("timers"), Integer::New(1000));
+  options->Set(String::New("roundTrips"), Integer::New(10000));
+  options->Set(String::New("port"), Integer::New(port ? atoi(port) : 47011));
+  options->Set(String::New("messages"), Integer::New(50000));
+  options->Set(String::New("postMessages"), NodeJSFunctionBind(&PostMessages));
+  Handle<Value> argv[] = {
+    options, NodeJSFunctionBind(&ReportScenario),
+    NodeJSFunctionBind(&NodeJSLoopNow)
+  };
+  NodeJSLoopResetStatistics();
+  TryCatch try_catch;
+  if (Local<Function>::Cast(run)->Call(options, 3, argv).IsEmpty())
+    Fail("loop", [NSError errorFromV8TryCatch:try_catch]);
+  NodeJSLoopRunWithPoll();
+
+  NodeJSLoopStats stats = NodeJSLoopStatistics();
+  return [NSString stringWithFormat:
+      @"{\"pumps\": %llu, \"readiness_pumps\": %llu, \"empty_pumps\": %llu, "
+       "\"yields\": %llu, \"dispatched\": %llu, "
+       "\"readiness_latency\": %@, \"timer_lateness\": %@}",
+      (unsigned long long)stats.pumps,
+      (unsigned long long)stats.readinessPumps,
+      (unsigned long long)stats.emptyPumps,
+      (unsigned long long)stats.yields,
+      (unsigned long long)stats.dispatched,
+      JSONHistogram(stats.readinessLatency),
+      JSONHistogram(stats.timerLateness)];
+}
+
+// -----------------------------------------------------------------------------
+// Interning: the same record conversions with and without the intern table
+
+static int64_t MallocBytesInUse() {
+#ifdef __APPLE__
+  malloc_statistics_t stats;
+  malloc_zone_statistics(NULL, &stats);
+  return (int64_t)stats.size_in_use;
+#else
+  struct mallinfo info = mallinfo();
+  return (int64_t)info.uordblks + info.hblkhd;
+#endif
+}
+
+
+static size_t V8HeapBytesInUse() {
+  HeapStatistics heap;
+  V8::GetHeapStatistics(&heap);
+  return heap.used_heap_size();
+}
+
+
+static NSArray* Records(NSUInteger count) {
+  NSMutableArray* records = [NSMutableArray arrayWithCapacity:count];
+  for (NSUInteger i = 0; i < count; ++i) {
+    [records addObject:[NSDictionary dictionaryWithObjectsAndKeys:
+        [NSNumber numberWithUnsignedInteger:i], @"id",
+        [NSString stringWithFormat:@"user%lu", (unsigned long)i], @"name",
+        @"someone@example.com", @"email",
+        [NSNumber numberWithInt:(int)(i % 90)], @"age",
+        [NSNumber numberWithDouble:i * 0.25], @"score",
+        [NSNumber numberWithBool:i % 2], @"active",
+        @"2010-11-01", @"created",
+        @"member", @"role", nil]];
+  }
+  return records;
+}
+
+
+// Runs |block| once and records how much it allocated: keys converted
+// without the intern table's help (misses and bypasses), malloc bytes and V8
+// heap bytes still in use before the autorelease pool drains
+static void CountAllocations(const char* name, NSUInteger records,
+                             BenchBlock block) {
+  if (!Selected(name)) return;
+  V8::LowMemoryNotification();
+  NodeJSInternTableResetStatistics();
+  NSAutoreleasePool* pool = [NSAutoreleasePool new];
+  int64_t mallocBefore = MallocBytesInUse();
+  size_t heapBefore = V8HeapBytesInUse();
+  {
+    HandleScope scope;
+    block(1);
+  }
+  int64_t mallocBytes = MallocBytesInUse() - mallocBefore;
+  int64_t heapBytes = (int64_t)V8HeapBytesInUse() - (int64_t)heapBefore;
+  [pool drain];
+  NodeJSInternTableStats intern = NodeJSInternTableStatistics();
+  [gAllocations addObject:[NSString stringWithFormat:
+      @"{\"name\": %@, \"records\": %lu, \"key_allocations\": %llu, "
+       "\"key_lookups\": %llu, \"malloc_bytes\": %lld, "
+       "\"v8_heap_bytes\": %lld}",
+      JSONString([NSString stringWithUTF8String:name]),
+      (unsigned long)records,
+      (unsigned long long)(intern.misses + intern.bypasses),
+      (unsigned long long)(intern.hits + intern.misses + intern.bypasses),
+      (long long)mallocBytes, (long long)heapBytes]];
+}
+
+
+static void InternBenchmarks() {
+  const NSUInteger kRecords = 1000;
+  NSArray* records = Records(kRecords);
+  HandleScope scope;
+  Persistent<Value> value = Persistent<Value>::New([records v8Value]);
+  NodeJSInternTableStats defaults = NodeJSInternTableStatistics();
+  for (int interned = 1; interned >= 0; --interned) {
+    NodeJSInternTableSetCapacity(interned ? defaults.capacity : 0);
+    const char* variant = interned ? "interned" : "uninterned";
+    BenchBlock toV8 = ^(NSUInteger n) {
+      for (NSUInteger i = 0; i < n; ++i) {
+        HandleScope scope;
+        [records v8Value];
+      }
+    };
+    BenchBlock fromV8 = ^(NSUInteger n) {
+      for (NSUInteger i = 0; i < n; ++i) {
+        NSAutoreleasePool* pool = [NSAutoreleasePool new];
+        HandleScope scope;
+        [NSObject fromV8Value:Local<Value>::New(value)];
+        [pool drain];
+      }
+    };
+    // |fromV8| drains its own pool, which would hide what it allocated
+    BenchBlock fromV8Kept = ^(NSUInteger n) {
+      HandleScope scope;
+      [NSObject fromV8Value:Local<Value>::New(value)];
+    };
+    char name[128];
+    snprintf(name, sizeof(name), "convert.to_v8.records.1k.%s", variant);
+    Bench(name, toV8);  // also warms up the table
+    CountAllocations(name, kRecords, toV8);
+    snprintf(name, sizeof(name), "convert.from_v8.records.1k.%s", variant);
+    Bench(name, fromV8);
+    CountAllocations(name, kRecords, fromV8Kept);
+  }
+  NodeJSInternTableSetCapacity(defaults.capacity);
+  value.Dispose();
+}
+
+// -----------------------------------------------------------------------------
+
+static NSString* Counters() {
+  NodeJSScriptCacheStats scripts =
+      [[NodeJSScriptCache sharedCache] statistics];
+  NodeJSInternTableStats intern = NodeJSInternTableStatistics();
+  NodeJSFunctionPoolStats functions = NodeJSFunctionPoolStatistics();
+  NodeJSHeapStats heap = NodeJSHeapStatistics();
+  NodeJSAllocatorStats memory = NodeJSAllocatorStatistics();
+  return [NSString stringWithFormat:
+      @"{\"script_cache\": {\"hits\": %llu, \"misses\": %llu, "
+       "\"evictions\": %llu}, "
+       "\"intern_table\": {\"hits\": %llu, \"misses\": %llu, "
+       "\"bypasses\": %llu, \"count\": %lu}, "
+       "\"function_pool\": {\"templates\": %lu, \"template_hits\": %llu, "
+       "\"trampolines\": %llu, \"reclaimed\": %llu, \"capacity\": %lu}, "
+       "\"heap\": {\"used\": %lu, \"total\": %lu, \"external\": %lld, "
+       "\"scavenges\": %llu, \"mark_sweeps\": %llu, \"pauses\": %@}, "
+       "\"loop_allocator\": {\"kind\": \"%s\", \"allocations\": %llu, "
+       "\"reallocations\": %llu, \"in_place\": %llu, \"pool_hits\": %llu, "
+       "\"system_allocations\": %llu, \"peak_bytes\": %lld}}",
+      (unsigned long long)scripts.hits, (unsigned long long)scripts.misses,
+      (unsigned long long)scripts.evictions,
+      (unsigned long long)intern.hits, (unsigned long long)intern.misses,
+      (unsigned long long)intern.bypasses, (unsigned long)intern.count,
+      (unsigned long)functions.templates,
+      (unsigned long long)functions.templateHits,
+      (unsigned long long)functions.trampolines,
+      (unsigned long long)functions.reclaimed,
+      (unsigned long)functions.capacity,
+      (unsigned long)heap.usedHeapSize, (unsigned long)heap.totalHeapSize,
+      (long long)heap.externalMemory, (unsigned long long)heap.scavenges,
+      (unsigned long long)heap.markSweeps, JSONHistogram(heap.pauseTime),
+      NodeJSAllocatorSelected() == NodeJSPoolAllocator ? "pool" : "system",
+      (unsigned long long)memory.allocations,
+      (unsigned long long)memory.reallocations,
+      (unsigned long long)memory.inPlace, (unsigned long long)memory.poolHits,
+      (unsigned long long)memory.systemAllocations,
+      (long long)memory.peakBytes];
+}
+
+
+// called by node once main.js has been loaded
+static void BenchMain(const Arguments& args) {
+  NSAutoreleasePool* pool = [NSAutoreleasePool new];
+  NodeJSAttachToCurrentContext();
+  gResults = [NSMutableArray new];
+  gAllocations = [NSMutableArray new];
+
+  EvalBenchmarks();
+  CallBenchmarks();
+  ConversionBenchmarks();
+  InternBenchmarks();
+  NSString* loop = LoopBenchmarks();
+
+  HandleScope scope;
+  Local<Object> process = [NodeJS process];
+  String::Utf8Value nodeVersion(process->Get(String::NewSymbol("version")));
+  String::Utf8Value platform(process->Get(String::NewSymbol("platform")));
+  printf("{\n  \"v8\": \"%s\",\n  \"node\": \"%s\",\n  \"platform\": \"%s\",\n"
+         "  \"time\": %.0f,\n  \"sample_time\": %g,\n  \"benchmarks\": [\n",
+         V8::GetVersion(), *nodeVersion, *platform,
+         [[NSDate date] timeIntervalSince1970], gSampleTime);
+  for (NSUInteger i = 0; i < gResults.count; ++i) {
+    printf("    %s%s\n", [[gResults objectAtIndex:i] UTF8String],
+           i + 1 < gResults.count ? "," : "");
+  }
+  printf("  ],\n  \"allocations\": [\n");
+  for (NSUInteger i = 0; i < gAllocations.count; ++i) {
+    printf("    %s%s\n", [[gAllocations objectAtIndex:i] UTF8String],
+           i + 1 < gAllocations.count ? "," : "");
+  }
+  printf("  ],\n  \"loop\": %s,\n  \"counters\": %s\n}\n",
+         loop ? [loop UTF8String] : "null", [Counters() UTF8String]);
+  fflush(stdout);
+  [pool drain];
+  exit(0);
+}
+
+
+int main(int argc, char* argv[]) {
+  NSAutoreleasePool* pool = [NSAutoreleasePool new];
+  NSString* mainScript = [[[NSString stringWithUTF8String:argv[0]]
+      stringByDeletingLastPathComponent]
+      stringByAppendingPathComponent:@"main.js"];
+  for (int i = 1; i < argc; ++i) {
+    if (i + 1 < argc && strcmp(argv[i], "--filter") == 0) {
+      gFilter = argv[++i];
+    } else if (i + 1 < argc && strcmp(argv[i], "--time") == 0) {
+      gSampleTime = MAX(atof(argv[++i]), 0.001);
+    } else if (i + 1 < argc && strcmp(argv[i], "--samples") == 0) {
+      gSamples = MAX(atoi(argv[++i]), 1);
+    } else if (i + 1 < argc && strcmp(argv[i], "--main") == 0) {
+      mainScript = [NSString stringWithUTF8String:argv[++i]];
+    } else {
+      fprintf(stderr, "usage: %s [--filter <substring>] [--time <seconds>] "
+              "[--samples <n>] [--main <main.js>]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  // Same setup as NodeJSApplicationMain, minus AppKit: node loads main.js in
+  // a module context and calls BenchMain once it has.
+  node::Main = &BenchMain;
+  NodeJSAllocatorSelectFromEnvironment();
+  ev_set_allocator(&NodeJSAllocatorRealloc);
+  setenv("NODE_MODULE_CONTEXTS", "1", 1);
+  char* nodeArgv[] = { argv[0], (char*)[mainScript fileSystemRepresentation],
+                       NULL };
+  int rc = node::Start(2, nodeArgv);
+  [pool drain];
+  return rc;
+}
@@ -1,3 +1,5 @@
+@class ConsoleOutput;
+
 @interface AppDelegate : NSObject <NSApplicationDelegate,
                                    NSTextViewDelegate,
                                    NSTextStorageDelegate> {
@@ -6,6 +8,7 @@
   NSScrollView* scrollView_;
   NSTextView* outputTextView_;
   NSScrollView* outputScrollView_;
+  ConsoleOutput* output_;
   NSPipe* nodeStdoutPipe_;
   NSPipe* nodeStderrPipe_;
   NSUInteger historyCursor_;
@@ -1,4 +1,5 @@
 #import "AppDelegate.h"
+#import "ConsoleOutput.h"
 #import <NodeCocoa/NodeCocoa.h>
 
 #define ENABLE_REDIRECT_STDERR 1
@@ -118,15 +119,19 @@ static NSDictionary *kInputStringAttributes,
   Local<Object> process = Local<Object>::Cast(
       Context::GetCurrent()->Global()->Get(String::NewSymbol("process")));
   
+  // output is streamed into the output text view, keeping a limited
+  // scrollback ("ConsoleScrollbackLines" in the user defaults)
+  output_ = [[ConsoleOutput alloc] initWithTextView:outputTextView_];
+  NSInteger maxLines = [[NSUserDefaults standardUserDefaults]
+      integerForKey:@"ConsoleScrollbackLines"];
+  if (maxLines > 0) output_.maxLines = maxLines;
+
   // redirect stdout to a pipe
   nodeStdoutPipe_ = [[NSPipe pipe] retain];
-  NSFileHandle* pipeReadHandle = [nodeStdoutPipe_ fileHandleForReading];
   dup2([[nodeStdoutPipe_ fileHandleForWriting] fileDescriptor], fileno(stdout));
-  [[NSNotificationCenter defaultCenter] addObserver:self
-      selector:@selector(stdoutReadCompletion:)
-      name:NSFileHandleReadCompletionNotification
-      object:pipeReadHandle];
-  [pipeReadHandle readInBackgroundAndNotify];
+  [output_ readFileDescriptor:
+      [[nodeStdoutPipe_ fileHandleForReading] fileDescriptor]
+                   attributes:kStdoutStringAttributes];
   
 #if ENABLE_REDIRECT_STDERR
   // redirect stderr to a pipe
@@ -139,49 +144,14 @@ static NSDictionary *kInputStringAttributes,
   //nodeStderrPipe_ = [[NSPipe pipe] retain];
   //int fd = [[nodeStderrPipe_ fileHandleForWriting] fileDescriptor];
   //process->ForceSet(String::New("_stderrfd"), Integer::New(fd));
-  pipeReadHandle = [nodeStderrPipe_ fileHandleForReading];
-  [[NSNotificationCenter defaultCenter] addObserver:self
-      selector:@selector(stderrReadCompletion:)
-      name:NSFileHandleReadCompletionNotification
-      object:pipeReadHandle];
-  [pipeReadHandle readInBackgroundAndNotify];
+  [output_ readFileDescriptor:
+      [[nodeStderrPipe_ fileHandleForReading] fileDescriptor]
+                   attributes:kStderrStringAttributes];
 #endif // ENABLE_REDIRECT_STDERR
 }
 
-// string from data with best guess encoding (utf8, latin-1)
-- (NSString*)stringFromData:(NSData*)data {
-  NSString *text = [NSString alloc], *ptr;
-  if ((ptr = [text initWithData:data encoding:NSUTF8StringEncoding])) {
-    text = ptr;
-  } else {
-    text = [text initWithData:data encoding:NSISOLatin1StringEncoding];
-  }
-  return [text autorelease];
-}
-
 - (void)appendOutput:(NSString*)text withAttributes:(NSDictionary*)attrs {
-  NSAttributedString* as =
-      [[NSAttributedString alloc] initWithString:text attributes:attrs];
-  static NSTextStorage* textStorage = nil;
-  if (!textStorage) textStorage = outputTextView_.textStorage;
-  [textStorage appendAttributedString:as];
-  [as release];
-}
-
--(void)_handleOutput:(NSNotification*)notification attrs:(NSDictionary*)attrs {
-  NSDictionary* info = [notification userInfo];
-  NSData* data = [info objectForKey: NSFileHandleNotificationDataItem];
-  [self appendOutput:[self stringFromData:data] withAttributes:attrs];
-  [[notification object] readInBackgroundAndNotify];
-  [[outputScrollView_ documentView] scrollToEndOfDocument:self];
-}
-
-- (void)stdoutReadCompletion:(NSNotification*)notification {
-  [self _handleOutput:notification attrs:kStdoutStringAttributes];
-}
-
-- (void)stderrReadCompletion:(NSNotification*)notification {
-  [self _handleOutput:notification attrs:kStderrStringAttributes];
+  [output_ appendString:text attributes:attrs];
 }
 
 - (void)applicationDidFinishLaunching:(NSNotification *)notification {
@@ -261,22 +231,12 @@ static NSDictionary *kInputStringAttributes,
   }
 }
 
-- (void)eval:(NSString*)script {
-  NSError *error;
-  
-  // Aquire reference to sys.inspect
-  if (kInspectFunction.IsEmpty()) {
-    HandleScope scope;
-    Local<Value> result = [NodeJS eval:@"require('util').inspect"
-                                origin:nil context:nil error:nil];
-    kInspectFunction =
-        Persistent<Function>::New(Local<Function>::Cast(result));
-  }
-
-  // Prepare input
+// Returns |script| ready for evaluation (and saved to history), or nil if
+// there's nothing to evaluate
+- (NSString*)prepareInput:(NSString*)script {
   script = [script stringByTrimmingCharactersInSet:
       [NSCharacterSet whitespaceAndNewlineCharacterSet]];
-  if ([script length] == 0) return;
+  if ([script length] == 0) return nil;
   
   // Save to history & reset history cursor
   [self appendToInputHistory:script];
@@ -290,6 +250,24 @@ static NSDictionary *kInputStringAttributes,
   if (ch0 == '{' || ch0 == '[' || [script hasPrefix:@"function"]) {
     script = [NSString stringWithFormat:@"(%@)", script];
   }
+  return script;
+}
+
+- (void)eval:(NSString*)script {
+  NSError *error;
+  
+  // Aquire reference to sys.inspect
+  if (kInspectFunction.IsEmpty()) {
+    HandleScope scope;
+    Local<Value> result = [NodeJS eval:@"require('util').inspect"
+                                origin:nil context:nil error:nil];
+    kInspectFunction =
+        Persistent<Function>::New(Local<Function>::Cast(result));
+  }
+
+  // Prepare input
+  script = [self prepareInput:script];
+  if (!script) return;
   
   // result = eval(script)
   HandleScope scope;
@@ -309,6 +287,39 @@ static NSDictionary *kInputStringAttributes,
   }
 }
 
+// Evaluates several lines (e.g. pasted) as one batch, printing each line
+// followed by its result
+- (void)evalLines:(NSArray*)lines {
+  NSMutableArray* items = [NSMutableArray arrayWithCapacity:[lines count]];
+  NSMutableArray* scripts = [NSMutableArray arrayWithCapacity:[lines count]];
+  for (NSString* line in lines) {
+    NSString* script = [self prepareInput:line];
+    [scripts addObject:script ? script : (id)[NSNull null]];
+    if (script) {
+      [items addObject:[NSArray arrayWithObjects:script, @"<input>", nil]];
+    }
+  }
+  NSArray* results = [NodeJS evalBatch:items
+                               context:nil
+                               options:NodeJSEvalBatchInspect];
+  NSUInteger resultIndex = 0;
+  NSTextStorage* textStorage = textView_.textStorage;
+  for (NSUInteger i = 0; i < [lines count]; ++i) {
+    [self appendLine:[lines objectAtIndex:i] attributes:kInputStringAttributes];
+    if ([scripts objectAtIndex:i] != [NSNull null]) {
+      id result = [results objectAtIndex:resultIndex++];
+      if ([result isKindOfClass:[NSError class]]) {
+        NSLog(@"eval: %@", result);
+        [self appendLine:[result localizedDescription]
+              attributes:kErrorStringAttributes];
+      } else if (result != [NSNull null]) {
+        [self appendLine:result attributes:kResultStringAttributes];
+      }
+    }
+    [textStorage appendAttributedString:[isa linePrefix]];
+  }
+}
+
 #pragma mark -
 #pragma mark NSTextViewDelegate implementation
 
@@ -378,11 +389,11 @@ static NSDictionary *kInputStringAttributes,
           // user performed more than one line break.
           // If something was pasted with multiple lines -- execute all
           // text before the last new line.
+          NSMutableArray* lines = [NSMutableArray array];
           [strUpToLastNewline enumerateLinesUsingBlock:^(NSString *line, BOOL *stop) {
-            [self appendLine:line attributes:kInputStringAttributes];
-            [self eval:line];
-            [textStorage appendAttributedString:[isa linePrefix]];
+            [lines addObject:line];
           }];
+          [self evalLines:lines];
           if (rstrNLRange.location+1 < [replacementString length]) {
             NSString* line =
                 [replacementString substringFromIndex:rstrNLRange.location+1];
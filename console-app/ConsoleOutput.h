@@ -0,0 +1,69 @@
+/**
+ * Streams text (e.g. node's stdout and stderr) into a text view.
+ *
+ * Text can be appended from any thread. It's queued and handed to the text
+ * view's storage at most once per display frame, as a single edit. Only the
+ * last |maxLines| rows are kept: older rows are removed from the text storage,
+ * and from the queue if the view falls that far behind. A row is a line, or
+ * |maxLineLength| characters of a longer one, so neither grows without bound.
+ *
+ * File descriptors are read on a background thread each. Their UTF-8 is
+ * decoded without breaking up multi-byte characters which span two reads.
+ * While the queue holds more than |highWaterMark| characters, reading pauses
+ * until the view catches up (unless the main thread stops flushing for a few
+ * frames, since the writer might be the main thread itself).
+ */
+@interface ConsoleOutput : NSObject {
+  NSTextView* textView_;
+  NSUInteger maxLines_;
+  NSUInteger maxLineLength_;
+  NSUInteger highWaterMark_;
+  NSTimeInterval frameInterval_;
+
+  // scrollback: lengths (including the newline) of the rows in the text
+  // storage, oldest first, in a ring of |maxLines_| entries
+  NSUInteger* lineLengths_;
+  NSUInteger lineHead_;
+  NSUInteger lineCount_;
+  NSUInteger partialLength_;  // length of the unterminated last row
+
+  // queue (guarded by |condition_|)
+  NSCondition* condition_;
+  NSMutableAttributedString* pending_;
+  NSUInteger pendingRows_;
+  NSUInteger pendingPartial_;  // length of the unterminated last queued row
+  BOOL flushScheduled_;
+  NSUInteger flushCount_;
+  NSTimeInterval lastFlush_;
+}
+
+/// Maximum number of rows kept. Defaults to 10000.
+@property(nonatomic) NSUInteger maxLines;
+
+/**
+ * Maximum length of a row: longer lines take several rows. Applies to text
+ * appended from now on. Defaults to 1024.
+ */
+@property(nonatomic) NSUInteger maxLineLength;
+
+/// Queued characters at which reading pauses. Defaults to 1M.
+@property NSUInteger highWaterMark;
+
+/// Minimum time between updates of the text view. Defaults to 1/60 s.
+@property NSTimeInterval frameInterval;
+
+- (id)initWithTextView:(NSTextView*)textView;
+
+/// Append |text| with |attrs|. Can be called from any thread.
+- (void)appendString:(NSString*)text attributes:(NSDictionary*)attrs;
+
+/**
+ * Read |fd| until end-of-file on a background thread, appending what's read
+ * with |attrs|. |fd| is not closed.
+ */
+- (void)readFileDescriptor:(int)fd attributes:(NSDictionary*)attrs;
+
+/// Remove all text, including any not yet displayed. Main thread only.
+- (void)clear;
+
+@end
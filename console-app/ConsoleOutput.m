@@ -0,0 +1,322 @@
+#import "ConsoleOutput.h"
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define READ_SIZE 65536
+
+@interface ConsoleOutput (Private)
+- (void)_scheduleFlush;
+- (void)_flush;
+@end
+
+
+// Number of leading bytes of |bytes| which don't end in the middle of a UTF-8
+// sequence. The rest is carried over to the next read.
+static NSUInteger CompleteUTF8Length(const char* bytes, NSUInteger length) {
+  for (NSUInteger i = 1; i <= 3 && i <= length; ++i) {
+    unsigned char c = bytes[length - i];
+    if ((c & 0xC0) == 0x80) continue;  // continuation byte
+    NSUInteger needed = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    return needed > i ? length - i : length;
+  }
+  return length;  // not UTF-8 -- leave it to the decoder
+}
+
+
+// string from bytes with best guess encoding (utf8, latin-1)
+static NSString* DecodeOutput(const char* bytes, NSUInteger length) {
+  NSString* text = [[NSString alloc] initWithBytes:bytes length:length
+                                          encoding:NSUTF8StringEncoding];
+  if (!text) {
+    text = [[NSString alloc] initWithBytes:bytes length:length
+                                  encoding:NSISOLatin1StringEncoding];
+  }
+  return [text autorelease];
+}
+
+
+// Output is kept and dropped in rows: a row ends after a newline or once it
+// holds |maxLength| characters, so that a single long line (a large dump,
+// progress output using \r) can't grow without bound.
+//
+// Index just past the row of |text| starting at |start|, which continues a row
+// already holding |partial| characters, or NSNotFound if the row isn't
+// complete yet.
+static NSUInteger RowEnd(NSString* text, NSUInteger start, NSUInteger partial,
+                         NSUInteger maxLength) {
+  NSUInteger length = text.length;
+  NSUInteger room = partial < maxLength ? maxLength - partial : 0;
+  NSRange newline =
+      [text rangeOfString:@"\n" options:NSLiteralSearch
+                    range:NSMakeRange(start, MIN(room + 1, length - start))];
+  if (newline.location != NSNotFound) return newline.location + 1;
+  if (length - start <= room) return NSNotFound;
+  NSUInteger end = start + room;
+  // don't split a surrogate pair
+  if (end > start && CFStringIsSurrogateHighCharacter(
+          [text characterAtIndex:end - 1])) {
+    end++;
+  }
+  return end;
+}
+
+
+// Number of rows ended in |text|. |*partial| is the length of the unterminated
+// row before and after |text|.
+static NSUInteger CountRows(NSString* text, NSUInteger maxLength,
+                           NSUInteger* partial) {
+  NSUInteger count = 0, start = 0, end;
+  while ((end = RowEnd(text, start, *partial, maxLength)) != NSNotFound) {
+    count++;
+    *partial = 0;
+    start = end;
+  }
+  *partial += text.length - start;
+  return count;
+}
+
+
+// Index just past the |n|th row of |text| (n > 0), or |text|'s length
+static NSUInteger IndexAfterRows(NSString* text, NSUInteger n,
+                                 NSUInteger maxLength) {
+  NSUInteger start = 0;
+  while (n--) {
+    NSUInteger end = RowEnd(text, start, 0, maxLength);
+    if (end == NSNotFound) return text.length;
+    start = end;
+  }
+  return start;
+}
+
+
+@implementation ConsoleOutput
+
+@synthesize highWaterMark = highWaterMark_,
+            frameInterval = frameInterval_;
+
+- (id)initWithTextView:(NSTextView*)textView {
+  if ((self = [super init])) {
+    textView_ = [textView retain];
+    maxLines_ = 10000;
+    maxLineLength_ = 1024;
+    highWaterMark_ = 1024 * 1024;
+    frameInterval_ = 1.0 / 60.0;
+    lineLengths_ = (NSUInteger*)calloc(maxLines_, sizeof(NSUInteger));
+    condition_ = [NSCondition new];
+    pending_ = [NSMutableAttributedString new];
+  }
+  return self;
+}
+
+
+- (void)dealloc {
+  [textView_ release];
+  free(lineLengths_);
+  [condition_ release];
+  [pending_ release];
+  [super dealloc];
+}
+
+
+- (NSUInteger)maxLines {
+  return maxLines_;
+}
+
+
+- (void)setMaxLines:(NSUInteger)maxLines {
+  assert([NSThread isMainThread]);
+  maxLines = MAX(maxLines, 1);
+  // keep the newest lines
+  NSUInteger drop = lineCount_ > maxLines ? lineCount_ - maxLines : 0;
+  NSUInteger trim = 0;
+  NSUInteger* lengths = (NSUInteger*)calloc(maxLines, sizeof(NSUInteger));
+  for (NSUInteger i = 0; i < lineCount_; ++i) {
+    NSUInteger length = lineLengths_[(lineHead_ + i) % maxLines_];
+    if (i < drop) trim += length;
+    else lengths[i - drop] = length;
+  }
+  free(lineLengths_);
+  lineLengths_ = lengths;
+  lineHead_ = 0;
+  lineCount_ -= drop;
+  [condition_ lock];
+  maxLines_ = maxLines;
+  [condition_ unlock];
+  if (trim)
+    [textView_.textStorage deleteCharactersInRange:NSMakeRange(0, trim)];
+}
+
+
+- (NSUInteger)maxLineLength {
+  return maxLineLength_;
+}
+
+
+- (void)setMaxLineLength:(NSUInteger)maxLineLength {
+  assert([NSThread isMainThread]);
+  [condition_ lock];
+  maxLineLength_ = MAX(maxLineLength, 1);
+  [condition_ unlock];
+}
+
+
+- (void)appendString:(NSString*)text attributes:(NSDictionary*)attrs {
+  if (!text.length) return;
+  NSAttributedString* as =
+      [[NSAttributedString alloc] initWithString:text attributes:attrs];
+  BOOL schedule = NO;
+  [condition_ lock];
+  [pending_ appendAttributedString:as];
+  pendingRows_ += CountRows(text, maxLineLength_, &pendingPartial_);
+  if (pendingRows_ > maxLines_) {
+    // the view has fallen so far behind that the oldest queued rows would
+    // be scrolled out as soon as they're displayed
+    NSUInteger drop = pendingRows_ - maxLines_;
+    [pending_ deleteCharactersInRange:
+        NSMakeRange(0, IndexAfterRows(pending_.string, drop, maxLineLength_))];
+    pendingRows_ -= drop;
+  }
+  if (!flushScheduled_) {
+    flushScheduled_ = YES;
+    schedule = YES;
+  }
+  [condition_ unlock];
+  [as release];
+  if (schedule) {
+    [self performSelectorOnMainThread:@selector(_scheduleFlush)
+                           withObject:nil
+                        waitUntilDone:NO];
+  }
+}
+
+
+- (void)_scheduleFlush {
+  NSTimeInterval delay =
+      lastFlush_ + frameInterval_ - [NSDate timeIntervalSinceReferenceDate];
+  NSTimer* timer = [NSTimer timerWithTimeInterval:MAX(delay, 0)
+                                           target:self
+                                         selector:@selector(_flush)
+                                         userInfo:nil
+                                          repeats:NO];
+  [[NSRunLoop currentRunLoop] addTimer:timer forMode:NSRunLoopCommonModes];
+}
+
+
+// Record the rows of |text| (just appended to the text storage) in the
+// scrollback. Returns the number of characters at the start of the text
+// storage which have been scrolled out.
+- (NSUInteger)_addLines:(NSString*)text {
+  NSUInteger trim = 0, start = 0, end;
+  while ((end = RowEnd(text, start, partialLength_, maxLineLength_)) !=
+         NSNotFound) {
+    NSUInteger lineLength = partialLength_ + end - start;
+    partialLength_ = 0;
+    start = end;
+    if (lineCount_ == maxLines_) {
+      trim += lineLengths_[lineHead_];
+      lineHead_ = (lineHead_ + 1) % maxLines_;
+      lineCount_--;
+    }
+    lineLengths_[(lineHead_ + lineCount_) % maxLines_] = lineLength;
+    lineCount_++;
+  }
+  partialLength_ += text.length - start;
+  return trim;
+}
+
+
+- (void)_flush {
+  [condition_ lock];
+  NSMutableAttributedString* text = pending_;
+  pending_ = [NSMutableAttributedString new];
+  pendingRows_ = pendingPartial_ = 0;
+  flushScheduled_ = NO;
+  flushCount_++;
+  [condition_ broadcast];  // resume paused readers
+  [condition_ unlock];
+  lastFlush_ = [NSDate timeIntervalSinceReferenceDate];
+
+  if (text.length) {
+    // only follow the output if the user hasn't scrolled up
+    NSRect visible = [textView_ visibleRect];
+    BOOL atEnd = NSMaxY(visible) >= NSMaxY([textView_ bounds]) - 1.0;
+    NSTextStorage* storage = textView_.textStorage;
+    [storage beginEditing];
+    [storage appendAttributedString:text];
+    NSUInteger trim = [self _addLines:text.string];
+    if (trim)
+      [storage deleteCharactersInRange:NSMakeRange(0, trim)];
+    [storage endEditing];
+    if (atEnd)
+      [textView_ scrollRangeToVisible:NSMakeRange(storage.length, 0)];
+  }
+  [text release];
+}
+
+
+- (void)clear {
+  assert([NSThread isMainThread]);
+  [condition_ lock];
+  [pending_ deleteCharactersInRange:NSMakeRange(0, pending_.length)];
+  pendingRows_ = pendingPartial_ = 0;
+  [condition_ broadcast];
+  [condition_ unlock];
+  NSTextStorage* storage = textView_.textStorage;
+  [storage deleteCharactersInRange:NSMakeRange(0, storage.length)];
+  lineHead_ = lineCount_ = partialLength_ = 0;
+}
+
+
+- (void)_readLoop:(NSArray*)args {
+  NSAutoreleasePool* pool = [NSAutoreleasePool new];
+  int fd = [[args objectAtIndex:0] intValue];
+  NSDictionary* attrs = [args objectAtIndex:1];
+  char* buffer = (char*)malloc(READ_SIZE + 3);
+  NSUInteger carry = 0;  // bytes of an incomplete UTF-8 sequence
+  for (;;) {
+    // backpressure: wait for the view to catch up for as long as the main
+    // thread keeps flushing. If it hasn't for a few frames, the writer might
+    // be the main thread itself, blocked on the full pipe, so read on -- the
+    // queue is capped, so that only drops its oldest rows.
+    [condition_ lock];
+    NSUInteger flushes = flushCount_;
+    NSDate* deadline =
+        [NSDate dateWithTimeIntervalSinceNow:frameInterval_ * 6];
+    while (pending_.length > highWaterMark_) {
+      if (![condition_ waitUntilDate:deadline]) break;
+      if (flushCount_ != flushes) {
+        flushes = flushCount_;
+        deadline = [NSDate dateWithTimeIntervalSinceNow:frameInterval_ * 6];
+      }
+    }
+    [condition_ unlock];
+
+    ssize_t n = read(fd, buffer + carry, READ_SIZE);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    NSUInteger length = carry + n;
+    NSUInteger complete = CompleteUTF8Length(buffer, length);
+    NSAutoreleasePool* readPool = [NSAutoreleasePool new];
+    [self appendString:DecodeOutput(buffer, complete) attributes:attrs];
+    [readPool drain];
+    carry = length - complete;
+    memmove(buffer, buffer + complete, carry);
+  }
+  if (carry) {
+    [self appendString:DecodeOutput(buffer, carry) attributes:attrs];
+  }
+  free(buffer);
+  [pool drain];
+}
+
+
+- (void)readFileDescriptor:(int)fd attributes:(NSDictionary*)attrs {
+  NSArray* args = [NSArray arrayWithObjects:[NSNumber numberWithInt:fd],
+                   attrs ? attrs : [NSDictionary dictionary], nil];
+  [NSThread detachNewThreadSelector:@selector(_readLoop:)
+                           toTarget:self
+                         withObject:args];
+}
+
+@end
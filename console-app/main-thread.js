@@ -7,10 +7,14 @@ if (process.host) {
       process.host.__proto__[key] = process.EventEmitter.prototype[key];
   });
 
-  process.host.recv = function (what, args) {
-    console.log('recv: '+require('sys').inspect({what:what, args:args}));
-    var fun = process.host[what];
-    return fun.apply(process.host, Array.isArray(args) ? args : []);
+  // Called with a batch of calls: [name, args, name, args, ...]
+  process.host.recv = function (calls) {
+    for (var i = 0; i < calls.length; i += 2) {
+      var what = calls[i], args = calls[i+1];
+      console.log('recv: '+require('sys').inspect({what:what, args:args}));
+      var fun = process.host[what];
+      fun.apply(process.host, Array.isArray(args) ? args : []);
+    }
   }
 
   // example
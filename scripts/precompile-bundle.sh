@@ -0,0 +1,14 @@
+#!/bin/bash
+# Precompile main.js and lib/ of the app bundle being built into
+# <Resources>/codecache.bin and pack lib/ into <Resources>/modules.pack, both of
+# which NodeJSApplicationMain maps at startup (see NodeJSCodeCache.h and
+# NodeJSModuleArchive.h). Run as a build phase of the app target, after its
+# frameworks have been copied.
+resources="${TARGET_BUILD_DIR}/${UNLOCALIZED_RESOURCES_FOLDER_PATH}"
+executable="${TARGET_BUILD_DIR}/${EXECUTABLE_PATH}"
+if [ ! -f "$resources/main.js" ]; then
+  echo "no main.js in $resources -- nothing to precompile"
+  exit 0
+fi
+"$executable" --precompile-bundle "$resources"
+exit $?
@@ -1,5 +1,26 @@
 #import <NodeCocoa/node.h>
 
+/// Options for |+[NSObject fromV8Value:options:]|.
+enum {
+  /**
+   * Arrays of objects which share the same keys are converted by reading the
+   * keys once (from the first element) and then fetching values by key for
+   * every element. An array qualifies if its first and last elements are
+   * objects with identical property names. Keys which only appear in other
+   * elements are not included.
+   */
+  NodeJSConvertUniformArrays = 1 << 0,
+
+  /**
+   * Like NodeJSConvertUniformArrays, but qualifying arrays are converted into
+   * a single NSDictionary of columns (key --> column) rather than an NSArray
+   * of NSDictionary rows. Columns which only hold numbers are NSData of packed
+   * doubles, other columns are NSArrays (using NSNull for missing values).
+   */
+  NodeJSConvertColumnarArrays = 1 << 1,
+};
+typedef NSUInteger NodeJSConversionOptions;
+
 @interface NSObject (v8)
 /**
  * Convert a Cocoa object to a V8 value.
@@ -10,21 +31,24 @@
  *   NSNumber (int) --> Integer
  *   NSNumber --> Number
  *   NSValue --> External
- *   NSString --> String
+ *   NSString --> String (shared if larger than NodeJSStringNoCopyThreshold)
  *   NSDate --> Date
  *   NodeJSFunction --> Function
  *   NSArray --> Array
  *   NSSet --> Array
- *   NSData --> node::Buffer
+ *   NSData --> node::Buffer (copied -- see |v8ValueNoCopy|)
  *   NSDictionary --> Object
  *   NSObject (description) --> String
+ *
+ * Containers which contain themselves yield an empty handle.
  */
 - (v8::Local<v8::Value>)v8Value;
 
 /**
  * Convert a V8 value to a Cocoa object.
  *
- * Returns nil if value.IsEmpty() or conversion failed (i.e. unsupported type).
+ * Returns nil if value.IsEmpty() or conversion failed (i.e. unsupported type
+ * or a cyclic structure -- see NodeJSConverter).
  *
  * Conversions:
  *   Undefined --> NSNull
@@ -34,17 +58,129 @@
  *   Number/UInt32 --> NSNumber (numberWithUnsignedInt:)
  *   Number --> NSNumber (numberWithDouble:)
  *   External --> NSValue (valueWithPointer:)
- *   String --> NSString
+ *   String --> NSString (shared if external and larger than
+ *              NodeJSStringNoCopyThreshold)
  *   Date --> NSDate
  *   RegExp --> NSString
  *   Function --> NodeJSFunction
  *   Array --> NSArray
- *   node::Buffer --> NSData
+ *   node::Buffer --> NSData (copied -- see |dataWithNodeBufferNoCopy:|)
  *   Object --> Dictionary
  */
 + (id)fromV8Value:(v8::Local<v8::Value>)value;
+
+/// Convert a V8 value to a Cocoa object using |options|.
++ (id)fromV8Value:(v8::Local<v8::Value>)value
+          options:(NodeJSConversionOptions)options;
 @end
 
+/**
+ * Length (in characters) from which NSString <-> V8 string conversions share
+ * memory instead of copying it. Defaults to 32768. Set to NSUIntegerMax to
+ * always copy.
+ *
+ * NSString --> V8: if the string (or, for a mutable string, an immutable copy)
+ * stores its characters as UTF-16 or ASCII, V8 gets an external string which
+ * refers to them and retains the NSString until it's garbage collected.
+ *
+ * V8 --> NSString: external V8 strings become NSStrings which refer to their
+ * characters and keep the V8 string alive (release them on the node thread if
+ * possible). Other V8 strings are copied once, as UTF-16.
+ *
+ * Converting a shared string back yields the original object in both cases.
+ */
+extern NSUInteger NodeJSStringNoCopyThreshold;
+
 @interface NSString (v8)
 + (NSString*)stringWithV8String:(v8::Local<v8::String>)str;
+
+/// Like |v8Value| but typed as a string.
+- (v8::Local<v8::String>)v8String;
+@end
+
+@interface NSData (node)
+/**
+ * Create an NSData which refers to the memory of |buffer| without copying it.
+ *
+ * The buffer is kept alive for as long as the NSData is alive. The returned
+ * object should be released on the node thread, but releasing it on another
+ * thread is supported (the buffer reference is then handed back to the node
+ * thread, see |NodeJSHeapDisposeHandle|). Passing the returned object to
+ * |v8Value| yields the original buffer. JavaScript can still write to the
+ * buffer, changing the contents of the NSData.
+ */
++ (NSData*)dataWithNodeBufferNoCopy:(v8::Local<v8::Object>)buffer;
+
+/**
+ * Create a node::Buffer which refers to the memory of the receiver without
+ * copying it.
+ *
+ * The buffer retains the receiver until it's garbage collected, and the size of
+ * the data is reported to V8 as externally allocated memory. The bytes must not
+ * change while the buffer is alive, so don't use this with NSMutableData.
+ *
+ * Buffers are writable: JavaScript is able to modify the receiver's bytes,
+ * "immutable" or not, and writing to data backed by read-only memory (e.g. a
+ * mapped file) crashes. Only share data you own and don't mind being written
+ * to.
+ */
+- (v8::Local<v8::Value>)v8ValueNoCopy;
+@end
+
+/// Element types of typed numeric arrays.
+typedef enum {
+  NodeJSInt32Elements = 0,
+  NodeJSUInt32Elements,
+  NodeJSFloatElements,
+  NodeJSDoubleElements,
+} NodeJSElementType;
+
+/// Size in bytes of one element of |type|.
+size_t NodeJSElementSize(NodeJSElementType type);
+
+/**
+ * Copy |count| elements from |src| to |dst|, converting each element from
+ * |srcType| to |dstType|. |src| and |dst| must not overlap.
+ */
+void NodeJSConvertElements(const void* src, NodeJSElementType srcType,
+                           void* dst, NodeJSElementType dstType,
+                           size_t count);
+
+/**
+ * Typed numeric arrays -- contiguous vectors of numbers passed to and from V8
+ * without boxing each element.
+ */
+@interface NSData (NodeJSTypedArray)
+/**
+ * Create a JavaScript array-like object whose indexed elements are the
+ * receiver's bytes interpreted as |type| elements. Int32, UInt32 and Float
+ * elements of immutable data are not copied: the object refers to the
+ * receiver's memory (the receiver is retained until the object is garbage
+ * collected), and JavaScript can write to it -- so don't pass data backed by
+ * read-only memory. Mutable data is copied first, since resizing it would free
+ * the memory the object refers to. V8 does not support double external arrays,
+ * so Double elements produce a plain Array.
+ */
+- (v8::Local<v8::Object>)v8ArrayWithElementType:(NodeJSElementType)type;
+
+/**
+ * Like |v8ArrayWithElementType:| but converts each element to |dstType| first,
+ * e.g. to expose a vector of doubles as a float array.
+ */
+- (v8::Local<v8::Object>)v8ArrayWithElementType:(NodeJSElementType)type
+                                   convertingTo:(NodeJSElementType)dstType;
+
+/// Packed copy of |data| with each element converted from |type| to |dstType|.
++ (NSData*)dataWithData:(NSData*)data
+            elementType:(NodeJSElementType)type
+           convertingTo:(NodeJSElementType)dstType;
+
+/**
+ * Packed |type| elements from |value|, which is either an object with external
+ * array data (as created by |v8ArrayWithElementType:|) or an Array of numbers.
+ * If the external array already holds |type| elements, the returned NSData
+ * refers to that memory without copying it. Returns nil for other values.
+ */
++ (NSData*)dataWithV8Array:(v8::Local<v8::Value>)value
+               elementType:(NodeJSElementType)type;
 @end
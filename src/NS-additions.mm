@@ -1,75 +1,25 @@
 #import "NS-additions.h"
-#import "NodeJSFunction.h"
-#import <node_buffer.h>
+#import "NodeJSConverter.h"
 
 using namespace v8;
 
 @implementation NSObject (v8)
 
 + (id)fromV8Value:(v8::Local<v8::Value>)v {
-  if (v.IsEmpty()) return nil;
-  if (v->IsUndefined() || v->IsNull()) return [NSNull null];
-  if (v->IsBoolean()) return [NSNumber numberWithBool:v->BooleanValue()];
-  if (v->IsInt32())   return [NSNumber numberWithInt:v->Int32Value()];
-  if (v->IsUint32())  return [NSNumber numberWithUnsignedInt:v->Uint32Value()];
-  if (v->IsNumber())  return [NSNumber numberWithDouble:v->NumberValue()];
-  HandleScope scope;
-  if (v->IsExternal())
-    return [NSValue valueWithPointer:(External::Unwrap(v))];
-  if (v->IsString() || v->IsRegExp())
-    return [NSString stringWithV8String:v->ToString()];
-  if (v->IsFunction())
-    return [NodeJSFunction functionWithFunction:Local<Function>::Cast(v)];
-  
-  if (v->IsArray()) {
-    Local<Array> a = Local<Array>::Cast(v);
-    uint32 i = 0, count = a->Length();
-    NSMutableArray *array = [NSMutableArray arrayWithCapacity:count];
-    for (; i < count; ++i) {
-      NSObject *obj = [self fromV8Value:a->Get(i)];
-      if (obj) [array addObject:obj];
-    }
-    return array;
-  }
-  
-  // node::Buffer --> NSData
-  if (v->IsObject() && node::Buffer::HasInstance(v)) {
-    Local<Object> bufobj = v->ToObject();
-    char* data = node::Buffer::Data(bufobj);
-    size_t length = node::Buffer::Length(bufobj);
-    return [NSData dataWithBytes:data length:length];
-  }
-
-  // Date --> NSDate
-  if (v->IsDate()) {
-    double ms = Local<Date>::Cast(v)->NumberValue();
-    return [NSDate dateWithTimeIntervalSince1970:ms/1000.0];
-  }
+  return [self fromV8Value:v options:0];
+}
 
-  // Object --> Dictionary
-  if (v->IsObject()) {
-    Local<Object> o = v->ToObject();
-    Local<Array> props = o->GetPropertyNames();
-    uint32 i = 0, count = props->Length();
-    NSMutableDictionary* dict =
-        [NSMutableDictionary dictionaryWithCapacity:count];
-    for (; i < count; ++i) {
-      Local<String> k = props->Get(i)->ToString();
-      NSString *kobj = [NSString stringWithV8String:k];
-      NSObject *vobj = [self fromV8Value:o->Get(k)];
-      if (vobj)
-        [dict setObject:vobj forKey:kobj];
-    }
-    return dict;
-  }
-  
-  return nil;
++ (id)fromV8Value:(v8::Local<v8::Value>)v
+          options:(NodeJSConversionOptions)options {
+  return [[NodeJSConverter sharedConverter] objectFromV8Value:v
+                                                      options:options
+                                                        error:nil];
 }
 
 - (Local<Value>)v8Value {
   // generic converter
   HandleScope scope;
-  return scope.Close(String::New([[self description] UTF8String]));
+  return scope.Close([[self description] v8String]);
 }
 
 @end
@@ -90,17 +40,6 @@ using namespace v8;
 }
 @end
 
-@implementation NSString (v8)
-- (Local<Value>)v8Value {
-  HandleScope scope;
-  return scope.Close(String::New([self UTF8String]));
-}
-+ (NSString*)stringWithV8String:(Local<String>)str {
-  String::Utf8Value utf8(str);
-  return [NSString stringWithUTF8String:*utf8];
-}
-@end
-
 @implementation NSNull (v8)
 - (Local<Value>)v8Value {
   HandleScope scope;
@@ -124,36 +63,18 @@ using namespace v8;
 
 @implementation NSArray (v8)
 - (Local<Value>)v8Value {
-  HandleScope scope;
-  NSUInteger i = 0, count = [self count];
-  Local<Array> a = Array::New(count);
-  for (; i < count; i++) {
-    a->Set(i, [[self objectAtIndex:i] v8Value]);
-  }
-  return scope.Close(a);
+  return [[NodeJSConverter sharedConverter] v8ValueFromObject:self error:nil];
 }
 @end
 
 @implementation NSSet (v8)
 - (Local<Value>)v8Value {
-  HandleScope scope;
-  NSUInteger i = 0, count = [self count];
-  Local<Array> a = Array::New(count);
-  for (NSObject* obj in self) {
-    a->Set(i++, [obj v8Value]);
-  }
-  return scope.Close(a);
+  return [[NodeJSConverter sharedConverter] v8ValueFromObject:self error:nil];
 }
 @end
 
 @implementation NSDictionary (v8)
 - (Local<Value>)v8Value {
-  HandleScope scope;
-  Local<Object> o = Object::New();
-  [self enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop){
-    assert([key isKindOfClass:[NSString class]]);
-    o->Set(String::New([key UTF8String]), [obj v8Value]);
-  }];
-  return scope.Close(o);
+  return [[NodeJSConverter sharedConverter] v8ValueFromObject:self error:nil];
 }
 @end
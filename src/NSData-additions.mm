@@ -1,12 +1,14 @@
+#import "NS-additions.h"
+#import "NodeJSHeap.h"
 #import <node_buffer.h>
+#include <float.h>
+#include <math.h>
+#include <limits.h>
 
 using namespace v8;
 
-@implementation NSData (node)
-
-- (Local<Value>)v8Value {
-  HandleScope scope;
-  
+// Returns the global "Buffer" constructor
+static Local<Function> BufferConstructor() {
   // Note: The following _might_ cause a race condition if called at the same
   // time by two node threads and might cause unknown magic spooky stuff if
   // called by one node thread and later used by another.
@@ -19,15 +21,402 @@ using namespace v8;
     BufferConstructor = Persistent<Function>::New(
         tmplscope.Close(Local<Function>::Cast(Buffer_v)));
   }
-  
+  return Local<Function>::New(BufferConstructor);
+}
+
+
+// Called by node when a buffer created by |v8ValueNoCopy| is collected
+static void ReleaseNSDataCallback(char* data, void* hint) {
+  NSData* nsdata = (NSData*)hint;
+  NodeJSHeapAdjustExternalMemory(-(intptr_t)[nsdata length]);
+  [nsdata release];
+}
+
+
+// An immutable NSData which refers to memory owned by a V8 object (a
+// node::Buffer or an object with external array data), keeping the object
+// alive for as long as the NSData instance is alive.
+@interface NodeJSBufferData : NSData {
+  Persistent<Object> buffer_;
+  const void* bytes_;
+  NSUInteger length_;
+}
+- (id)initWithObject:(Local<Object>)object
+               bytes:(const void*)bytes
+              length:(NSUInteger)length;
+- (id)initWithBuffer:(Local<Object>)buffer;
+- (Local<Object>)buffer;
+@end
+
+@implementation NodeJSBufferData
+
+- (id)initWithObject:(Local<Object>)object
+               bytes:(const void*)bytes
+              length:(NSUInteger)length {
+  if ((self = [super init])) {
+    buffer_ = Persistent<Object>::New(object);
+    bytes_ = bytes;
+    length_ = length;
+  }
+  return self;
+}
+
+- (id)initWithBuffer:(Local<Object>)buffer {
+  return [self initWithObject:buffer
+                        bytes:node::Buffer::Data(buffer)
+                       length:node::Buffer::Length(buffer)];
+}
+
+- (void)dealloc {
+  // Note: The backing store is already accounted for by node, so there's no
+  // need to adjust V8's external memory counter here.
+  NodeJSHeapDisposeHandle(buffer_);
+  buffer_.Clear();
+  [super dealloc];
+}
+
+- (const void*)bytes { return bytes_; }
+- (NSUInteger)length { return length_; }
+- (Local<Object>)buffer { return Local<Object>::New(buffer_); }
+
+- (Local<Value>)v8Value {
+  // round-trip: hand back the very same buffer
+  HandleScope scope;
+  return scope.Close(Local<Value>(self.buffer));
+}
+
+- (Local<Value>)v8ValueNoCopy {
+  return [self v8Value];
+}
+
+@end
+
+
+@implementation NSData (node)
+
++ (NSData*)dataWithNodeBufferNoCopy:(Local<Object>)buffer {
+  assert(node::Buffer::HasInstance(buffer));
+  return [[[NodeJSBufferData alloc] initWithBuffer:buffer] autorelease];
+}
+
+
+- (Local<Value>)v8Value {
+  HandleScope scope;
   Local<Value> argv[] = {Integer::New([self length])};
-  Local<Value> buf = BufferConstructor->NewInstance(1, argv);
-  
+  Local<Value> buf = BufferConstructor()->NewInstance(1, argv);
+
   char *dataptr = node::Buffer::Data(Local<Object>::Cast(buf));
   assert(dataptr != NULL);
   [self getBytes:dataptr length:[self length]];
-  
+
   return scope.Close(buf);
 }
 
+
+- (Local<Value>)v8ValueNoCopy {
+  HandleScope scope;
+  NSUInteger length = [self length];
+
+  // The buffer retains |self| which is released by node when the buffer is
+  // garbage collected.
+  node::Buffer* slowbuf = node::Buffer::New((char*)[self bytes], length,
+                                            &ReleaseNSDataCallback,
+                                            (void*)[self retain]);
+  NodeJSHeapAdjustExternalMemory((intptr_t)length);
+
+  // new Buffer(slowbuf, length, 0) creates a "fast" buffer which refers to the
+  // memory of |slowbuf| (no copying involved)
+  Local<Value> argv[] = {
+    Local<Value>::New(slowbuf->handle_),
+    Integer::NewFromUnsigned(length),
+    Integer::New(0)
+  };
+  Local<Value> buf = BufferConstructor()->NewInstance(3, argv);
+  return scope.Close(buf);
+}
+
+@end
+
+
+// -----------------------------------------------------------------------------
+// Typed numeric arrays
+
+static const size_t kElementSize[] = {
+  sizeof(int32_t),  // NodeJSInt32Elements
+  sizeof(uint32_t), // NodeJSUInt32Elements
+  sizeof(float),    // NodeJSFloatElements
+  sizeof(double),   // NodeJSDoubleElements
+};
+
+size_t NodeJSElementSize(NodeJSElementType type) {
+  return kElementSize[type];
+}
+
+
+// Element conversion. A plain cast, except from floating point to a narrower
+// type, where a cast is undefined for NaN and out of range values: integers
+// saturate (NaN becomes 0) and floats overflow to infinity.
+template <typename D, typename S>
+static inline D ConvertElement(S v) {
+  return (D)v;
+}
+
+template <>
+inline int32_t ConvertElement<int32_t, double>(double v) {
+  if (v != v) return 0;
+  if (v <= (double)INT_MIN) return INT_MIN;
+  if (v >= (double)INT_MAX) return INT_MAX;
+  return (int32_t)v;
+}
+
+template <>
+inline uint32_t ConvertElement<uint32_t, double>(double v) {
+  if (!(v > 0)) return 0;  // NaN too
+  if (v >= (double)UINT_MAX) return UINT_MAX;
+  return (uint32_t)v;
+}
+
+template <>
+inline float ConvertElement<float, double>(double v) {
+  if (v > FLT_MAX) return HUGE_VALF;
+  if (v < -FLT_MAX) return -HUGE_VALF;
+  return (float)v;
+}
+
+template <>
+inline int32_t ConvertElement<int32_t, float>(float v) {
+  return ConvertElement<int32_t, double>(v);
+}
+
+template <>
+inline uint32_t ConvertElement<uint32_t, float>(float v) {
+  return ConvertElement<uint32_t, double>(v);
+}
+
+
+// Conversion kernel. Written as a plain, unaliased loop over contiguous memory
+// so that the compiler is free to vectorize it.
+template <typename S, typename D>
+static void ConvertKernel(const S* __restrict src, D* __restrict dst,
+                          size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    dst[i]   = ConvertElement<D>(src[i]);
+    dst[i+1] = ConvertElement<D>(src[i+1]);
+    dst[i+2] = ConvertElement<D>(src[i+2]);
+    dst[i+3] = ConvertElement<D>(src[i+3]);
+  }
+  for (; i < count; ++i)
+    dst[i] = ConvertElement<D>(src[i]);
+}
+
+template <typename S>
+static void ConvertFrom(const S* src, void* dst, NodeJSElementType dstType,
+                        size_t count) {
+  switch (dstType) {
+    case NodeJSInt32Elements:
+      ConvertKernel(src, (int32_t*)dst, count); break;
+    case NodeJSUInt32Elements:
+      ConvertKernel(src, (uint32_t*)dst, count); break;
+    case NodeJSFloatElements:
+      ConvertKernel(src, (float*)dst, count); break;
+    case NodeJSDoubleElements:
+      ConvertKernel(src, (double*)dst, count); break;
+  }
+}
+
+void NodeJSConvertElements(const void* src, NodeJSElementType srcType,
+                           void* dst, NodeJSElementType dstType,
+                           size_t count) {
+  if (srcType == dstType) {
+    memcpy(dst, src, count * kElementSize[srcType]);
+    return;
+  }
+  switch (srcType) {
+    case NodeJSInt32Elements:
+      ConvertFrom((const int32_t*)src, dst, dstType, count); break;
+    case NodeJSUInt32Elements:
+      ConvertFrom((const uint32_t*)src, dst, dstType, count); break;
+    case NodeJSFloatElements:
+      ConvertFrom((const float*)src, dst, dstType, count); break;
+    case NodeJSDoubleElements:
+      ConvertFrom((const double*)src, dst, dstType, count); break;
+  }
+}
+
+
+// Maps an element type to a V8 external array type. Returns false for types
+// which V8 is unable to represent (double).
+static bool ExternalArrayTypeForElementType(NodeJSElementType type,
+                                            ExternalArrayType* out) {
+  switch (type) {
+    case NodeJSInt32Elements:  *out = kExternalIntArray; return true;
+    case NodeJSUInt32Elements: *out = kExternalUnsignedIntArray; return true;
+    case NodeJSFloatElements:  *out = kExternalFloatArray; return true;
+    default: return false;
+  }
+}
+
+static bool ElementTypeForExternalArrayType(ExternalArrayType type,
+                                            NodeJSElementType* out) {
+  switch (type) {
+    case kExternalIntArray:         *out = NodeJSInt32Elements; return true;
+    case kExternalUnsignedIntArray: *out = NodeJSUInt32Elements; return true;
+    case kExternalFloatArray:       *out = NodeJSFloatElements; return true;
+    default: return false;
+  }
+}
+
+
+// Keeps the memory behind an external array alive until the array object is
+// garbage collected. Either |owner| is retained or |memory| is malloc'ed.
+struct ExternalArrayHolder {
+  Persistent<Object> handle;
+  id owner;
+  void* memory;
+  size_t size;
+};
+
+static void ExternalArrayWeakCallback(Persistent<Value> value, void* data) {
+  ExternalArrayHolder* holder = (ExternalArrayHolder*)data;
+  assert(value.IsNearDeath());
+  if (holder->owner) [holder->owner release];
+  if (holder->memory) free(holder->memory);
+  NodeJSHeapAdjustExternalMemory(-(intptr_t)holder->size);
+  holder->handle.Dispose();
+  holder->handle.Clear();
+  delete holder;
+}
+
+static Local<Object> NewExternalArray(void* bytes, ExternalArrayType type,
+                                      size_t count, size_t size, id owner,
+                                      void* memory) {
+  HandleScope scope;
+  Local<Object> obj = Object::New();
+  obj->SetIndexedPropertiesToExternalArrayData(bytes, type, (int)count);
+  obj->Set(String::NewSymbol("length"), Integer::NewFromUnsigned(count),
+           static_cast<PropertyAttribute>(ReadOnly | DontEnum));
+  ExternalArrayHolder* holder = new ExternalArrayHolder;
+  holder->owner = owner ? [owner retain] : nil;
+  holder->memory = memory;
+  holder->size = size;
+  holder->handle = Persistent<Object>::New(obj);
+  holder->handle.MakeWeak(holder, &ExternalArrayWeakCallback);
+  NodeJSHeapAdjustExternalMemory((intptr_t)size);
+  return scope.Close(obj);
+}
+
+
+@implementation NSData (NodeJSTypedArray)
+
+- (Local<Object>)v8ArrayWithElementType:(NodeJSElementType)type {
+  HandleScope scope;
+  size_t count = [self length] / kElementSize[type];
+  ExternalArrayType arrayType;
+  if (ExternalArrayTypeForElementType(type, &arrayType)) {
+    // A snapshot: mutable data is copied, as resizing it would free the
+    // memory under V8's feet. Copying immutable data is just a retain.
+    NSData* snapshot = [self copy];
+    Local<Object> array = NewExternalArray((void*)[snapshot bytes], arrayType,
+                                           count, [snapshot length], snapshot,
+                                           NULL);
+    [snapshot release];
+    return scope.Close(array);
+  }
+  // V8 has no external array type for doubles -- produce a plain array
+  const double* values = (const double*)[self bytes];
+  Local<Array> a = Array::New((int)count);
+  for (size_t i = 0; i < count; ++i)
+    a->Set((uint32_t)i, Number::New(values[i]));
+  return scope.Close(Local<Object>(a));
+}
+
+
+- (Local<Object>)v8ArrayWithElementType:(NodeJSElementType)type
+                           convertingTo:(NodeJSElementType)dstType {
+  if (type == dstType)
+    return [self v8ArrayWithElementType:type];
+  ExternalArrayType arrayType;
+  if (!ExternalArrayTypeForElementType(dstType, &arrayType)) {
+    NSData* converted =
+        [NSData dataWithData:self elementType:type convertingTo:dstType];
+    return [converted v8ArrayWithElementType:dstType];
+  }
+  HandleScope scope;
+  size_t count = [self length] / kElementSize[type];
+  size_t size = count * kElementSize[dstType];
+  void* memory = malloc(size ? size : 1);
+  NodeJSConvertElements([self bytes], type, memory, dstType, count);
+  return scope.Close(NewExternalArray(memory, arrayType, count, size, nil,
+                                      memory));
+}
+
+
++ (NSData*)dataWithData:(NSData*)data
+            elementType:(NodeJSElementType)type
+           convertingTo:(NodeJSElementType)dstType {
+  size_t count = [data length] / kElementSize[type];
+  NSMutableData* converted =
+      [NSMutableData dataWithLength:count * kElementSize[dstType]];
+  NodeJSConvertElements([data bytes], type, [converted mutableBytes], dstType,
+                        count);
+  return converted;
+}
+
+
++ (NSData*)dataWithV8Array:(Local<Value>)value
+               elementType:(NodeJSElementType)type {
+  if (value.IsEmpty() || !value->IsObject()) return nil;
+  HandleScope scope;
+  Local<Object> obj = value->ToObject();
+
+  // external array data
+  NodeJSElementType srcType;
+  if (obj->HasIndexedPropertiesInExternalArrayData() &&
+      ElementTypeForExternalArrayType(
+          obj->GetIndexedPropertiesExternalArrayDataType(), &srcType)) {
+    void* bytes = obj->GetIndexedPropertiesExternalArrayData();
+    size_t count = obj->GetIndexedPropertiesExternalArrayDataLength();
+    if (srcType == type) {
+      return [[[NodeJSBufferData alloc]
+          initWithObject:obj bytes:bytes
+                  length:count * kElementSize[type]] autorelease];
+    }
+    NSMutableData* data =
+        [NSMutableData dataWithLength:count * kElementSize[type]];
+    NodeJSConvertElements(bytes, srcType, [data mutableBytes], type, count);
+    return data;
+  }
+
+  // plain array of numbers
+  if (value->IsArray()) {
+    Local<Array> a = Local<Array>::Cast(value);
+    uint32_t i, count = a->Length();
+    NSMutableData* data =
+        [NSMutableData dataWithLength:count * kElementSize[type]];
+    void* bytes = [data mutableBytes];
+    switch (type) {
+      case NodeJSInt32Elements:
+        for (i = 0; i < count; ++i)
+          ((int32_t*)bytes)[i] = a->Get(i)->Int32Value();
+        break;
+      case NodeJSUInt32Elements:
+        for (i = 0; i < count; ++i)
+          ((uint32_t*)bytes)[i] = a->Get(i)->Uint32Value();
+        break;
+      case NodeJSFloatElements:
+        for (i = 0; i < count; ++i)
+          ((float*)bytes)[i] = (float)a->Get(i)->NumberValue();
+        break;
+      case NodeJSDoubleElements:
+        for (i = 0; i < count; ++i)
+          ((double*)bytes)[i] = a->Get(i)->NumberValue();
+        break;
+    }
+    return data;
+  }
+
+  return nil;
+}
+
 @end
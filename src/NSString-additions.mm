@@ -1 +1,230 @@
+#import "NS-additions.h"
+#import "NodeJSHeap.h"
+#import "NodeJSAtomic.h"
 
+using namespace v8;
+
+NSUInteger NodeJSStringNoCopyThreshold = 32 * 1024;
+
+// -----------------------------------------------------------------------------
+// NSString --> V8: external strings backed by the NSString's own buffer
+
+// Resources created by us (so that V8 --> NSString can hand back the original
+// NSString). Guarded by a lock since there might be several node threads.
+static CFMutableSetRef gResources = NULL;
+static NodeJSSpinLock gResourcesLock = NODEJS_SPINLOCK_INIT;
+
+static void RegisterResource(const void* resource, bool add) {
+  NodeJSSpinLockLock(&gResourcesLock);
+  if (!gResources)
+    gResources = CFSetCreateMutable(NULL, 0, NULL); // pointer identity
+  if (add) CFSetAddValue(gResources, resource);
+  else CFSetRemoveValue(gResources, resource);
+  NodeJSSpinLockUnlock(&gResourcesLock);
+}
+
+static bool IsOurResource(const void* resource) {
+  NodeJSSpinLockLock(&gResourcesLock);
+  bool found = gResources && CFSetContainsValue(gResources, resource);
+  NodeJSSpinLockUnlock(&gResourcesLock);
+  return found;
+}
+
+
+// Keeps |string| (immutable) alive for as long as V8 refers to its buffer
+template <class Base, typename Char>
+class NSStringResource : public Base {
+ public:
+  NSStringResource(NSString* string, const Char* data, size_t length)
+      : string_([string retain]), data_(data), length_(length) {
+    RegisterResource(static_cast<String::ExternalStringResourceBase*>(this),
+                     true);
+    V8::AdjustAmountOfExternalAllocatedMemory(length * sizeof(Char));
+  }
+  virtual ~NSStringResource() {
+    RegisterResource(static_cast<String::ExternalStringResourceBase*>(this),
+                     false);
+    V8::AdjustAmountOfExternalAllocatedMemory(-(int)(length_ * sizeof(Char)));
+    [string_ release];
+  }
+  virtual const Char* data() const { return data_; }
+  virtual size_t length() const { return length_; }
+  NSString* string() const { return string_; }
+ private:
+  NSString* string_;
+  const Char* data_;
+  size_t length_;
+};
+
+typedef NSStringResource<String::ExternalStringResource, uint16_t>
+    NSStringTwoByteResource;
+typedef NSStringResource<String::ExternalAsciiStringResource, char>
+    NSStringAsciiResource;
+
+
+static bool IsASCII(const char* chars, size_t length) {
+  for (size_t i = 0; i < length; ++i) {
+    if (chars[i] & 0x80) return false;
+  }
+  return true;
+}
+
+
+// Returns an external string if |str| has a buffer V8 can use, otherwise an
+// empty handle.
+static Local<String> NewExternalString(NSString* str) {
+  CFStringRef s = (CFStringRef)str;
+  CFIndex length = CFStringGetLength(s);
+  const UniChar* chars = CFStringGetCharactersPtr(s);
+  if (chars) {
+    return String::NewExternal(
+        new NSStringTwoByteResource(str, (const uint16_t*)chars, length));
+  }
+  const char* bytes = CFStringGetCStringPtr(s, kCFStringEncodingASCII);
+  if (bytes && IsASCII(bytes, length)) {
+    return String::NewExternal(new NSStringAsciiResource(str, bytes, length));
+  }
+  return Local<String>();
+}
+
+// -----------------------------------------------------------------------------
+// V8 --> NSString: an immutable NSString which refers to the characters of an
+// external V8 string, keeping the V8 string alive for as long as the NSString
+// is alive.
+
+@interface NodeJSV8String : NSString {
+  Persistent<String> string_;
+  const void* chars_;
+  NSUInteger length_;
+  BOOL ascii_;            // |chars_| are 8-bit (ASCII) rather than UTF-16
+}
+- (id)initWithExternalString:(Local<String>)string;
+@end
+
+@implementation NodeJSV8String
+
+- (id)initWithExternalString:(Local<String>)string {
+  if ((self = [super init])) {
+    string_ = Persistent<String>::New(string);
+    length_ = string->Length();
+    if (string->IsExternal()) {
+      chars_ = string->GetExternalStringResource()->data();
+    } else {
+      assert(string->IsExternalAscii());
+      chars_ = string->GetExternalAsciiStringResource()->data();
+      ascii_ = YES;
+    }
+  }
+  return self;
+}
+
+- (void)dealloc {
+  // may be released on any thread
+  NodeJSHeapDisposeHandle(string_);
+  string_.Clear();
+  [super dealloc];
+}
+
+- (NSUInteger)length {
+  return length_;
+}
+
+- (unichar)characterAtIndex:(NSUInteger)index {
+  if (index >= length_) {
+    [NSException raise:NSRangeException format:@"index %lu out of bounds",
+     (unsigned long)index];
+  }
+  return ascii_ ? ((const uint8_t*)chars_)[index]
+                : ((const unichar*)chars_)[index];
+}
+
+- (void)getCharacters:(unichar*)buffer range:(NSRange)range {
+  if (NSMaxRange(range) > length_) {
+    [NSException raise:NSRangeException format:@"range %@ out of bounds",
+     NSStringFromRange(range)];
+  }
+  if (!ascii_) {
+    memcpy(buffer, (const unichar*)chars_ + range.location,
+           range.length * sizeof(unichar));
+  } else {
+    const uint8_t* src = (const uint8_t*)chars_ + range.location;
+    for (NSUInteger i = 0; i < range.length; ++i)
+      buffer[i] = src[i];
+  }
+}
+
+- (id)copyWithZone:(NSZone*)zone {
+  return [self retain]; // immutable
+}
+
+- (Local<String>)v8String {
+  // round-trip: hand back the very same string
+  return Local<String>::New(string_);
+}
+
+- (Local<Value>)v8Value {
+  HandleScope scope;
+  return scope.Close(Local<Value>([self v8String]));
+}
+
+@end
+
+// -----------------------------------------------------------------------------
+
+@implementation NSString (v8)
+
+- (Local<String>)v8String {
+  HandleScope scope;
+  if ((NSUInteger)CFStringGetLength((CFStringRef)self) >=
+      NodeJSStringNoCopyThreshold) {
+    // |copy| is free for immutable strings and makes sure the characters don't
+    // change under V8's feet otherwise
+    NSString* immutable = [self copy];
+    Local<String> str = NewExternalString(immutable);
+    [immutable release];
+    if (!str.IsEmpty()) return scope.Close(str);
+  }
+  return scope.Close(String::New([self UTF8String]));
+}
+
+- (Local<Value>)v8Value {
+  HandleScope scope;
+  return scope.Close(Local<Value>([self v8String]));
+}
+
++ (NSString*)stringWithV8String:(Local<String>)str {
+  int length = str->Length();
+  if ((NSUInteger)length >= NodeJSStringNoCopyThreshold) {
+    if (str->IsExternal()) {
+      String::ExternalStringResource* resource =
+          str->GetExternalStringResource();
+      if (IsOurResource(static_cast<String::ExternalStringResourceBase*>(
+              resource))) {
+        // round-trip: hand back the very same NSString
+        return [[((NSStringTwoByteResource*)resource)->string() retain]
+                autorelease];
+      }
+      return [[[NodeJSV8String alloc] initWithExternalString:str] autorelease];
+    } else if (str->IsExternalAscii()) {
+      String::ExternalAsciiStringResource* resource =
+          str->GetExternalAsciiStringResource();
+      if (IsOurResource(static_cast<String::ExternalStringResourceBase*>(
+              resource))) {
+        return [[((NSStringAsciiResource*)resource)->string() retain]
+                autorelease];
+      }
+      return [[[NodeJSV8String alloc] initWithExternalString:str] autorelease];
+    }
+    // Heap strings may move, so copy -- but only once, as UTF-16 straight
+    // into the buffer the NSString takes ownership of.
+    unichar* chars = (unichar*)malloc(length * sizeof(unichar));
+    str->Write(chars, 0, length);
+    return [[[NSString alloc] initWithCharactersNoCopy:chars
+                                                length:length
+                                          freeWhenDone:YES] autorelease];
+  }
+  String::Utf8Value utf8(str);
+  return [NSString stringWithUTF8String:*utf8];
+}
+
+@end
@@ -30,8 +30,22 @@
 #endif
 
 #import <NodeCocoa/NodeJS.h>
+#import <NodeCocoa/NodeJSLoop.h>
+#import <NodeCocoa/NodeJSHeap.h>
+#import <NodeCocoa/NodeJSAllocator.h>
+#import <NodeCocoa/NodeJSAtomic.h>
 #import <NodeCocoa/NodeJSScript.h>
+#import <NodeCocoa/NodeJSScriptCache.h>
+#import <NodeCocoa/NodeJSCodeCache.h>
+#import <NodeCocoa/NodeJSModuleArchive.h>
 #import <NodeCocoa/NodeJSFunction.h>
 #import <NodeCocoa/NS-additions.h>
+#import <NodeCocoa/NodeJSInternTable.h>
+#import <NodeCocoa/NodeJSConverter.h>
+#import <NodeCocoa/NodeThread.h>
+#import <NodeCocoa/NodeJSWireFormat.h>
+#import <NodeCocoa/NodeWorkerPool.h>
+#import <NodeCocoa/NodeTask.h>
+#import <NodeCocoa/NodeJSChannel.h>
 
 #endif // NODECOCOA_NODECOCOA_H_
@@ -2,21 +2,67 @@
 #define NODECOCOA_NODEJS_H_
 
 #import <NodeCocoa/node.h>
+#import <NodeCocoa/NodeJSLoop.h>
+#import <NodeCocoa/NodeJSHeap.h>
+#import <NodeCocoa/NodeJSAllocator.h>
+#import <NodeCocoa/NodeJSCodeCache.h>
+#import <NodeCocoa/NodeJSModuleArchive.h>
+
+/// Runtime counters reported by +[NodeJS statistics].
+typedef struct {
+  NodeJSLoopStats loop;          // event loop counters (see NodeJSLoop.h)
+  NodeJSHeapStats heap;          // V8 heap counters (see NodeJSHeap.h)
+  NodeJSAllocatorStats allocator; // event loop memory (see NodeJSAllocator.h)
+  NodeJSHistogram iterationTime; // time per main runloop iteration, not
+                                 // counting time blocked waiting for events
+  NodeJSHistogram blockedTime;   // time blocked in nextEventMatchingMask
+  uint64_t compiles;             // calls to +[NodeJS compile:...]
+  uint64_t cachedCompiles;       // ... which reused a cached script
+  uint64_t compileErrors;        // ... which failed
+  uint64_t evals;                // calls to +[NodeJS eval:...]
+  uint64_t evalErrors;           // ... which failed (compiling or running)
+  NodeJSCodeCacheStats codeCache; // precompiled bundle cache counters
+  NodeJSModuleArchiveStats moduleArchive; // module archive counters
+} NodeJSStats;
 
 /**
  * Program entry point -- replaces use of NSApplicationMain.
  *
+ * When called with "--precompile-bundle <directory>" it instead writes a
+ * NodeJSCodeCache (codecache.bin) and a NodeJSModuleArchive (modules.pack) for
+ * the JavaScript in <directory> to <directory> and returns.
+ *
  * Tip: You can utilize the NSApplication delegate method
  * |applicationWillFinishLaunching:| to perform environment setup if needed.
  */
 int NodeJSApplicationMain(int argc, const char** argv);
 
+/**
+ * Adopt the current context (node's main context) as the main context and set
+ * up process.host, the code cache and the module archive.
+ *
+ * NodeJSApplicationMain does this itself. It's meant for programs which start
+ * node without AppKit, from their own node::Main (e.g. the benchmark suite in
+ * bench/), before they use the rest of the API. Call at most once. Modules
+ * loaded before the call -- the main module and what it requires while it
+ * loads -- don't go through the code cache or module archive.
+ */
+void NodeJSAttachToCurrentContext();
+
 #ifdef __OBJC__
 
+/// How much of an exception |+[NSError errorFromV8TryCatch:]| keeps.
+typedef enum {
+  NodeJSErrorDetailFull = 0,  // everything, formatted right away (default)
+  NodeJSErrorDetailLazy,      // everything, formatted on first use
+  NodeJSErrorDetailMessage,   // only the exception's message
+} NodeJSErrorDetail;
+
 // NSError additions
 @interface NSError (v8)
 /**
- * Create a NSError from a valid TryCatch struct.
+ * Create a NSError from a valid TryCatch struct, with the detail set by
+ * |+[NodeJS setErrorDetail:]|.
  *
  * The userInfo dict includes the following keys:
  *
@@ -24,9 +70,23 @@ int NodeJSApplicationMain(int argc, const char** argv);
  *   filename -- filename of origin where the exception was raised.
  *   lineno -- line number where the exception was raised.
  *   sourceline -- origin source line.
+ *
+ * With NodeJSErrorDetailMessage only NSLocalizedDescriptionKey is set, to the
+ * exception's message (no stack trace).
  */
 + (NSError*)errorFromV8TryCatch:(v8::TryCatch &)try_catch;
 
+/**
+ * Create a NSError from a valid TryCatch struct with |detail|.
+ *
+ * A lazy error only keeps handles to the exception and its message, and
+ * formats |userInfo| (and thus |localizedDescription|) the first time it's
+ * asked for. Like any V8 handle it must only be used, and released, on the
+ * node thread, so it's only worth asking for when errors are handled there.
+ */
++ (NSError*)errorFromV8TryCatch:(v8::TryCatch &)try_catch
+                         detail:(NodeJSErrorDetail)detail;
+
 /**
  * Convenience: create an NSError in the |NodeJSNSErrorDomain| with the
  * |userInfo| key |NSLocalizedDescriptionKey| set to |description|.
@@ -37,6 +97,15 @@ int NodeJSApplicationMain(int argc, const char** argv);
 /// NSError domain for errors related to Node.js.
 extern const NSString* NodeJSNSErrorDomain;
 
+/// Options for |+[NodeJS evalBatch:context:options:]|.
+enum {
+  NodeJSEvalBatchStopOnError = 1 << 0,    // skip the items after a failure
+  NodeJSEvalBatchInspect = 1 << 1,        // results as util.inspect strings
+  NodeJSEvalBatchDiscardResults = 1 << 2, // results as NSNull (only errors)
+  NodeJSEvalBatchPipeline = 1 << 3,       // prepare items on another thread
+};
+typedef NSUInteger NodeJSEvalBatchOptions;
+
 // Objective-C++ interface to node.js
 @interface NodeJS : NSObject {
 }
@@ -54,6 +123,33 @@ extern const NSString* NodeJSNSErrorDomain;
 /// Returns the number of registered events currently in the node runloop.
 + (int)registeredEvents;
 
+/**
+ * Current runtime counters.
+ *
+ * The same information is available to JavaScript as a plain object returned
+ * by process.host.stats() (durations in milliseconds, histograms summarized as
+ * count, mean, min, max, p50, p90 and p99 plus the raw buckets).
+ */
++ (NodeJSStats)statistics;
+
+/// Reset all runtime counters (including the event loop's) to zero.
++ (void)resetStatistics;
+
+/**
+ * Detail of the errors created for exceptions (by |eval:|, |compile:|,
+ * |-[NodeJSScript run:]|, |-[NodeJSFunction callWithV8Arguments:...]| and
+ * others). Defaults to NodeJSErrorDetailFull, which gives errors that can be
+ * used on any thread. Scripts which throw as part of normal operation can use
+ * NodeJSErrorDetailMessage to skip capturing stack traces altogether, or
+ * NodeJSErrorDetailLazy if every error they produce is only looked at on the
+ * node thread (lazy errors can be released on any thread, but off the node
+ * thread their userInfo is just "JavaScript exception"; NodeJSFunction's and
+ * NodeThread's asynchronous completions format their errors right away
+ * regardless).
+ */
++ (NodeJSErrorDetail)errorDetail;
++ (void)setErrorDetail:(NodeJSErrorDetail)detail;
+
 /// The main v8 context.
 + (v8::Persistent<v8::Context>)mainContext;
 
@@ -63,6 +159,9 @@ extern const NSString* NodeJSNSErrorDomain;
 /**
  * Compile |source| in |context| identified by |name| passing |error|.
  *
+ * Compiled scripts are kept in +[NodeJSScriptCache sharedCache], so compiling
+ * the same source again (with the same origin and context) is cheap.
+ *
  * @param source   JavaScript source.
  * @param origi    Optional identifier (e.g. filename).
  * @param context  An optional custom context in which to compile the script.
@@ -84,6 +183,28 @@ extern const NSString* NodeJSNSErrorDomain;
                      context:(v8::Context*)context
                        error:(NSError**)error;
 
+/**
+ * Evaluate a batch of scripts, one after the other, like |eval:| would.
+ *
+ * |items| are NSStrings (source) or NSArrays of source and origin (NSNull or
+ * absent for none). The contexts are entered once for the whole batch and a
+ * single TryCatch is reused for every item.
+ *
+ * Returns an array with one entry per item: the result (converted with
+ * |+[NSObject fromV8Value:]|, or a string with NodeJSEvalBatchInspect) or the
+ * NSError the item failed with. Undefined results are NSNull. With
+ * NodeJSEvalBatchStopOnError the array ends at the first NSError, as it does
+ * when execution is terminated (e.g. a cancelled NodeJSCall evaluating it).
+ *
+ * V8 can't compile one script while running another, so with
+ * NodeJSEvalBatchPipeline the work which doesn't need V8 -- hashing sources
+ * for the script cache and copying out their characters -- is done ahead on
+ * another thread while earlier items run.
+ */
++ (NSArray*)evalBatch:(NSArray*)items
+              context:(v8::Context*)context
+              options:(NodeJSEvalBatchOptions)options;
+
 @end
 
 #endif // __OBJC__
@@ -1,5 +1,13 @@
 #import "NodeJS.h"
+#import "NodeJSScriptCache.h"
+#import "NodeJSCodeCache.h"
+#import "NodeJSModuleArchive.h"
+#import "NodeJSLoop.h"
+#import "NodeJSChannel.h"
+#import "NodeJSHeap.h"
+#import "NodeJSAllocator.h"
 #import <ev.h>
+#import <node_events.h>
 #import <node_stdio.h>
 
 @interface NodeJS (Private)
@@ -23,9 +31,20 @@ static NSString *ExceptionToNSString(Local<Value> &er) {
 }
 
 
-static NSMutableDictionary* TryCatchToErrorDict(TryCatch &try_catch) {
+// The exception's "stack" property, like TryCatch::StackTrace
+static Local<Value> ExceptionStackTrace(Handle<Value> er) {
+  if (er.IsEmpty() || !er->IsObject()) return Local<Value>();
+  Local<Object> obj = er->ToObject();
+  Local<String> key = String::NewSymbol("stack");
+  if (!obj->Has(key)) return Local<Value>();
+  return obj->Get(key);
+}
+
+
+static NSMutableDictionary* ExceptionToErrorDict(Handle<Value> er,
+                                                 Handle<Message> message) {
+  HandleScope scope;
   NSMutableDictionary* info = [NSMutableDictionary dictionary];
-  v8::Handle<Message> message = try_catch.Message();
   if (!message.IsEmpty()) {
     String::Utf8Value filename(message->GetScriptResourceName());
     [info setObject:[NSString stringWithUTF8String:ToCString(filename)]
@@ -36,16 +55,16 @@ static NSMutableDictionary* TryCatchToErrorDict(TryCatch &try_catch) {
     [info setObject:[NSString stringWithUTF8String:ToCString(sourceline)]
              forKey:@"sourceline"];
   }
-  String::Utf8Value trace(try_catch.StackTrace());
+  String::Utf8Value trace(ExceptionStackTrace(er));
   if (trace.length() > 0) {
     [info setObject:[NSString stringWithUTF8String:*trace]
              forKey:NSLocalizedDescriptionKey];
-  } else {
+  } else if (!er.IsEmpty()) {
     // this really only happens for RangeErrors, since they're the only
     // kind that won't have all this info in the trace.
-    Local<Value> er = try_catch.Exception();
-    if (!er.IsEmpty())
-      [info setObject:ExceptionToNSString(er) forKey:NSLocalizedDescriptionKey];
+    Local<Value> value = Local<Value>::New(er);
+    [info setObject:ExceptionToNSString(value)
+             forKey:NSLocalizedDescriptionKey];
   }
   return info;
 }
@@ -58,23 +77,70 @@ using namespace v8;
 
 static Persistent<Context> gMainContext;
 static int gTerminationState = 0; // 0=running, 1=exit-deferred, 2=exit-asap
+static NodeJSStats gStats; // |loop| is filled in by +statistics
 
-// ev_run until no more queued events
-static void PumpNode() {
-  ev_now_update();  // Bring the clock forward since the last ev_run().
-  ev_run(EV_DEFAULT_UC_ EVLOOP_NONBLOCK);
-  while(ev_loop_fdchangecount() != 0) {
-    ev_run(EV_DEFAULT_UC_ EVLOOP_NONBLOCK);
-  }
-}
+// -----------------------------------------------------------------------------
+// CFRunLoop host for NodeJSLoop
 
+static CFFileDescriptorRef gBackendFile = NULL;
+static CFRunLoopTimerRef gPumpTimer = NULL;
 
 // called when something is pending in node's I/O
 static void KqueueCallback(CFFileDescriptorRef backendFile,
                            CFOptionFlags callBackTypes,
                            void* info) {
-  PumpNode();
-  CFFileDescriptorEnableCallBacks(backendFile, kCFFileDescriptorReadCallBack);
+  NodeJSLoopBackendReady(NodeJSLoopNow());
+}
+
+
+static void PumpTimerCallback(CFRunLoopTimerRef timer, void* info) {
+  NodeJSLoopPump();
+}
+
+
+static void HostWatch(void* data, int fd) {
+  // add node's I/O backend to the CFRunLoop as a runloop source
+  gBackendFile = CFFileDescriptorCreate(NULL, fd, true, &KqueueCallback, NULL);
+  CFRunLoopSourceRef backendRunLoopSource =
+      CFFileDescriptorCreateRunLoopSource(NULL, gBackendFile, 0);
+  CFRunLoopAddSource(CFRunLoopGetCurrent(), backendRunLoopSource,
+                     kCFRunLoopDefaultMode);
+  CFRelease(backendRunLoopSource);
+  CFFileDescriptorEnableCallBacks(gBackendFile, kCFFileDescriptorReadCallBack);
+}
+
+
+static void HostRearm(void* data) {
+  // CFFileDescriptor callbacks are one-shot
+  CFFileDescriptorEnableCallBacks(gBackendFile, kCFFileDescriptorReadCallBack);
+}
+
+
+static void HostSchedule(void* data, double delay) {
+  if (!gPumpTimer) {
+    // A repeating timer stays valid after firing, so it can be rescheduled
+    gPumpTimer = CFRunLoopTimerCreate(NULL, DBL_MAX, 1.0e10, 0, 0,
+                                      &PumpTimerCallback, NULL);
+    CFRunLoopAddTimer(CFRunLoopGetCurrent(), gPumpTimer,
+                      kCFRunLoopDefaultMode);
+  }
+  CFRunLoopTimerSetNextFireDate(gPumpTimer, delay < 0 ? DBL_MAX :
+      CFAbsoluteTimeGetCurrent() + delay);
+}
+
+
+static void HostExhausted(void* data) {
+  // wake up the main runloop (waiting in nextEventMatchingMask) so it exits
+  NSEvent* event = [NSEvent otherEventWithType:NSApplicationDefined
+                                      location:NSZeroPoint
+                                 modifierFlags:0
+                                     timestamp:0
+                                  windowNumber:0
+                                       context:nil
+                                       subtype:0
+                                         data1:0
+                                         data2:0];
+  [NSApp postEvent:event atStart:NO];
 }
 
 
@@ -93,10 +159,158 @@ static Local<Value> _NodeEval(v8::Handle<String> source,
 }
 
 
-// called when node has been setup and is about to enter its runloop
-static void NodeMain(const Arguments& args) {
+// -----------------------------------------------------------------------------
+// process.host.stats()
+
+static inline void SetNumber(Local<Object> obj, const char* key, double v) {
+  obj->Set(String::NewSymbol(key), Number::New(v));
+}
+
+
+static Local<Object> HistogramToObject(const NodeJSHistogram& h) {
+  HandleScope scope;
+  Local<Object> obj = Object::New();
+  SetNumber(obj, "count", (double)h.count);
+  SetNumber(obj, "mean", h.count ? h.sum / h.count * 1000.0 : 0);
+  SetNumber(obj, "min", h.min * 1000.0);
+  SetNumber(obj, "max", h.max * 1000.0);
+  SetNumber(obj, "p50", NodeJSHistogramPercentile(&h, 0.5) * 1000.0);
+  SetNumber(obj, "p90", NodeJSHistogramPercentile(&h, 0.9) * 1000.0);
+  SetNumber(obj, "p99", NodeJSHistogramPercentile(&h, 0.99) * 1000.0);
+  Local<Array> buckets = Array::New(NODEJS_HISTOGRAM_BUCKETS);
+  for (int i = 0; i < NODEJS_HISTOGRAM_BUCKETS; ++i)
+    buckets->Set(i, Number::New((double)h.buckets[i]));
+  obj->Set(String::NewSymbol("buckets"), buckets);
+  return scope.Close(obj);
+}
+
+
+static v8::Handle<Value> HostStats(const Arguments& args) {
+  HandleScope scope;
+  NodeJSStats stats = [NodeJS statistics];
+  Local<Object> loop = Object::New();
+  SetNumber(loop, "pumps", (double)stats.loop.pumps);
+  SetNumber(loop, "readinessPumps", (double)stats.loop.readinessPumps);
+  SetNumber(loop, "emptyPumps", (double)stats.loop.emptyPumps);
+  SetNumber(loop, "iterations", (double)stats.loop.iterations);
+  SetNumber(loop, "yields", (double)stats.loop.yields);
+  SetNumber(loop, "dispatched", (double)stats.loop.dispatched);
+  SetNumber(loop, "jsTime", stats.loop.jsTime * 1000.0);
+  SetNumber(loop, "pumpTime", stats.loop.pumpTime * 1000.0);
+  SetNumber(loop, "hostTime", stats.loop.hostTime * 1000.0);
+  loop->Set(String::NewSymbol("readinessLatency"),
+            HistogramToObject(stats.loop.readinessLatency));
+  loop->Set(String::NewSymbol("timerLateness"),
+            HistogramToObject(stats.loop.timerLateness));
+  Local<Object> obj = Object::New();
+  obj->Set(String::NewSymbol("loop"), loop);
+  obj->Set(String::NewSymbol("iterationTime"),
+           HistogramToObject(stats.iterationTime));
+  obj->Set(String::NewSymbol("blockedTime"),
+           HistogramToObject(stats.blockedTime));
+  Local<Object> heap = Object::New();
+  SetNumber(heap, "totalHeapSize", (double)stats.heap.totalHeapSize);
+  SetNumber(heap, "usedHeapSize", (double)stats.heap.usedHeapSize);
+  SetNumber(heap, "externalMemory", (double)stats.heap.externalMemory);
+  SetNumber(heap, "scavenges", (double)stats.heap.scavenges);
+  SetNumber(heap, "markSweeps", (double)stats.heap.markSweeps);
+  SetNumber(heap, "idleNotifications", (double)stats.heap.idleNotifications);
+  SetNumber(heap, "idleCompletions", (double)stats.heap.idleCompletions);
+  heap->Set(String::NewSymbol("pauseTime"),
+            HistogramToObject(stats.heap.pauseTime));
+  obj->Set(String::NewSymbol("heap"), heap);
+  Local<Object> allocator = Object::New();
+  SetNumber(allocator, "allocations", (double)stats.allocator.allocations);
+  SetNumber(allocator, "frees", (double)stats.allocator.frees);
+  SetNumber(allocator, "reallocations", (double)stats.allocator.reallocations);
+  SetNumber(allocator, "inPlace", (double)stats.allocator.inPlace);
+  SetNumber(allocator, "poolHits", (double)stats.allocator.poolHits);
+  SetNumber(allocator, "systemAllocations",
+            (double)stats.allocator.systemAllocations);
+  SetNumber(allocator, "currentBytes", (double)stats.allocator.currentBytes);
+  SetNumber(allocator, "peakBytes", (double)stats.allocator.peakBytes);
+  SetNumber(allocator, "arenaBytes", (double)stats.allocator.arenaBytes);
+  obj->Set(String::NewSymbol("allocator"), allocator);
+  SetNumber(obj, "compiles", (double)stats.compiles);
+  SetNumber(obj, "cachedCompiles", (double)stats.cachedCompiles);
+  SetNumber(obj, "compileErrors", (double)stats.compileErrors);
+  SetNumber(obj, "evals", (double)stats.evals);
+  SetNumber(obj, "evalErrors", (double)stats.evalErrors);
+  Local<Object> codeCache = Object::New();
+  SetNumber(codeCache, "hits", (double)stats.codeCache.hits);
+  SetNumber(codeCache, "stale", (double)stats.codeCache.stale);
+  SetNumber(codeCache, "misses", (double)stats.codeCache.misses);
+  SetNumber(codeCache, "compileTime", stats.codeCache.compileTime * 1000.0);
+  SetNumber(codeCache, "savedTime", stats.codeCache.savedTime * 1000.0);
+  SetNumber(codeCache, "count", (double)stats.codeCache.count);
+  SetNumber(codeCache, "size", (double)stats.codeCache.size);
+  obj->Set(String::NewSymbol("codeCache"), codeCache);
+  Local<Object> archive = Object::New();
+  SetNumber(archive, "lookups", (double)stats.moduleArchive.lookups);
+  SetNumber(archive, "misses", (double)stats.moduleArchive.misses);
+  SetNumber(archive, "statsAnswered",
+            (double)stats.moduleArchive.statsAnswered);
+  SetNumber(archive, "stale", (double)stats.moduleArchive.stale);
+  SetNumber(archive, "reads", (double)stats.moduleArchive.reads);
+  SetNumber(archive, "bytesRead", (double)stats.moduleArchive.bytesRead);
+  SetNumber(archive, "count", (double)stats.moduleArchive.count);
+  SetNumber(archive, "size", (double)stats.moduleArchive.size);
+  obj->Set(String::NewSymbol("moduleArchive"), archive);
+  return scope.Close(obj);
+}
+
+
+static v8::Handle<Value> HostResetStats(const Arguments& args) {
+  [NodeJS resetStatistics];
+  return Undefined();
+}
+
+
+// Makes sure there's a process.host object (an EventEmitter) and adds our
+// functions and the message channel to it
+static void SetupHostObject(Local<Object> process) {
+  HandleScope scope;
+  Local<String> host_symbol = String::NewSymbol("host");
+  Local<Value> host = process->Get(host_symbol);
+  if (!host->IsObject()) {
+    Local<FunctionTemplate> t = FunctionTemplate::New();
+    node::EventEmitter::Initialize(t);
+    host = t->GetFunction()->NewInstance();
+    process->Set(host_symbol, host);
+  }
+  Local<Object> hostObj = host->ToObject();
+  hostObj->Set(String::NewSymbol("stats"),
+               FunctionTemplate::New(&HostStats)->GetFunction());
+  hostObj->Set(String::NewSymbol("resetStats"),
+               FunctionTemplate::New(&HostResetStats)->GetFunction());
+  [[NodeJSChannel sharedChannel] installOnHostObject:hostObj];
+}
+
+// -----------------------------------------------------------------------------
+
+void NodeJSAttachToCurrentContext() {
   // Keep a reference to the main module's context
+  assert(gMainContext.IsEmpty());
   gMainContext = Persistent<Context>::New(Context::GetCurrent());
+  NodeJSHeapAttach();
+  SetupHostObject([NodeJS process]);
+
+  // From now on, have node compile modules using our precompiled data and
+  // resolve and read them from the module archive
+  [[NodeJSCodeCache sharedCache] installInProcess:[NodeJS process]];
+  Local<Value> require =
+      Context::GetCurrent()->Global()->Get(String::NewSymbol("require"));
+  if (require->IsFunction()) {
+    [[NodeJSModuleArchive sharedArchive]
+        installInProcess:[NodeJS process]
+                 require:Local<Function>::Cast(require)];
+  }
+}
+
+
+// called when node has been setup and is about to enter its runloop
+static void NodeMain(const Arguments& args) {
+  NodeJSAttachToCurrentContext();
 
   // load main nib file if applicable
   NSBundle *mainBundle = [NSBundle mainBundle];
@@ -122,42 +336,51 @@ static void NodeMain(const Arguments& args) {
   // by a unref in [NodeJS terminate];
   ev_ref(EV_DEFAULT_UC);
   
-  // Make sure the kqueue is initialized and the kernel state is up to date.
+  // Make sure the kqueue is initialized and the kernel state is up to date,
+  // then let the runloop pump node whenever its backend is readable or a timer
+  // is due.
   // Note: This need to happen after app initialization (since it will
   // effectively perform one runloop iteration).
-  PumpNode();
-  
-  // add node's I/O backend to the CFRunLoop as a runloop source
-  int backendFD = ev_backend_fd();
-  CFFileDescriptorRef backendFile =
-      CFFileDescriptorCreate(NULL, backendFD, true, &KqueueCallback, NULL);
-  CFRunLoopSourceRef backendRunLoopSource =
-      CFFileDescriptorCreateRunLoopSource(NULL, backendFile, 0);
-  CFRunLoopAddSource(CFRunLoopGetCurrent(), backendRunLoopSource,
-                     kCFRunLoopDefaultMode);
-  CFRelease(backendRunLoopSource);
-  CFFileDescriptorEnableCallBacks(backendFile, kCFFileDescriptorReadCallBack);
+  NodeJSLoopHost host = {
+    NULL, &HostWatch, &HostRearm, &HostSchedule, &HostExhausted
+  };
+  NodeJSLoopStart(&host);
   
-  // main runloop
+  // main runloop. When nothing happens for a while, the wait times out so V8
+  // can collect garbage (see NodeJSHeap.h).
+  double idleTimeout = NodeJSHeapIdleCheck(true);
   while (ev_refcount(EV_DEFAULT_UC) && gTerminationState != 2) {
     NSAutoreleasePool* pool = [NSAutoreleasePool new];
-    PumpNode();
-    if (ev_refcount(EV_DEFAULT_UC) == 0)
-      break;
-    double next_waittime = ev_loop_next_waittime(EV_DEFAULT_UC);
-    NSDate* next_date = [NSDate dateWithTimeIntervalSinceNow:next_waittime];
-    //NSLog(@"Running a loop iteration with timeout %f", next_waittime);
+    // node is pumped from within nextEventMatchingMask, so time spent pumping
+    // counts as work rather than as being blocked
+    double waitStart = NodeJSLoopNow();
+    NodeJSLoopStats loop = NodeJSLoopStatistics();
+    double pumpTime = loop.pumpTime;
+    uint64_t pumps = loop.pumps;
+    NSDate* until = idleTimeout < 0 ? [NSDate distantFuture] :
+        [NSDate dateWithTimeIntervalSinceNow:idleTimeout];
     NSEvent* event = [NSApp nextEventMatchingMask:NSAnyEventMask
-                            untilDate:next_date
+                            untilDate:until
                             inMode:NSDefaultRunLoopMode
                             dequeue:YES];
-    if (event != nil) {  // event is nil on a timeout.
+    double waitEnd = NodeJSLoopNow();
+    loop = NodeJSLoopStatistics();
+    double pumped = loop.pumpTime - pumpTime;
+    bool busy = event != nil || loop.pumps != pumps;
+    if (pumped < 0) pumped = 0; // statistics were reset while waiting
+    NodeJSHistogramAdd(&gStats.blockedTime,
+                       MAX(waitEnd - waitStart - pumped, 0));
+    if (event != nil) {
       //NSLog(@"Event: %@\n", event);
       [event retain];
       [NSApp sendEvent:event];
       [event release];
     }
     [pool drain];
+    NodeJSHistogramAdd(&gStats.iterationTime,
+                       NodeJSLoopNow() - waitEnd + pumped);
+    // also hands external memory released by the pool to V8
+    idleTimeout = NodeJSHeapIdleCheck(busy);
   }
   //NSLog(@"exited from main runloop -- delegating to NSRunLoop...");
   
@@ -167,29 +390,34 @@ static void NodeMain(const Arguments& args) {
 }
 
 
-// cf-aware memory allocator which uses the cf memory pool
-//   alloc:   MemAlloc(NULL, long size)
-//   realloc: MemAlloc(void *ptr, long size)
-//   free:    MemAlloc(void *ptr, 0)
-static void *MemAlloc(void *ptr, long size) {
-  if (size)
-    return CFAllocatorReallocate(kCFAllocatorDefault, ptr, (CFIndex)size, 0);
-  CFAllocatorDeallocate(kCFAllocatorDefault, ptr);
-  return NULL;
-}
-
-
 int NodeJSApplicationMain(int argc, const char** argv) {
   NSAutoreleasePool* pool = [NSAutoreleasePool new];
   
+  // Build-time mode (see scripts/precompile-bundle.sh)
+  if (argc >= 3 && strcmp(argv[1], "--precompile-bundle") == 0) {
+    NSString* directory = [NSString stringWithUTF8String:argv[2]];
+    NSError* error = nil;
+    BOOL ok = [NodeJSCodeCache buildCacheForDirectory:directory
+        toFile:[directory stringByAppendingPathComponent:NodeJSCodeCacheFilename]
+         error:&error] &&
+        [NodeJSModuleArchive buildArchiveForDirectory:directory
+        toFile:[directory stringByAppendingPathComponent:
+                NodeJSModuleArchiveFilename]
+         error:&error];
+    if (!ok) fprintf(stderr, "%s\n", [[error localizedDescription] UTF8String]);
+    [pool drain];
+    return ok ? 0 : 1;
+  }
+  
   // Make sure NSApp is initialized.
   [NSApplication sharedApplication];
   
   // Have node use our custom main
   node::Main = &NodeMain;
   
-  // Have libev use our memory allocator
-  ev_set_allocator(&MemAlloc);
+  // Have libev use our memory allocator (see NodeJSAllocator.h)
+  NodeJSAllocatorSelectFromEnvironment();
+  ev_set_allocator(&NodeJSAllocatorRealloc);
   
   // Manipulate process.argv to contain main.js
   assert(argc >= 1);
@@ -205,12 +433,13 @@ int NodeJSApplicationMain(int argc, const char** argv) {
   // TODO: create empty temporary file if |mainScriptPath| is missing.
   // Note: We need to load a module though, since we use some tricks enabled by
   // loading the main module in node.
-  const char **argv2 = (const char **)MemAlloc(NULL, sizeof(char*)*argc+1);
+  const char **argv2 = (const char **)malloc(sizeof(char*) * (argc + 2));
   argv2[0] = argv[0];
   argv2[1] = [mainScriptPath UTF8String];
   for (int i = 1; i < argc; i++) {
     argv2[i+1] = argv[i];
   }
+  argv2[argc+1] = NULL;
   
   // Tell node to load modules in separate contexts -- a trick to get access to
   // require() and friends. This works together with |gMainContext| in the way
@@ -230,12 +459,17 @@ int NodeJSApplicationMain(int argc, const char** argv) {
       libPath = [libPath stringByAppendingFormat:@":%s", node_path];
     setenv("NODE_PATH", [libPath UTF8String], 1);
   }
+  
+  // Map the precompiled code cache and module archive (if any) while node is
+  // starting up
+  [NodeJSCodeCache sharedCache];
+  [NodeJSModuleArchive sharedArchive];
     
   // pass control over to node (we'll get control soon when NodeMain is called)
   int rc = node::Start(argc+1, (char**)argv2);
   
   // we will probably never get here
-  MemAlloc(argv2, 0);
+  free(argv2);
   [pool drain];
   return rc;
 }
@@ -244,12 +478,112 @@ int NodeJSApplicationMain(int argc, const char** argv) {
 
 const NSString* NodeJSNSErrorDomain = @"node.js";
 
+static NodeJSErrorDetail gErrorDetail = NodeJSErrorDetailFull;
+
+// NodeJSHeapDisposeHandle takes any handle as a Persistent<Value>; disposing
+// of a global handle doesn't depend on its type.
+template <class T>
+static void DisposeHandle(Persistent<T>& handle) {
+  NodeJSHeapDisposeHandle(Persistent<Value>(reinterpret_cast<Value*>(*handle)));
+  handle.Clear();
+}
+
+
+// An error for a V8 exception which formats its userInfo on first access.
+// Keeps the context the exception was thrown in, as formatting calls into V8.
+// Can be released on any thread, but only formats on the node thread.
+@interface NodeJSLazyError : NSError {
+  Persistent<Value> exception_;
+  Persistent<Message> message_;
+  Persistent<Context> context_;
+  NSDictionary* details_;
+}
+- (id)initWithTryCatch:(TryCatch &)try_catch;
+@end
+
+@implementation NodeJSLazyError
+
+- (id)initWithTryCatch:(TryCatch &)try_catch {
+  if ((self = [super initWithDomain:(NSString*)NodeJSNSErrorDomain
+                               code:0
+                           userInfo:nil])) {
+    HandleScope scope;
+    exception_ = Persistent<Value>::New(try_catch.Exception());
+    Local<Message> message = try_catch.Message();
+    if (!message.IsEmpty())
+      message_ = Persistent<Message>::New(message);
+    if (Context::InContext())
+      context_ = Persistent<Context>::New(Context::GetCurrent());
+  }
+  return self;
+}
+
+
+- (void)dealloc {
+  DisposeHandle(exception_);
+  DisposeHandle(message_);
+  DisposeHandle(context_);
+  [details_ release];
+  [super dealloc];
+}
+
+
+- (NSDictionary*)userInfo {
+  if (!details_) {
+    if (!NodeJSHeapOnNodeThread()) {
+      // Formatting needs V8. Not cached, so the details are still available
+      // on the node thread later.
+      assert(!"NodeJSLazyError formatted off the node thread");
+      return [NSDictionary dictionaryWithObject:@"JavaScript exception"
+                                         forKey:NSLocalizedDescriptionKey];
+    }
+    HandleScope scope;
+    if (!context_.IsEmpty()) context_->Enter();
+    details_ = [ExceptionToErrorDict(exception_, message_) copy];
+    if (!context_.IsEmpty()) context_->Exit();
+  }
+  return details_;
+}
+
+
+- (NSString*)localizedDescription {
+  NSString* description =
+      [[self userInfo] objectForKey:NSLocalizedDescriptionKey];
+  return description ? description : [super localizedDescription];
+}
+
+
+- (NSString*)description {
+  return [NSString stringWithFormat:@"Error Domain=%@ Code=%ld \"%@\"",
+      [self domain], (long)[self code], [self localizedDescription]];
+}
+
+@end
+
+
 @implementation NSError (v8)
 
 + (NSError*)errorFromV8TryCatch:(TryCatch &)try_catch {
-  NSMutableDictionary* info = nil;
-  if (try_catch.HasCaught())
-    info = TryCatchToErrorDict(try_catch);
+  return [self errorFromV8TryCatch:try_catch detail:gErrorDetail];
+}
+
++ (NSError*)errorFromV8TryCatch:(TryCatch &)try_catch
+                         detail:(NodeJSErrorDetail)detail {
+  NSDictionary* info = nil;
+  if (try_catch.HasCaught()) {
+    if (detail == NodeJSErrorDetailLazy) {
+      return [[[NodeJSLazyError alloc] initWithTryCatch:try_catch]
+          autorelease];
+    }
+    HandleScope scope;
+    Local<Value> er = try_catch.Exception();
+    if (detail == NodeJSErrorDetailMessage) {
+      info = [NSDictionary dictionaryWithObject:ExceptionToNSString(er)
+                                         forKey:NSLocalizedDescriptionKey];
+    } else {
+      info = ExceptionToErrorDict(er, try_catch.Message());
+    }
+  }
   return [NSError errorWithDomain:NodeJSNSErrorDomain code:0 userInfo:info];
 }
 
@@ -262,9 +596,104 @@ const NSString* NodeJSNSErrorDomain = @"node.js";
 @end
 
 
+// -----------------------------------------------------------------------------
+
+// Error for what |try_catch| caught. Termination (e.g. of a cancelled
+// NodeJSCall which ran this code) carries no exception; V8 keeps unwinding the
+// JavaScript which called us once we return.
+static NSError* ErrorFromTryCatch(TryCatch& try_catch) {
+  if (!try_catch.CanContinue())
+    return [NSError nodeErrorWithLocalizedDescription:@"execution terminated"];
+  return [NSError errorFromV8TryCatch:try_catch];
+}
+
+
+// Returns a script for |source| from the script cache, or compiles one in the
+// current context and adds it to the cache. |sourcestr| is |source| as a V8
+// string, or empty to have it converted here. Exceptions are left to the
+// caller's TryCatch.
+static Local<v8::Script> CompileCached(NSString* source, uint64_t sourceHash,
+                                      Local<String> sourcestr,
+                                      NSString* origin, Context* context) {
+  HandleScope scope;
+  NodeJSScriptCache* cache = [NodeJSScriptCache sharedCache];
+  Local<v8::Script> script = [cache scriptForSource:source
+                                         sourceHash:sourceHash
+                                             origin:origin
+                                            context:context];
+  gStats.compiles++;
+  if (!script.IsEmpty()) {
+    gStats.cachedCompiles++;
+    return scope.Close(script);
+  }
+  if (sourcestr.IsEmpty())
+    sourcestr = [source v8String];
+  if (origin) {
+    script = [[NodeJSCodeCache sharedCache] compile:sourcestr
+        filename:String::New([origin UTF8String])];
+  } else {
+    script = Script::Compile(sourcestr);
+  }
+  if (!script.IsEmpty()) {
+    [cache setScript:script forSource:source sourceHash:sourceHash
+              origin:origin context:context];
+  } else {
+    gStats.compileErrors++;
+  }
+  return scope.Close(script);
+}
+
+
+// An item of +evalBatch:, prepared without V8 (so possibly ahead of time, on
+// another thread)
+struct BatchItem {
+  NSString* source;  // owned by the items array
+  NSString* origin;
+  uint64_t sourceHash;
+  UniChar* chars;    // characters of small sources, for String::New
+  CFIndex length;
+};
+
+
+static void PrepareBatchItem(BatchItem* item) {
+  CFStringRef source = (CFStringRef)item->source;
+  item->sourceHash = [NodeJSScriptCache hashForSource:item->source];
+  item->length = CFStringGetLength(source);
+  // large sources are shared with V8 by -v8String instead
+  if ((NSUInteger)item->length < NodeJSStringNoCopyThreshold) {
+    item->chars = (UniChar*)malloc(sizeof(UniChar) * MAX(item->length, 1));
+    CFStringGetCharacters(source, CFRangeMake(0, item->length), item->chars);
+  }
+}
+
+
+// util.inspect, or an empty handle if it's not available
+static Local<Function> InspectFunction() {
+  HandleScope scope;
+  TryCatch try_catch;
+  Local<Object> global = gMainContext->Global();
+  Local<Value> require = global->Get(String::NewSymbol("require"));
+  if (!require->IsFunction()) return Local<Function>();
+  Local<Value> name = String::New("util");
+  Local<Value> util = Local<Function>::Cast(require)->Call(global, 1, &name);
+  if (util.IsEmpty() || !util->IsObject()) return Local<Function>();
+  Local<Value> inspect = util->ToObject()->Get(String::NewSymbol("inspect"));
+  if (!inspect->IsFunction()) return Local<Function>();
+  return scope.Close(Local<Function>::Cast(inspect));
+}
+
+
 @implementation NodeJS
 static NodeJS* sharedInstance_ = nil;
 
++ (NodeJSErrorDetail)errorDetail {
+  return gErrorDetail;
+}
+
++ (void)setErrorDetail:(NodeJSErrorDetail)detail {
+  gErrorDetail = detail;
+}
+
 - (id)init {
   if ((self = [super init])) {
     // ...
@@ -308,6 +737,26 @@ static NodeJS* sharedInstance_ = nil;
   return n;
 }
 
++ (NodeJSStats)statistics {
+  NodeJSStats stats = gStats;
+  stats.loop = NodeJSLoopStatistics();
+  stats.heap = NodeJSHeapStatistics();
+  stats.allocator = NodeJSAllocatorStatistics();
+  stats.codeCache = [[NodeJSCodeCache sharedCache] statistics];
+  NodeJSModuleArchive* archive = [NodeJSModuleArchive sharedArchive];
+  if (archive) stats.moduleArchive = [archive statistics];
+  return stats;
+}
+
++ (void)resetStatistics {
+  memset(&gStats, 0, sizeof(gStats));
+  NodeJSLoopResetStatistics();
+  NodeJSHeapResetStatistics();
+  NodeJSAllocatorResetStatistics();
+  [[NodeJSCodeCache sharedCache] resetStatistics];
+  [[NodeJSModuleArchive sharedArchive] resetStatistics];
+}
+
 + (Persistent<Context>)mainContext {
   return gMainContext;
 }
@@ -353,21 +802,12 @@ static Persistent<String> process_symbol;
   HandleScope scope;
   TryCatch try_catch;
   
-  // Compile
-  Local<String> sourcestr = String::New([source UTF8String]);
-  Local<v8::Script> script;
-  if (origin) {
-    script = Script::Compile(sourcestr, String::New([origin UTF8String]));
-  } else {
-    script = Script::Compile(sourcestr);
-  }
+  Local<v8::Script> script = CompileCached(
+      source, [NodeJSScriptCache hashForSource:source], Local<String>(),
+      origin, context);
   if (script.IsEmpty() && error) {
     if (try_catch.HasCaught()) {
-      *error = [NSError errorFromV8TryCatch:try_catch];
-      if (!try_catch.CanContinue()) {
-        NSLog(@"fatal: %@", *error);
-        exit(3);
-      }
+      *error = ErrorFromTryCatch(try_catch);
     } else {
       *error = [NSError nodeErrorWithLocalizedDescription:@"internal error"];
     }
@@ -385,195 +825,123 @@ static Persistent<String> process_symbol;
                error:(NSError**)error {
   HandleScope scope;
   Local<Value> result;
+  gStats.evals++;
   Local<v8::Script> script =
       [self compile:source origin:origin context:context error:error];
   if (!script.IsEmpty()) {
     TryCatch try_catch;
     result = script->Run();
-    if (result.IsEmpty() && error) {
-      *error = [NSError errorFromV8TryCatch:try_catch];
-      if (try_catch.HasCaught() && !try_catch.CanContinue()) {
-        NSLog(@"fatal: %@", *error);
-        exit(3);
-      }
-    }
+    if (result.IsEmpty() && error)
+      *error = ErrorFromTryCatch(try_catch);
   }
+  if (result.IsEmpty()) gStats.evalErrors++;
   return scope.Close(result);
 }
 
-@end
-
-// -----------------------------------------------------------------------------
-
-/*class BlockInvocation {
- public:
-  enum Type {
-    VoidReturn = 1,
-    HandleValueReturn = 2,
-  };
-  
-  virtual ~BlockInvocation() {
-    if (block_) {
-      [(NodeJSFunctionBlock1)block_ release];
-      block_ = NULL;
-    }
-  }
-  
-  inline Type type() { return type_; }
-  inline void* block() { return block_; }
-  
-  Persistent<Function> handle_;
-  
-  static v8::Local<Function> New(NodeJSFunctionBlock1 block) {
-    HandleScope scope;
-    BlockInvocation* self = new BlockInvocation(block, VoidReturn);
-    Persistent<Function> phandle;
-    Local<FunctionTemplate> fun_t =
-        FunctionTemplate::New(&Handler, External::Wrap(self));
-    phandle = Persistent<Function>::New(fun_t->GetFunction());
-    //assert(phandle->InternalFieldCount() > 0);
-    //phandle->SetPointerInInternalField(0, self);
-    phandle.MakeWeak(self, &WeakCallback);
-    return scope.Close(phandle);
-  }
-  
-  static v8::Handle<Value> Handler(const Arguments& args) {
-    Local<Value> data = args.Data(); assert(!data.IsEmpty());
-    BlockInvocation* ctx = (BlockInvocation*)External::Unwrap(data);
-    switch (ctx->type()) {
-      case BlockInvocation::VoidReturn:
-        ((NodeJSFunctionBlock1)ctx->block())(args);
-    }
-    return Undefined();
-  }
-  
- protected:
-  BlockInvocation(void* block, Type type) : block_(block)
-                                             , type_(type) {
-    // Note: block should be copied already, so we "steal" a reference.
-  }
- 
-  void *block_;
-  Type type_;
-  
- private:
-  static void WeakCallback(v8::Persistent<v8::Value> value, void *data) {
-    NSLog(@"WeakCallback"); fflush(stderr);
-    return;
-    BlockInvocation *obj = static_cast<BlockInvocation*>(data);
-    assert(value == obj->handle_);
-    //assert(!obj->refs_);
-    assert(value.IsNearDeath());
-    delete obj;
-  }
-};*/
-
-/*class NodeJSBlock : NodeJSFunctionWrap {
- public:
-  enum Type {
-    VoidReturn = 1,
-    HandleValueReturn = 2,
-  };
-  
-  static v8::Persistent<v8::FunctionTemplate> constructor_template;
-  
-  static void Initialize(v8::Handle<v8::Object> target);
-  static v8::Handle<v8::Value> New (const v8::Arguments& args);
-  static v8::Local<Function> Create(NodeJSFunctionBlock1 block);
-  
-  NodeJSBlock() : NodeJSFunctionWrap() {
-    
-  }
-  
-  virtual NodeJSBlock() {
-    NSLog(@"~NodeJSBlock");
-    if (block_) {
-      [(NodeJSFunctionBlock1)block_ release];
-      block_ = NULL;
++ (NSArray*)evalBatch:(NSArray*)items
+              context:(v8::Context*)context
+              options:(NodeJSEvalBatchOptions)options {
+  NSUInteger count = [items count];
+  NSMutableArray* results = [NSMutableArray arrayWithCapacity:count];
+  if (!count) return results;
+  BatchItem* batch = (BatchItem*)calloc(count, sizeof(BatchItem));
+  for (NSUInteger i = 0; i < count; ++i) {
+    id item = [items objectAtIndex:i];
+    if ([item isKindOfClass:[NSArray class]]) {
+      batch[i].source = [item objectAtIndex:0];
+      id origin = [item count] > 1 ? [item objectAtIndex:1] : nil;
+      if (origin != [NSNull null]) batch[i].origin = origin;
+    } else {
+      batch[i].source = item;
     }
   }
-  
-  inline Type type() { return type_; }
-  inline void* block() { return block_; }
-
- private:
-  void *block;
-  Type type;
-};
 
-v8::Handle<Value> NodeJSBlock::New (const Arguments& args) {
-  if (!args.IsConstructCall()) {
-    return FromConstructorTemplate(constructor_template, args);
+  // Prepare items on another thread while earlier ones run
+  dispatch_semaphore_t prepared = NULL;
+  dispatch_group_t preparing = NULL;
+  __block volatile int32_t cancelled = 0;
+  if (options & NodeJSEvalBatchPipeline) {
+    prepared = dispatch_semaphore_create(0);
+    preparing = dispatch_group_create();
+    dispatch_group_async(preparing,
+        dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+      for (NSUInteger i = 0; i < count && !cancelled; ++i) {
+        PrepareBatchItem(&batch[i]);
+        dispatch_semaphore_signal(prepared);
+      }
+    });
   }
-  HandleScope scope;
-
-  NodeJSBlock *obj = new NodeJSBlock();
-  obj->Wrap(args.Holder());
 
-  return args.This();
-}
-
-v8::Local<Function> NodeJSBlock::Create(NodeJSFunctionBlock1 block) {
+  // Enter the contexts once for the whole batch
+  assert(!gMainContext.IsEmpty());
+  gMainContext->Enter();
+  if (context) context->Enter();
   HandleScope scope;
+  Local<Function> inspect;
+  if (options & NodeJSEvalBatchInspect)
+    inspect = InspectFunction();
+  TryCatch try_catch;
+  for (NSUInteger i = 0; i < count; ++i) {
+    BatchItem* item = &batch[i];
+    if (prepared)
+      dispatch_semaphore_wait(prepared, DISPATCH_TIME_FOREVER);
+    else
+      item->sourceHash = [NodeJSScriptCache hashForSource:item->source];
+    NSAutoreleasePool* pool = [NSAutoreleasePool new];
+    HandleScope itemScope;
+    try_catch.Reset();
+    gStats.evals++;
 
-  Local<FunctionTemplate> t = FunctionTemplate::New(, External::Wrap(self));
-  constructor_template = Persistent<FunctionTemplate>::New(t);
-  constructor_template->InstanceTemplate()->SetInternalFieldCount(1);
-  constructor_template->SetClassName(String::NewSymbol("NodeJSBlock"));
-  
-  Local<Function> function = constructor_template->GetFunction();
-  Local<Object> instance = function->NewInstance();
-}*/
-
-/*typedef struct {
-  void *block;
-  int type;
-} BlockCtx;
+    Local<String> sourcestr;
+    if (item->chars) {
+      sourcestr = String::New((const uint16_t*)item->chars, (int)item->length);
+    }
+    Local<v8::Script> script = CompileCached(item->source, item->sourceHash,
+                                             sourcestr, item->origin, context);
+    Local<Value> result;
+    if (!script.IsEmpty()) {
+      result = script->Run();
+      if (!result.IsEmpty() && !inspect.IsEmpty() && !result->IsUndefined())
+        result = inspect->Call(inspect, 1, &result);
+    }
 
-static v8::Handle<Value> Handler(const Arguments& args) {
-  HandleScope scope;
-  NSLog(@"! Handler");
-  Local<Value> data = args.Data(); assert(!data.IsEmpty());
-  BlockCtx* ctx = (BlockCtx*)External::Unwrap(data);
-  switch (ctx->type) {
-    case 1:
-      ((NodeJSFunctionBlock1)ctx->block)(args);
+    id entry;
+    if (result.IsEmpty()) {
+      gStats.evalErrors++;
+      if (try_catch.HasCaught()) {
+        entry = ErrorFromTryCatch(try_catch);
+      } else {
+        entry = [NSError nodeErrorWithLocalizedDescription:@"internal error"];
+      }
+    } else if ((options & NodeJSEvalBatchDiscardResults) ||
+               result->IsUndefined()) {
+      entry = [NSNull null];
+    } else if (!inspect.IsEmpty()) {
+      entry = [NSString stringWithV8String:result->ToString()];
+    } else {
+      entry = [NSObject fromV8Value:result];
+      if (!entry) entry = [NSNull null];
+    }
+    [results addObject:entry];
+    [pool drain];
+    if (result.IsEmpty() && ((options & NodeJSEvalBatchStopOnError) ||
+                             !try_catch.CanContinue())) {
+      break;  // terminated: the rest would be, too
+    }
   }
-  return Undefined();
-}
 
-static void WeakCallback(v8::Persistent<v8::Value> value, void *data) {
-  NSLog(@"! WeakCallback"); fflush(stderr);
-  BlockCtx* ctx = (BlockCtx*)data;
-  //assert(value == obj->handle_);
-  //assert(!obj->refs_);
-  assert(value.IsNearDeath());
-  if (ctx->block) [(id)ctx->block release];
-  delete ctx;
+  if (context) context->Exit();
+  gMainContext->Exit();
+  if (preparing) {
+    cancelled = 1;
+    dispatch_group_wait(preparing, DISPATCH_TIME_FOREVER);
+    dispatch_release(preparing);
+    dispatch_release(prepared);
+  }
+  for (NSUInteger i = 0; i < count; ++i)
+    free(batch[i].chars);
+  free(batch);
+  return results;
 }
 
-v8::Local<Function> NodeJS_function(NodeJSFunctionBlock1 block) {
-  HandleScope scope;
-  
-  // ctx
-  BlockCtx *ctx = new BlockCtx;
-  ctx->block = [block copy];
-  ctx->type = 1;
-  
-  // create a function
-  Local<FunctionTemplate> t =
-        FunctionTemplate::New(&Handler, External::Wrap(ctx));
-  Local<Function> fun = t->GetFunction();
-  
-  // register for a "destroy" callback
-  Persistent<Function> phandle = Persistent<Function>::New(fun);
-  phandle.MakeWeak(ctx, &WeakCallback);
-  
-  return fun;
-}*/
-
-//namespace nodejs {
-//typedef void (^FunctionBlockWithoutArgs)(void);
-//typedef void (^FunctionBlockWithV8Args)(const v8::Arguments&);
-//typedef v8::Local<v8::Value> (^FunctionBlockWithV8ArgsResult)(const v8::Arguments&);
-//}
+@end
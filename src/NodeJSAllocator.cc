@@ -0,0 +1,309 @@
+#include "NodeJSAllocator.h"
+#include <CoreFoundation/CoreFoundation.h>
+#include "NodeJSAtomic.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#define USABLE_SIZE(p) malloc_size(p)
+#else
+#include <malloc.h>
+#define USABLE_SIZE(p) malloc_usable_size(p)
+#endif
+
+static const int kClassCount = 14;            // 16 bytes .. 128 KB
+static const int kMinClassShift = 4;
+static const int kMaxArenaClass = 8;          // 4 KB
+static const size_t kArenaSize = 64 * 1024;
+static const uint32_t kMaxCachedLarge = 8;    // per class and thread
+static const uint32_t kLargeClass = 0xFFFFFFFF;
+
+// Precedes every pool block. 16 bytes on 64-bit, keeping blocks aligned.
+struct BlockHeader {
+  size_t capacity;     // usable bytes
+  uint32_t sizeClass;  // or kLargeClass
+  uint32_t unused;
+};
+
+struct FreeBlock {
+  FreeBlock* next;
+};
+
+struct ThreadCache {
+  FreeBlock* freeLists[kClassCount];
+  uint32_t freeCounts[kClassCount];
+  NodeJSAllocatorStats stats;  // counts only
+  bool orphaned;               // its thread has exited
+  ThreadCache* next;           // all caches
+};
+
+static NodeJSAllocatorKind gKind = NodeJSPoolAllocator;
+static bool gStarted = false;  // an allocation has been made
+static volatile int64_t gCurrentBytes = 0;
+static volatile int64_t gPeakBytes = 0;
+static volatile int64_t gArenaBytes = 0;
+
+static pthread_key_t gCacheKey;
+static pthread_once_t gCacheOnce = PTHREAD_ONCE_INIT;
+static NodeJSSpinLock gCacheListLock = NODEJS_SPINLOCK_INIT;
+static ThreadCache* gCaches = NULL;
+
+// Counts of the system allocator (single list, no per-thread caches)
+static ThreadCache gSystemCounts;
+
+
+bool NodeJSAllocatorSelect(NodeJSAllocatorKind kind) {
+  if (gStarted) return kind == gKind;
+  gKind = kind;
+  return true;
+}
+
+
+void NodeJSAllocatorSelectFromEnvironment() {
+  const char* name = getenv("NODECOCOA_ALLOCATOR");
+  if (!name) return;
+  if (strcmp(name, "system") == 0)
+    NodeJSAllocatorSelect(NodeJSSystemAllocator);
+  else if (strcmp(name, "pool") == 0)
+    NodeJSAllocatorSelect(NodeJSPoolAllocator);
+}
+
+
+NodeJSAllocatorKind NodeJSAllocatorSelected() {
+  return gKind;
+}
+
+
+static inline void AddBytes(int64_t change) {
+  int64_t current = NodeJSAtomicAdd64(change, &gCurrentBytes);
+  int64_t peak;
+  while (current > (peak = gPeakBytes) &&
+         !NodeJSAtomicCompareAndSwap64(peak, current, &gPeakBytes)) {}
+}
+
+// -----------------------------------------------------------------------------
+// Per-thread caches
+
+static void OrphanCache(void* data) {
+  NodeJSSpinLockLock(&gCacheListLock);
+  ((ThreadCache*)data)->orphaned = true;
+  NodeJSSpinLockUnlock(&gCacheListLock);
+}
+
+
+static void CreateCacheKey() {
+  pthread_key_create(&gCacheKey, &OrphanCache);
+}
+
+
+static ThreadCache* CurrentCache() {
+  pthread_once(&gCacheOnce, &CreateCacheKey);
+  ThreadCache* cache = (ThreadCache*)pthread_getspecific(gCacheKey);
+  if (cache) return cache;
+  // Adopt the cache of a thread which has exited, blocks and all
+  NodeJSSpinLockLock(&gCacheListLock);
+  for (cache = gCaches; cache && !cache->orphaned; cache = cache->next) {}
+  if (cache) {
+    cache->orphaned = false;
+  } else {
+    cache = (ThreadCache*)calloc(1, sizeof(ThreadCache));
+    cache->next = gCaches;
+    gCaches = cache;
+  }
+  NodeJSSpinLockUnlock(&gCacheListLock);
+  pthread_setspecific(gCacheKey, cache);
+  return cache;
+}
+
+
+static inline uint32_t ClassForSize(size_t size) {
+  if (size <= (1u << kMinClassShift)) return 0;
+  uint32_t cls = 0;
+  size_t capacity = 1u << kMinClassShift;
+  while (capacity < size) {
+    capacity <<= 1;
+    cls++;
+  }
+  return cls < (uint32_t)kClassCount ? cls : kLargeClass;
+}
+
+
+static inline size_t ClassCapacity(uint32_t cls) {
+  return (size_t)1 << (cls + kMinClassShift);
+}
+
+
+static inline void* BlockData(BlockHeader* header) {
+  return header + 1;
+}
+
+
+static inline BlockHeader* BlockHeaderOf(void* ptr) {
+  return (BlockHeader*)ptr - 1;
+}
+
+
+static inline void Push(ThreadCache* cache, uint32_t cls, BlockHeader* h) {
+  FreeBlock* block = (FreeBlock*)BlockData(h);
+  block->next = cache->freeLists[cls];
+  cache->freeLists[cls] = block;
+  cache->freeCounts[cls]++;
+}
+
+
+// Fill the free list of |cls| from the system. Returns false if out of memory.
+static bool Refill(ThreadCache* cache, uint32_t cls) {
+  size_t capacity = ClassCapacity(cls);
+  size_t stride = sizeof(BlockHeader) + capacity;
+  cache->stats.systemAllocations++;
+  if (cls > (uint32_t)kMaxArenaClass) {
+    BlockHeader* h = (BlockHeader*)malloc(stride);
+    if (!h) return false;
+    h->capacity = capacity;
+    h->sizeClass = cls;
+    Push(cache, cls, h);
+    return true;
+  }
+  char* arena = (char*)malloc(kArenaSize);
+  if (!arena) return false;
+  NodeJSAtomicAdd64(kArenaSize, &gArenaBytes);
+  for (size_t offset = 0; offset + stride <= kArenaSize; offset += stride) {
+    BlockHeader* h = (BlockHeader*)(arena + offset);
+    h->capacity = capacity;
+    h->sizeClass = cls;
+    Push(cache, cls, h);
+  }
+  return true;
+}
+
+
+static void* PoolAlloc(ThreadCache* cache, size_t size) {
+  uint32_t cls = ClassForSize(size);
+  cache->stats.allocations++;
+  if (cls == kLargeClass) {
+    BlockHeader* h = (BlockHeader*)malloc(sizeof(BlockHeader) + size);
+    if (!h) return NULL;
+    h->capacity = size;
+    h->sizeClass = kLargeClass;
+    cache->stats.systemAllocations++;
+    AddBytes(size);
+    return BlockData(h);
+  }
+  if (cache->freeLists[cls])
+    cache->stats.poolHits++;
+  else if (!Refill(cache, cls))
+    return NULL;
+  FreeBlock* block = cache->freeLists[cls];
+  cache->freeLists[cls] = block->next;
+  cache->freeCounts[cls]--;
+  AddBytes(ClassCapacity(cls));
+  return block;
+}
+
+
+static void PoolFree(ThreadCache* cache, void* ptr) {
+  BlockHeader* h = BlockHeaderOf(ptr);
+  cache->stats.frees++;
+  AddBytes(-(int64_t)h->capacity);
+  uint32_t cls = h->sizeClass;
+  if (cls == kLargeClass ||
+      (cls > (uint32_t)kMaxArenaClass &&
+       cache->freeCounts[cls] >= kMaxCachedLarge)) {
+    free(h);
+    return;
+  }
+  Push(cache, cls, h);
+}
+
+
+static void* PoolRealloc(void* ptr, long size) {
+  ThreadCache* cache = CurrentCache();
+  if (!ptr) return size > 0 ? PoolAlloc(cache, size) : NULL;
+  if (size <= 0) {
+    PoolFree(cache, ptr);
+    return NULL;
+  }
+  cache->stats.reallocations++;
+  BlockHeader* h = BlockHeaderOf(ptr);
+  // keep the block unless it would be mostly unused
+  if ((size_t)size <= h->capacity &&
+      (h->sizeClass == 0 || (size_t)size > h->capacity / 4)) {
+    cache->stats.inPlace++;
+    return ptr;
+  }
+  void* block = PoolAlloc(cache, size);
+  if (!block) return NULL;
+  memcpy(block, ptr, h->capacity < (size_t)size ? h->capacity : size);
+  PoolFree(cache, ptr);
+  return block;
+}
+
+// -----------------------------------------------------------------------------
+// CFAllocator (no per-thread state -- counts are approximate if several
+// threads allocate at once)
+
+static void* SystemRealloc(void* ptr, long size) {
+  NodeJSAllocatorStats& stats = gSystemCounts.stats;
+  if (ptr) {
+    AddBytes(-(int64_t)USABLE_SIZE(ptr));
+    if (!size) {
+      stats.frees++;
+      CFAllocatorDeallocate(kCFAllocatorDefault, ptr);
+      return NULL;
+    }
+    stats.reallocations++;
+  } else {
+    if (!size) return NULL;
+    stats.allocations++;
+  }
+  stats.systemAllocations++;
+  ptr = CFAllocatorReallocate(kCFAllocatorDefault, ptr, (CFIndex)size, 0);
+  if (ptr) AddBytes(USABLE_SIZE(ptr));
+  return ptr;
+}
+
+// -----------------------------------------------------------------------------
+
+void* NodeJSAllocatorRealloc(void* ptr, long size) {
+  gStarted = true;
+  if (gKind == NodeJSSystemAllocator)
+    return SystemRealloc(ptr, size);
+  return PoolRealloc(ptr, size);
+}
+
+
+static void AddCounts(NodeJSAllocatorStats* total,
+                      const NodeJSAllocatorStats& s) {
+  total->allocations += s.allocations;
+  total->frees += s.frees;
+  total->reallocations += s.reallocations;
+  total->inPlace += s.inPlace;
+  total->poolHits += s.poolHits;
+  total->systemAllocations += s.systemAllocations;
+}
+
+
+NodeJSAllocatorStats NodeJSAllocatorStatistics() {
+  NodeJSAllocatorStats stats;
+  memset(&stats, 0, sizeof(stats));
+  AddCounts(&stats, gSystemCounts.stats);
+  NodeJSSpinLockLock(&gCacheListLock);
+  for (ThreadCache* cache = gCaches; cache; cache = cache->next)
+    AddCounts(&stats, cache->stats);
+  NodeJSSpinLockUnlock(&gCacheListLock);
+  stats.currentBytes = gCurrentBytes;
+  stats.peakBytes = gPeakBytes;
+  stats.arenaBytes = gArenaBytes;
+  return stats;
+}
+
+
+void NodeJSAllocatorResetStatistics() {
+  memset(&gSystemCounts.stats, 0, sizeof(gSystemCounts.stats));
+  NodeJSSpinLockLock(&gCacheListLock);
+  for (ThreadCache* cache = gCaches; cache; cache = cache->next)
+    memset(&cache->stats, 0, sizeof(cache->stats));
+  NodeJSSpinLockUnlock(&gCacheListLock);
+  gPeakBytes = gCurrentBytes;
+}
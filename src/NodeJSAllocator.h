@@ -0,0 +1,70 @@
+#ifndef NODECOCOA_NODEJS_ALLOCATOR_H_
+#define NODECOCOA_NODEJS_ALLOCATOR_H_
+
+#include <stdint.h>
+
+/**
+ * Memory allocator for node's event loop.
+ *
+ * libev keeps its watchers, pending events and timer heap in arrays which it
+ * resizes (roughly doubling) all the time under churn. The pool allocator
+ * serves these from power-of-two size classes (16 bytes to 128 KB) kept in
+ * per-thread free lists, so a resize is usually a free-list pop plus a copy,
+ * and growing within a block's class is free. Classes up to 4 KB are carved
+ * from 64 KB arenas; larger ones are allocated individually and a few of each
+ * are kept for reuse. Anything above 128 KB goes straight to the system.
+ *
+ * The system allocator is CFAllocator, as used by earlier versions, for
+ * comparison. NodeJSApplicationMain installs the allocator selected with
+ * |NodeJSAllocatorSelect| or, failing that, by the NODECOCOA_ALLOCATOR
+ * environment variable ("pool" or "system"). The pool is the default.
+ */
+
+typedef enum {
+  NodeJSPoolAllocator = 0,  // size-class pools
+  NodeJSSystemAllocator,    // CFAllocator
+} NodeJSAllocatorKind;
+
+/// Counters reported by |NodeJSAllocatorStatistics|.
+typedef struct {
+  uint64_t allocations;     // blocks handed out (including by reallocations)
+  uint64_t frees;           // blocks returned (including by reallocations)
+  uint64_t reallocations;   // resizes of existing blocks
+  uint64_t inPlace;         // ... which kept their block
+  uint64_t poolHits;        // allocations served from a free list
+  uint64_t systemAllocations; // blocks and arenas requested from the system
+  int64_t currentBytes;     // usable bytes of live blocks
+  int64_t peakBytes;        // maximum of |currentBytes|
+  int64_t arenaBytes;       // bytes of arenas (never returned to the system)
+} NodeJSAllocatorStats;
+
+/**
+ * Choose the allocator. Must be called before the first allocation (i.e.
+ * before node starts). Returns false if it's too late.
+ */
+bool NodeJSAllocatorSelect(NodeJSAllocatorKind kind);
+
+/// Select the allocator named by NODECOCOA_ALLOCATOR, if set.
+void NodeJSAllocatorSelectFromEnvironment();
+
+/// The selected allocator.
+NodeJSAllocatorKind NodeJSAllocatorSelected();
+
+/**
+ * Allocate, resize or free a block using the selected allocator, with
+ * libev's ev_set_allocator signature:
+ *
+ *   NodeJSAllocatorRealloc(NULL, size)  allocates
+ *   NodeJSAllocatorRealloc(ptr, size)   resizes
+ *   NodeJSAllocatorRealloc(ptr, 0)      frees
+ */
+void* NodeJSAllocatorRealloc(void* ptr, long size);
+
+/// Current counters. Counts are summed over the threads which allocated.
+NodeJSAllocatorStats NodeJSAllocatorStatistics();
+
+/// Reset counts to zero (|currentBytes| and |arenaBytes| are kept, and the
+/// peak restarts from the current value).
+void NodeJSAllocatorResetStatistics();
+
+#endif // NODECOCOA_NODEJS_ALLOCATOR_H_
@@ -0,0 +1,90 @@
+#ifndef NODECOCOA_NODEJS_ATOMIC_H_
+#define NODECOCOA_NODEJS_ATOMIC_H_
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Atomic operations and spin locks.
+ *
+ * libkern/OSAtomic.h only exists on Mac OS X, so the framework uses these
+ * instead. They are built on GCC's __sync builtins (a full barrier each, like
+ * the OSAtomic*Barrier functions) and sched_yield, and behave the same with
+ * Apple's compilers, clang and GCC on other systems.
+ *
+ * Arguments are in the same order as their OSAtomic counterparts.
+ */
+
+/// Full memory barrier.
+static inline void NodeJSMemoryBarrier(void) {
+  __sync_synchronize();
+}
+
+/// Adds |amount| to |*value| and returns the new value.
+static inline int32_t NodeJSAtomicAdd32(int32_t amount,
+                                        volatile int32_t* value) {
+  return __sync_add_and_fetch(value, amount);
+}
+
+static inline int64_t NodeJSAtomicAdd64(int64_t amount,
+                                        volatile int64_t* value) {
+  return __sync_add_and_fetch(value, amount);
+}
+
+static inline int32_t NodeJSAtomicIncrement32(volatile int32_t* value) {
+  return __sync_add_and_fetch(value, 1);
+}
+
+static inline int64_t NodeJSAtomicIncrement64(volatile int64_t* value) {
+  return __sync_add_and_fetch(value, 1);
+}
+
+/// Stores |newValue| in |*value| if it holds |oldValue|. True if it did.
+static inline bool NodeJSAtomicCompareAndSwap32(int32_t oldValue,
+                                                int32_t newValue,
+                                                volatile int32_t* value) {
+  return __sync_bool_compare_and_swap(value, oldValue, newValue);
+}
+
+static inline bool NodeJSAtomicCompareAndSwap64(int64_t oldValue,
+                                                int64_t newValue,
+                                                volatile int64_t* value) {
+  return __sync_bool_compare_and_swap(value, oldValue, newValue);
+}
+
+static inline bool NodeJSAtomicCompareAndSwapPtr(void* oldValue,
+                                                 void* newValue,
+                                                 void* volatile* value) {
+  return __sync_bool_compare_and_swap(value, oldValue, newValue);
+}
+
+/**
+ * Spin lock for short critical sections. Zero is unlocked, so zero-filled
+ * memory (and NODEJS_SPINLOCK_INIT) holds an unlocked lock. A waiter which
+ * doesn't get the lock after a few spins yields the processor.
+ */
+typedef volatile int32_t NodeJSSpinLock;
+#define NODEJS_SPINLOCK_INIT 0
+
+static inline void NodeJSSpinLockLock(NodeJSSpinLock* lock) {
+  int spins = 0;
+  while (__sync_lock_test_and_set(lock, 1)) {
+    while (*lock) {
+      if (++spins >= 100) {
+        sched_yield();
+        spins = 0;
+      }
+    }
+  }
+}
+
+static inline bool NodeJSSpinLockTry(NodeJSSpinLock* lock) {
+  return __sync_lock_test_and_set(lock, 1) == 0;
+}
+
+static inline void NodeJSSpinLockUnlock(NodeJSSpinLock* lock) {
+  __sync_lock_release(lock);
+}
+
+#endif  // NODECOCOA_NODEJS_ATOMIC_H_
@@ -0,0 +1,103 @@
+#ifndef NODECOCOA_NODEJS_CHANNEL_H_
+#define NODECOCOA_NODEJS_CHANNEL_H_
+
+#import <NodeCocoa/node.h>
+#include <dispatch/dispatch.h>
+
+/// Error codes (in |NodeJSNSErrorDomain|) produced by the channel.
+enum {
+  NodeJSChannelFullError = 50,  // the message doesn't fit in the ring
+};
+
+/// Called with each message posted by JavaScript.
+typedef void (^NodeJSChannelHandler)(id message);
+
+struct NodeJSChannelRing;
+
+/// Counters reported by |-[NodeJSChannel statistics]|.
+typedef struct {
+  uint64_t posted;     // messages posted by the host
+  uint64_t rejected;   // ... which didn't fit in the ring (or failed to encode)
+  uint64_t emitted;    // ... emitted on process.host
+  uint64_t received;   // messages posted by JavaScript
+  uint64_t handled;    // ... passed to the handler
+  uint64_t wakeups;    // node thread wakeups
+  uint64_t deliveries; // batches handed to the handler's queue
+} NodeJSChannelStats;
+
+/**
+ * Message channel between the host and JavaScript, carrying the values of the
+ * wire format (see NodeJSWireFormat.h): numbers, strings, dates, buffers,
+ * arrays and objects.
+ *
+ * Host to JavaScript: |postMessage:| can be called from any thread. It encodes
+ * the message, copies it into a ring shared with the node thread and wakes
+ * that thread, which decodes everything queued directly into V8 values (no
+ * intermediate Cocoa objects, no JSON) and emits each as a "message" event on
+ * process.host:
+ *
+ *   process.host.on('message', function (message) { ... });
+ *
+ * JavaScript to host: process.host.postMessage(value) encodes |value| into a
+ * second ring. Messages are decoded and passed to |handler| on |queue| (the
+ * main queue by default), in batches of whatever has accumulated.
+ *
+ * Both rings are bounded. A message which doesn't fit is rejected:
+ * |postMessage:| returns NO and process.host.postMessage returns false.
+ *
+ * Messages are encoded into a reusable per-thread buffer and decoded in place
+ * from the ring (or from a reusable buffer if a message wraps around the end
+ * of the ring), so steady-state traffic allocates nothing but the decoded
+ * values themselves.
+ *
+ * The shared channel is installed on process.host when node starts, on the
+ * main thread (NodeJSApplicationMain) or on a NodeThread. Messages posted
+ * before that are queued.
+ */
+@interface NodeJSChannel : NSObject {
+ @public  // accessed from C callbacks
+  struct NodeJSChannelRing* inbound_;   // host --> JavaScript
+  struct NodeJSChannelRing* outbound_;  // JavaScript --> host
+  NodeJSChannelHandler handler_;
+  dispatch_queue_t queue_;
+  volatile int32_t wakeupPending_;
+  volatile int32_t deliveryPending_;
+  BOOL installed_;
+  v8::Persistent<v8::Object> host_;
+  NodeJSChannelStats stats_;
+}
+
+/// Called with messages posted by JavaScript.
+@property(copy) NodeJSChannelHandler handler;
+
+/// Queue on which |handler| is called. Defaults to the main queue.
+@property dispatch_queue_t queue;
+
+/// The channel of process.host. Rings hold 4 MB each.
++ (NodeJSChannel*)sharedChannel;
+
+/// |capacity| (in bytes, per direction) is rounded up to a power of two.
+- (id)initWithCapacity:(NSUInteger)capacity;
+
+/**
+ * Post |message| to JavaScript. Can be called from any thread. Returns NO and
+ * sets |error| if the message can't be encoded or the ring is full.
+ */
+- (BOOL)postMessage:(id)message error:(NSError**)error;
+
+/// Convenience: no error details.
+- (BOOL)postMessage:(id)message;
+
+/**
+ * Make |host| (process.host, an EventEmitter) the JavaScript end of the
+ * channel: adds |host.postMessage| and starts emitting "message" events.
+ * Called on the node thread.
+ */
+- (void)installOnHostObject:(v8::Handle<v8::Object>)host;
+
+/// Current counters.
+- (NodeJSChannelStats)statistics;
+
+@end
+
+#endif // NODECOCOA_NODEJS_CHANNEL_H_
@@ -0,0 +1,542 @@
+#import "NodeJSChannel.h"
+#import "NodeJS.h"
+#import "NodeJSWireFormat.h"
+#import "NodeJSWireCodec.h"
+#import "NodeJSAtomic.h"
+#import <node.h>
+#import <node_buffer.h>
+#import <ev.h>
+#include <pthread.h>
+
+using namespace v8;
+
+static const NSUInteger kDefaultCapacity = 4 * 1024 * 1024;
+static const int kMaxMessagesPerWakeup = 4096;  // then yield to other I/O
+static const NSUInteger kMaxRetainedEncodeBuffer = 256 * 1024;
+
+
+static NSError* ChannelError(int code, NSString* description) {
+  return [NSError errorWithDomain:(NSString*)NodeJSNSErrorDomain code:code
+      userInfo:[NSDictionary dictionaryWithObject:description
+                                           forKey:NSLocalizedDescriptionKey]];
+}
+
+// -----------------------------------------------------------------------------
+// Byte ring of framed messages (uint32 length, encoded value). Producers are
+// serialized by a spinlock; the single consumer reads without locking and
+// publishes the space it's done with.
+
+struct NodeJSChannelRing {
+  uint8_t* bytes;
+  int64_t mask;
+  NodeJSSpinLock lock;
+  volatile int64_t tail __attribute__((aligned(64)));  // end of written data
+  volatile int64_t head __attribute__((aligned(64)));  // end of consumed data
+  uint8_t* scratch;  // consumer only: messages which wrap around
+  size_t scratchSize;
+};
+
+
+static NodeJSChannelRing* RingCreate(NSUInteger capacity) {
+  NSUInteger size = 4096;
+  while (size < capacity) size <<= 1;
+  NodeJSChannelRing* ring = new NodeJSChannelRing;
+  ring->bytes = (uint8_t*)malloc(size);
+  ring->mask = size - 1;
+  ring->lock = NODEJS_SPINLOCK_INIT;
+  ring->tail = 0;
+  ring->head = 0;
+  ring->scratch = NULL;
+  ring->scratchSize = 0;
+  return ring;
+}
+
+
+static void RingDestroy(NodeJSChannelRing* ring) {
+  free(ring->bytes);
+  free(ring->scratch);
+  delete ring;
+}
+
+
+static void RingCopyIn(NodeJSChannelRing* ring, int64_t pos,
+                       const void* src, size_t length) {
+  size_t offset = (size_t)(pos & ring->mask);
+  size_t first = MIN(length, (size_t)ring->mask + 1 - offset);
+  memcpy(ring->bytes + offset, src, first);
+  memcpy(ring->bytes, (const uint8_t*)src + first, length - first);
+}
+
+
+static void RingCopyOut(NodeJSChannelRing* ring, int64_t pos,
+                        void* dst, size_t length) {
+  size_t offset = (size_t)(pos & ring->mask);
+  size_t first = MIN(length, (size_t)ring->mask + 1 - offset);
+  memcpy(dst, ring->bytes + offset, first);
+  memcpy((uint8_t*)dst + first, ring->bytes, length - first);
+}
+
+
+// Returns false if there's no room for the message
+static bool RingWrite(NodeJSChannelRing* ring, const void* bytes,
+                      uint32_t length) {
+  int64_t frame = 4 + (int64_t)length;
+  uint32_t be = CFSwapInt32HostToBig(length);
+  NodeJSSpinLockLock(&ring->lock);
+  int64_t tail = ring->tail;
+  int64_t head = ring->head;
+  NodeJSMemoryBarrier();
+  if (frame > ring->mask + 1 - (tail - head)) {
+    NodeJSSpinLockUnlock(&ring->lock);
+    return false;
+  }
+  RingCopyIn(ring, tail, &be, 4);
+  RingCopyIn(ring, tail + 4, bytes, length);
+  NodeJSMemoryBarrier();
+  ring->tail = tail + frame;
+  NodeJSSpinLockUnlock(&ring->lock);
+  return true;
+}
+
+
+// Next message, or NULL if the ring is empty. The bytes stay valid until
+// RingConsume. Must only be called from the consumer.
+static const uint8_t* RingPeek(NodeJSChannelRing* ring, uint32_t* length) {
+  int64_t head = ring->head;
+  int64_t tail = ring->tail;
+  NodeJSMemoryBarrier();
+  if (head == tail) return NULL;
+  uint32_t be;
+  RingCopyOut(ring, head, &be, 4);
+  *length = CFSwapInt32BigToHost(be);
+  size_t offset = (size_t)((head + 4) & ring->mask);
+  if (offset + *length <= (size_t)ring->mask + 1)
+    return ring->bytes + offset;
+  if (ring->scratchSize < *length) {
+    free(ring->scratch);
+    ring->scratchSize = MAX(*length, (uint32_t)4096);
+    ring->scratch = (uint8_t*)malloc(ring->scratchSize);
+  }
+  RingCopyOut(ring, head + 4, ring->scratch, *length);
+  return ring->scratch;
+}
+
+
+static void RingConsume(NodeJSChannelRing* ring, uint32_t length) {
+  NodeJSMemoryBarrier();
+  ring->head = ring->head + 4 + length;
+}
+
+
+static bool RingIsEmpty(NodeJSChannelRing* ring) {
+  NodeJSMemoryBarrier();
+  return ring->head == ring->tail;
+}
+
+// -----------------------------------------------------------------------------
+// Per-thread encoding buffer
+
+static pthread_key_t gEncodeBufferKey;
+static pthread_once_t gEncodeBufferOnce = PTHREAD_ONCE_INIT;
+
+static void ReleaseEncodeBuffer(void* data) {
+  [(NSMutableData*)data release];
+}
+
+static void CreateEncodeBufferKey() {
+  pthread_key_create(&gEncodeBufferKey, &ReleaseEncodeBuffer);
+}
+
+
+// An empty buffer for the calling thread. Buffers which grew large are
+// replaced rather than kept around.
+static NSMutableData* EncodeBuffer() {
+  pthread_once(&gEncodeBufferOnce, &CreateEncodeBufferKey);
+  NSMutableData* data =
+      (NSMutableData*)pthread_getspecific(gEncodeBufferKey);
+  if (data && [data length] > kMaxRetainedEncodeBuffer) {
+    [data release];
+    data = nil;
+  }
+  if (!data) {
+    data = [[NSMutableData alloc] initWithCapacity:4096];
+    pthread_setspecific(gEncodeBufferKey, data);
+  }
+  [data setLength:0];
+  return data;
+}
+
+// -----------------------------------------------------------------------------
+// V8 --> wire format (node thread, no Cocoa objects)
+
+static void PutString(NSMutableData* data, Local<String> str) {
+  int size = str->Utf8Length();
+  WirePutU8(data, 's');
+  WirePutU32(data, (uint32_t)size);
+  NSUInteger offset = [data length];
+  [data increaseLengthBy:size];
+  str->WriteUtf8((char*)[data mutableBytes] + offset, size);
+}
+
+
+// Returns false if |v| is nested too deep or a getter threw (in which case
+// the exception is pending in the caller's TryCatch)
+static bool EncodeV8(Local<Value> v, NSMutableData* data, int depth) {
+  if (v.IsEmpty() || depth > kWireMaxDepth) return false;
+  if (v->IsUndefined() || v->IsNull()) {
+    WirePutU8(data, 'z');
+  } else if (v->IsBoolean()) {
+    WirePutU8(data, v->BooleanValue() ? 't' : 'f');
+  } else if (v->IsInt32()) {
+    WirePutU8(data, 'i');
+    WirePutU32(data, (uint32_t)v->Int32Value());
+  } else if (v->IsNumber()) {
+    WirePutDouble(data, 'd', v->NumberValue());
+  } else if (v->IsString()) {
+    PutString(data, Local<String>::Cast(v));
+  } else if (v->IsDate()) {
+    WirePutDouble(data, 'D', Local<Date>::Cast(v)->NumberValue());
+  } else if (node::Buffer::HasInstance(v)) {
+    Local<Object> buf = v->ToObject();
+    size_t length = node::Buffer::Length(buf);
+    WirePutBytes(data, 'b', node::Buffer::Data(buf), length);
+  } else if (v->IsArray()) {
+    Local<Array> array = Local<Array>::Cast(v);
+    uint32_t count = array->Length();
+    WirePutU8(data, 'a');
+    WirePutU32(data, count);
+    for (uint32_t i = 0; i < count; ++i) {
+      if (!EncodeV8(array->Get(i), data, depth + 1)) return false;
+    }
+  } else if (v->IsObject() && !v->IsFunction() && !v->IsRegExp() &&
+             !v->IsExternal()) {
+    Local<Object> obj = v->ToObject();
+    Local<Array> keys = obj->GetPropertyNames();
+    uint32_t count = keys->Length();
+    WirePutU8(data, 'o');
+    WirePutU32(data, count);
+    for (uint32_t i = 0; i < count; ++i) {
+      Local<Value> key = keys->Get(i);
+      PutString(data, key->ToString());
+      if (!EncodeV8(obj->Get(key), data, depth + 1)) return false;
+    }
+  } else {
+    Local<String> str = v->ToString();
+    if (str.IsEmpty()) return false;
+    PutString(data, str);
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// wire format --> V8 (node thread, no Cocoa objects)
+
+static Persistent<Function> gBufferConstructor;
+
+
+// Returns an empty handle if the input is malformed
+static Local<Value> DecodeV8(WireReader* r) {
+  if (!r->Has(1) || r->depth > kWireMaxDepth) return Local<Value>();
+  uint8_t tag = *r->p++;
+  uint32_t length;
+  const uint8_t* payload;
+  switch (tag) {
+    case 'z': return Local<Value>::New(Null());
+    case 't': return Local<Value>::New(True());
+    case 'f': return Local<Value>::New(False());
+    case 'i':
+      if (!r->Has(4)) break;
+      return Integer::New((int32_t)r->U32());
+    case 'd':
+    case 'D': {
+      if (!r->Has(8)) break;
+      double v = r->F64();
+      if (tag == 'd') return Number::New(v);
+      return Date::New(v);
+    }
+    case 's':
+      if (!(payload = r->Payload(&length))) break;
+      return String::New((const char*)payload, length);
+    case 'b': {
+      if (!(payload = r->Payload(&length))) break;
+      Local<Value> argv[] = {Integer::NewFromUnsigned(length)};
+      Local<Object> buf = gBufferConstructor->NewInstance(1, argv);
+      memcpy(node::Buffer::Data(buf), payload, length);
+      return buf;
+    }
+    case 'a': {
+      if (!r->Has(4)) break;
+      uint32_t count = r->U32();
+      if (!r->Has(count)) break;  // at least one byte per value
+      Local<Array> array = Array::New(count);
+      r->depth++;
+      for (uint32_t i = 0; i < count; ++i) {
+        Local<Value> item = DecodeV8(r);
+        if (item.IsEmpty()) return item;
+        array->Set(i, item);
+      }
+      r->depth--;
+      return array;
+    }
+    case 'o': {
+      if (!r->Has(4)) break;
+      uint32_t count = r->U32();
+      if (!r->Has((size_t)count * 2)) break;
+      Local<Object> obj = Object::New();
+      r->depth++;
+      for (uint32_t i = 0; i < count; ++i) {
+        // keys repeat from message to message -- intern them as symbols
+        if (!r->Has(1) || *r->p++ != 's') return Local<Value>();
+        if (!(payload = r->Payload(&length))) return Local<Value>();
+        Local<String> key = String::NewSymbol((const char*)payload, length);
+        Local<Value> value = DecodeV8(r);
+        if (value.IsEmpty()) return value;
+        obj->Set(key, value);
+      }
+      r->depth--;
+      return obj;
+    }
+  }
+  return Local<Value>();
+}
+
+// -----------------------------------------------------------------------------
+
+@interface NodeJSChannel (Private)
+- (void)_wakeup;
+- (void)_scheduleDelivery;
+- (void)_deliver;
+@end
+
+
+static ev_async gInboundNotifier;
+
+
+// Triggered by postMessage:, executed by node, to emit queued messages
+static void DrainInbound(EV_P_ ev_async *watcher, int revents) {
+  NodeJSChannel* self = (NodeJSChannel*)watcher->data;
+  self->stats_.wakeups++;
+
+  // Producers which post after this point will send a new wakeup
+  NodeJSAtomicCompareAndSwap32(1, 0, &self->wakeupPending_);
+
+  HandleScope scope;
+  Local<Object> host = Local<Object>::New(self->host_);
+  Local<Value> emit_v = host->Get(String::NewSymbol("emit"));
+  Local<Value> argv[2] = {String::NewSymbol("message"), Local<Value>()};
+  const uint8_t* bytes;
+  uint32_t length;
+  for (int n = 0; n < kMaxMessagesPerWakeup; ++n) {
+    if (!(bytes = RingPeek(self->inbound_, &length))) return;
+    HandleScope messageScope;
+    WireReader r = { bytes, bytes + length, 0 };
+    argv[1] = DecodeV8(&r);
+    RingConsume(self->inbound_, length);
+    assert(!argv[1].IsEmpty() && r.p == r.end);  // we encoded it
+    if (!emit_v->IsFunction() || argv[1].IsEmpty()) continue;
+    TryCatch try_catch;
+    Local<Function>::Cast(emit_v)->Call(host, 2, argv);
+    self->stats_.emitted++;
+    if (try_catch.HasCaught())
+      node::FatalException(try_catch);
+  }
+
+  // More messages might be queued -- come back after other events had a
+  // chance
+  [self _wakeup];
+}
+
+
+// process.host.postMessage(value) -> false if the ring is full
+static Handle<Value> HostPostMessage(const Arguments& args) {
+  HandleScope scope;
+  NodeJSChannel* self = (NodeJSChannel*)External::Unwrap(args.Data());
+  NSMutableData* data = EncodeBuffer();
+  TryCatch try_catch;
+  if (!EncodeV8(args[0], data, 0)) {
+    if (try_catch.HasCaught()) return try_catch.ReThrow();
+    return ThrowException(Exception::Error(
+        String::New("maximum depth exceeded")));
+  }
+  if (!RingWrite(self->outbound_, [data bytes], (uint32_t)[data length])) {
+    NodeJSAtomicIncrement64((volatile int64_t*)&self->stats_.rejected);
+    return scope.Close(False());
+  }
+  NodeJSAtomicIncrement64((volatile int64_t*)&self->stats_.received);
+  [self _scheduleDelivery];
+  return scope.Close(True());
+}
+
+
+@implementation NodeJSChannel
+
+@synthesize handler = handler_;
+
+
++ (NodeJSChannel*)sharedChannel {
+  static NodeJSChannel* sharedChannel = nil;
+  if (!sharedChannel) {
+    NodeJSChannel* channel =
+        [[NodeJSChannel alloc] initWithCapacity:kDefaultCapacity];
+    if (!NodeJSAtomicCompareAndSwapPtr(nil, channel,
+                                       (void* volatile*)&sharedChannel)) {
+      [channel release];  // another thread won
+    }
+  }
+  return sharedChannel;
+}
+
+
+- (id)init {
+  return [self initWithCapacity:kDefaultCapacity];
+}
+
+
+- (id)initWithCapacity:(NSUInteger)capacity {
+  if ((self = [super init])) {
+    inbound_ = RingCreate(capacity);
+    outbound_ = RingCreate(capacity);
+    queue_ = dispatch_get_main_queue();
+    dispatch_retain(queue_);
+    // Set until the watcher exists, so producers don't try to wake us before
+    wakeupPending_ = 1;
+  }
+  return self;
+}
+
+
+- (void)dealloc {
+  // Installed channels live as long as node
+  assert(!installed_);
+  RingDestroy(inbound_);
+  RingDestroy(outbound_);
+  [handler_ release];
+  dispatch_release(queue_);
+  [super dealloc];
+}
+
+
+- (dispatch_queue_t)queue {
+  return queue_;
+}
+
+
+- (void)setQueue:(dispatch_queue_t)queue {
+  assert(queue != NULL);
+  dispatch_retain(queue);
+  dispatch_queue_t old = (dispatch_queue_t)
+      __sync_lock_test_and_set((void**)&queue_, (void*)queue);
+  dispatch_release(old);
+}
+
+
+- (void)installOnHostObject:(Handle<Object>)host {
+  HandleScope scope;
+  assert(!installed_);  // one JavaScript end per channel (and loop)
+  installed_ = YES;
+  [self retain];
+  host_ = Persistent<Object>::New(host);
+
+  Local<Value> buffer_v =
+      Context::GetCurrent()->Global()->Get(String::NewSymbol("Buffer"));
+  assert(buffer_v->IsFunction());
+  if (gBufferConstructor.IsEmpty()) {
+    gBufferConstructor =
+        Persistent<Function>::New(Local<Function>::Cast(buffer_v));
+  }
+
+  host->Set(String::NewSymbol("postMessage"),
+            FunctionTemplate::New(&HostPostMessage,
+                                  External::Wrap(self))->GetFunction());
+
+  // Emit whatever was posted before now. The watcher doesn't keep node
+  // alive.
+  gInboundNotifier.data = self;
+  ev_async_init(&gInboundNotifier, &DrainInbound);
+  ev_async_start(EV_DEFAULT_UC_ &gInboundNotifier);
+  ev_unref(EV_DEFAULT_UC);
+  ev_async_send(EV_DEFAULT_UC_ &gInboundNotifier);
+}
+
+
+- (void)_wakeup {
+  if (NodeJSAtomicCompareAndSwap32(0, 1, &wakeupPending_))
+    ev_async_send(EV_DEFAULT_UC_ &gInboundNotifier);
+}
+
+
+- (BOOL)postMessage:(id)message error:(NSError**)error {
+  NSMutableData* data = EncodeBuffer();
+  if (!NodeJSWireEncode(message, data, error)) {
+    NodeJSAtomicIncrement64((volatile int64_t*)&stats_.rejected);
+    return NO;
+  }
+  if ([data length] > UINT32_MAX ||
+      !RingWrite(inbound_, [data bytes], (uint32_t)[data length])) {
+    NodeJSAtomicIncrement64((volatile int64_t*)&stats_.rejected);
+    if (error) {
+      *error = ChannelError(NodeJSChannelFullError,
+                            @"message channel is full");
+    }
+    return NO;
+  }
+  NodeJSAtomicIncrement64((volatile int64_t*)&stats_.posted);
+  [self _wakeup];
+  return YES;
+}
+
+
+- (BOOL)postMessage:(id)message {
+  return [self postMessage:message error:NULL];
+}
+
+
+// Called on the node thread. Messages arriving before the delivery runs join
+// it.
+- (void)_scheduleDelivery {
+  if (!NodeJSAtomicCompareAndSwap32(0, 1, &deliveryPending_)) return;
+  NodeJSAtomicIncrement64((volatile int64_t*)&stats_.deliveries);
+  dispatch_async(queue_, ^{ [self _deliver]; });
+}
+
+
+// Called on |queue_|. Only one delivery runs at a time, so this is the ring's
+// only consumer.
+- (void)_deliver {
+  NSAutoreleasePool* pool = [NSAutoreleasePool new];
+  NodeJSChannelHandler handler = [self.handler retain];
+  const uint8_t* bytes;
+  uint32_t length;
+  NSUInteger count = 0;
+  while ((bytes = RingPeek(outbound_, &length))) {
+    id message = NodeJSWireDecode(bytes, length, NULL);
+    RingConsume(outbound_, length);
+    assert(message != nil);  // we encoded it
+    if (handler && message) {
+      handler(message);
+      NodeJSAtomicIncrement64((volatile int64_t*)&stats_.handled);
+    }
+    if (++count % 256 == 0) {
+      [pool drain];
+      pool = [NSAutoreleasePool new];
+    }
+  }
+  [handler release];
+  [pool drain];
+
+  // Messages posted after the ring was found empty, but before the flag was
+  // cleared, didn't schedule a delivery of their own
+  NodeJSAtomicCompareAndSwap32(1, 0, &deliveryPending_);
+  if (!RingIsEmpty(outbound_) &&
+      NodeJSAtomicCompareAndSwap32(0, 1, &deliveryPending_)) {
+    NodeJSAtomicIncrement64((volatile int64_t*)&stats_.deliveries);
+    dispatch_async(queue_, ^{ [self _deliver]; });
+  }
+}
+
+
+- (NodeJSChannelStats)statistics {
+  return stats_;
+}
+
+@end
@@ -0,0 +1,108 @@
+#ifndef NODECOCOA_NODEJS_CODE_CACHE_H_
+#define NODECOCOA_NODEJS_CODE_CACHE_H_
+
+#import <NodeCocoa/node.h>
+
+/// Error codes in NodeJSNSErrorDomain
+enum {
+  NodeJSCodeCacheInvalidError = 30,  // not a cache file or truncated
+  NodeJSCodeCacheVersionError = 31,  // built by another format or V8 version
+};
+
+/// Name of the cache file in the app's resource directory.
+extern NSString* const NodeJSCodeCacheFilename;
+
+/// Counters reported by |-[NodeJSCodeCache statistics]|.
+typedef struct {
+  uint64_t hits;        // compiles which used precompiled data
+  uint64_t stale;       // ... which found an entry but the source had changed
+  uint64_t misses;      // ... which found no entry
+  double compileTime;   // seconds spent compiling through the cache
+  double savedTime;     // estimated seconds saved (preparse time of the hits,
+                        // as measured when the cache was built)
+  NSUInteger count;     // number of entries in the mapped file
+  NSUInteger size;      // size of the mapped file in bytes
+} NodeJSCodeCacheStats;
+
+/**
+ * A read-only, memory-mapped cache of V8 preparse data (ScriptData) for the
+ * JavaScript files of an app bundle.
+ *
+ * The cache file is produced at build time by running the app with
+ * --precompile-bundle (see scripts/precompile-bundle.sh) which calls
+ * |buildCacheForDirectory:toFile:error:| for main.js and lib/. At startup
+ * NodeJSApplicationMain maps <Resources>/codecache.bin and, once node is
+ * running, wraps process.compile and the evals module's runInThisContext and
+ * runInNewContext (which node uses to load modules) so that sources with an
+ * entry are compiled using its preparse data. Everything else is passed on to
+ * node's original functions.
+ *
+ * Entries are keyed by path relative to the cache file's directory and carry
+ * the length and hash of the source they were built from. An entry whose
+ * source has changed is ignored (the script is compiled from source), as is
+ * the whole file if it was built by a different V8 version.
+ *
+ * Note: Modules which are loaded before node hands control to the app (main.js
+ * and those it requires synchronously while it's first evaluated) are compiled
+ * by node itself and do not benefit from the cache. main.js stays node's root
+ * module so that it runs in the main context.
+ *
+ * Note: Like the rest of the V8 API, this is not thread safe and must only be
+ * used from the node thread.
+ */
+@interface NodeJSCodeCache : NSObject {
+  NSString* rootPath_;
+  const char* map_;
+  NSUInteger mapSize_;
+  NSDictionary* index_; // relative path => entry number
+  NodeJSCodeCacheStats stats_;
+}
+
+/// Directory which entry paths are relative to.
+@property(readonly) NSString* rootPath;
+
+/**
+ * The cache used by +[NodeJS compile:origin:context:error:] and node's module
+ * loading. Maps <Resources>/codecache.bin of the main bundle on first call; if
+ * there's no such file (or it's invalid) an empty cache is returned.
+ */
++ (NodeJSCodeCache*)sharedCache;
+
+/**
+ * Map the cache file at |path|. Returns nil and sets |error| if the file can't
+ * be read or is not a valid cache for this V8 version.
+ */
+- (id)initWithContentsOfFile:(NSString*)path error:(NSError**)error;
+
+/**
+ * Compile |source| (originating from the file |filename|) in the current
+ * context, using precompiled data if there's a matching entry.
+ */
+- (v8::Local<v8::Script>)compile:(v8::Handle<v8::String>)source
+                        filename:(v8::Handle<v8::String>)filename;
+
+/**
+ * Wrap process.compile, Script.runInThisContext and Script.runInNewContext of
+ * |process| so that sources with a current entry compile using it. Others,
+ * and sources which fail to compile, go to the original functions, so errors
+ * are reported like before (e.g. with displayErrors).
+ */
+- (void)installInProcess:(v8::Handle<v8::Object>)process;
+
+/// Current counters.
+- (NodeJSCodeCacheStats)statistics;
+
+/// Reset all counters except |count| and |size| to zero.
+- (void)resetStatistics;
+
+/**
+ * Write a cache file for main.js and all .js files in lib/ (recursively) of
+ * |directory| to |path|.
+ */
++ (BOOL)buildCacheForDirectory:(NSString*)directory
+                        toFile:(NSString*)path
+                         error:(NSError**)error;
+
+@end
+
+#endif // NODECOCOA_NODEJS_CODE_CACHE_H_
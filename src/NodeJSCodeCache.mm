@@ -0,0 +1,482 @@
+#import "NodeJSCodeCache.h"
+#import "NodeJS.h"
+#import "NodeJSLoop.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+using namespace v8;
+
+NSString* const NodeJSCodeCacheFilename = @"codecache.bin";
+
+// File layout: CacheHeader, CacheEntry[count], entry paths (UTF-8), preparse
+// data (each blob aligned to 8 bytes so V8 can use it in place).
+static const char kMagic[8] = {'N','J','S','C','C','A','C','H'};
+static const uint32_t kFormatVersion = 1;
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  char v8version[32];
+};
+
+struct CacheEntry {
+  uint32_t pathOffset;
+  uint32_t pathLength;
+  uint32_t sourceLength;  // in UTF-16 code units
+  uint32_t dataOffset;
+  uint32_t dataLength;
+  uint32_t reserved;
+  uint64_t sourceHash;
+  double preparseTime;    // seconds, measured when building
+};
+
+
+static NSError* CacheError(int code, NSString* description) {
+  return [NSError errorWithDomain:(NSString*)NodeJSNSErrorDomain code:code
+      userInfo:[NSDictionary dictionaryWithObject:description
+                                           forKey:NSLocalizedDescriptionKey]];
+}
+
+
+// 64-bit FNV-1a over UTF-16 code units (same as NodeJSScriptCache)
+static uint64_t HashChars(const uint16_t* chars, NSUInteger length) {
+  uint64_t h = 14695981039346656037ULL;
+  for (NSUInteger i = 0; i < length; ++i) {
+    h ^= chars[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+
+static void GetV8Version(char* buf, size_t size) {
+  memset(buf, 0, size);
+  strncpy(buf, V8::GetVersion(), size - 1);
+}
+
+
+@implementation NodeJSCodeCache
+
+@synthesize rootPath = rootPath_;
+
+
++ (NodeJSCodeCache*)sharedCache {
+  static NodeJSCodeCache* sharedCache = nil;
+  if (!sharedCache) {
+    NSString* resourcePath = [[NSBundle mainBundle] resourcePath];
+    NSString* path =
+        [resourcePath stringByAppendingPathComponent:NodeJSCodeCacheFilename];
+    if ([[NSFileManager defaultManager] fileExistsAtPath:path]) {
+      NSError* error = nil;
+      sharedCache = [[self alloc] initWithContentsOfFile:path error:&error];
+      if (!sharedCache)
+        NSLog(@"warning: ignoring code cache %@: %@", path, error);
+    }
+    if (!sharedCache) {
+      sharedCache = [[self alloc] init];
+      sharedCache->rootPath_ = [resourcePath copy];
+    }
+  }
+  return sharedCache;
+}
+
+
+- (id)initWithContentsOfFile:(NSString*)path error:(NSError**)error {
+  if (!(self = [super init])) return nil;
+  NSString* problem = nil;
+  int code = NodeJSCodeCacheInvalidError;
+  int fd = open([path fileSystemRepresentation], O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0) {
+    problem = [NSString stringWithUTF8String:strerror(errno)];
+  } else if ((size_t)st.st_size < sizeof(CacheHeader)) {
+    problem = @"file is truncated";
+  } else {
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      problem = [NSString stringWithUTF8String:strerror(errno)];
+    } else {
+      map_ = (const char*)map;
+      mapSize_ = st.st_size;
+    }
+  }
+  if (fd != -1) close(fd);
+
+  if (!problem) {
+    const CacheHeader* header = (const CacheHeader*)map_;
+    char v8version[sizeof(header->v8version)];
+    GetV8Version(v8version, sizeof(v8version));
+    if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0) {
+      problem = @"not a code cache file";
+    } else if (header->version != kFormatVersion ||
+               strncmp(header->v8version, v8version, sizeof(v8version))) {
+      code = NodeJSCodeCacheVersionError;
+      problem = [NSString stringWithFormat:@"built by V8 %.*s (format %u)",
+                 (int)sizeof(v8version), header->v8version, header->version];
+    } else if ((mapSize_ - sizeof(CacheHeader)) / sizeof(CacheEntry) <
+               header->count) {
+      problem = @"file is truncated";
+    }
+  }
+
+  // build the path index, validating each entry
+  if (!problem) {
+    const CacheHeader* header = (const CacheHeader*)map_;
+    const CacheEntry* entries = (const CacheEntry*)(header + 1);
+    NSMutableDictionary* index =
+        [NSMutableDictionary dictionaryWithCapacity:header->count];
+    for (uint32_t i = 0; i < header->count; ++i) {
+      const CacheEntry& e = entries[i];
+      if ((uint64_t)e.pathOffset + e.pathLength > mapSize_ ||
+          (uint64_t)e.dataOffset + e.dataLength > mapSize_ ||
+          (e.dataOffset & 7)) {
+        problem = @"file is corrupt";
+        break;
+      }
+      NSString* key = [[NSString alloc] initWithBytes:map_ + e.pathOffset
+                                               length:e.pathLength
+                                             encoding:NSUTF8StringEncoding];
+      if (key) {
+        [index setObject:[NSNumber numberWithUnsignedInt:i] forKey:key];
+        [key release];
+      }
+    }
+    if (!problem) {
+      index_ = [index copy];
+      stats_.count = header->count;
+      stats_.size = mapSize_;
+    }
+  }
+
+  if (problem) {
+    if (error) {
+      *error = CacheError(code, [NSString stringWithFormat:@"%@: %@",
+                                 path, problem]);
+    }
+    [self release];
+    return nil;
+  }
+  rootPath_ = [[path stringByDeletingLastPathComponent] copy];
+  return self;
+}
+
+
+- (void)dealloc {
+  if (map_) munmap((void*)map_, mapSize_);
+  [index_ release];
+  [rootPath_ release];
+  [super dealloc];
+}
+
+
+- (const CacheEntry*)_entryForFilename:(Handle<String>)filename {
+  if (!index_ || filename.IsEmpty()) return NULL;
+  String::Utf8Value utf8(filename);
+  if (!*utf8) return NULL;
+  NSUInteger rootLength = [rootPath_ length];
+  NSString* path = [NSString stringWithUTF8String:*utf8];
+  if ([path length] <= rootLength + 1 || ![path hasPrefix:rootPath_] ||
+      [path characterAtIndex:rootLength] != '/') {
+    return NULL;
+  }
+  NSNumber* i = [index_ objectForKey:[path substringFromIndex:rootLength + 1]];
+  if (!i) return NULL;
+  const CacheHeader* header = (const CacheHeader*)map_;
+  return (const CacheEntry*)(header + 1) + [i unsignedIntValue];
+}
+
+
+// Precompiled data for |source| or NULL if there's no (current) entry. The
+// caller deletes the returned object.
+- (ScriptData*)_preparseDataForSource:(Handle<String>)source
+                             filename:(Handle<String>)filename {
+  const CacheEntry* entry = [self _entryForFilename:filename];
+  if (!entry) {
+    stats_.misses++;
+    return NULL;
+  }
+  String::Value chars(source);
+  if ((uint32_t)chars.length() != entry->sourceLength ||
+      HashChars(*chars, chars.length()) != entry->sourceHash) {
+    stats_.stale++;
+    return NULL;
+  }
+  stats_.hits++;
+  stats_.savedTime += entry->preparseTime;
+  // the data is 8-byte aligned, so V8 uses it in place (no copy)
+  return ScriptData::New(map_ + entry->dataOffset, entry->dataLength);
+}
+
+
+// Compiles |source| with |pre_data| (may be NULL), which is deleted
+- (Local<v8::Script>)_compile:(Handle<String>)source
+                     filename:(Handle<String>)filename
+                 preparseData:(ScriptData*)pre_data
+                        start:(double)start {
+  HandleScope scope;
+  ScriptOrigin origin(filename);
+  Local<v8::Script> script = v8::Script::Compile(source, &origin, pre_data);
+  delete pre_data;
+  stats_.compileTime += NodeJSLoopNow() - start;
+  return scope.Close(script);
+}
+
+
+- (Local<v8::Script>)compile:(Handle<String>)source
+                    filename:(Handle<String>)filename {
+  double start = NodeJSLoopNow();
+  ScriptData* pre_data = [self _preparseDataForSource:source
+                                             filename:filename];
+  return [self _compile:source filename:filename preparseData:pre_data
+                  start:start];
+}
+
+
+- (NodeJSCodeCacheStats)statistics {
+  return stats_;
+}
+
+
+- (void)resetStatistics {
+  NSUInteger count = stats_.count, size = stats_.size;
+  memset(&stats_, 0, sizeof(stats_));
+  stats_.count = count;
+  stats_.size = size;
+}
+
+// -----------------------------------------------------------------------------
+// Wrappers of process.compile and the evals module (node_script.cc). Sources
+// with a current cache entry are compiled with its preparse data; everything
+// else -- and anything which fails to compile, so that node reports it (e.g.
+// with displayErrors) -- is passed on to node's original function.
+
+// Function data: [External(cache), original function]
+static inline NodeJSCodeCache* CacheFromArgs(const Arguments& args) {
+  return (NodeJSCodeCache*)External::Unwrap(
+      Local<Array>::Cast(args.Data())->Get(0));
+}
+
+
+// Calls the original function with |args|. Returns an empty handle if it
+// threw (the exception is passed on as is).
+static Local<Value> CallOriginal(const Arguments& args) {
+  Local<Function> original =
+      Local<Function>::Cast(Local<Array>::Cast(args.Data())->Get(1));
+  int argc = args.Length();
+  Local<Value>* argv = new Local<Value>[argc ? argc : 1];
+  for (int i = 0; i < argc; ++i)
+    argv[i] = args[i];
+  Local<Value> result = original->Call(args.This(), argc, argv);
+  delete[] argv;
+  return result;
+}
+
+
+// Precompiled data for the code in args[0] if args[i] names a file with a
+// current entry, NULL otherwise
+static ScriptData* PreparseData(const Arguments& args, int i) {
+  if (args.Length() <= i || !args[0]->IsString() || !args[i]->IsString())
+    return NULL;
+  return [CacheFromArgs(args) _preparseDataForSource:args[0]->ToString()
+                                            filename:args[i]->ToString()];
+}
+
+
+// Compiles the code in args[0] in the current context using |pre_data|
+// (deleted). Returns an empty handle without throwing if that fails: node
+// compiles the code again and reports the error.
+static Local<v8::Script> CompileWith(const Arguments& args, int i,
+                                     ScriptData* pre_data, double start) {
+  TryCatch try_catch;
+  return [CacheFromArgs(args) _compile:args[0]->ToString()
+                              filename:args[i]->ToString()
+                          preparseData:pre_data
+                                 start:start];
+}
+
+
+// process.compile(code, filename) and
+// Script.runInThisContext(code, filename[, displayErrors])
+static v8::Handle<Value> CompileAndRun(const Arguments& args) {
+  HandleScope scope;
+  double start = NodeJSLoopNow();
+  ScriptData* pre_data = PreparseData(args, 1);
+  Local<v8::Script> script;
+  if (pre_data) script = CompileWith(args, 1, pre_data, start);
+  Local<Value> result =
+      script.IsEmpty() ? CallOriginal(args) : script->Run();
+  if (result.IsEmpty()) return v8::Handle<Value>(); // exception pending
+  return scope.Close(result);
+}
+
+
+// Script.runInNewContext(code, sandbox, filename[, displayErrors])
+static v8::Handle<Value> RunInNewContext(const Arguments& args) {
+  HandleScope scope;
+  double start = NodeJSLoopNow();
+  ScriptData* pre_data = PreparseData(args, 2);
+  if (!pre_data) {
+    Local<Value> result = CallOriginal(args);
+    if (result.IsEmpty()) return v8::Handle<Value>(); // exception pending
+    return scope.Close(result);
+  }
+  Local<Object> sandbox = (args.Length() > 1 && args[1]->IsObject()) ?
+      args[1]->ToObject() : Object::New();
+
+  Persistent<Context> context = Context::New();
+  context->Enter();
+  TryCatch try_catch;
+  // copy the sandbox into the new context's global object
+  Local<Object> global = context->Global();
+  Local<Array> keys = sandbox->GetPropertyNames();
+  for (uint32_t i = 0; i < keys->Length(); ++i) {
+    Local<Value> key = keys->Get(Integer::New(i));
+    global->Set(key, sandbox->Get(key));
+  }
+  Local<v8::Script> script = CompileWith(args, 2, pre_data, start);
+  Local<Value> result;
+  if (!script.IsEmpty()) {
+    result = script->Run();
+    if (!result.IsEmpty()) {
+      // copy (possibly new) globals back to the sandbox
+      keys = global->GetPropertyNames();
+      for (uint32_t i = 0; i < keys->Length(); ++i) {
+        Local<Value> key = keys->Get(Integer::New(i));
+        sandbox->Set(key, global->Get(key));
+      }
+    }
+  }
+  context->DetachGlobal();
+  context->Exit();
+  context.Dispose();
+
+  if (script.IsEmpty()) result = CallOriginal(args);
+  if (result.IsEmpty()) return try_catch.ReThrow();  // keeps the message
+  return scope.Close(result);
+}
+
+
+// Replaces |object|[name] with |callback| wrapping the original
+static void Wrap(NodeJSCodeCache* cache, Local<Object> object,
+                 const char* name, InvocationCallback callback) {
+  Local<String> symbol = String::NewSymbol(name);
+  Local<Value> original = object->Get(symbol);
+  if (!original->IsFunction()) return;
+  Local<Array> data = Array::New(2);
+  data->Set(0, External::Wrap(cache));
+  data->Set(1, original);
+  object->Set(symbol, FunctionTemplate::New(callback, data)->GetFunction());
+}
+
+
+- (void)installInProcess:(v8::Handle<Object>)process {
+  HandleScope scope;
+  [self retain]; // referenced by the installed functions from now on
+  Wrap(self, Local<Object>::New(process), "compile", &CompileAndRun);
+  Local<Value> binding = process->Get(String::NewSymbol("binding"));
+  if (!binding->IsFunction()) return;
+  TryCatch try_catch;
+  Local<Value> argv[] = { String::New("evals") };
+  Local<Value> evals = Local<Function>::Cast(binding)->Call(process, 1, argv);
+  if (evals.IsEmpty() || !evals->IsObject()) return;
+  Local<Value> script = evals->ToObject()->Get(String::NewSymbol("Script"));
+  if (!script->IsObject()) return;
+  Local<Object> scriptObj = script->ToObject();
+  Wrap(self, scriptObj, "runInThisContext", &CompileAndRun);
+  Wrap(self, scriptObj, "runInNewContext", &RunInNewContext);
+}
+
+// -----------------------------------------------------------------------------
+// Building
+
++ (BOOL)buildCacheForDirectory:(NSString*)directory
+                        toFile:(NSString*)path
+                         error:(NSError**)error {
+  NSAutoreleasePool* pool = [NSAutoreleasePool new];
+  NSFileManager* fm = [NSFileManager defaultManager];
+  NSMutableArray* files = [NSMutableArray array];
+  if ([fm fileExistsAtPath:[directory stringByAppendingPathComponent:@"main.js"]])
+    [files addObject:@"main.js"];
+  NSString* libPath = [directory stringByAppendingPathComponent:@"lib"];
+  for (NSString* subpath in [fm enumeratorAtPath:libPath]) {
+    if ([[subpath pathExtension] isEqualToString:@"js"])
+      [files addObject:[@"lib" stringByAppendingPathComponent:subpath]];
+  }
+  [files sortUsingSelector:@selector(compare:)];
+
+  V8::Initialize();
+  HandleScope scope;
+  NSMutableData* paths = [NSMutableData data];
+  NSMutableData* blobs = [NSMutableData data];
+  CacheEntry* entries =
+      (CacheEntry*)calloc(MAX([files count], 1), sizeof(CacheEntry));
+  uint32_t count = 0;
+  for (NSString* file in files) {
+    NSData* bytes = [NSData dataWithContentsOfFile:
+        [directory stringByAppendingPathComponent:file]];
+    NSString* source = bytes ? [[[NSString alloc] initWithData:bytes
+        encoding:NSUTF8StringEncoding] autorelease] : nil;
+    if (!source) {
+      NSLog(@"warning: skipping %@ (not readable as UTF-8)", file);
+      continue;
+    }
+    double start = NodeJSLoopNow();
+    ScriptData* data = ScriptData::PreCompile((const char*)[bytes bytes],
+                                              (int)[bytes length]);
+    double preparseTime = NodeJSLoopNow() - start;
+    if (!data || data->HasError()) {
+      NSLog(@"warning: skipping %@ (syntax error)", file);
+      delete data;
+      continue;
+    }
+    NSUInteger length = [source length];
+    uint16_t* chars = (uint16_t*)malloc(sizeof(uint16_t) * MAX(length, 1));
+    [source getCharacters:chars range:NSMakeRange(0, length)];
+    CacheEntry& e = entries[count++];
+    e.sourceLength = (uint32_t)length;
+    e.sourceHash = HashChars(chars, length);
+    e.preparseTime = preparseTime;
+    free(chars);
+    const char* utf8path = [file UTF8String];
+    e.pathOffset = (uint32_t)[paths length];  // relative, fixed up below
+    e.pathLength = (uint32_t)strlen(utf8path);
+    [paths appendBytes:utf8path length:e.pathLength];
+    [blobs setLength:([blobs length] + 7) & ~(NSUInteger)7];
+    e.dataOffset = (uint32_t)[blobs length];  // relative, fixed up below
+    e.dataLength = (uint32_t)data->Length();
+    [blobs appendBytes:data->Data() length:e.dataLength];
+    delete data;
+  }
+
+  CacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kFormatVersion;
+  header.count = count;
+  GetV8Version(header.v8version, sizeof(header.v8version));
+  NSUInteger pathsStart = sizeof(header) + sizeof(CacheEntry) * count;
+  NSUInteger blobsStart = (pathsStart + [paths length] + 7) & ~(NSUInteger)7;
+  for (uint32_t i = 0; i < count; ++i) {
+    entries[i].pathOffset += pathsStart;
+    entries[i].dataOffset += blobsStart;
+  }
+
+  NSMutableData* out = [NSMutableData dataWithCapacity:blobsStart +
+                                                       [blobs length]];
+  [out appendBytes:&header length:sizeof(header)];
+  [out appendBytes:entries length:sizeof(CacheEntry) * count];
+  free(entries);
+  [out appendData:paths];
+  [out setLength:blobsStart];
+  [out appendData:blobs];
+
+  BOOL ok = [out writeToFile:path options:NSAtomicWrite error:error];
+  if (!ok && error) [*error retain];
+  [pool drain];
+  if (!ok && error) [*error autorelease];
+  return ok;
+}
+
+@end
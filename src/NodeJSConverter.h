@@ -0,0 +1,66 @@
+#ifndef NODECOCOA_NODEJS_CONVERTER_H_
+#define NODECOCOA_NODEJS_CONVERTER_H_
+
+#import <NodeCocoa/NS-additions.h>
+
+/// Error codes (in |NodeJSNSErrorDomain|) produced by NodeJSConverter.
+enum {
+  NodeJSConverterCycleError = 1,      // a container contains itself
+  NodeJSConverterDepthLimitError = 2, // nesting deeper than |maxDepth|
+  NodeJSConverterSizeLimitError = 3,  // more values than |maxValues|
+};
+
+struct NodeJSConverterScratch;
+
+/**
+ * Converts between V8 values and Cocoa objects.
+ *
+ * Object graphs are walked using an explicit stack rather than recursion, so
+ * deeply nested values can't overflow the C stack. Containers which contain
+ * themselves (directly or indirectly) are detected and reported as errors
+ * rather than looping forever. Shared (but acyclic) references are converted
+ * once per reference, like before.
+ *
+ * Scratch memory (the work stack, identity map and per-container key caches)
+ * lives in an arena owned by the converter and is reused across calls.
+ *
+ * |+[NSObject fromV8Value:]| and the |v8Value| methods of NSArray, NSSet and
+ * NSDictionary use |sharedConverter|.
+ *
+ * Note: Must only be used from the node thread.
+ */
+@interface NodeJSConverter : NSObject {
+  struct NodeJSConverterScratch* scratch_;
+  NSUInteger maxDepth_;
+  NSUInteger maxValues_;
+  BOOL busy_;
+}
+
+/// Maximum nesting of containers. Defaults to NSUIntegerMax (the walk doesn't
+/// recurse, so depth is only bounded by memory).
+@property(nonatomic) NSUInteger maxDepth;
+
+/// Maximum number of values converted in one call. Defaults to NSUIntegerMax.
+@property(nonatomic) NSUInteger maxValues;
+
++ (NodeJSConverter*)sharedConverter;
+
+/**
+ * Convert |value| to a Cocoa object (see |+[NSObject fromV8Value:]| for the
+ * rules). Returns nil and sets |error| if a limit is exceeded or a cycle is
+ * found. Returns nil without setting |error| for unsupported values.
+ */
+- (id)objectFromV8Value:(v8::Local<v8::Value>)value
+                options:(NodeJSConversionOptions)options
+                  error:(NSError**)error;
+
+/**
+ * Convert |object| to a V8 value (see |-[NSObject v8Value]| for the rules).
+ * Returns an empty handle and sets |error| if a limit is exceeded or a cycle
+ * is found.
+ */
+- (v8::Local<v8::Value>)v8ValueFromObject:(id)object error:(NSError**)error;
+
+@end
+
+#endif // NODECOCOA_NODEJS_CONVERTER_H_
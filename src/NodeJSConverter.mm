@@ -0,0 +1,615 @@
+#import "NodeJSConverter.h"
+#import "NodeJS.h"
+#import "NodeJSFunction.h"
+#import "NodeJSInternTable.h"
+#import <node_buffer.h>
+
+using namespace v8;
+
+static const int kBucketCount = 256; // identity map buckets (power of two)
+
+// -----------------------------------------------------------------------------
+// Scratch memory
+
+// Bump allocator whose chunks are kept (and reused) across conversions
+class Arena {
+ public:
+  Arena() : first_(NULL), current_(NULL) {}
+
+  ~Arena() {
+    while (first_) {
+      Chunk* next = first_->next;
+      free(first_);
+      first_ = next;
+    }
+  }
+
+  void* Alloc(size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    while (current_ && current_->used + size > current_->size) {
+      if (!current_->next) break;
+      current_ = current_->next;
+      current_->used = 0;
+    }
+    if (!current_ || current_->used + size > current_->size) {
+      size_t chunksize = MAX(size, (size_t)64 * 1024);
+      Chunk* chunk = (Chunk*)malloc(sizeof(Chunk) + chunksize);
+      chunk->next = NULL;
+      chunk->size = chunksize;
+      chunk->used = 0;
+      if (current_) {
+        chunk->next = current_->next;
+        current_->next = chunk;
+      } else {
+        first_ = chunk;
+      }
+      current_ = chunk;
+    }
+    void* p = current_->data + current_->used;
+    current_->used += size;
+    return p;
+  }
+
+  template <typename T> T* AllocArray(size_t count) {
+    return (T*)Alloc(sizeof(T) * (count ? count : 1));
+  }
+
+  void Reset() {
+    current_ = first_;
+    if (current_) current_->used = 0;
+  }
+
+ private:
+  struct Chunk {
+    Chunk* next;
+    size_t size;
+    size_t used;
+    char data[0];
+  };
+  Chunk* first_;
+  Chunk* current_;
+};
+
+
+enum FrameKind {
+  kArrayFrame,       // V8 Array --> NSMutableArray
+  kObjectFrame,      // V8 Object --> NSMutableDictionary
+  kColumnarFrame,    // V8 Array of uniform Objects --> NSMutableDictionary
+  kCocoaArrayFrame,  // NSArray or NSSet --> V8 Array
+  kCocoaDictFrame,   // NSDictionary --> V8 Object
+};
+
+struct Frame {
+  FrameKind kind;
+  uint32_t index;       // next child
+  uint32_t count;       // number of children
+  uint32_t bucket;      // identity map bucket
+  int nextInBucket;     // frame index or -1
+
+  // V8 --> Cocoa
+  Local<Object> object;
+  Local<Array> keys;        // property names (unless |keyv| is set)
+  Local<String>* keyv;      // cached property names (uniform layouts)
+  NSString** keyobjs;       // interned |keyv|
+  uint32_t nkeys;
+  bool uniformChildren;     // plain object children share |keyv|
+  id container;             // NSMutableArray or NSMutableDictionary
+  Local<Object> row;        // current row of a columnar frame
+  NSMutableData** numcols;  // columnar: packed double columns
+  NSMutableArray** objcols; // columnar: boxed columns
+
+  // Cocoa --> V8
+  id source;
+  NSArray* items;           // elements (NSArray/NSSet) or keys (NSDictionary)
+  Local<Object> target;
+};
+
+struct NodeJSConverterScratch {
+  Arena arena;
+  Frame* frames;
+  int capacity;
+  int depth;
+  int buckets[kBucketCount];
+  NSUInteger values;
+  NodeJSConversionOptions options;
+  int error;
+
+  NodeJSConverterScratch() : frames(NULL), capacity(0) {}
+  ~NodeJSConverterScratch() { free(frames); }
+
+  void Reset(NodeJSConversionOptions opts) {
+    arena.Reset();
+    depth = 0;
+    values = 0;
+    options = opts;
+    error = 0;
+    memset(buckets, 0xff, sizeof(buckets)); // -1
+  }
+
+  Frame* Top() { return &frames[depth-1]; }
+
+  // Returns a new frame on top of the stack (the stack might be relocated)
+  Frame* PushFrame(FrameKind kind, uint32_t bucket) {
+    if (depth == capacity) {
+      capacity = capacity ? capacity * 2 : 32;
+      frames = (Frame*)realloc(frames, sizeof(Frame) * capacity);
+    }
+    Frame* f = &frames[depth];
+    memset(f, 0, sizeof(Frame));
+    f->kind = kind;
+    f->bucket = bucket;
+    f->nextInBucket = buckets[bucket];
+    buckets[bucket] = depth++;
+    return f;
+  }
+
+  // Frames are popped in LIFO order, so the top frame is always the head of
+  // its identity map bucket.
+  void PopFrame() {
+    Frame* f = Top();
+    buckets[f->bucket] = f->nextInBucket;
+    --depth;
+  }
+};
+
+
+// -----------------------------------------------------------------------------
+// V8 --> Cocoa
+
+// True if |v| is an object which would be converted to an NSDictionary
+static inline bool IsPlainObject(Local<Value> v) {
+  return v->IsObject() && !v->IsArray() && !v->IsFunction() &&
+         !v->IsDate() && !v->IsRegExp() && !v->IsExternal() &&
+         !node::Buffer::HasInstance(v);
+}
+
+
+static inline bool IsContainer(Local<Value> v) {
+  return v->IsArray() || IsPlainObject(v);
+}
+
+
+// Converts a non-container value
+static id ObjectFromLeaf(Local<Value> v) {
+  if (v->IsUndefined() || v->IsNull()) return [NSNull null];
+  if (v->IsBoolean()) return [NSNumber numberWithBool:v->BooleanValue()];
+  if (v->IsInt32())   return [NSNumber numberWithInt:v->Int32Value()];
+  if (v->IsUint32())  return [NSNumber numberWithUnsignedInt:v->Uint32Value()];
+  if (v->IsNumber())  return [NSNumber numberWithDouble:v->NumberValue()];
+  if (v->IsExternal())
+    return [NSValue valueWithPointer:(External::Unwrap(v))];
+  if (v->IsString() || v->IsRegExp())
+    return [NSString stringWithV8String:v->ToString()];
+  if (v->IsFunction())
+    return [NodeJSFunction functionWithFunction:Local<Function>::Cast(v)];
+
+  // node::Buffer --> NSData
+  if (v->IsObject() && node::Buffer::HasInstance(v)) {
+    Local<Object> bufobj = v->ToObject();
+    size_t length = node::Buffer::Length(bufobj);
+    char* data = node::Buffer::Data(bufobj);
+    return [NSData dataWithBytes:data length:length];
+  }
+
+  // Date --> NSDate
+  if (v->IsDate()) {
+    double ms = Local<Date>::Cast(v)->NumberValue();
+    return [NSDate dateWithTimeIntervalSince1970:ms/1000.0];
+  }
+
+  return nil;
+}
+
+
+// True if the property names |a| and |b| are the same and in the same order
+static bool SameKeys(Local<Array> a, Local<Array> b) {
+  uint32_t i = 0, count = a->Length();
+  if (b->Length() != count) return false;
+  for (; i < count; ++i) {
+    if (!a->Get(i)->StrictEquals(b->Get(i))) return false;
+  }
+  return true;
+}
+
+
+// Returns the property names of the first element of |a| if |a| looks like an
+// array of objects sharing the same layout (the first and last elements are
+// compared), otherwise an empty handle.
+static Local<Array> UniformArrayKeys(Local<Array> a) {
+  HandleScope scope;
+  uint32_t count = a->Length();
+  if (count == 0) return Local<Array>();
+  Local<Value> first = a->Get(0);
+  if (!IsPlainObject(first)) return Local<Array>();
+  Local<Array> keys = first->ToObject()->GetPropertyNames();
+  if (count > 1) {
+    Local<Value> last = a->Get(count-1);
+    if (!IsPlainObject(last) ||
+        !SameKeys(keys, last->ToObject()->GetPropertyNames())) {
+      return Local<Array>();
+    }
+  }
+  return scope.Close(keys);
+}
+
+
+// Caches |keys| (and their interned NSStrings) in the arena
+static void CacheKeys(NodeJSConverterScratch* s, Frame* f, Local<Array> keys) {
+  f->nkeys = keys->Length();
+  f->keyv = s->arena.AllocArray<Local<String> >(f->nkeys);
+  f->keyobjs = s->arena.AllocArray<NSString*>(f->nkeys);
+  for (uint32_t k = 0; k < f->nkeys; ++k) {
+    f->keyv[k] = keys->Get(k)->ToString();
+    f->keyobjs[k] = NodeJSInternedString(f->keyv[k]);
+  }
+}
+
+
+// Push a frame for converting the container |v|, returning the (empty)
+// container object which will be filled in as the frame is processed. |parent|
+// is the frame index of the container holding |v| or -1.
+static id PushV8Container(NodeJSConverterScratch* s, NSUInteger maxDepth,
+                          Local<Value> v, int parent) {
+  if ((NSUInteger)s->depth >= maxDepth) {
+    s->error = NodeJSConverterDepthLimitError;
+    return nil;
+  }
+  Local<Object> o = v->ToObject();
+  int hash = o->GetIdentityHash();
+  uint32_t bucket = (uint32_t)hash & (kBucketCount - 1);
+  for (int i = s->buckets[bucket]; i != -1; i = s->frames[i].nextInBucket) {
+    if (s->frames[i].object->StrictEquals(o)) {
+      s->error = NodeJSConverterCycleError;
+      return nil;
+    }
+  }
+
+  if (v->IsArray()) {
+    Local<Array> a = Local<Array>::Cast(v);
+    Local<Array> keys;
+    if (s->options & (NodeJSConvertUniformArrays|NodeJSConvertColumnarArrays))
+      keys = UniformArrayKeys(a);
+    Frame* f;
+    if (!keys.IsEmpty() && (s->options & NodeJSConvertColumnarArrays)) {
+      f = s->PushFrame(kColumnarFrame, bucket);
+      CacheKeys(s, f, keys);
+      uint32_t rows = a->Length();
+      f->count = rows * f->nkeys;
+      f->numcols = s->arena.AllocArray<NSMutableData*>(f->nkeys);
+      f->objcols = s->arena.AllocArray<NSMutableArray*>(f->nkeys);
+      for (uint32_t k = 0; k < f->nkeys; ++k) {
+        f->numcols[k] = [NSMutableData dataWithLength:rows * sizeof(double)];
+        f->objcols[k] = nil;
+      }
+      f->container = [NSMutableDictionary dictionaryWithCapacity:f->nkeys];
+    } else {
+      f = s->PushFrame(kArrayFrame, bucket);
+      f->count = a->Length();
+      if (!keys.IsEmpty()) {
+        CacheKeys(s, f, keys);
+        f->uniformChildren = true;
+      }
+      f->container = [NSMutableArray arrayWithCapacity:f->count];
+    }
+    f->object = o;
+    return f->container;
+  }
+
+  // plain object
+  Frame* pf = parent == -1 ? NULL : &s->frames[parent];
+  Frame* f = s->PushFrame(kObjectFrame, bucket);
+  if (pf && pf->uniformChildren) {
+    pf = &s->frames[parent]; // might have been relocated
+    f->keyv = pf->keyv;
+    f->keyobjs = pf->keyobjs;
+    f->nkeys = f->count = pf->nkeys;
+  } else {
+    f->keys = o->GetPropertyNames();
+    f->count = f->keys->Length();
+  }
+  f->object = o;
+  f->container = [NSMutableDictionary dictionaryWithCapacity:f->count];
+  return f->container;
+}
+
+
+// Finalize a columnar frame by moving its columns into the result dictionary
+static void FinishColumnarFrame(Frame* f) {
+  for (uint32_t k = 0; k < f->nkeys; ++k) {
+    id column = f->objcols[k] ? (id)f->objcols[k] : (id)f->numcols[k];
+    [f->container setObject:column forKey:f->keyobjs[k]];
+  }
+}
+
+
+static id ObjectFromV8Value(NodeJSConverterScratch* s, NSUInteger maxDepth,
+                            NSUInteger maxValues, Local<Value> root) {
+  if (!IsContainer(root))
+    return ObjectFromLeaf(root);
+
+  id result = PushV8Container(s, maxDepth, root, -1);
+  while (s->depth > 0 && !s->error) {
+    Frame* f = s->Top();
+    if (f->index >= f->count) {
+      if (f->kind == kColumnarFrame) FinishColumnarFrame(f);
+      s->PopFrame();
+      continue;
+    }
+
+    // fetch and convert the next child
+    uint32_t i = f->index++;
+    NSString* key = nil;
+    uint32_t col = 0;
+    Local<Value> child;
+    id obj = nil;
+    if (f->kind == kColumnarFrame && i % f->nkeys == 0) {
+      // |row| is kept in the frame, so it's created outside the value scope
+      Local<Value> rowv = f->object->Get(i / f->nkeys);
+      f->row = IsPlainObject(rowv) ? Local<Object>::Cast(rowv)
+                                   : Local<Object>();
+    }
+    {
+      HandleScope scope;
+      Local<Value> v;
+      switch (f->kind) {
+        case kArrayFrame:
+          v = f->object->Get(i);
+          break;
+        case kObjectFrame:
+          if (f->keyv) {
+            v = f->object->Get(f->keyv[i]);
+            if (v->IsUndefined() && !f->object->Has(f->keyv[i]))
+              continue;  // uniform layout, but missing in this object
+            key = f->keyobjs[i];
+          } else {
+            Local<String> k = f->keys->Get(i)->ToString();
+            v = f->object->Get(k);
+            key = NodeJSInternedString(k);
+          }
+          break;
+        case kColumnarFrame: {
+          col = i % f->nkeys;
+          if (!f->row.IsEmpty())
+            v = f->row->Get(f->keyv[col]);
+          if (!f->objcols[col]) {
+            if (!v.IsEmpty() && v->IsNumber()) {
+              ((double*)[f->numcols[col] mutableBytes])[i / f->nkeys] =
+                  v->NumberValue();
+              break;
+            }
+            // not a numeric column after all -- box the values read so far
+            uint32_t row = i / f->nkeys;
+            const double* nums = (const double*)[f->numcols[col] bytes];
+            f->objcols[col] = [NSMutableArray arrayWithCapacity:
+                f->count / f->nkeys];
+            for (uint32_t j = 0; j < row; ++j)
+              [f->objcols[col] addObject:[NSNumber numberWithDouble:nums[j]]];
+            f->numcols[col] = nil;
+          }
+          if (v.IsEmpty()) {
+            [f->objcols[col] addObject:[NSNull null]];
+            v.Clear();
+          }
+          break;
+        }
+        default:
+          assert(0);
+      }
+      if (++s->values > maxValues) {
+        s->error = NodeJSConverterSizeLimitError;
+        break;
+      }
+      if (v.IsEmpty() || (f->kind == kColumnarFrame && !f->objcols[col]))
+        continue;  // handled above
+      if (IsContainer(v))
+        child = scope.Close(v);
+      else
+        obj = ObjectFromLeaf(v);
+    }
+
+    if (!child.IsEmpty()) {
+      int parent = s->depth - 1;
+      obj = PushV8Container(s, maxDepth, child, parent);
+      if (!obj) break;
+      f = &s->frames[parent];  // might have been relocated
+    }
+
+    // add to parent container
+    switch (f->kind) {
+      case kArrayFrame:
+        if (obj) [f->container addObject:obj];
+        break;
+      case kObjectFrame:
+        if (obj) [f->container setObject:obj forKey:key];
+        break;
+      case kColumnarFrame:
+        [f->objcols[col] addObject:obj ? obj : [NSNull null]];
+        break;
+      default:
+        break;
+    }
+  }
+  return s->error ? nil : result;
+}
+
+
+// -----------------------------------------------------------------------------
+// Cocoa --> V8
+
+static inline bool IsCocoaContainer(id obj) {
+  return [obj isKindOfClass:[NSArray class]] ||
+         [obj isKindOfClass:[NSDictionary class]] ||
+         [obj isKindOfClass:[NSSet class]];
+}
+
+
+// Push a frame for converting the container |obj|, returning the (empty) V8
+// object which will be filled in as the frame is processed.
+static Local<Object> PushCocoaContainer(NodeJSConverterScratch* s,
+                                        NSUInteger maxDepth, id obj) {
+  if ((NSUInteger)s->depth >= maxDepth) {
+    s->error = NodeJSConverterDepthLimitError;
+    return Local<Object>();
+  }
+  uint32_t bucket = (uint32_t)((uintptr_t)obj >> 4) & (kBucketCount - 1);
+  for (int i = s->buckets[bucket]; i != -1; i = s->frames[i].nextInBucket) {
+    if (s->frames[i].source == obj) {
+      s->error = NodeJSConverterCycleError;
+      return Local<Object>();
+    }
+  }
+  Frame* f;
+  if ([obj isKindOfClass:[NSDictionary class]]) {
+    f = s->PushFrame(kCocoaDictFrame, bucket);
+    f->items = [obj allKeys];
+    f->target = Object::New();
+  } else {
+    f = s->PushFrame(kCocoaArrayFrame, bucket);
+    f->items = [obj isKindOfClass:[NSSet class]] ? [obj allObjects] : obj;
+    f->target = Array::New([f->items count]);
+  }
+  f->source = obj;
+  f->count = [f->items count];
+  return f->target;
+}
+
+
+static Local<Value> V8ValueFromObject(NodeJSConverterScratch* s,
+                                      NSUInteger maxDepth,
+                                      NSUInteger maxValues, id root) {
+  if (!IsCocoaContainer(root))
+    return [root v8Value];
+
+  Local<Object> result = PushCocoaContainer(s, maxDepth, root);
+  while (s->depth > 0 && !s->error) {
+    Frame* f = s->Top();
+    if (f->index >= f->count) {
+      s->PopFrame();
+      continue;
+    }
+    uint32_t i = f->index++;
+    if (++s->values > maxValues) {
+      s->error = NodeJSConverterSizeLimitError;
+      break;
+    }
+    id key = nil, child;
+    if (f->kind == kCocoaDictFrame) {
+      key = [f->items objectAtIndex:i];
+      assert([key isKindOfClass:[NSString class]]);
+      child = [f->source objectForKey:key];
+    } else {
+      child = [f->items objectAtIndex:i];
+    }
+
+    if (IsCocoaContainer(child)) {
+      int parent = s->depth - 1;
+      Local<Object> t = PushCocoaContainer(s, maxDepth, child);
+      if (t.IsEmpty()) break;
+      f = &s->frames[parent];  // might have been relocated
+      if (key)
+        f->target->Set(NodeJSInternedSymbol(key), t);
+      else
+        f->target->Set(i, t);
+    } else {
+      HandleScope scope;
+      if (key)
+        f->target->Set(NodeJSInternedSymbol(key), [child v8Value]);
+      else
+        f->target->Set(i, [child v8Value]);
+    }
+  }
+  return s->error ? Local<Value>() : Local<Value>(result);
+}
+
+
+// -----------------------------------------------------------------------------
+
+static NSError* ConverterError(int code) {
+  NSString* description = @"conversion failed";
+  switch (code) {
+    case NodeJSConverterCycleError:
+      description = @"cyclic structure"; break;
+    case NodeJSConverterDepthLimitError:
+      description = @"maximum depth exceeded"; break;
+    case NodeJSConverterSizeLimitError:
+      description = @"maximum number of values exceeded"; break;
+  }
+  return [NSError errorWithDomain:(NSString*)NodeJSNSErrorDomain code:code
+      userInfo:[NSDictionary dictionaryWithObject:description
+                                           forKey:NSLocalizedDescriptionKey]];
+}
+
+
+@implementation NodeJSConverter
+
+@synthesize maxDepth = maxDepth_, maxValues = maxValues_;
+
++ (NodeJSConverter*)sharedConverter {
+  static NodeJSConverter* sharedConverter = nil;
+  if (!sharedConverter)
+    sharedConverter = [[self alloc] init];
+  return sharedConverter;
+}
+
+
+- (id)init {
+  if ((self = [super init])) {
+    scratch_ = new NodeJSConverterScratch;
+    maxDepth_ = NSUIntegerMax;
+    maxValues_ = NSUIntegerMax;
+  }
+  return self;
+}
+
+
+- (void)dealloc {
+  delete scratch_;
+  [super dealloc];
+}
+
+
+// A converter which can be used while the receiver is busy (i.e. when a
+// |v8Value| method calls back into the converter).
+- (NodeJSConverter*)_reentrantConverter {
+  NodeJSConverter* converter = [[[NodeJSConverter alloc] init] autorelease];
+  converter.maxDepth = maxDepth_;
+  converter.maxValues = maxValues_;
+  return converter;
+}
+
+
+- (id)objectFromV8Value:(Local<Value>)value
+                options:(NodeJSConversionOptions)options
+                  error:(NSError**)error {
+  if (value.IsEmpty()) return nil;
+  if (busy_) {
+    return [[self _reentrantConverter] objectFromV8Value:value
+                                                 options:options
+                                                   error:error];
+  }
+  busy_ = YES;
+  HandleScope scope;
+  scratch_->Reset(options);
+  id result = ObjectFromV8Value(scratch_, maxDepth_, maxValues_, value);
+  if (scratch_->error && error)
+    *error = ConverterError(scratch_->error);
+  busy_ = NO;
+  return result;
+}
+
+
+- (Local<Value>)v8ValueFromObject:(id)object error:(NSError**)error {
+  if (busy_)
+    return [[self _reentrantConverter] v8ValueFromObject:object error:error];
+  busy_ = YES;
+  HandleScope scope;
+  scratch_->Reset(0);
+  Local<Value> result = V8ValueFromObject(scratch_, maxDepth_, maxValues_,
+                                          object);
+  if (scratch_->error && error)
+    *error = ConverterError(scratch_->error);
+  busy_ = NO;
+  return scope.Close(result);
+}
+
+@end
@@ -1,7 +1,23 @@
 #import <NodeCocoa/node.h>
+#import <NodeCocoa/NS-additions.h>
+#include <dispatch/dispatch.h>
 
 typedef v8::Handle<v8::Value> (^NodeJSFunctionBlock)(const v8::Arguments& args);
 
+/// Error codes in NodeJSNSErrorDomain
+enum {
+  NodeJSCallCancelledError = 40,  // the call was cancelled
+  NodeJSCallTimeoutError = 41,    // the call didn't finish within its timeout
+};
+
+@class NodeJSCall;
+
+/**
+ * Called with the converted return value (or nil and an error) of an
+ * asynchronous call. Cancelled calls complete with NodeJSCallCancelledError.
+ */
+typedef void (^NodeJSCallCompletion)(id result, NSError* error);
+
 @interface NodeJSFunction : NSObject {
   v8::Persistent<v8::Function> function_;
   id block_;
@@ -43,6 +59,8 @@ typedef v8::Handle<v8::Value> (^NodeJSFunctionBlock)(const v8::Arguments& args);
 // convenience methods.
 + (NodeJSFunction*)functionWithFunction:(v8::Local<v8::Function>)function;
 + (NodeJSFunction*)functionWithCFunction:(v8::InvocationCallback)funptr;
++ (NodeJSFunction*)functionWithCallback:(v8::InvocationCallback)callback
+                                   data:(void*)data;
 + (NodeJSFunction*)functionWithBlock:(NodeJSFunctionBlock)block;
 
 /// Function based on a V8 function.
@@ -69,9 +87,20 @@ typedef v8::Handle<v8::Value> (^NodeJSFunctionBlock)(const v8::Arguments& args);
  *
  * If you pass |nil| to |data|, the NodeJSFunction instance (aka "self") will be
  * used as |data|.
+ *
+ * Note: V8 keeps every template for the life of the context, so functions
+ * which are created over and over should use |initWithCallback:data:|.
  */
 - (id)initWithCFunction:(v8::InvocationCallback)funptr data:(void*)data;
 
+/**
+ * Function based on a C function, made by NodeJSFunctionWithCallback: all
+ * functions wrapping |callback| share one template, and |callback| gets |data|
+ * from NodeJSFunctionData(args) (|args.Data()| is not |data|). If you pass
+ * |nil| to |data|, the NodeJSFunction instance will be used as |data|.
+ */
+- (id)initWithCallback:(v8::InvocationCallback)callback data:(void*)data;
+
 /**
  * Function based on a C block.
  *
@@ -103,26 +132,21 @@ typedef v8::Handle<v8::Value> (^NodeJSFunctionBlock)(const v8::Arguments& args);
  *   [fun call];
  *   // here, fun will be autoreleased when returning, thus is no longer valid.
  *
- * Blocks are _not_ very suitable for being used as event callbacks or otherwise
- * passed into JavaScript-land where we have no control. Doing so might lead to
- * memory leaks and/or hard-to-debug segmentation violations.
- *
- * Example of a one-shot callback block:
+ * The function is a pooled trampoline (see NodeJSFunctionWithBlock below),
+ * which keeps the block alive for as long as JavaScript can reach the function,
+ * even after the NodeJSFunction has been deallocated, so block functions can be
+ * passed into JavaScript-land as callbacks:
  *
- *   __block NodeJSFunction *callback;
- *   callback = [[NodeJSFunction alloc] initWithBlock:^(const Arguments& args){
+ *   NodeJSFunction *callback =
+ *       [NodeJSFunction functionWithBlock:^(const Arguments& args){
  *     HandleScope scope;
- *     Local<Value> result = Local<Value>::New(Undefined());
- *     // your code here, which possibly sets |result|
- *     [callback release];
- *     return v8::Handle<v8::Value>(scope.Close(result));
+ *     // your code here
+ *     return v8::Handle<v8::Value>(scope.Close(Undefined()));
  *   }];
- *   v8::Local<Value> argv[] = { callback.v8Value };
+ *   v8::Handle<Value> argv[] = { callback.v8Value };
  *   [someAsyncFunc callWithV8Arguments:argv count:1 error:nil];
  *
- * Once again, in the above use case it's not recommended to use blocks. If you
- * need coupling with C-land, go with |initWithCFunction:|, otherwise use
- * |functionFromString:..|.
+ * Note that anything the block captures lives as long as the block.
  */
 - (id)initWithBlock:(NodeJSFunctionBlock)block;
 
@@ -157,4 +181,299 @@ typedef v8::Handle<v8::Value> (^NodeJSFunctionBlock)(const v8::Arguments& args);
 /// Convenience: No arguments and no |thisObject| (errors printed to stderr).
 - (v8::Local<v8::Value>)call;
 
+/**
+ * Invoke the function asynchronously on the node thread. Can be called from
+ * any thread.
+ *
+ * |arguments| is copied and converted to V8 values (using |v8Value|) once the
+ * call runs. NodeJSFunction arguments are kept alive until the JavaScript side
+ * drops them (through a weak handle), so they are safe to use as callbacks.
+ * The return value is converted using +[NSObject fromV8Value:].
+ *
+ * @param arguments   Arguments, or nil for none.
+ * @param timeout     Seconds after which the call is cancelled (terminating the
+ *                    script if it's running) and completed with
+ *                    NodeJSCallTimeoutError. 0 means no timeout.
+ * @param queue       Queue on which |completion| is called. NULL means the main
+ *                    queue.
+ * @param completion  Optional block receiving the result.
+ * Returns a handle which can be used to cancel or wait for the call.
+ */
+- (NodeJSCall*)callAsyncWithArguments:(NSArray*)arguments
+                              timeout:(NSTimeInterval)timeout
+                                queue:(dispatch_queue_t)queue
+                           completion:(NodeJSCallCompletion)completion;
+
+/// Convenience: No timeout, completion called on the main queue.
+- (NodeJSCall*)callAsyncWithArguments:(NSArray*)arguments
+                           completion:(NodeJSCallCompletion)completion;
+
 @end
+
+
+/**
+ * Handle to an asynchronous call to a NodeJSFunction (a future).
+ *
+ * A call completes exactly once: with the function's result, an error, or
+ * NodeJSCallCancelledError/NodeJSCallTimeoutError. A call which is cancelled
+ * before it starts never runs. A call which is running when cancelled has its
+ * script terminated (V8::TerminateExecution), which also unwinds any
+ * JavaScript it called synchronously.
+ */
+@interface NodeJSCall : NSObject {
+ @public
+  NodeJSFunction* function_;
+  NSArray* arguments_;
+  NodeJSCallCompletion completion_;
+  dispatch_queue_t queue_;
+  NSTimeInterval timeout_;
+  volatile int32_t state_;
+  int cancelCode_;
+  id result_;
+  NSError* error_;
+  NSCondition* condition_;
+  NodeJSCall* next_;  // queue link
+}
+
+/// YES once the call has completed (successfully or not).
+@property(readonly) BOOL isFinished;
+
+/// YES if the call was cancelled (explicitly or by its timeout).
+@property(readonly) BOOL isCancelled;
+
+/// The converted return value, once finished.
+@property(readonly) id result;
+
+/// Error, once finished, if the call failed or was cancelled.
+@property(readonly) NSError* error;
+
+/// Cancel the call. Does nothing if the call has already finished.
+- (void)cancel;
+
+/**
+ * Block until the call has finished or |timeout| seconds have passed. Returns
+ * YES if the call finished. Must not be called on the node thread.
+ */
+- (BOOL)waitUntilFinished:(NSTimeInterval)timeout;
+
+@end
+
+
+// -----------------------------------------------------------------------------
+// Lightweight native functions
+//
+// Every FunctionTemplate V8 instantiates stays in the context's function cache
+// for as long as the context lives, so creating a template per callback is
+// slow and never frees anything. The functions below avoid that: they return
+// small JavaScript closures around a native function shared by everything
+// with the same callback (or by all blocks), which V8 can collect like any
+// other closure. The closure hands its data or block to the native side.
+//
+// Like the rest of the V8 API, these must only be called on the node thread.
+
+/**
+ * Function calling |callback|, which can get |data| with NodeJSFunctionData().
+ * Templates are kept in a registry keyed by |callback|, so each call only
+ * creates a closure. Inside |callback|, |args.Callee()| is the shared native
+ * function and |args.Data()| belongs to the registry.
+ */
+v8::Local<v8::Function> NodeJSFunctionWithCallback(
+    v8::InvocationCallback callback, void* data);
+
+/// The |data| of the NodeJSFunctionWithCallback function being called.
+void* NodeJSFunctionData(const v8::Arguments& args);
+
+/**
+ * Function calling |block|. The block is copied into a pooled trampoline
+ * record which is returned to the pool (and the block released) when V8
+ * collects the function. Inside the block, |args.Callee()| is the shared
+ * native function rather than the returned closure and |args.Data()| is
+ * undefined -- the block's captured variables take its place.
+ */
+v8::Local<v8::Function> NodeJSFunctionWithBlock(NodeJSFunctionBlock block);
+
+/// Counters reported by NodeJSFunctionPoolStatistics().
+typedef struct {
+  NSUInteger templates;       // templates in the registry
+  uint64_t templateHits;      // functions served from an existing template
+  uint64_t trampolines;       // block functions created
+  uint64_t reclaimed;         // ... collected and returned to the pool
+  NSUInteger live;            // trampoline records in use
+  NSUInteger capacity;        // trampoline records allocated
+} NodeJSFunctionPoolStats;
+
+NodeJSFunctionPoolStats NodeJSFunctionPoolStatistics();
+
+// -----------------------------------------------------------------------------
+// Typed functions
+//
+// NodeJSFunctionBind(&fun) returns a function calling the plain C function
+// |fun|, with each JavaScript argument unpacked into the declared parameter
+// type and the return value packed back -- the conversion is chosen at compile
+// time by the parameter types, with no dynamic type inspection. Missing
+// arguments are undefined (i.e. 0, NaN, false or nil). Supported parameter and
+// return types are the ones with a NodeJSArg/NodeJSReturn specialization below;
+// functions take up to four parameters.
+//
+// Example:
+//
+//   static double hypot2(double x, double y) { return x*x + y*y; }
+//   target->Set(v8::String::NewSymbol("hypot2"), NodeJSFunctionBind(&hypot2));
+
+template <typename T> struct NodeJSArg;
+template <typename T> struct NodeJSReturn;
+
+#define NODEJS_ARG(T, expr) \
+  template <> struct NodeJSArg<T> { \
+    static inline T Get(v8::Handle<v8::Value> v) { return expr; } \
+  }
+NODEJS_ARG(bool, v->BooleanValue());
+NODEJS_ARG(int32_t, v->Int32Value());
+NODEJS_ARG(uint32_t, v->Uint32Value());
+NODEJS_ARG(int64_t, v->IntegerValue());
+NODEJS_ARG(double, v->NumberValue());
+NODEJS_ARG(float, (float)v->NumberValue());
+NODEJS_ARG(v8::Handle<v8::Value>, v);
+NODEJS_ARG(v8::Local<v8::Value>, v8::Local<v8::Value>::New(v));
+NODEJS_ARG(v8::Local<v8::Object>, v->ToObject());
+NODEJS_ARG(v8::Local<v8::String>, v->ToString());
+NODEJS_ARG(NSString*, v->IsUndefined() || v->IsNull() ? nil :
+           [NSString stringWithV8String:v->ToString()]);
+NODEJS_ARG(id, [NSObject fromV8Value:v8::Local<v8::Value>::New(v)]);
+#undef NODEJS_ARG
+
+#define NODEJS_RETURN(T, expr) \
+  template <> struct NodeJSReturn<T> { \
+    static inline v8::Handle<v8::Value> Wrap(T r) { return expr; } \
+  }
+NODEJS_RETURN(bool, v8::Boolean::New(r));
+NODEJS_RETURN(int32_t, v8::Integer::New(r));
+NODEJS_RETURN(uint32_t, v8::Integer::NewFromUnsigned(r));
+NODEJS_RETURN(int64_t, v8::Number::New((double)r));
+NODEJS_RETURN(double, v8::Number::New(r));
+NODEJS_RETURN(float, v8::Number::New(r));
+NODEJS_RETURN(v8::Handle<v8::Value>, r);
+NODEJS_RETURN(v8::Local<v8::Value>, r);
+NODEJS_RETURN(v8::Local<v8::Object>, r);
+NODEJS_RETURN(v8::Local<v8::String>, r);
+NODEJS_RETURN(NSString*, r ? v8::Handle<v8::Value>([r v8String]) :
+              v8::Handle<v8::Value>(v8::Null()));
+NODEJS_RETURN(id, r ? [r v8Value] : v8::Local<v8::Value>::New(v8::Null()));
+#undef NODEJS_RETURN
+
+// Invocation callbacks, one per function type. The C function is the data.
+template <typename F> struct NodeJSBinder;
+
+template <typename F>
+inline F NodeJSBoundFunction(const v8::Arguments& args) {
+  return (F)NodeJSFunctionData(args);
+}
+
+template <typename R>
+struct NodeJSBinder<R (*)()> {
+  static v8::Handle<v8::Value> Invoke(const v8::Arguments& args) {
+    v8::HandleScope scope;
+    typedef R (*F)();
+    F fn = NodeJSBoundFunction<F>(args);
+    return scope.Close(NodeJSReturn<R>::Wrap(fn()));
+  }
+};
+template <>
+struct NodeJSBinder<void (*)()> {
+  static v8::Handle<v8::Value> Invoke(const v8::Arguments& args) {
+    typedef void (*F)();
+    F fn = NodeJSBoundFunction<F>(args);
+    fn();
+    return v8::Undefined();
+  }
+};
+
+template <typename R, typename A1>
+struct NodeJSBinder<R (*)(A1)> {
+  static v8::Handle<v8::Value> Invoke(const v8::Arguments& args) {
+    v8::HandleScope scope;
+    typedef R (*F)(A1);
+    F fn = NodeJSBoundFunction<F>(args);
+    return scope.Close(NodeJSReturn<R>::Wrap(fn(NodeJSArg<A1>::Get(args[0]))));
+  }
+};
+template <typename A1>
+struct NodeJSBinder<void (*)(A1)> {
+  static v8::Handle<v8::Value> Invoke(const v8::Arguments& args) {
+    typedef void (*F)(A1);
+    F fn = NodeJSBoundFunction<F>(args);
+    fn(NodeJSArg<A1>::Get(args[0]));
+    return v8::Undefined();
+  }
+};
+
+template <typename R, typename A1, typename A2>
+struct NodeJSBinder<R (*)(A1, A2)> {
+  static v8::Handle<v8::Value> Invoke(const v8::Arguments& args) {
+    v8::HandleScope scope;
+    typedef R (*F)(A1, A2);
+    F fn = NodeJSBoundFunction<F>(args);
+    return scope.Close(NodeJSReturn<R>::Wrap(fn(NodeJSArg<A1>::Get(args[0]),
+                                                NodeJSArg<A2>::Get(args[1]))));
+  }
+};
+template <typename A1, typename A2>
+struct NodeJSBinder<void (*)(A1, A2)> {
+  static v8::Handle<v8::Value> Invoke(const v8::Arguments& args) {
+    typedef void (*F)(A1, A2);
+    F fn = NodeJSBoundFunction<F>(args);
+    fn(NodeJSArg<A1>::Get(args[0]), NodeJSArg<A2>::Get(args[1]));
+    return v8::Undefined();
+  }
+};
+
+template <typename R, typename A1, typename A2, typename A3>
+struct NodeJSBinder<R (*)(A1, A2, A3)> {
+  static v8::Handle<v8::Value> Invoke(const v8::Arguments& args) {
+    v8::HandleScope scope;
+    typedef R (*F)(A1, A2, A3);
+    F fn = NodeJSBoundFunction<F>(args);
+    return scope.Close(NodeJSReturn<R>::Wrap(fn(NodeJSArg<A1>::Get(args[0]),
+                                                NodeJSArg<A2>::Get(args[1]),
+                                                NodeJSArg<A3>::Get(args[2]))));
+  }
+};
+template <typename A1, typename A2, typename A3>
+struct NodeJSBinder<void (*)(A1, A2, A3)> {
+  static v8::Handle<v8::Value> Invoke(const v8::Arguments& args) {
+    typedef void (*F)(A1, A2, A3);
+    F fn = NodeJSBoundFunction<F>(args);
+    fn(NodeJSArg<A1>::Get(args[0]), NodeJSArg<A2>::Get(args[1]),
+       NodeJSArg<A3>::Get(args[2]));
+    return v8::Undefined();
+  }
+};
+
+template <typename R, typename A1, typename A2, typename A3, typename A4>
+struct NodeJSBinder<R (*)(A1, A2, A3, A4)> {
+  static v8::Handle<v8::Value> Invoke(const v8::Arguments& args) {
+    v8::HandleScope scope;
+    typedef R (*F)(A1, A2, A3, A4);
+    F fn = NodeJSBoundFunction<F>(args);
+    return scope.Close(NodeJSReturn<R>::Wrap(fn(NodeJSArg<A1>::Get(args[0]),
+                                                NodeJSArg<A2>::Get(args[1]),
+                                                NodeJSArg<A3>::Get(args[2]),
+                                                NodeJSArg<A4>::Get(args[3]))));
+  }
+};
+template <typename A1, typename A2, typename A3, typename A4>
+struct NodeJSBinder<void (*)(A1, A2, A3, A4)> {
+  static v8::Handle<v8::Value> Invoke(const v8::Arguments& args) {
+    typedef void (*F)(A1, A2, A3, A4);
+    F fn = NodeJSBoundFunction<F>(args);
+    fn(NodeJSArg<A1>::Get(args[0]), NodeJSArg<A2>::Get(args[1]),
+       NodeJSArg<A3>::Get(args[2]), NodeJSArg<A4>::Get(args[3]));
+    return v8::Undefined();
+  }
+};
+
+/// Function calling the C function |fn| with typed arguments (see above).
+template <typename F>
+inline v8::Local<v8::Function> NodeJSFunctionBind(F fn) {
+  return NodeJSFunctionWithCallback(&NodeJSBinder<F>::Invoke, (void*)fn);
+}
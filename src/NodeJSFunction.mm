@@ -1,9 +1,312 @@
 #import "NodeJSFunction.h"
 #import "NodeJS.h"
 #import "NS-additions.h"
+#import <ev.h>
+#import "NodeJSAtomic.h"
 
 using namespace v8;
 
+// -----------------------------------------------------------------------------
+// Asynchronous calls are queued here and run by an ev_async watcher on the node
+// thread (node runs once per process, so there's only one libev loop).
+
+enum { kCallQueued = 0, kCallRunning, kCallDone };
+
+static NodeJSSpinLock gCallLock = NODEJS_SPINLOCK_INIT;
+static NodeJSCall* gCallHead = nil;     // FIFO of queued calls (retained)
+static NodeJSCall* gCallTail = nil;
+static NodeJSCall* gRunningCall = nil;  // call currently in JavaScript
+static BOOL gTerminating = NO;          // TerminateExecution was requested
+static ev_async gCallNotifier;
+static bool gCallNotifierStarted = false;
+
+@interface NodeJSCall (Private)
+- (id)initWithFunction:(NodeJSFunction*)function
+             arguments:(NSArray*)arguments
+               timeout:(NSTimeInterval)timeout
+                 queue:(dispatch_queue_t)queue
+            completion:(NodeJSCallCompletion)completion;
+- (void)_run;
+- (void)_cancelWithCode:(int)code;
+@end
+
+
+static void RunQueuedCalls(EV_P_ ev_async* watcher, int revents) {
+  NodeJSSpinLockLock(&gCallLock);
+  NodeJSCall* call = gCallHead;
+  gCallHead = gCallTail = nil;
+  NodeJSSpinLockUnlock(&gCallLock);
+  while (call) {
+    NodeJSCall* next = call->next_;
+    call->next_ = nil;
+    NSAutoreleasePool* pool = [NSAutoreleasePool new];
+    [call _run];
+    [call release];
+    [pool drain];
+    call = next;
+  }
+}
+
+
+// Called on the node thread by every initializer, so the watcher exists before
+// anyone gets hold of a function to call
+static void StartCallNotifier() {
+  if (gCallNotifierStarted) return;
+  gCallNotifierStarted = true;
+  ev_async_init(&gCallNotifier, &RunQueuedCalls);
+  ev_async_start(EV_DEFAULT_UC_ &gCallNotifier);
+  ev_unref(EV_DEFAULT_UC); // queued calls alone don't keep node alive
+}
+
+
+static void EnqueueCall(NodeJSCall* call) {
+  [call retain];
+  NodeJSSpinLockLock(&gCallLock);
+  if (gCallTail) gCallTail->next_ = call;
+  else gCallHead = call;
+  gCallTail = call;
+  NodeJSSpinLockUnlock(&gCallLock);
+  ev_async_send(EV_DEFAULT_UC_ &gCallNotifier);
+}
+
+
+// -----------------------------------------------------------------------------
+// Closures. V8 keeps every template it has instantiated (and the function) for
+// the life of the context, so native functions share one template per
+// callback. Each function handed out is a closure created by
+// kClosureFactorySource around such a native function and a record: the
+// closure stores the record in a slot shared with the native side, which picks
+// it up before anything else can run. Closures are collected like any other.
+
+static const char* kClosureFactorySource =
+    "(function (slot) {\n"
+    "  return function (native, record) {\n"
+    "    return function () {\n"
+    "      slot[0] = record;\n"
+    "      return native.apply(this, arguments);\n"
+    "    };\n"
+    "  };\n"
+    "})";
+
+static Persistent<Function> gClosureFactory;  // (native, record) -> closure
+static Persistent<Object> gClosureSlot;       // [record of current call]
+static NodeJSFunctionPoolStats gPoolStats;
+
+
+static bool SetupClosures() {
+  HandleScope scope;
+  TryCatch try_catch;
+  Local<v8::Script> script =
+      v8::Script::Compile(String::New(kClosureFactorySource),
+                          String::New("NodeJSFunction"));
+  Local<Value> outer = script.IsEmpty() ? Local<Value>() : script->Run();
+  if (outer.IsEmpty() || !outer->IsFunction()) return false;
+  Local<Object> slot = Array::New(1);
+  Handle<Value> argv[] = { slot };
+  Local<Value> factory =
+      Local<Function>::Cast(outer)->Call(Context::GetCurrent()->Global(),
+                                         1, argv);
+  if (factory.IsEmpty() || !factory->IsFunction()) return false;
+  gClosureSlot = Persistent<Object>::New(slot);
+  gClosureFactory = Persistent<Function>::New(Local<Function>::Cast(factory));
+  return true;
+}
+
+
+// Closure calling |native| with |record| in the slot
+static Local<Function> NewClosure(Handle<Function> native, void* record) {
+  HandleScope scope;
+  if (gClosureFactory.IsEmpty() && !SetupClosures())
+    return Local<Function>();
+  Handle<Value> argv[] = { native, External::Wrap(record) };
+  Local<Value> closure = gClosureFactory->Call(gClosureFactory, 2, argv);
+  if (closure.IsEmpty()) return Local<Function>(); // e.g. terminating
+  return scope.Close(Local<Function>::Cast(closure));
+}
+
+
+// The record stored by the closure being called
+static inline void* ClosureRecord() {
+  return External::Unwrap(gClosureSlot->Get(0));
+}
+
+// -----------------------------------------------------------------------------
+// Template registry: one template per callback
+
+struct TemplateEntry {
+  InvocationCallback callback;
+  Persistent<FunctionTemplate> tmpl;
+  TemplateEntry* next;
+};
+
+static TemplateEntry** gTemplates = NULL;
+static uint32_t gTemplateMask = 0;  // bucket count - 1
+static void* gCallbackData = NULL;  // data of the innermost callback
+
+static inline uint32_t TemplateHash(InvocationCallback callback) {
+  uintptr_t h = (uintptr_t)callback * 2654435761U;
+  return (uint32_t)(h ^ (h >> 7) ^ (h >> 16));
+}
+
+// Doubles the number of buckets once there are twice as many entries
+static void GrowTemplates() {
+  uint32_t count = gTemplates ? (gTemplateMask + 1) * 2 : 64;
+  TemplateEntry** buckets =
+      (TemplateEntry**)calloc(count, sizeof(TemplateEntry*));
+  for (uint32_t i = 0; gTemplates && i <= gTemplateMask; ++i) {
+    TemplateEntry* e = gTemplates[i];
+    while (e) {
+      TemplateEntry* next = e->next;
+      uint32_t b = TemplateHash(e->callback) & (count - 1);
+      e->next = buckets[b];
+      buckets[b] = e;
+      e = next;
+    }
+  }
+  free(gTemplates);
+  gTemplates = buckets;
+  gTemplateMask = count - 1;
+}
+
+
+// Native side of every callback closure. The template's data is the callback.
+static Handle<Value> CallbackDispatch(const Arguments& args) {
+  InvocationCallback callback =
+      (InvocationCallback)External::Unwrap(args.Data());
+  void* outer = gCallbackData;
+  gCallbackData = ClosureRecord();
+  Handle<Value> result = callback(args);
+  gCallbackData = outer;
+  return result;
+}
+
+
+void* NodeJSFunctionData(const Arguments& args) {
+  return gCallbackData;
+}
+
+
+static Local<Function> NativeFunctionForCallback(InvocationCallback callback) {
+  HandleScope scope;
+  if (!gTemplates) GrowTemplates();
+  uint32_t hash = TemplateHash(callback);
+  for (TemplateEntry* e = gTemplates[hash & gTemplateMask]; e; e = e->next) {
+    if (e->callback == callback) {
+      gPoolStats.templateHits++;
+      return scope.Close(e->tmpl->GetFunction());
+    }
+  }
+  if (gPoolStats.templates >= (gTemplateMask + 1) * 2) GrowTemplates();
+  TemplateEntry* e = new TemplateEntry;
+  e->callback = callback;
+  e->tmpl = Persistent<FunctionTemplate>::New(
+      FunctionTemplate::New(&CallbackDispatch, External::Wrap((void*)callback)));
+  TemplateEntry** bucket = &gTemplates[hash & gTemplateMask];
+  e->next = *bucket;
+  *bucket = e;
+  gPoolStats.templates++;
+  return scope.Close(e->tmpl->GetFunction());
+}
+
+
+Local<Function> NodeJSFunctionWithCallback(InvocationCallback callback,
+                                           void* data) {
+  HandleScope scope;
+  Local<Function> closure =
+      NewClosure(NativeFunctionForCallback(callback), data);
+  if (closure.IsEmpty()) return Local<Function>();
+  return scope.Close(closure);
+}
+
+// -----------------------------------------------------------------------------
+// Block trampolines: block functions are closures around a single native
+// function whose record is a pooled trampoline holding the block. Records are
+// returned to the pool by a weak callback once V8 has collected the closure.
+
+struct Trampoline {
+  NodeJSFunctionBlock block;
+  intptr_t size;     // of |block|, reported to V8 as external memory
+  Trampoline* next;  // free list link
+};
+
+// Heap block layout, as laid down by the blocks ABI
+struct BlockDescriptor {
+  unsigned long reserved;
+  unsigned long size;  // of the block, including its captured variables
+};
+struct BlockLayout {
+  void* isa;
+  int flags;
+  int reserved;
+  void (*invoke)(void*, ...);
+  BlockDescriptor* descriptor;
+};
+
+static const size_t kTrampolineChunk = 256;
+static Trampoline* gFreeTrampolines = NULL;
+static Persistent<Function> gTrampolineNative;
+
+
+static Handle<Value> TrampolineDispatch(const Arguments& args) {
+  Trampoline* t = (Trampoline*)ClosureRecord();
+  assert(t != NULL && t->block != nil);
+  return t->block(args);
+}
+
+
+static void ReclaimTrampoline(Persistent<Value> value, void* data) {
+  Trampoline* t = (Trampoline*)data;
+  NodeJSHeapAdjustExternalMemory(-t->size);
+  [t->block release];
+  t->block = nil;
+  t->next = gFreeTrampolines;
+  gFreeTrampolines = t;
+  gPoolStats.reclaimed++;
+  gPoolStats.live--;
+  value.Dispose();
+  value.Clear();
+}
+
+
+Local<Function> NodeJSFunctionWithBlock(NodeJSFunctionBlock block) {
+  HandleScope scope;
+  if (gTrampolineNative.IsEmpty()) {
+    gTrampolineNative = Persistent<Function>::New(
+        FunctionTemplate::New(&TrampolineDispatch)->GetFunction());
+  }
+  if (!gFreeTrampolines) {
+    Trampoline* chunk =
+        (Trampoline*)calloc(kTrampolineChunk, sizeof(Trampoline));
+    for (size_t i = 0; i < kTrampolineChunk; ++i) {
+      chunk[i].next = gFreeTrampolines;
+      gFreeTrampolines = &chunk[i];
+    }
+    gPoolStats.capacity += kTrampolineChunk;
+  }
+  Trampoline* t = gFreeTrampolines;
+  Local<Function> closure = NewClosure(gTrampolineNative, t);
+  if (closure.IsEmpty()) return Local<Function>();
+  gFreeTrampolines = t->next;
+  t->next = NULL;
+  t->block = [block copy];
+  // the block's captured variables live as long as the closure
+  t->size = (intptr_t)((BlockLayout*)t->block)->descriptor->size;
+  NodeJSHeapAdjustExternalMemory(t->size);
+  Persistent<Value> weak = Persistent<Value>::New(closure);
+  weak.MakeWeak(t, &ReclaimTrampoline);
+  gPoolStats.trampolines++;
+  gPoolStats.live++;
+  return scope.Close(closure);
+}
+
+
+NodeJSFunctionPoolStats NodeJSFunctionPoolStatistics() {
+  return gPoolStats;
+}
+
+
+// -----------------------------------------------------------------------------
+
 @implementation NodeJSFunction
 
 + (NodeJSFunction*)functionFromString:(NSString*)source
@@ -62,6 +365,11 @@ using namespace v8;
   return [[[self alloc] initWithCFunction:funptr data:data] autorelease];
 }
 
++ (NodeJSFunction*)functionWithCallback:(v8::InvocationCallback)callback
+                                   data:(void*)data {
+  return [[[self alloc] initWithCallback:callback data:data] autorelease];
+}
+
 + (NodeJSFunction*)functionWithBlock:(NodeJSFunctionBlock)block {
   return [[[self alloc] initWithBlock:block] autorelease];
 }
@@ -69,6 +377,7 @@ using namespace v8;
 
 - (id)initWithFunction:(v8::Local<v8::Function>)function {
   if ((self = [super init])) {
+    StartCallNotifier();
     assert(function_.IsEmpty());
     HandleScope scope;
     function_ = Persistent<Function>::New(function);
@@ -79,6 +388,7 @@ using namespace v8;
 
 - (id)initWithCFunction:(v8::InvocationCallback)funptr data:(void*)data {
   if ((self = [super init])) {
+    StartCallNotifier();
     assert(function_.IsEmpty());
     HandleScope scope;
     Local<FunctionTemplate> t =
@@ -89,12 +399,20 @@ using namespace v8;
 }
 
 
-static v8::Handle<Value> _InvocationProxy(const Arguments& args) {
-  Local<Value> data = args.Data();
-  assert(!data.IsEmpty());
-  NodeJSFunction* self = (NodeJSFunction*)External::Unwrap(data);
-  assert(self->block_ != nil);
-  return ((NodeJSFunctionBlock)self->block_)(args);
+- (id)initWithCallback:(v8::InvocationCallback)callback data:(void*)data {
+  if ((self = [super init])) {
+    StartCallNotifier();
+    assert(function_.IsEmpty());
+    HandleScope scope;
+    Local<Function> function =
+        NodeJSFunctionWithCallback(callback, data ? data : (void*)self);
+    if (function.IsEmpty()) {
+      [self release];
+      return nil;
+    }
+    function_ = Persistent<Function>::New(function);
+  }
+  return self;
 }
 
 
@@ -102,11 +420,18 @@ static v8::Handle<Value> _InvocationProxy(const Arguments& args) {
   if ((self = [super init])) {
     assert(function_.IsEmpty());
     assert(block_ == nil);
+    StartCallNotifier();
     HandleScope scope;
     block_ = [block copy];
-    Local<FunctionTemplate> t =
-        FunctionTemplate::New(_InvocationProxy, External::Wrap(self));
-    function_ = Persistent<Function>::New(t->GetFunction());
+    // The trampoline keeps its own reference to the block for as long as the
+    // function is reachable from JavaScript, so it's safe to hand out as a
+    // callback.
+    Local<Function> function = NodeJSFunctionWithBlock(block_);
+    if (function.IsEmpty()) {
+      [self release];
+      return nil;
+    }
+    function_ = Persistent<Function>::New(function);
   }
   return self;
 }
@@ -200,6 +525,35 @@ static v8::Handle<Value> _InvocationProxy(const Arguments& args) {
 }
 
 
+- (NodeJSCall*)callAsyncWithArguments:(NSArray*)arguments
+                              timeout:(NSTimeInterval)timeout
+                                queue:(dispatch_queue_t)queue
+                           completion:(NodeJSCallCompletion)completion {
+  NodeJSCall* call = [[NodeJSCall alloc] initWithFunction:self
+                                                arguments:arguments
+                                                  timeout:timeout
+                                                    queue:queue
+                                               completion:completion];
+  EnqueueCall(call);
+  if (timeout > 0) {
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW,
+                                 (int64_t)(timeout * NSEC_PER_SEC)),
+                   dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0),
+                   ^{ [call _cancelWithCode:NodeJSCallTimeoutError]; });
+  }
+  return [call autorelease];
+}
+
+
+- (NodeJSCall*)callAsyncWithArguments:(NSArray*)arguments
+                           completion:(NodeJSCallCompletion)completion {
+  return [self callAsyncWithArguments:arguments
+                              timeout:0
+                                queue:NULL
+                           completion:completion];
+}
+
+
 - (NSString*)description {
   if (!function_.IsEmpty())
     return [NSString stringWithV8String:function_->ToString()];
@@ -208,3 +562,192 @@ static v8::Handle<Value> _InvocationProxy(const Arguments& args) {
 }
 
 @end
+
+
+// -----------------------------------------------------------------------------
+
+static NSError* CancelError(int code) {
+  NSString* description = code == NodeJSCallTimeoutError ?
+      @"call timed out" : @"call cancelled";
+  return [NSError errorWithDomain:(NSString*)NodeJSNSErrorDomain code:code
+      userInfo:[NSDictionary dictionaryWithObject:description
+                                           forKey:NSLocalizedDescriptionKey]];
+}
+
+
+@implementation NodeJSCall
+
+- (id)initWithFunction:(NodeJSFunction*)function
+             arguments:(NSArray*)arguments
+               timeout:(NSTimeInterval)timeout
+                 queue:(dispatch_queue_t)queue
+            completion:(NodeJSCallCompletion)completion {
+  if ((self = [super init])) {
+    function_ = [function retain];
+    arguments_ = [arguments copy];
+    timeout_ = timeout;
+    queue_ = queue ? queue : dispatch_get_main_queue();
+    dispatch_retain(queue_);
+    completion_ = [completion copy];
+    condition_ = [NSCondition new];
+  }
+  return self;
+}
+
+
+- (void)dealloc {
+  [function_ release];
+  [arguments_ release];
+  dispatch_release(queue_);
+  [completion_ release];
+  [result_ release];
+  [error_ release];
+  [condition_ release];
+  [super dealloc];
+}
+
+
+- (BOOL)isFinished {
+  [condition_ lock];
+  BOOL finished = state_ == kCallDone;
+  [condition_ unlock];
+  return finished;
+}
+
+
+- (BOOL)isCancelled {
+  return cancelCode_ != 0;
+}
+
+
+- (id)result {
+  [condition_ lock];
+  id result = [[result_ retain] autorelease];
+  [condition_ unlock];
+  return result;
+}
+
+
+- (NSError*)error {
+  [condition_ lock];
+  NSError* error = [[error_ retain] autorelease];
+  [condition_ unlock];
+  return error;
+}
+
+
+- (void)_finishWithResult:(id)result error:(NSError*)error {
+  [condition_ lock];
+  result_ = [result retain];
+  error_ = [error retain];
+  state_ = kCallDone;
+  [condition_ broadcast];
+  [condition_ unlock];
+  if (completion_) {
+    NodeJSCallCompletion completion = completion_;
+    dispatch_async(queue_, ^{ completion(result, error); });
+  }
+}
+
+
+- (BOOL)waitUntilFinished:(NSTimeInterval)timeout {
+  NSDate* deadline = [NSDate dateWithTimeIntervalSinceNow:timeout];
+  [condition_ lock];
+  while (state_ != kCallDone) {
+    if (![condition_ waitUntilDate:deadline]) break;
+  }
+  BOOL finished = state_ == kCallDone;
+  [condition_ unlock];
+  return finished;
+}
+
+
+- (void)cancel {
+  [self _cancelWithCode:NodeJSCallCancelledError];
+}
+
+
+- (void)_cancelWithCode:(int)code {
+  // The state and gRunningCall change together under gCallLock (see _run), so
+  // the call is either still queued or known to be running
+  NodeJSSpinLockLock(&gCallLock);
+  BOOL queued =
+      NodeJSAtomicCompareAndSwap32(kCallQueued, kCallRunning, &state_);
+  if (queued) {
+    // not started yet: it never will
+    cancelCode_ = code;
+  } else if (gRunningCall == self && !cancelCode_) {
+    // running: terminate the script
+    cancelCode_ = code;
+    gTerminating = YES;
+    V8::TerminateExecution();
+  }
+  NodeJSSpinLockUnlock(&gCallLock);
+  if (queued)
+    [self _finishWithResult:nil error:CancelError(code)];
+}
+
+
+// Runs on the node thread
+- (void)_run {
+  if (state_ != kCallQueued)
+    return; // cancelled while queued
+
+  HandleScope scope;
+  NSUInteger argc = [arguments_ count];
+  Handle<Value>* argv = new Handle<Value>[argc];
+  for (NSUInteger i = 0; i < argc; ++i) {
+    argv[i] = [[arguments_ objectAtIndex:i] v8Value];
+    if (argv[i].IsEmpty()) argv[i] = Undefined();
+  }
+
+  // From here on a cancel terminates the script
+  NodeJSSpinLockLock(&gCallLock);
+  BOOL started =
+      NodeJSAtomicCompareAndSwap32(kCallQueued, kCallRunning, &state_);
+  if (started) gRunningCall = self;
+  NodeJSSpinLockUnlock(&gCallLock);
+  if (!started) {
+    delete[] argv;
+    return; // cancelled while converting arguments
+  }
+
+  Local<Value> result;
+  bool canContinue = true;
+  {
+    TryCatch try_catch;
+    Local<Function> fun = Local<Function>::New([function_ function]);
+    result = fun->Call(fun, (int)argc, argv);
+    NodeJSSpinLockLock(&gCallLock);
+    gRunningCall = nil;
+    bool terminating = gTerminating;
+    gTerminating = NO;
+    NodeJSSpinLockUnlock(&gCallLock);
+    canContinue = try_catch.CanContinue();
+
+    if (terminating && canContinue) {
+      // The script returned just before it could be terminated. Let the
+      // pending termination hit a throw-away script rather than whatever
+      // JavaScript runs next.
+      TryCatch drain;
+      v8::Script::Compile(String::New("(function(){})()"))->Run();
+    }
+
+    if (cancelCode_) {
+      [self _finishWithResult:nil error:CancelError(cancelCode_)];
+    } else if (result.IsEmpty()) {
+      // formatted now, as the completion runs on another queue
+      NodeJSErrorDetail detail =
+          [NodeJS errorDetail] == NodeJSErrorDetailMessage ?
+              NodeJSErrorDetailMessage : NodeJSErrorDetailFull;
+      [self _finishWithResult:nil error:canContinue && try_catch.HasCaught() ?
+          [NSError errorFromV8TryCatch:try_catch detail:detail] :
+          [NSError nodeErrorWithLocalizedDescription:@"execution terminated"]];
+    } else {
+      [self _finishWithResult:[NSObject fromV8Value:result] error:nil];
+    }
+  }
+  delete[] argv;
+}
+
+@end
@@ -0,0 +1,110 @@
+#ifndef NODECOCOA_NODEJS_HEAP_H_
+#define NODECOCOA_NODEJS_HEAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#import <NodeCocoa/node.h>
+#import <NodeCocoa/NodeJSLoop.h>
+
+/**
+ * V8 heap management for long-running hosts.
+ *
+ * - Limits: |NodeJSHeapSetLimits| configures V8's resource constraints. It
+ *   must be called before node starts (i.e. before NodeJSApplicationMain).
+ *
+ * - Idle-time collection: the host loop tells V8 when it has been idle for
+ *   |NodeJSHeapIdleDelay| seconds (V8::IdleNotification), so garbage is
+ *   collected while nothing is happening rather than in the middle of work.
+ *   NodeJSApplicationMain's loop and NodeThread do this; other hosts can drive
+ *   it with |NodeJSHeapIdleCheck|.
+ *
+ * - Statistics: heap sizes and garbage collection pauses, reported by
+ *   |NodeJSHeapStatistics| and passed to callbacks after every collection.
+ *
+ * - External memory: native memory kept alive by JavaScript objects (the
+ *   blocks of block functions, buffers) is reported to V8 through
+ *   |NodeJSHeapAdjustExternalMemory|, so it counts towards the next
+ *   collection.
+ *
+ * - Handle disposal: native objects which hold persistent handles but may be
+ *   released on any thread hand them to |NodeJSHeapDisposeHandle|, which
+ *   disposes of them on the node thread.
+ */
+
+/// Heap limits, in bytes. Zero leaves V8's default.
+typedef struct {
+  size_t maxYoungSpaceSize;  // new space (scavenged)
+  size_t maxOldSpaceSize;    // old space (mark-sweep/compact)
+} NodeJSHeapLimits;
+
+/// Counters reported by |NodeJSHeapStatistics|.
+typedef struct {
+  size_t totalHeapSize;        // bytes reserved by V8's heap
+  size_t usedHeapSize;         // ... of which are in use
+  int64_t externalMemory;      // bytes reported as external memory
+  uint64_t scavenges;          // young generation collections
+  uint64_t markSweeps;         // full collections
+  uint64_t idleNotifications;  // calls to V8::IdleNotification
+  uint64_t idleCompletions;    // ... after which V8 had no more idle work
+  NodeJSHistogram pauseTime;   // duration of each collection
+} NodeJSHeapStats;
+
+/**
+ * Called on the node thread after every garbage collection. Must not use V8
+ * (the collector is still running).
+ */
+typedef void (*NodeJSHeapCallback)(const NodeJSHeapStats* stats, void* data);
+
+/**
+ * Apply |limits| to V8. Returns false if V8 rejected them or is already
+ * running.
+ */
+bool NodeJSHeapSetLimits(const NodeJSHeapLimits* limits);
+
+/// Seconds of host idleness before V8 is told to collect garbage. Defaults to
+/// 1. Zero disables idle-time collection.
+void NodeJSHeapSetIdleDelay(double seconds);
+double NodeJSHeapIdleDelay();
+
+/**
+ * Idle-time collection for host loops. Call on the node thread after each
+ * iteration of the host loop, passing whether anything happened (an event or
+ * a pump of node). Returns the longest the host should wait for the next event
+ * before calling again, or a negative number for no limit.
+ */
+double NodeJSHeapIdleCheck(bool busy);
+
+/**
+ * Add |change| bytes (negative to subtract) to the external memory reported
+ * to V8. Can be called from any thread -- changes made off the node thread
+ * are handed to V8 the next time the node thread reports or checks idleness.
+ */
+void NodeJSHeapAdjustExternalMemory(intptr_t change);
+
+/**
+ * Dispose of |handle| on the node thread: right away when called on it,
+ * otherwise from an ev_async wakeup of node's loop (so it works for any host,
+ * including NodeThread). Can be called from any thread.
+ */
+void NodeJSHeapDisposeHandle(v8::Persistent<v8::Value> handle);
+
+/// True if called on the node thread (once NodeJSHeapAttach has been called).
+bool NodeJSHeapOnNodeThread();
+
+/// Register |callback|. At most 8 callbacks can be registered.
+bool NodeJSHeapAddCallback(NodeJSHeapCallback callback, void* data);
+void NodeJSHeapRemoveCallback(NodeJSHeapCallback callback, void* data);
+
+/// Current counters. Node thread only.
+NodeJSHeapStats NodeJSHeapStatistics();
+
+/// Reset counters to zero (heap sizes and external memory are not counters).
+void NodeJSHeapResetStatistics();
+
+/**
+ * Start collecting statistics. Called on the node thread once V8 is running
+ * (NodeJSAttachToCurrentContext and NodeThread do this).
+ */
+void NodeJSHeapAttach();
+
+#endif // NODECOCOA_NODEJS_HEAP_H_
@@ -0,0 +1,237 @@
+#import "NodeJSHeap.h"
+#import <node.h>
+#import <ev.h>
+#import "NodeJSAtomic.h"
+#include <limits.h>
+#include <pthread.h>
+
+using namespace v8;
+
+// While V8 still has idle work, notify it this often
+static const double kIdleNotificationInterval = 0.1;
+static const int kMaxCallbacks = 8;
+
+enum {
+  kIdleWaiting,     // host was busy; notify once it's been idle long enough
+  kIdleCollecting,  // V8 has more idle work
+  kIdleDone,        // V8 is done until the host gets busy again
+};
+
+static NodeJSHeapStats gStats;
+static double gIdleDelay = 1.0;
+static int gIdleState = kIdleWaiting;
+static double gGCStart = 0;
+
+static volatile int64_t gExternalMemory = 0;
+static volatile int64_t gPendingExternalMemory = 0;  // not yet told to V8
+static pthread_t gNodeThread;
+static bool gAttached = false;
+
+struct CallbackEntry {
+  NodeJSHeapCallback callback;
+  void* data;
+};
+static CallbackEntry gCallbacks[kMaxCallbacks];
+static int gCallbackCount = 0;
+
+// Handles released off the node thread, waiting to be disposed of (a
+// lock-free stack)
+struct PendingDisposal {
+  Persistent<Value> handle;
+  PendingDisposal* next;
+};
+static PendingDisposal* volatile gPendingDisposals = NULL;
+static ev_async gDisposalNotifier;
+
+
+bool NodeJSHeapSetLimits(const NodeJSHeapLimits* limits) {
+  ResourceConstraints constraints;
+  if (limits->maxYoungSpaceSize)
+    constraints.set_max_young_space_size((int)limits->maxYoungSpaceSize);
+  if (limits->maxOldSpaceSize)
+    constraints.set_max_old_space_size((int)limits->maxOldSpaceSize);
+  return SetResourceConstraints(&constraints);
+}
+
+
+void NodeJSHeapSetIdleDelay(double seconds) {
+  gIdleDelay = seconds > 0 ? seconds : 0;
+}
+
+
+double NodeJSHeapIdleDelay() {
+  return gIdleDelay;
+}
+
+
+// V8 takes an int, so large changes are handed over in pieces
+static void AdjustV8ExternalMemory(int64_t change) {
+  while (change) {
+    int piece = (int)MAX(MIN(change, (int64_t)INT_MAX), (int64_t)-INT_MAX);
+    V8::AdjustAmountOfExternalAllocatedMemory(piece);
+    change -= piece;
+  }
+}
+
+
+// Hand changes made on other threads to V8. Node thread only.
+static void FlushExternalMemory() {
+  int64_t pending = gPendingExternalMemory;
+  if (!pending) return;
+  NodeJSAtomicAdd64(-pending, &gPendingExternalMemory);
+  AdjustV8ExternalMemory(pending);
+}
+
+
+double NodeJSHeapIdleCheck(bool busy) {
+  FlushExternalMemory();
+  if (gIdleDelay <= 0) return -1;
+  if (busy) {
+    gIdleState = kIdleWaiting;
+    return gIdleDelay;
+  }
+  if (gIdleState == kIdleDone) return -1;
+  // idle for the whole wait
+  gStats.idleNotifications++;
+  if (V8::IdleNotification()) {
+    gStats.idleCompletions++;
+    gIdleState = kIdleDone;
+    return -1;
+  }
+  gIdleState = kIdleCollecting;
+  return MIN(kIdleNotificationInterval, gIdleDelay);
+}
+
+
+static bool OnNodeThread() {
+  return gAttached && pthread_equal(pthread_self(), gNodeThread);
+}
+
+
+bool NodeJSHeapOnNodeThread() {
+  return OnNodeThread();
+}
+
+
+// Node thread only
+static void DisposePending() {
+  PendingDisposal* p;
+  do {
+    p = gPendingDisposals;
+  } while (p && !NodeJSAtomicCompareAndSwapPtr(
+      p, NULL, (void* volatile*)&gPendingDisposals));
+  while (p) {
+    PendingDisposal* next = p->next;
+    p->handle.Dispose();
+    delete p;
+    p = next;
+  }
+}
+
+
+static void DisposalNotified(EV_P_ ev_async* watcher, int revents) {
+  DisposePending();
+}
+
+
+void NodeJSHeapDisposeHandle(Persistent<Value> handle) {
+  if (handle.IsEmpty()) return;
+  if (OnNodeThread()) {
+    handle.Dispose();
+    return;
+  }
+  PendingDisposal* p = new PendingDisposal;
+  p->handle = handle;
+  do {
+    p->next = gPendingDisposals;
+  } while (!NodeJSAtomicCompareAndSwapPtr(
+      p->next, p, (void* volatile*)&gPendingDisposals));
+  // before attaching, NodeJSHeapAttach takes care of them
+  if (gAttached)
+    ev_async_send(EV_DEFAULT_UC_ &gDisposalNotifier);
+}
+
+
+void NodeJSHeapAdjustExternalMemory(intptr_t change) {
+  NodeJSAtomicAdd64(change, &gExternalMemory);
+  if (OnNodeThread()) {
+    FlushExternalMemory();
+    AdjustV8ExternalMemory(change);
+  } else {
+    NodeJSAtomicAdd64(change, &gPendingExternalMemory);
+  }
+}
+
+
+bool NodeJSHeapAddCallback(NodeJSHeapCallback callback, void* data) {
+  if (gCallbackCount == kMaxCallbacks) return false;
+  gCallbacks[gCallbackCount].callback = callback;
+  gCallbacks[gCallbackCount].data = data;
+  gCallbackCount++;
+  return true;
+}
+
+
+void NodeJSHeapRemoveCallback(NodeJSHeapCallback callback, void* data) {
+  for (int i = 0; i < gCallbackCount; ++i) {
+    if (gCallbacks[i].callback == callback && gCallbacks[i].data == data) {
+      gCallbacks[i] = gCallbacks[--gCallbackCount];
+      return;
+    }
+  }
+}
+
+
+static void UpdateHeapSizes(NodeJSHeapStats* stats) {
+  HeapStatistics heap;
+  V8::GetHeapStatistics(&heap);
+  stats->totalHeapSize = heap.total_heap_size();
+  stats->usedHeapSize = heap.used_heap_size();
+  stats->externalMemory = gExternalMemory;
+}
+
+
+NodeJSHeapStats NodeJSHeapStatistics() {
+  UpdateHeapSizes(&gStats);
+  return gStats;
+}
+
+
+void NodeJSHeapResetStatistics() {
+  gStats.scavenges = gStats.markSweeps = 0;
+  gStats.idleNotifications = gStats.idleCompletions = 0;
+  memset(&gStats.pauseTime, 0, sizeof(gStats.pauseTime));
+}
+
+
+static void GCPrologue(GCType type, GCCallbackFlags flags) {
+  gGCStart = NodeJSLoopNow();
+}
+
+
+static void GCEpilogue(GCType type, GCCallbackFlags flags) {
+  NodeJSHistogramAdd(&gStats.pauseTime, NodeJSLoopNow() - gGCStart);
+  if (type == kGCTypeScavenge)
+    gStats.scavenges++;
+  else
+    gStats.markSweeps++;
+  if (!gCallbackCount) return;
+  UpdateHeapSizes(&gStats);
+  for (int i = 0; i < gCallbackCount; ++i)
+    gCallbacks[i].callback(&gStats, gCallbacks[i].data);
+}
+
+
+void NodeJSHeapAttach() {
+  assert(!gAttached);
+  // pending disposals alone don't keep node alive
+  ev_async_init(&gDisposalNotifier, &DisposalNotified);
+  ev_async_start(EV_DEFAULT_UC_ &gDisposalNotifier);
+  ev_unref(EV_DEFAULT_UC);
+  gNodeThread = pthread_self();
+  gAttached = true;
+  V8::AddGCPrologueCallback(&GCPrologue);
+  V8::AddGCEpilogueCallback(&GCEpilogue);
+  FlushExternalMemory();
+  DisposePending();
+}
@@ -0,0 +1,50 @@
+#ifndef NODECOCOA_NODEJS_INTERN_TABLE_H_
+#define NODECOCOA_NODEJS_INTERN_TABLE_H_
+
+#import <NodeCocoa/node.h>
+
+/**
+ * The intern table maps short strings (e.g. dictionary keys and property names)
+ * to a V8 symbol and an immutable NSString, both created once. Converting a
+ * key in either direction is then a table lookup rather than a transcode and
+ * an allocation, which makes converting homogeneous records (many objects
+ * sharing the same keys) allocation-free after warm-up.
+ *
+ * |-[NSDictionary v8Value]| and |+[NSObject fromV8Value:]| intern keys.
+ *
+ * Strings longer than 64 characters are never interned. Once the table holds
+ * |capacity| entries, new keys are converted the old way (and counted as
+ * |bypasses|).
+ *
+ * Note: The table is not thread safe and must only be used from the node
+ * thread.
+ */
+
+/// Counters reported by |NodeJSInternTableStatistics|.
+typedef struct {
+  uint64_t hits;      // conversions served by an existing entry
+  uint64_t misses;    // conversions which created a new entry
+  uint64_t bypasses;  // conversions which allocated a non-interned string
+  NSUInteger count;   // number of entries
+  NSUInteger capacity;
+} NodeJSInternTableStats;
+
+/// Returns the V8 symbol for |str|.
+v8::Local<v8::String> NodeJSInternedSymbol(NSString* str);
+
+/// Returns the immutable NSString for |str| (not retained).
+NSString* NodeJSInternedString(v8::Local<v8::String> str);
+
+/// Current counters.
+NodeJSInternTableStats NodeJSInternTableStatistics();
+
+/// Reset counters to zero, keeping entries.
+void NodeJSInternTableResetStatistics();
+
+/// Remove all entries (and reset counters).
+void NodeJSInternTableClear();
+
+/// Set the maximum number of entries (default 4096). Clears the table.
+void NodeJSInternTableSetCapacity(NSUInteger capacity);
+
+#endif // NODECOCOA_NODEJS_INTERN_TABLE_H_
@@ -0,0 +1,148 @@
+#import "NodeJSInternTable.h"
+
+using namespace v8;
+
+static const int kMaxLength = 64;
+
+struct InternEntry {
+  uint32_t hash;
+  int length;
+  uint16_t* chars;
+  NSString* string;
+  Persistent<String> symbol;
+  InternEntry* chain;
+};
+
+static InternEntry** gBuckets = NULL;
+static NSUInteger gBucketMask = 0;
+static NodeJSInternTableStats gStats = {0, 0, 0, 0, 4096};
+
+
+// 32-bit FNV-1a over UTF-16 code units
+static inline uint32_t HashChars(const uint16_t* chars, int length) {
+  uint32_t h = 2166136261U;
+  for (int i = 0; i < length; ++i) {
+    h ^= chars[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+
+static InternEntry* Lookup(const uint16_t* chars, int length, uint32_t hash) {
+  if (!gBuckets) return NULL;
+  InternEntry* entry = gBuckets[hash & gBucketMask];
+  while (entry) {
+    if (entry->hash == hash && entry->length == length &&
+        memcmp(entry->chars, chars, length * sizeof(uint16_t)) == 0) {
+      return entry;
+    }
+    entry = entry->chain;
+  }
+  return NULL;
+}
+
+
+// Add an entry, or return NULL if the table is full
+static InternEntry* Insert(const uint16_t* chars, int length, uint32_t hash) {
+  if (gStats.count >= gStats.capacity) return NULL;
+  if (!gBuckets) {
+    NSUInteger nbuckets = 16;
+    while (nbuckets < gStats.capacity) nbuckets <<= 1;
+    gBuckets = (InternEntry**)calloc(nbuckets, sizeof(InternEntry*));
+    gBucketMask = nbuckets - 1;
+  }
+  InternEntry* entry = new InternEntry;
+  entry->hash = hash;
+  entry->length = length;
+  entry->chars = (uint16_t*)malloc(length * sizeof(uint16_t));
+  memcpy(entry->chars, chars, length * sizeof(uint16_t));
+  entry->string = [[NSString alloc] initWithCharacters:chars length:length];
+  entry->symbol = Persistent<String>::New(
+      String::NewSymbol([entry->string UTF8String]));
+  InternEntry** bucket = &gBuckets[hash & gBucketMask];
+  entry->chain = *bucket;
+  *bucket = entry;
+  gStats.count++;
+  return entry;
+}
+
+
+Local<String> NodeJSInternedSymbol(NSString* str) {
+  CFIndex length = CFStringGetLength((CFStringRef)str);
+  if (length <= kMaxLength) {
+    uint16_t chars[kMaxLength];
+    CFStringGetCharacters((CFStringRef)str, CFRangeMake(0, length), chars);
+    uint32_t hash = HashChars(chars, length);
+    InternEntry* entry = Lookup(chars, length, hash);
+    if (entry) {
+      gStats.hits++;
+      return Local<String>::New(entry->symbol);
+    }
+    if ((entry = Insert(chars, length, hash))) {
+      gStats.misses++;
+      return Local<String>::New(entry->symbol);
+    }
+  }
+  gStats.bypasses++;
+  return String::New([str UTF8String]);
+}
+
+
+NSString* NodeJSInternedString(Local<String> str) {
+  int length = str->Length();
+  if (length <= kMaxLength) {
+    uint16_t chars[kMaxLength];
+    str->Write(chars, 0, length);
+    uint32_t hash = HashChars(chars, length);
+    InternEntry* entry = Lookup(chars, length, hash);
+    if (entry) {
+      gStats.hits++;
+      return entry->string;
+    }
+    if ((entry = Insert(chars, length, hash))) {
+      gStats.misses++;
+      return entry->string;
+    }
+  }
+  gStats.bypasses++;
+  String::Utf8Value utf8(str);
+  return [NSString stringWithUTF8String:*utf8];
+}
+
+
+NodeJSInternTableStats NodeJSInternTableStatistics() {
+  return gStats;
+}
+
+
+void NodeJSInternTableResetStatistics() {
+  gStats.hits = gStats.misses = gStats.bypasses = 0;
+}
+
+
+void NodeJSInternTableClear() {
+  if (gBuckets) {
+    for (NSUInteger i = 0; i <= gBucketMask; ++i) {
+      InternEntry* entry = gBuckets[i];
+      while (entry) {
+        InternEntry* next = entry->chain;
+        free(entry->chars);
+        [entry->string release];
+        entry->symbol.Dispose();
+        delete entry;
+        entry = next;
+      }
+    }
+    free(gBuckets);
+    gBuckets = NULL;
+  }
+  gStats.count = 0;
+  NodeJSInternTableResetStatistics();
+}
+
+
+void NodeJSInternTableSetCapacity(NSUInteger capacity) {
+  NodeJSInternTableClear();
+  gStats.capacity = capacity;
+}
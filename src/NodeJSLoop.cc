@@ -0,0 +1,231 @@
+#include "NodeJSLoop.h"
+#include <ev.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+static NodeJSLoopHost gHost;
+static NodeJSLoopStats gStats;
+static double gBudget = 0.008;
+static double gLastPumpEnd = 0;
+static bool gPumping = false;
+static double gReadyTime = 0;      // when the host noticed the fd readable
+static double gTimerDeadline = 0;  // when libev's next timeout is due, or 0
+static bool gNestedPump = false;       // pump requested while pumping
+static bool gNestedReadiness = false;  // ... by the backend fd
+static double gNestedReadyTime = 0;    // ... which was readable since then
+
+
+double NodeJSLoopNow() {
+#ifdef __APPLE__
+  static mach_timebase_info_data_t timebase;
+  if (!timebase.denom) mach_timebase_info(&timebase);
+  return (double)mach_absolute_time() * timebase.numer / timebase.denom / 1e9;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+
+void NodeJSHistogramAdd(NodeJSHistogram* histogram, double seconds) {
+  if (histogram->count == 0 || seconds < histogram->min)
+    histogram->min = seconds;
+  if (seconds > histogram->max)
+    histogram->max = seconds;
+  histogram->count++;
+  histogram->sum += seconds;
+  double us = seconds * 1e6;
+  int bucket = 0;
+  if (us >= 2.0) {
+    bucket = ilogb(us);
+    if (bucket >= NODEJS_HISTOGRAM_BUCKETS)
+      bucket = NODEJS_HISTOGRAM_BUCKETS - 1;
+  }
+  histogram->buckets[bucket]++;
+}
+
+
+double NodeJSHistogramPercentile(const NodeJSHistogram* histogram, double p) {
+  if (histogram->count == 0) return 0;
+  uint64_t rank = (uint64_t)ceil(p * histogram->count);
+  uint64_t seen = 0;
+  for (int i = 0; i < NODEJS_HISTOGRAM_BUCKETS; ++i) {
+    seen += histogram->buckets[i];
+    if (seen >= rank && seen > 0) {
+      double upper = ldexp(1.0, i + 1) / 1e6;
+      return upper < histogram->max ? upper : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+
+
+// Replaces libev's invocation of pending watchers to account for time spent in
+// callbacks (which is where JavaScript runs)
+static void InvokePending(EV_P) {
+  unsigned int count = ev_pending_count(EV_A);
+  if (!count) return;
+  gStats.dispatched += count;
+  double start = NodeJSLoopNow();
+  if (gReadyTime != 0) {
+    NodeJSHistogramAdd(&gStats.readinessLatency, start - gReadyTime);
+    gReadyTime = 0;
+  }
+  ev_invoke_pending(EV_A);
+  gStats.jsTime += NodeJSLoopNow() - start;
+}
+
+
+static void Pump(bool readiness, double readyTime) {
+  if (gPumping) {
+    // re-entered from a callback (e.g. a nested host loop) -- come back later.
+    // The outer pump reschedules and rearms once it's done.
+    gNestedPump = true;
+    if (readiness && !gNestedReadiness) {
+      gNestedReadiness = true;
+      gNestedReadyTime = readyTime;
+    }
+    gHost.schedule(gHost.data, 0);
+    return;
+  }
+  gPumping = true;
+  double start = NodeJSLoopNow();
+  if (gLastPumpEnd != 0)
+    gStats.hostTime += start - gLastPumpEnd;
+  if (readiness) {
+    gReadyTime = readyTime;
+  } else if (gTimerDeadline != 0) {
+    double lateness = start - gTimerDeadline;
+    NodeJSHistogramAdd(&gStats.timerLateness, lateness > 0 ? lateness : 0);
+  }
+  uint64_t dispatched = gStats.dispatched;
+  bool yielded = false;
+
+  // Run once. Additional passes are only needed while there are fd changes
+  // which haven't reached the kernel yet (they are applied at the start of
+  // the next iteration), since we won't be notified about those fds otherwise.
+  ev_now_update();
+  for (;;) {
+    ev_run(EV_DEFAULT_UC_ EVLOOP_NONBLOCK);
+    gStats.iterations++;
+    if (ev_loop_fdchangecount() == 0)
+      break;
+    if (NodeJSLoopNow() - start >= gBudget) {
+      yielded = true;
+      break;
+    }
+  }
+
+  gStats.pumps++;
+  if (readiness) gStats.readinessPumps++;
+  if (gStats.dispatched == dispatched) gStats.emptyPumps++;
+  if (yielded) gStats.yields++;
+  gLastPumpEnd = NodeJSLoopNow();
+  gStats.pumpTime += gLastPumpEnd - start;
+  gPumping = false;
+  // latency of a nested readiness is measured by the pump scheduled for it
+  gReadyTime = gNestedReadyTime;
+  bool nested = gNestedPump;
+  if (gNestedReadiness) readiness = true;
+  gNestedPump = gNestedReadiness = false;
+  gNestedReadyTime = 0;
+
+  gTimerDeadline = 0;
+  if (ev_refcount(EV_DEFAULT_UC) == 0) {
+    gHost.schedule(gHost.data, -1);
+    if (gHost.exhausted) gHost.exhausted(gHost.data);
+  } else if (yielded || nested) {
+    gHost.schedule(gHost.data, 0);
+  } else {
+    double waittime = ev_loop_next_waittime(EV_DEFAULT_UC);
+    gTimerDeadline = gLastPumpEnd + waittime;
+    gHost.schedule(gHost.data, waittime);
+  }
+  if (readiness && gHost.rearm)
+    gHost.rearm(gHost.data);
+}
+
+
+void NodeJSLoopStart(const NodeJSLoopHost* host) {
+  gHost = *host;
+  ev_set_invoke_pending_cb(EV_DEFAULT_UC_ &InvokePending);
+  Pump(false, 0);
+  gHost.watch(gHost.data, ev_backend_fd());
+}
+
+
+void NodeJSLoopBackendReady(double readyTime) {
+  Pump(true, readyTime);
+}
+
+
+void NodeJSLoopPump() {
+  Pump(false, 0);
+}
+
+
+void NodeJSLoopSetPumpBudget(double seconds) {
+  gBudget = seconds;
+}
+
+
+double NodeJSLoopPumpBudget() {
+  return gBudget;
+}
+
+
+NodeJSLoopStats NodeJSLoopStatistics() {
+  return gStats;
+}
+
+
+void NodeJSLoopResetStatistics() {
+  memset(&gStats, 0, sizeof(gStats));
+}
+
+// -----------------------------------------------------------------------------
+// poll(2) host
+
+struct PollHost {
+  int fd;
+  double deadline;  // < 0 if none
+};
+
+
+static void PollWatch(void* data, int fd) {
+  ((PollHost*)data)->fd = fd;
+}
+
+
+static void PollSchedule(void* data, double delay) {
+  ((PollHost*)data)->deadline = delay < 0 ? -1 : NodeJSLoopNow() + delay;
+}
+
+
+void NodeJSLoopRunWithPoll() {
+  PollHost poller = { -1, -1 };
+  NodeJSLoopHost host = { &poller, &PollWatch, NULL, &PollSchedule, NULL };
+  NodeJSLoopStart(&host);
+  while (ev_refcount(EV_DEFAULT_UC)) {
+    int timeout = -1;
+    if (poller.deadline >= 0) {
+      double remaining = poller.deadline - NodeJSLoopNow();
+      timeout = remaining <= 0 ? 0 : (int)ceil(remaining * 1000.0);
+    }
+    struct pollfd pfd = { poller.fd, POLLIN, 0 };
+    int n = poll(&pfd, 1, timeout);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n > 0)
+      NodeJSLoopBackendReady(NodeJSLoopNow());
+    else
+      NodeJSLoopPump();
+  }
+}
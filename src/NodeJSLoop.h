@@ -0,0 +1,114 @@
+#ifndef NODECOCOA_NODEJS_LOOP_H_
+#define NODECOCOA_NODEJS_LOOP_H_
+
+#include <stdint.h>
+
+/**
+ * Integration of node's event loop (libev) into a host event loop.
+ *
+ * The host watches libev's backend fd (kqueue, epoll, ...) and keeps a single
+ * timer. When the fd becomes readable it calls |NodeJSLoopBackendReady|, when
+ * the timer fires it calls |NodeJSLoopPump|. Each call runs libev once, plus
+ * a few extra non-blocking passes only while fd changes are waiting to be
+ * handed to the kernel, and never for longer than the pump budget. After a
+ * pump the host is asked to reschedule its timer: immediately if the pump ran
+ * out of budget (so host events get a chance to run in between), otherwise for
+ * libev's next timeout.
+ *
+ * NodeJSApplicationMain uses a CFRunLoop-based host. |NodeJSLoopRunWithPoll|
+ * runs node with a plain poll(2) host, which works anywhere libev does.
+ *
+ * Note: Only to be used from the thread running node.
+ */
+
+/// Callbacks implemented by the host loop.
+typedef struct {
+  void* data;  // passed to the callbacks
+
+  // Start watching |fd| for readability.
+  void (*watch)(void* data, int fd);
+
+  // Optional: re-enable one-shot readability notifications after a pump.
+  void (*rearm)(void* data);
+
+  // Call NodeJSLoopPump() in |delay| seconds, replacing any earlier request.
+  // A negative |delay| cancels the timer.
+  void (*schedule)(void* data, double delay);
+
+  // Optional: node has no more active watchers (the host might want to exit).
+  void (*exhausted)(void* data);
+} NodeJSLoopHost;
+
+/// Number of buckets in a NodeJSHistogram.
+#define NODEJS_HISTOGRAM_BUCKETS 32
+
+/**
+ * Histogram of durations. Bucket 0 counts durations below 2 microseconds and
+ * bucket N (N > 0) counts durations in [2^N, 2^(N+1)) microseconds, the last
+ * bucket also counting anything longer.
+ */
+typedef struct {
+  uint64_t count;
+  double sum;  // seconds
+  double min;
+  double max;
+  uint64_t buckets[NODEJS_HISTOGRAM_BUCKETS];
+} NodeJSHistogram;
+
+/// Record a duration of |seconds|.
+void NodeJSHistogramAdd(NodeJSHistogram* histogram, double seconds);
+
+/**
+ * Estimate the |p| (0..1) percentile, in seconds. Returns the upper bound of
+ * the bucket containing the percentile (clamped to |max|) or 0 if empty.
+ */
+double NodeJSHistogramPercentile(const NodeJSHistogram* histogram, double p);
+
+/// Counters reported by |NodeJSLoopStatistics|.
+typedef struct {
+  uint64_t pumps;           // calls to BackendReady or Pump which ran libev
+  uint64_t readinessPumps;  // ... of which were triggered by the backend fd
+  uint64_t emptyPumps;      // pumps which didn't dispatch any watcher
+  uint64_t iterations;      // non-blocking libev iterations
+  uint64_t yields;          // pumps which ran out of budget
+  uint64_t dispatched;      // watcher callbacks invoked
+  double jsTime;            // seconds spent in watcher callbacks (i.e. JS)
+  double pumpTime;          // seconds spent pumping, including |jsTime|
+  double hostTime;          // seconds between pumps (host work and idling)
+  NodeJSHistogram readinessLatency;  // backend fd readiness to first callback
+  NodeJSHistogram timerLateness;     // timer pumps relative to libev's timeout
+} NodeJSLoopStats;
+
+/**
+ * Install |host| (copied) and pump once so that the kernel state is up to date,
+ * then start watching the backend fd.
+ */
+void NodeJSLoopStart(const NodeJSLoopHost* host);
+
+/**
+ * To be called by the host when the backend fd is readable. |readyTime| is
+ * NodeJSLoopNow() taken as soon as the host noticed (e.g. first thing in its fd
+ * callback), so that readiness latency includes the host's own delay.
+ */
+void NodeJSLoopBackendReady(double readyTime);
+
+/// To be called by the host when its timer fires.
+void NodeJSLoopPump();
+
+/// Maximum time (in seconds) of a pump before yielding. Defaults to 0.008.
+void NodeJSLoopSetPumpBudget(double seconds);
+double NodeJSLoopPumpBudget();
+
+/// Current counters.
+NodeJSLoopStats NodeJSLoopStatistics();
+
+/// Reset counters to zero.
+void NodeJSLoopResetStatistics();
+
+/// Monotonic time in seconds.
+double NodeJSLoopNow();
+
+/// Run node until it has no more active watchers using a poll(2) host.
+void NodeJSLoopRunWithPoll();
+
+#endif // NODECOCOA_NODEJS_LOOP_H_
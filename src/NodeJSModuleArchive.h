@@ -0,0 +1,114 @@
+#ifndef NODECOCOA_NODEJS_MODULE_ARCHIVE_H_
+#define NODECOCOA_NODEJS_MODULE_ARCHIVE_H_
+
+#import <NodeCocoa/node.h>
+
+/// Error codes in NodeJSNSErrorDomain
+enum {
+  NodeJSModuleArchiveInvalidError = 32,  // not an archive or corrupt
+};
+
+/// Name of the archive file in the app's resource directory.
+extern NSString* const NodeJSModuleArchiveFilename;
+
+/// Counters reported by |-[NodeJSModuleArchive statistics]|.
+typedef struct {
+  uint64_t lookups;     // paths below <rootPath>/lib looked up
+  uint64_t misses;      // ... which aren't in the archive
+  uint64_t stale;       // archived paths which no longer match the disk
+  uint64_t statsAnswered; // sync stat/lstat calls answered from the archive
+  uint64_t reads;       // sources handed out
+  uint64_t bytesRead;   // ... their total size in bytes (none of it copied)
+  NSUInteger count;     // number of paths in the archive
+  NSUInteger size;      // size of the mapped file in bytes
+} NodeJSModuleArchiveStats;
+
+/**
+ * A packed, memory-mapped archive of the JavaScript modules of an app bundle.
+ *
+ * The archive holds a hash index of the paths in lib/ (relative to the
+ * archive's directory), i.e. its directories and files, and the source of
+ * every .js file with the size and modification time of the file it was
+ * archived from. Sources are stored as ASCII or, if they contain anything
+ * else, as UTF-16, so that they can be handed to V8 as external strings which
+ * point straight into the mapping.
+ *
+ * Once node is running (after main.js and its synchronous requires have
+ * loaded), NodeJSApplicationMain overlays the archive on node's synchronous
+ * stat, lstat and readFileSync: for an archived path below <Resources>/lib
+ * they are answered after one hash lookup, stat from the archive's record of
+ * the path and readFileSync with the external string. Each archived path is
+ * checked against the disk once, with a single lstat (by type and, for
+ * sources, size and modification time); paths which no longer match, and
+ * anything which isn't in the archive, go to the file system as before. So
+ * require() resolves archived modules without touching the disk beyond that
+ * one lstat per module, while its probes for candidates which aren't archived
+ * still hit the file system.
+ *
+ * Function bodies are compiled lazily by V8 (on first call). Together with the
+ * preparse data of a NodeJSCodeCache the initial parse can skip them, too.
+ *
+ * The archive is written at build time together with the code cache (see
+ * --precompile-bundle in NodeJS.h) and is read-only at runtime. Like the rest
+ * of the V8 API, this must only be used from the node thread.
+ */
+@interface NodeJSModuleArchive : NSObject {
+  NSString* rootPath_;
+  char* prefix_;         // <rootPath>/lib
+  size_t prefixLength_;
+  const char* map_;
+  NSUInteger mapSize_;
+  uint32_t bucketMask_;
+  struct NodeJSModuleArchiveEntryState* state_;  // per entry: disk check
+  NodeJSModuleArchiveStats stats_;
+}
+
+/// Directory which archived paths are relative to.
+@property(readonly) NSString* rootPath;
+
+/**
+ * The archive of the main bundle (<Resources>/modules.pack), mapped on first
+ * call, or nil if there is no valid archive.
+ */
++ (NodeJSModuleArchive*)sharedArchive;
+
+/**
+ * Map the archive at |path|. Returns nil and sets |error| if the file can't be
+ * read or is not a valid archive.
+ */
+- (id)initWithContentsOfFile:(NSString*)path error:(NSError**)error;
+
+/// YES if the (absolute) |path| is a source in the archive which matches the
+/// file on disk.
+- (BOOL)containsFile:(NSString*)path;
+
+/**
+ * Source of the file at the (absolute) |path| as an external string backed by
+ * the mapping, or an empty handle if there's no such file or it has changed on
+ * disk.
+ */
+- (v8::Local<v8::String>)sourceForPath:(NSString*)path;
+
+/**
+ * Overlay the archive on the "fs" module and binding reachable through
+ * |process| and |require| (see above).
+ */
+- (void)installInProcess:(v8::Handle<v8::Object>)process
+                 require:(v8::Handle<v8::Function>)require;
+
+/// Current counters.
+- (NodeJSModuleArchiveStats)statistics;
+
+/// Reset all counters except |count| and |size| to zero.
+- (void)resetStatistics;
+
+/**
+ * Write an archive of lib/ (recursively) of |directory| to |path|.
+ */
++ (BOOL)buildArchiveForDirectory:(NSString*)directory
+                          toFile:(NSString*)path
+                           error:(NSError**)error;
+
+@end
+
+#endif // NODECOCOA_NODEJS_MODULE_ARCHIVE_H_
@@ -0,0 +1,571 @@
+#import "NodeJSModuleArchive.h"
+#import "NodeJS.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+using namespace v8;
+
+NSString* const NodeJSModuleArchiveFilename = @"modules.pack";
+
+// File layout: ArchiveHeader, uint32_t buckets[bucketCount] (entry index + 1,
+// 0 if empty; linear probing), ArchiveEntry[count], paths (UTF-8), sources
+// (each aligned to 8 bytes).
+static const char kMagic[8] = {'N','J','S','M','P','A','C','K'};
+static const uint32_t kFormatVersion = 3;
+
+enum { kKindFile = 1, kKindDirectory = 2, kKindOther = 3 };
+enum { kEncodingASCII = 0, kEncodingUTF16 = 1 };
+
+// Per-entry state of a path compared with the file system
+enum { kUnchecked = 0, kCurrent = 1, kStale = 2 };
+
+struct NodeJSModuleArchiveEntryState {
+  uint8_t state;
+  struct stat st;  // the lstat result the entry was checked with
+};
+typedef struct NodeJSModuleArchiveEntryState EntryState;
+
+struct ArchiveHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  uint32_t bucketCount;  // power of two
+  uint32_t reserved;
+};
+
+struct ArchiveEntry {
+  uint64_t pathHash;
+  uint32_t pathOffset;
+  uint32_t pathLength;
+  uint32_t dataOffset;
+  uint32_t dataLength;  // in bytes
+  uint16_t kind;
+  uint16_t encoding;
+  uint32_t reserved;
+  // the file the source was archived from (kKindFile only)
+  uint64_t fileSize;
+  int64_t fileModified;   // st_mtime
+};
+
+
+static NSError* ArchiveError(NSString* description) {
+  return [NSError errorWithDomain:(NSString*)NodeJSNSErrorDomain
+                             code:NodeJSModuleArchiveInvalidError
+      userInfo:[NSDictionary dictionaryWithObject:description
+                                           forKey:NSLocalizedDescriptionKey]];
+}
+
+
+// 64-bit FNV-1a
+static uint64_t HashBytes(const char* bytes, size_t length) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; ++i) {
+    h ^= (uint8_t)bytes[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// -----------------------------------------------------------------------------
+// External string resources pointing into the mapping. Each keeps the archive
+// alive until V8 collects the string.
+
+class ArchiveAsciiResource : public String::ExternalAsciiStringResource {
+ public:
+  ArchiveAsciiResource(NodeJSModuleArchive* archive, const char* data,
+                       size_t length)
+      : archive_([archive retain]), data_(data), length_(length) {}
+  virtual ~ArchiveAsciiResource() { [archive_ release]; }
+  virtual const char* data() const { return data_; }
+  virtual size_t length() const { return length_; }
+ private:
+  NodeJSModuleArchive* archive_;
+  const char* data_;
+  size_t length_;
+};
+
+
+class ArchiveTwoByteResource : public String::ExternalStringResource {
+ public:
+  ArchiveTwoByteResource(NodeJSModuleArchive* archive, const uint16_t* data,
+                         size_t length)
+      : archive_([archive retain]), data_(data), length_(length) {}
+  virtual ~ArchiveTwoByteResource() { [archive_ release]; }
+  virtual const uint16_t* data() const { return data_; }
+  virtual size_t length() const { return length_; }
+ private:
+  NodeJSModuleArchive* archive_;
+  const uint16_t* data_;
+  size_t length_;
+};
+
+// -----------------------------------------------------------------------------
+
+@implementation NodeJSModuleArchive
+
+@synthesize rootPath = rootPath_;
+
+
++ (NodeJSModuleArchive*)sharedArchive {
+  static NodeJSModuleArchive* sharedArchive = nil;
+  static BOOL loaded = NO;
+  if (!loaded) {
+    loaded = YES;
+    NSString* path = [[[NSBundle mainBundle] resourcePath]
+        stringByAppendingPathComponent:NodeJSModuleArchiveFilename];
+    if ([[NSFileManager defaultManager] fileExistsAtPath:path]) {
+      NSError* error = nil;
+      sharedArchive = [[self alloc] initWithContentsOfFile:path error:&error];
+      if (!sharedArchive)
+        NSLog(@"warning: ignoring module archive %@: %@", path, error);
+    }
+  }
+  return sharedArchive;
+}
+
+
+- (id)initWithContentsOfFile:(NSString*)path error:(NSError**)error {
+  if (!(self = [super init])) return nil;
+  NSString* problem = nil;
+  int fd = open([path fileSystemRepresentation], O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0) {
+    problem = [NSString stringWithUTF8String:strerror(errno)];
+  } else if ((size_t)st.st_size < sizeof(ArchiveHeader)) {
+    problem = @"file is truncated";
+  } else {
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      problem = [NSString stringWithUTF8String:strerror(errno)];
+    } else {
+      map_ = (const char*)map;
+      mapSize_ = st.st_size;
+    }
+  }
+  if (fd != -1) close(fd);
+
+  if (!problem) {
+    const ArchiveHeader* header = (const ArchiveHeader*)map_;
+    uint64_t tableEnd = sizeof(ArchiveHeader) +
+                        (uint64_t)header->bucketCount * sizeof(uint32_t) +
+                        (uint64_t)header->count * sizeof(ArchiveEntry);
+    if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+        header->version != kFormatVersion) {
+      problem = @"not a module archive (or an unsupported version)";
+    } else if (header->bucketCount == 0 ||
+               (header->bucketCount & (header->bucketCount - 1)) ||
+               header->bucketCount <= header->count || tableEnd > mapSize_) {
+      problem = @"file is corrupt";
+    } else {
+      const uint32_t* buckets = (const uint32_t*)(header + 1);
+      const ArchiveEntry* entries =
+          (const ArchiveEntry*)(buckets + header->bucketCount);
+      for (uint32_t i = 0; i < header->count && !problem; ++i) {
+        const ArchiveEntry& e = entries[i];
+        if ((uint64_t)e.pathOffset + e.pathLength > mapSize_ ||
+            (uint64_t)e.dataOffset + e.dataLength > mapSize_ ||
+            (e.dataOffset & 7) || (e.encoding == kEncodingUTF16 &&
+                                   (e.dataLength & 1))) {
+          problem = @"file is corrupt";
+        }
+      }
+      for (uint32_t i = 0; i < header->bucketCount && !problem; ++i) {
+        if (buckets[i] > header->count) problem = @"file is corrupt";
+      }
+      bucketMask_ = header->bucketCount - 1;
+      state_ = (EntryState*)calloc(MAX(header->count, 1), sizeof(EntryState));
+      stats_.count = header->count;
+      stats_.size = mapSize_;
+    }
+  }
+
+  if (problem) {
+    if (error) {
+      *error = ArchiveError([NSString stringWithFormat:@"%@: %@",
+                             path, problem]);
+    }
+    [self release];
+    return nil;
+  }
+  rootPath_ = [[path stringByDeletingLastPathComponent] copy];
+  prefix_ = strdup([[rootPath_ stringByAppendingPathComponent:@"lib"]
+                     fileSystemRepresentation]);
+  prefixLength_ = strlen(prefix_);
+  return self;
+}
+
+
+- (void)dealloc {
+  if (map_) munmap((void*)map_, mapSize_);
+  [rootPath_ release];
+  free(prefix_);
+  free(state_);
+  [super dealloc];
+}
+
+
+// Returns the entry for an absolute path (UTF-8), NULL if it's not in the
+// archive. Only <rootPath>/lib and normalized paths below it are looked up.
+- (const ArchiveEntry*)_entryForPath:(const char*)path length:(size_t)length {
+  BOOL below = length >= prefixLength_ &&
+               memcmp(path, prefix_, prefixLength_) == 0 &&
+               (length == prefixLength_ || path[prefixLength_] == '/') &&
+               !strstr(path, "//") && !strstr(path, "/./") &&
+               !strstr(path, "/../") && path[length - 1] != '/' &&
+               path[length - 1] != '.';
+  if (!below) return NULL;
+  stats_.lookups++;
+  size_t rootLength = prefixLength_ - 4;  // without "/lib"
+  const char* rel = path + rootLength + 1;
+  size_t relLength = length - rootLength - 1;
+  uint64_t hash = HashBytes(rel, relLength);
+  const ArchiveHeader* header = (const ArchiveHeader*)map_;
+  const uint32_t* buckets = (const uint32_t*)(header + 1);
+  const ArchiveEntry* entries =
+      (const ArchiveEntry*)(buckets + header->bucketCount);
+  for (uint32_t i = (uint32_t)hash & bucketMask_;; i = (i + 1) & bucketMask_) {
+    uint32_t n = buckets[i];
+    if (!n) break;
+    const ArchiveEntry* e = &entries[n - 1];
+    if (e->pathHash == hash && e->pathLength == relLength &&
+        memcmp(map_ + e->pathOffset, rel, relLength) == 0) {
+      return e;
+    }
+  }
+  stats_.misses++;
+  return NULL;
+}
+
+
+// The stat of |path| if |e| still matches it, NULL if it doesn't. Each entry
+// is checked once, with an lstat: directories must still be directories,
+// other files regular files and sources must also have the size and
+// modification time they were archived with. Symbolic links never match, so
+// stat and lstat of them are left to the file system.
+- (const struct stat*)_statForEntry:(const ArchiveEntry*)e
+                               path:(const char*)path {
+  const ArchiveHeader* header = (const ArchiveHeader*)map_;
+  const ArchiveEntry* entries = (const ArchiveEntry*)(
+      (const uint32_t*)(header + 1) + header->bucketCount);
+  EntryState* s = &state_[e - entries];
+  if (s->state == kUnchecked) {
+    BOOL current = NO;
+    if (lstat(path, &s->st) == 0) {
+      if (e->kind == kKindDirectory) {
+        current = S_ISDIR(s->st.st_mode);
+      } else if (e->kind == kKindFile) {
+        current = S_ISREG(s->st.st_mode) &&
+                  (uint64_t)s->st.st_size == e->fileSize &&
+                  (int64_t)s->st.st_mtime == e->fileModified;
+      } else {
+        current = S_ISREG(s->st.st_mode);
+      }
+    }
+    s->state = current ? kCurrent : kStale;
+    if (!current) stats_.stale++;
+  }
+  return s->state == kCurrent ? &s->st : NULL;
+}
+
+
+- (BOOL)_isCurrentSource:(const ArchiveEntry*)e path:(const char*)path {
+  return e->kind == kKindFile && [self _statForEntry:e path:path];
+}
+
+
+// Stat for a synchronous stat/lstat of |path|, NULL if the file system has to
+// answer it
+- (const struct stat*)_statForPath:(const char*)path length:(size_t)length {
+  const ArchiveEntry* e = [self _entryForPath:path length:length];
+  const struct stat* st = e ? [self _statForEntry:e path:path] : NULL;
+  if (st) stats_.statsAnswered++;
+  return st;
+}
+
+
+- (BOOL)containsFile:(NSString*)path {
+  const char* p = [path UTF8String];
+  const ArchiveEntry* e = [self _entryForPath:p length:strlen(p)];
+  return e && [self _isCurrentSource:e path:p];
+}
+
+
+- (Local<String>)_sourceForEntry:(const ArchiveEntry*)e {
+  stats_.reads++;
+  stats_.bytesRead += e->dataLength;
+  const char* data = map_ + e->dataOffset;
+  if (e->encoding == kEncodingASCII) {
+    return String::NewExternal(
+        new ArchiveAsciiResource(self, data, e->dataLength));
+  }
+  return String::NewExternal(new ArchiveTwoByteResource(
+      self, (const uint16_t*)data, e->dataLength / 2));
+}
+
+
+- (Local<String>)sourceForPath:(NSString*)path {
+  HandleScope scope;
+  const char* p = [path UTF8String];
+  const ArchiveEntry* e = [self _entryForPath:p length:strlen(p)];
+  if (!e || ![self _isCurrentSource:e path:p]) return Local<String>();
+  return scope.Close([self _sourceForEntry:e]);
+}
+
+
+- (NodeJSModuleArchiveStats)statistics {
+  return stats_;
+}
+
+
+- (void)resetStatistics {
+  NSUInteger count = stats_.count, size = stats_.size;
+  memset(&stats_, 0, sizeof(stats_));
+  stats_.count = count;
+  stats_.size = size;
+}
+
+// -----------------------------------------------------------------------------
+// File system overlay
+
+static inline NodeJSModuleArchive* ArchiveFromArgs(const Arguments& args) {
+  return (NodeJSModuleArchive*)External::Unwrap(args.Data());
+}
+
+
+// archive.source(path) -> external string, or undefined if |path| isn't an
+// archived source which matches the file on disk
+static v8::Handle<Value> Source(const Arguments& args) {
+  HandleScope scope;
+  if (args.Length() < 1 || !args[0]->IsString()) return Undefined();
+  NodeJSModuleArchive* archive = ArchiveFromArgs(args);
+  String::Utf8Value path(args[0]);
+  const ArchiveEntry* e = [archive _entryForPath:*path length:path.length()];
+  if (!e || ![archive _isCurrentSource:e path:*path]) return Undefined();
+  return scope.Close([archive _sourceForEntry:e]);
+}
+
+
+static inline Local<Value> UnixTime(time_t t) {
+  return Date::New(1000.0 * (double)t);
+}
+
+
+// archive.stat(path, stats) -> |stats| filled in like node's own stat does, or
+// undefined if |path| isn't archived or no longer matches the file system
+static v8::Handle<Value> Stat(const Arguments& args) {
+  HandleScope scope;
+  if (args.Length() < 2 || !args[0]->IsString() || !args[1]->IsObject())
+    return Undefined();
+  String::Utf8Value path(args[0]);
+  const struct stat* st =
+      [ArchiveFromArgs(args) _statForPath:*path length:path.length()];
+  if (!st) return Undefined();
+  Local<Object> stats = args[1]->ToObject();
+  stats->Set(String::NewSymbol("dev"), Number::New(st->st_dev));
+  stats->Set(String::NewSymbol("ino"), Number::New(st->st_ino));
+  stats->Set(String::NewSymbol("mode"), Number::New(st->st_mode));
+  stats->Set(String::NewSymbol("nlink"), Number::New(st->st_nlink));
+  stats->Set(String::NewSymbol("uid"), Number::New(st->st_uid));
+  stats->Set(String::NewSymbol("gid"), Number::New(st->st_gid));
+  stats->Set(String::NewSymbol("rdev"), Number::New(st->st_rdev));
+  stats->Set(String::NewSymbol("size"), Number::New(st->st_size));
+  stats->Set(String::NewSymbol("blksize"), Number::New(st->st_blksize));
+  stats->Set(String::NewSymbol("blocks"), Number::New(st->st_blocks));
+  stats->Set(String::NewSymbol("atime"), UnixTime(st->st_atime));
+  stats->Set(String::NewSymbol("mtime"), UnixTime(st->st_mtime));
+  stats->Set(String::NewSymbol("ctime"), UnixTime(st->st_ctime));
+  return scope.Close(stats);
+}
+
+
+// Wraps the sync forms of binding.stat/lstat and fs.readFileSync; anything the
+// archive can't answer goes to the file system. Whether readFileSync returns a
+// string when no encoding is given differs between node versions, so that is
+// probed (on /dev/null) rather than assumed.
+static const char* kOverlaySource =
+"(function (archive, binding, fs) {\n"
+"  var Stats = binding.Stats || fs.Stats;\n"
+"  function wrapStat(name) {\n"
+"    var stat = binding[name];\n"
+"    if (typeof stat !== 'function' || typeof Stats !== 'function') return;\n"
+"    binding[name] = function (path, callback) {\n"
+"      if (typeof callback !== 'function') {\n"
+"        var stats = archive.stat(path, new Stats());\n"
+"        if (stats !== undefined) return stats;\n"
+"      }\n"
+"      return stat.apply(this, arguments);\n"
+"    };\n"
+"  }\n"
+"  wrapStat('stat');\n"
+"  wrapStat('lstat');\n"
+"  var readFileSync = fs.readFileSync;\n"
+"  var stringByDefault = typeof readFileSync('/dev/null') === 'string';\n"
+"  fs.readFileSync = function (path, encoding) {\n"
+"    if (encoding ? /^utf-?8$/i.test(encoding) : stringByDefault) {\n"
+"      var source = archive.source(path);\n"
+"      if (source !== undefined) return source;\n"
+"    }\n"
+"    return readFileSync.apply(this, arguments);\n"
+"  };\n"
+"})";
+
+
+- (void)installInProcess:(v8::Handle<Object>)process
+                 require:(v8::Handle<Function>)require {
+  HandleScope scope;
+  TryCatch try_catch;
+  Local<Value> binding_v = process->Get(String::NewSymbol("binding"));
+  if (!binding_v->IsFunction()) return;
+  Local<Value> argv[3];
+  argv[0] = String::New("fs");
+  Local<Value> binding =
+      Local<Function>::Cast(binding_v)->Call(process, 1, argv);
+  Local<Value> fs = require->Call(process, 1, argv);
+  if (binding.IsEmpty() || !binding->IsObject() ||
+      fs.IsEmpty() || !fs->IsObject()) {
+    NSLog(@"warning: module archive not installed (no fs module)");
+    return;
+  }
+
+  [self retain]; // referenced by the installed functions from now on
+  Local<Value> data = External::Wrap(self);
+  Local<Object> archive = Object::New();
+  archive->Set(String::NewSymbol("root"), String::New([rootPath_ UTF8String]));
+  archive->Set(String::NewSymbol("source"),
+               FunctionTemplate::New(&Source, data)->GetFunction());
+  archive->Set(String::NewSymbol("stat"),
+               FunctionTemplate::New(&Stat, data)->GetFunction());
+
+  Local<Value> overlay = v8::Script::Compile(String::New(kOverlaySource),
+      String::New("NodeJSModuleArchive"))->Run();
+  argv[0] = archive;
+  argv[1] = binding;
+  argv[2] = fs;
+  Local<Function>::Cast(overlay)->Call(process, 3, argv);
+  if (try_catch.HasCaught()) {
+    NSLog(@"warning: module archive not installed: %@",
+          [NSError errorFromV8TryCatch:try_catch]);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Building
+
++ (BOOL)buildArchiveForDirectory:(NSString*)directory
+                          toFile:(NSString*)path
+                           error:(NSError**)error {
+  NSAutoreleasePool* pool = [NSAutoreleasePool new];
+  NSFileManager* fm = [NSFileManager defaultManager];
+
+  // lib/ and everything below it. Only the source of .js files is included,
+  // other files are just recorded as existing.
+  NSMutableArray* files = [NSMutableArray array];
+  NSMutableArray* directories = [NSMutableArray arrayWithObject:@"lib"];
+  NSString* libPath = [directory stringByAppendingPathComponent:@"lib"];
+  NSDirectoryEnumerator* dirents = [fm enumeratorAtPath:libPath];
+  for (NSString* subpath in dirents) {
+    NSString* type = [[dirents fileAttributes] fileType];
+    NSString* rel = [@"lib" stringByAppendingPathComponent:subpath];
+    if ([type isEqualToString:NSFileTypeDirectory])
+      [directories addObject:rel];
+    else
+      [files addObject:rel];
+  }
+  [files sortUsingSelector:@selector(compare:)];
+  [directories sortUsingSelector:@selector(compare:)];
+
+  uint32_t count = (uint32_t)([files count] + [directories count]);
+  uint32_t bucketCount = 16;
+  while (bucketCount < count * 2) bucketCount <<= 1;
+  uint32_t* buckets = (uint32_t*)calloc(bucketCount, sizeof(uint32_t));
+  ArchiveEntry* entries =
+      (ArchiveEntry*)calloc(MAX(count, 1), sizeof(ArchiveEntry));
+  NSMutableData* paths = [NSMutableData data];
+  NSMutableData* sources = [NSMutableData data];
+  uint32_t n = 0;
+
+  NSUInteger fileCount = [files count];
+  [files addObjectsFromArray:directories];
+  for (NSUInteger k = 0; k < [files count]; ++k) {
+    NSString* rel = [files objectAtIndex:k];
+    ArchiveEntry& e = entries[n];
+    NSData* bytes = nil;
+    NSString* source = nil;
+    if (k < fileCount && [[rel pathExtension] isEqualToString:@"js"]) {
+      bytes = [NSData dataWithContentsOfFile:
+          [directory stringByAppendingPathComponent:rel]];
+      source = bytes ? [[[NSString alloc] initWithData:bytes
+          encoding:NSUTF8StringEncoding] autorelease] : nil;
+      if (!source)
+        NSLog(@"warning: not archiving %@ (not readable as UTF-8)", rel);
+    }
+    if (source) {
+      [sources setLength:([sources length] + 7) & ~(NSUInteger)7];
+      e.dataOffset = (uint32_t)[sources length];  // relative, fixed up below
+      if ([source canBeConvertedToEncoding:NSASCIIStringEncoding]) {
+        e.encoding = kEncodingASCII;
+        [sources appendData:bytes];
+      } else {
+        e.encoding = kEncodingUTF16;
+        NSUInteger length = [source length];
+        NSUInteger offset = [sources length];
+        [sources increaseLengthBy:length * sizeof(unichar)];
+        [source getCharacters:(unichar*)((char*)[sources mutableBytes] + offset)
+                        range:NSMakeRange(0, length)];
+      }
+      e.dataLength = (uint32_t)([sources length] - e.dataOffset);
+      e.kind = kKindFile;
+      struct stat st;
+      if (stat([[directory stringByAppendingPathComponent:rel]
+                   fileSystemRepresentation], &st) == 0) {
+        e.fileModified = (int64_t)st.st_mtime;
+      }
+      e.fileSize = [bytes length];
+    } else {
+      e.kind = k < fileCount ? kKindOther : kKindDirectory;
+    }
+    const char* utf8 = [rel UTF8String];
+    e.pathLength = (uint32_t)strlen(utf8);
+    e.pathOffset = (uint32_t)[paths length];  // relative, fixed up below
+    e.pathHash = HashBytes(utf8, e.pathLength);
+    [paths appendBytes:utf8 length:e.pathLength];
+    uint32_t i = (uint32_t)e.pathHash & (bucketCount - 1);
+    while (buckets[i]) i = (i + 1) & (bucketCount - 1);
+    buckets[i] = ++n;
+  }
+
+  ArchiveHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kFormatVersion;
+  header.count = n;
+  header.bucketCount = bucketCount;
+  NSUInteger pathsStart = sizeof(header) + sizeof(uint32_t) * bucketCount +
+                          sizeof(ArchiveEntry) * n;
+  NSUInteger sourcesStart = (pathsStart + [paths length] + 7) & ~(NSUInteger)7;
+  for (uint32_t i = 0; i < n; ++i) {
+    entries[i].pathOffset += pathsStart;
+    if (entries[i].kind == kKindFile)
+      entries[i].dataOffset += sourcesStart;
+  }
+
+  NSMutableData* out = [NSMutableData dataWithCapacity:sourcesStart +
+                                                       [sources length]];
+  [out appendBytes:&header length:sizeof(header)];
+  [out appendBytes:buckets length:sizeof(uint32_t) * bucketCount];
+  [out appendBytes:entries length:sizeof(ArchiveEntry) * n];
+  [out appendData:paths];
+  [out setLength:sourcesStart];
+  [out appendData:sources];
+  free(buckets);
+  free(entries);
+
+  BOOL ok = [out writeToFile:path options:NSAtomicWrite error:error];
+  if (!ok && error) [*error retain];
+  [pool drain];
+  if (!ok && error) [*error autorelease];
+  return ok;
+}
+
+@end
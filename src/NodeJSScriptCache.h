@@ -0,0 +1,99 @@
+#ifndef NODECOCOA_NODEJS_SCRIPT_CACHE_H_
+#define NODECOCOA_NODEJS_SCRIPT_CACHE_H_
+
+#import <NodeCocoa/node.h>
+
+/// Counters reported by |-[NodeJSScriptCache statistics]|.
+typedef struct {
+  uint64_t hits;       // lookups which returned a compiled script
+  uint64_t misses;     // lookups which did not find a compiled script
+  uint64_t evictions;  // entries dropped to stay within |capacity|
+  NSUInteger count;    // number of scripts currently cached
+  NSUInteger capacity; // max number of scripts cached
+} NodeJSScriptCacheStats;
+
+struct NodeJSScriptCacheEntry;
+
+/**
+ * A bounded, least-recently-used cache of compiled scripts.
+ *
+ * Scripts are keyed by (source, origin, context). Lookups hash the source text
+ * and only compare the full source when the hash matches, so repeatedly
+ * compiling the same snippet skips parsing entirely.
+ *
+ * +[NodeJS compile:origin:context:error:] (and thus everything built on top of
+ * it, like |eval:| and |functionFromString:|) consults |sharedCache|.
+ *
+ * Note: A compiled script is bound to the context it was compiled in. Entries
+ * compare contexts by identity (not by handle address) and keep their context
+ * alive, so when you're done with a custom context call
+ * |removeScriptsInContext:| to let it be collected.
+ *
+ * Note: Like the rest of the V8 API, this is not thread safe and must only be
+ * used from the node thread (except for |hashForSource:|).
+ */
+@interface NodeJSScriptCache : NSObject {
+  struct NodeJSScriptCacheEntry **buckets_;
+  NSUInteger bucketMask_;
+  struct NodeJSScriptCacheEntry *head_; // most recently used
+  struct NodeJSScriptCacheEntry *tail_; // least recently used
+  NodeJSScriptCacheStats stats_;
+}
+
+/// Maximum number of cached scripts. Setting this to 0 disables caching.
+@property(nonatomic) NSUInteger capacity;
+
+/// The cache used by +[NodeJS compile:origin:context:error:].
++ (NodeJSScriptCache*)sharedCache;
+
+- (id)initWithCapacity:(NSUInteger)capacity;
+
+/// Returns a cached script or an empty handle if there's no such script.
+- (v8::Local<v8::Script>)scriptForSource:(NSString*)source
+                                  origin:(NSString*)origin
+                                 context:(v8::Context*)context;
+
+/// Add (or replace) |script|, possibly evicting the least recently used entry.
+- (void)setScript:(v8::Local<v8::Script>)script
+        forSource:(NSString*)source
+           origin:(NSString*)origin
+          context:(v8::Context*)context;
+
+/**
+ * The hash of |source| used in keys. Doesn't use V8, so it can be computed on
+ * any thread ahead of time and passed to the |sourceHash:| variants, which
+ * otherwise behave like the methods above.
+ */
++ (uint64_t)hashForSource:(NSString*)source;
+
+- (v8::Local<v8::Script>)scriptForSource:(NSString*)source
+                              sourceHash:(uint64_t)sourceHash
+                                  origin:(NSString*)origin
+                                 context:(v8::Context*)context;
+
+- (void)setScript:(v8::Local<v8::Script>)script
+        forSource:(NSString*)source
+       sourceHash:(uint64_t)sourceHash
+           origin:(NSString*)origin
+          context:(v8::Context*)context;
+
+/// Remove the script for (|source|, |origin|, |context|), if cached.
+- (void)removeScriptForSource:(NSString*)source
+                       origin:(NSString*)origin
+                      context:(v8::Context*)context;
+
+/// Remove all scripts compiled in |context| (NULL means the main context).
+- (void)removeScriptsInContext:(v8::Context*)context;
+
+/// Remove all scripts.
+- (void)removeAllScripts;
+
+/// Current counters.
+- (NodeJSScriptCacheStats)statistics;
+
+/// Reset the hits, misses and evictions counters to zero.
+- (void)resetStatistics;
+
+@end
+
+#endif // NODECOCOA_NODEJS_SCRIPT_CACHE_H_
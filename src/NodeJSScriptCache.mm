@@ -0,0 +1,313 @@
+#import "NodeJSScriptCache.h"
+
+using namespace v8;
+
+struct NodeJSScriptCacheEntry {
+  uint64_t hash;
+  NSString* source;
+  NSString* origin;
+  Persistent<Context> context;        // empty for NULL (the main context)
+  Persistent<Script> script;
+  NodeJSScriptCacheEntry* prev;       // LRU list (towards head_)
+  NodeJSScriptCacheEntry* next;       // LRU list (towards tail_)
+  NodeJSScriptCacheEntry* chain;      // bucket chain
+};
+
+static const NSUInteger kDefaultCapacity = 128;
+
+
+// 64-bit FNV-1a over the UTF-16 code units of |source|
+static uint64_t HashSource(NSString* source) {
+  uint64_t h = 14695981039346656037ULL;
+  CFStringRef str = (CFStringRef)source;
+  CFIndex length = CFStringGetLength(str);
+  const UniChar* chars = CFStringGetCharactersPtr(str);
+  if (chars) {
+    for (CFIndex i = 0; i < length; ++i) {
+      h ^= chars[i];
+      h *= 1099511628211ULL;
+    }
+    return h;
+  }
+  UniChar buf[256];
+  for (CFIndex offset = 0; offset < length; offset += 256) {
+    CFIndex n = MIN(length - offset, 256);
+    CFStringGetCharacters(str, CFRangeMake(offset, n), buf);
+    for (CFIndex i = 0; i < n; ++i) {
+      h ^= buf[i];
+      h *= 1099511628211ULL;
+    }
+  }
+  return h;
+}
+
+
+// Note: The context isn't part of the hash -- a Context* is the address of a
+// handle, not of the context itself, so it says nothing about identity. Few
+// scripts are compiled in more than one context anyway.
+static inline uint64_t HashKey(uint64_t sourceHash, NSString* origin) {
+  uint64_t h = sourceHash;
+  h ^= origin ? (uint64_t)[origin hash] : 0;
+  h *= 1099511628211ULL;
+  return h;
+}
+
+
+// Compares the contexts themselves (Handle::operator==), not handle addresses
+static inline bool ContextMatches(NodeJSScriptCacheEntry* entry,
+                                  Context* context) {
+  if (!context) return entry->context.IsEmpty();
+  return !entry->context.IsEmpty() &&
+         entry->context == Handle<Context>(context);
+}
+
+
+static inline bool EntryMatches(NodeJSScriptCacheEntry* entry, uint64_t hash,
+                                NSString* source, NSString* origin,
+                                Context* context) {
+  return entry->hash == hash &&
+         ContextMatches(entry, context) &&
+         (entry->origin == origin ||
+          (origin && [entry->origin isEqualToString:origin])) &&
+         (entry->source == source || [entry->source isEqualToString:source]);
+}
+
+
+static void DisposeEntry(NodeJSScriptCacheEntry* entry) {
+  [entry->source release];
+  [entry->origin release];
+  entry->script.Dispose();
+  entry->script.Clear();
+  if (!entry->context.IsEmpty()) entry->context.Dispose();
+  delete entry;
+}
+
+
+@interface NodeJSScriptCache (Private)
+- (void)_removeEntry:(NodeJSScriptCacheEntry*)entry;
+- (void)_resizeBuckets:(NSUInteger)capacity;
+@end
+
+
+@implementation NodeJSScriptCache
+
++ (NodeJSScriptCache*)sharedCache {
+  static NodeJSScriptCache* sharedCache = nil;
+  if (!sharedCache)
+    sharedCache = [[self alloc] initWithCapacity:kDefaultCapacity];
+  return sharedCache;
+}
+
+
+- (id)init {
+  return [self initWithCapacity:kDefaultCapacity];
+}
+
+
+- (id)initWithCapacity:(NSUInteger)capacity {
+  if ((self = [super init])) {
+    [self _resizeBuckets:capacity];
+    stats_.capacity = capacity;
+  }
+  return self;
+}
+
+
+- (void)dealloc {
+  [self removeAllScripts];
+  free(buckets_);
+  [super dealloc];
+}
+
+
+- (NSUInteger)capacity {
+  return stats_.capacity;
+}
+
+
+- (void)setCapacity:(NSUInteger)capacity {
+  stats_.capacity = capacity;
+  while (stats_.count > capacity) {
+    [self _removeEntry:tail_];
+    stats_.evictions++;
+  }
+  if (capacity > bucketMask_ + 1)
+    [self _resizeBuckets:capacity];
+}
+
+
+// Bucket count is the power of two >= capacity (at least 16)
+- (void)_resizeBuckets:(NSUInteger)capacity {
+  NSUInteger nbuckets = 16;
+  while (nbuckets < capacity) nbuckets <<= 1;
+  free(buckets_);
+  buckets_ = (NodeJSScriptCacheEntry**)
+      calloc(nbuckets, sizeof(NodeJSScriptCacheEntry*));
+  bucketMask_ = nbuckets - 1;
+  // rehash live entries
+  for (NodeJSScriptCacheEntry* entry = head_; entry; entry = entry->next) {
+    NodeJSScriptCacheEntry** bucket = &buckets_[entry->hash & bucketMask_];
+    entry->chain = *bucket;
+    *bucket = entry;
+  }
+}
+
+
+// Unlink |entry| from its bucket chain and the LRU list, then dispose of it
+- (void)_removeEntry:(NodeJSScriptCacheEntry*)entry {
+  NodeJSScriptCacheEntry** link = &buckets_[entry->hash & bucketMask_];
+  while (*link != entry) link = &(*link)->chain;
+  *link = entry->chain;
+  if (entry->prev) entry->prev->next = entry->next; else head_ = entry->next;
+  if (entry->next) entry->next->prev = entry->prev; else tail_ = entry->prev;
+  stats_.count--;
+  DisposeEntry(entry);
+}
+
+
+- (NodeJSScriptCacheEntry*)_entryForHash:(uint64_t)hash
+                                  source:(NSString*)source
+                                  origin:(NSString*)origin
+                                 context:(Context*)context {
+  NodeJSScriptCacheEntry* entry = buckets_[hash & bucketMask_];
+  while (entry && !EntryMatches(entry, hash, source, origin, context))
+    entry = entry->chain;
+  return entry;
+}
+
+
++ (uint64_t)hashForSource:(NSString*)source {
+  return HashSource(source);
+}
+
+
+- (Local<Script>)scriptForSource:(NSString*)source
+                          origin:(NSString*)origin
+                         context:(Context*)context {
+  return [self scriptForSource:source sourceHash:HashSource(source)
+                        origin:origin context:context];
+}
+
+
+- (Local<Script>)scriptForSource:(NSString*)source
+                      sourceHash:(uint64_t)sourceHash
+                          origin:(NSString*)origin
+                         context:(Context*)context {
+  if (stats_.capacity == 0) return Local<Script>();
+  uint64_t hash = HashKey(sourceHash, origin);
+  NodeJSScriptCacheEntry* entry =
+      [self _entryForHash:hash source:source origin:origin context:context];
+  if (!entry) {
+    stats_.misses++;
+    return Local<Script>();
+  }
+  stats_.hits++;
+  // move to front of the LRU list
+  if (entry != head_) {
+    entry->prev->next = entry->next;
+    if (entry->next) entry->next->prev = entry->prev; else tail_ = entry->prev;
+    entry->prev = NULL;
+    entry->next = head_;
+    head_->prev = entry;
+    head_ = entry;
+  }
+  return Local<Script>::New(entry->script);
+}
+
+
+- (void)setScript:(Local<Script>)script
+        forSource:(NSString*)source
+           origin:(NSString*)origin
+          context:(Context*)context {
+  [self setScript:script forSource:source sourceHash:HashSource(source)
+           origin:origin context:context];
+}
+
+
+- (void)setScript:(Local<Script>)script
+        forSource:(NSString*)source
+       sourceHash:(uint64_t)sourceHash
+           origin:(NSString*)origin
+          context:(Context*)context {
+  if (stats_.capacity == 0 || script.IsEmpty()) return;
+  uint64_t hash = HashKey(sourceHash, origin);
+  NodeJSScriptCacheEntry* entry =
+      [self _entryForHash:hash source:source origin:origin context:context];
+  if (entry) {
+    // replace script of existing entry
+    entry->script.Dispose();
+    entry->script = Persistent<Script>::New(script);
+    return;
+  }
+  // make room
+  while (stats_.count >= stats_.capacity) {
+    [self _removeEntry:tail_];
+    stats_.evictions++;
+  }
+  entry = new NodeJSScriptCacheEntry;
+  entry->hash = hash;
+  entry->source = [source copy];
+  entry->origin = [origin copy];
+  if (context)
+    entry->context = Persistent<Context>::New(Handle<Context>(context));
+  entry->script = Persistent<Script>::New(script);
+  // insert into bucket
+  NodeJSScriptCacheEntry** bucket = &buckets_[hash & bucketMask_];
+  entry->chain = *bucket;
+  *bucket = entry;
+  // insert at front of the LRU list
+  entry->prev = NULL;
+  entry->next = head_;
+  if (head_) head_->prev = entry; else tail_ = entry;
+  head_ = entry;
+  stats_.count++;
+}
+
+
+- (void)removeScriptForSource:(NSString*)source
+                       origin:(NSString*)origin
+                      context:(Context*)context {
+  uint64_t hash = HashKey(HashSource(source), origin);
+  NodeJSScriptCacheEntry* entry =
+      [self _entryForHash:hash source:source origin:origin context:context];
+  if (entry)
+    [self _removeEntry:entry];
+}
+
+
+- (void)removeScriptsInContext:(Context*)context {
+  NodeJSScriptCacheEntry* entry = head_;
+  while (entry) {
+    NodeJSScriptCacheEntry* next = entry->next;
+    if (ContextMatches(entry, context))
+      [self _removeEntry:entry];
+    entry = next;
+  }
+}
+
+
+- (void)removeAllScripts {
+  while (tail_)
+    [self _removeEntry:tail_];
+}
+
+
+- (NodeJSScriptCacheStats)statistics {
+  return stats_;
+}
+
+
+- (void)resetStatistics {
+  stats_.hits = stats_.misses = stats_.evictions = 0;
+}
+
+
+- (NSString*)description {
+  return [NSString stringWithFormat:
+      @"<%@ %p count=%lu capacity=%lu hits=%llu misses=%llu evictions=%llu>",
+      NSStringFromClass([self class]), self,
+      (unsigned long)stats_.count, (unsigned long)stats_.capacity,
+      stats_.hits, stats_.misses, stats_.evictions];
+}
+
+@end
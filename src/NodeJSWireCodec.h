@@ -0,0 +1,77 @@
+#ifndef NODECOCOA_NODEJS_WIRE_CODEC_H_
+#define NODECOCOA_NODEJS_WIRE_CODEC_H_
+
+#import <Foundation/Foundation.h>
+
+/**
+ * Byte-level reading and writing of the wire format (see NodeJSWireFormat.h),
+ * shared by its Cocoa codec (NodeJSWireFormat.mm) and the V8 codec of
+ * NodeJSChannel. Internal, not part of the framework's headers.
+ */
+
+/// Nesting deeper than this is rejected by both encoders and decoders.
+static const int kWireMaxDepth = 512;
+
+
+static inline void WirePutU8(NSMutableData* data, uint8_t v) {
+  [data appendBytes:&v length:1];
+}
+
+
+static inline void WirePutU32(NSMutableData* data, uint32_t v) {
+  uint32_t be = CFSwapInt32HostToBig(v);
+  [data appendBytes:&be length:4];
+}
+
+
+/// |tag|, uint32 length, |bytes|
+static inline void WirePutBytes(NSMutableData* data, uint8_t tag,
+                                const void* bytes, NSUInteger length) {
+  WirePutU8(data, tag);
+  WirePutU32(data, (uint32_t)length);
+  [data appendBytes:bytes length:length];
+}
+
+
+/// |tag|, big-endian IEEE-754 double
+static inline void WirePutDouble(NSMutableData* data, uint8_t tag, double v) {
+  CFSwappedFloat64 be = CFConvertDoubleHostToSwapped(v);
+  WirePutU8(data, tag);
+  [data appendBytes:&be length:8];
+}
+
+
+/// Reads from |p| up to |end|. Callers check |Has| before reading.
+struct WireReader {
+  const uint8_t* p;
+  const uint8_t* end;
+  int depth;
+
+  bool Has(NSUInteger n) { return (NSUInteger)(end - p) >= n; }
+
+  uint32_t U32() {
+    uint32_t v = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                 ((uint32_t)p[2] << 8) | p[3];
+    p += 4;
+    return v;
+  }
+
+  double F64() {
+    CFSwappedFloat64 be;
+    memcpy(&be, p, 8);
+    p += 8;
+    return CFConvertDoubleSwappedToHost(be);
+  }
+
+  // Reads a length-prefixed payload, returning NULL if truncated
+  const uint8_t* Payload(uint32_t* length) {
+    if (!Has(4)) return NULL;
+    *length = U32();
+    if (!Has(*length)) return NULL;
+    const uint8_t* start = p;
+    p += *length;
+    return start;
+  }
+};
+
+#endif  // NODECOCOA_NODEJS_WIRE_CODEC_H_
@@ -0,0 +1,48 @@
+#ifndef NODECOCOA_NODEJS_WIRE_FORMAT_H_
+#define NODECOCOA_NODEJS_WIRE_FORMAT_H_
+
+#import <Foundation/Foundation.h>
+
+/**
+ * A compact binary encoding of property-list-like values, used for talking to
+ * node across thread and process boundaries without a JSON round trip and
+ * without needing V8 (so encoding and decoding can happen on any thread).
+ *
+ * Each value is a one-byte tag followed by its payload. Integers and doubles
+ * (IEEE-754) are big endian.
+ *
+ *   'z'                                 null (NSNull, undefined)
+ *   't' / 'f'                           true / false
+ *   'i' int32                           NSNumber fitting in an int32
+ *   'd' float64                         other numbers
+ *   's' uint32 length, UTF-8            NSString
+ *   'b' uint32 length, bytes            NSData <--> node::Buffer
+ *   'D' float64                         NSDate <--> Date (ms since 1970)
+ *   'a' uint32 count, values            NSArray (and NSSet)
+ *   'o' uint32 count, (key, value)s     NSDictionary (keys are 's' values)
+ *
+ * Other objects are encoded as their |description|, like |-[NSObject v8Value]|.
+ *
+ * Framed messages (as used on pipes) are a uint32 length followed by one
+ * encoded value.
+ */
+
+/// Error codes (in |NodeJSNSErrorDomain|) produced by the wire format.
+enum {
+  NodeJSWireFormatMalformedError = 20,  // truncated or unknown tag
+  NodeJSWireFormatDepthLimitError = 21, // nesting deeper than 512
+};
+
+/// Append the encoding of |object| to |data|. Returns NO on error.
+BOOL NodeJSWireEncode(id object, NSMutableData* data, NSError** error);
+
+/**
+ * Decode one value from |length| bytes at |bytes|. Returns nil and sets
+ * |error| if the input is malformed or not fully consumed.
+ */
+id NodeJSWireDecode(const void* bytes, NSUInteger length, NSError** error);
+
+/// Decoding of a whole NSData.
+id NodeJSWireDecodeData(NSData* data, NSError** error);
+
+#endif // NODECOCOA_NODEJS_WIRE_FORMAT_H_
@@ -0,0 +1,191 @@
+#import "NodeJSWireFormat.h"
+#import "NodeJS.h"
+#import "NodeJSWireCodec.h"
+
+
+static NSError* WireError(int code, NSString* description) {
+  return [NSError errorWithDomain:(NSString*)NodeJSNSErrorDomain code:code
+      userInfo:[NSDictionary dictionaryWithObject:description
+                                           forKey:NSLocalizedDescriptionKey]];
+}
+
+// -----------------------------------------------------------------------------
+// Encoding
+
+static void PutString(NSMutableData* data, uint8_t tag, NSString* str) {
+  CFStringRef s = (CFStringRef)str;
+  CFIndex length = CFStringGetLength(s);
+  const char* fast = CFStringGetCStringPtr(s, kCFStringEncodingUTF8);
+  if (fast) {
+    WirePutBytes(data, tag, fast, strlen(fast));
+    return;
+  }
+  CFIndex size = 0;
+  CFStringGetBytes(s, CFRangeMake(0, length), kCFStringEncodingUTF8, 0, false,
+                   NULL, 0, &size);
+  WirePutU8(data, tag);
+  WirePutU32(data, (uint32_t)size);
+  NSUInteger offset = [data length];
+  [data increaseLengthBy:size];
+  CFStringGetBytes(s, CFRangeMake(0, length), kCFStringEncodingUTF8, 0, false,
+                   (UInt8*)[data mutableBytes] + offset, size, NULL);
+}
+
+
+static void PutNumber(NSMutableData* data, NSNumber* n) {
+  if (CFGetTypeID((CFTypeRef)n) == CFBooleanGetTypeID()) {
+    WirePutU8(data, [n boolValue] ? 't' : 'f');
+    return;
+  }
+  if (!CFNumberIsFloatType((CFNumberRef)n)) {
+    long long v = [n longLongValue];
+    if (v >= INT32_MIN && v <= INT32_MAX) {
+      WirePutU8(data, 'i');
+      WirePutU32(data, (uint32_t)(int32_t)v);
+      return;
+    }
+  }
+  WirePutDouble(data, 'd', [n doubleValue]);
+}
+
+
+static BOOL Encode(id obj, NSMutableData* data, int depth, NSError** error) {
+  if (depth > kWireMaxDepth) {
+    if (error) {
+      *error = WireError(NodeJSWireFormatDepthLimitError,
+                         @"maximum depth exceeded");
+    }
+    return NO;
+  }
+  if (!obj || obj == [NSNull null]) {
+    WirePutU8(data, 'z');
+  } else if ([obj isKindOfClass:[NSString class]]) {
+    PutString(data, 's', obj);
+  } else if ([obj isKindOfClass:[NSNumber class]]) {
+    PutNumber(data, obj);
+  } else if ([obj isKindOfClass:[NSData class]]) {
+    WirePutBytes(data, 'b', [obj bytes], [obj length]);
+  } else if ([obj isKindOfClass:[NSDate class]]) {
+    WirePutDouble(data, 'D', [obj timeIntervalSince1970] * 1000.0);
+  } else if ([obj isKindOfClass:[NSArray class]] ||
+             [obj isKindOfClass:[NSSet class]]) {
+    WirePutU8(data, 'a');
+    WirePutU32(data, (uint32_t)[obj count]);
+    for (id item in obj) {
+      if (!Encode(item, data, depth + 1, error)) return NO;
+    }
+  } else if ([obj isKindOfClass:[NSDictionary class]]) {
+    WirePutU8(data, 'o');
+    WirePutU32(data, (uint32_t)[obj count]);
+    for (id key in obj) {
+      assert([key isKindOfClass:[NSString class]]);
+      PutString(data, 's', key);
+      if (!Encode([obj objectForKey:key], data, depth + 1, error)) return NO;
+    }
+  } else {
+    PutString(data, 's', [obj description]);
+  }
+  return YES;
+}
+
+
+BOOL NodeJSWireEncode(id object, NSMutableData* data, NSError** error) {
+  NSUInteger length = [data length];
+  if (Encode(object, data, 0, error)) return YES;
+  [data setLength:length];
+  return NO;
+}
+
+// -----------------------------------------------------------------------------
+// Decoding
+
+static id Decode(WireReader* r, NSError** error) {
+  if (!r->Has(1) || r->depth > kWireMaxDepth) goto malformed;
+  {
+    uint8_t tag = *r->p++;
+    uint32_t length;
+    const uint8_t* payload;
+    switch (tag) {
+      case 'z': return [NSNull null];
+      case 't': return (id)kCFBooleanTrue;
+      case 'f': return (id)kCFBooleanFalse;
+      case 'i':
+        if (!r->Has(4)) goto malformed;
+        return [NSNumber numberWithInt:(int32_t)r->U32()];
+      case 'd':
+      case 'D': {
+        if (!r->Has(8)) goto malformed;
+        double v = r->F64();
+        if (tag == 'd') return [NSNumber numberWithDouble:v];
+        return [NSDate dateWithTimeIntervalSince1970:v / 1000.0];
+      }
+      case 's': {
+        if (!(payload = r->Payload(&length))) goto malformed;
+        NSString* str = [[NSString alloc] initWithBytes:payload length:length
+                                               encoding:NSUTF8StringEncoding];
+        if (!str) goto malformed;
+        return [str autorelease];
+      }
+      case 'b':
+        if (!(payload = r->Payload(&length))) goto malformed;
+        return [NSData dataWithBytes:payload length:length];
+      case 'a': {
+        if (!r->Has(4)) goto malformed;
+        uint32_t count = r->U32();
+        if (!r->Has(count)) goto malformed;  // at least one byte per value
+        NSMutableArray* array = [NSMutableArray arrayWithCapacity:count];
+        r->depth++;
+        for (uint32_t i = 0; i < count; ++i) {
+          id item = Decode(r, error);
+          if (!item) return nil;
+          [array addObject:item];
+        }
+        r->depth--;
+        return array;
+      }
+      case 'o': {
+        if (!r->Has(4)) goto malformed;
+        uint32_t count = r->U32();
+        if (!r->Has((NSUInteger)count * 2)) goto malformed;
+        NSMutableDictionary* dict =
+            [NSMutableDictionary dictionaryWithCapacity:count];
+        r->depth++;
+        for (uint32_t i = 0; i < count; ++i) {
+          if (!r->Has(1) || *r->p != 's') goto malformed;
+          id key = Decode(r, error);
+          if (!key) return nil;
+          id value = Decode(r, error);
+          if (!value) return nil;
+          [dict setObject:value forKey:key];
+        }
+        r->depth--;
+        return dict;
+      }
+    }
+  }
+malformed:
+  if (error) {
+    *error = WireError(NodeJSWireFormatMalformedError,
+                       @"malformed wire format data");
+  }
+  return nil;
+}
+
+
+id NodeJSWireDecode(const void* bytes, NSUInteger length, NSError** error) {
+  WireReader r = { (const uint8_t*)bytes, (const uint8_t*)bytes + length, 0 };
+  id obj = Decode(&r, error);
+  if (obj && r.p != r.end) {
+    if (error) {
+      *error = WireError(NodeJSWireFormatMalformedError,
+                         @"trailing wire format data");
+    }
+    return nil;
+  }
+  return obj;
+}
+
+
+id NodeJSWireDecodeData(NSData* data, NSError** error) {
+  return NodeJSWireDecode([data bytes], [data length], error);
+}
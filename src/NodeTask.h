@@ -1,3 +1,7 @@
+#ifndef NODECOCOA_NODE_TASK_H_
+#define NODECOCOA_NODE_TASK_H_
+
+#import <NodeCocoa/NodeWorkerPool.h>
 
 @interface NodeTask : NSObject {
   NSTask* task_;
@@ -22,10 +26,42 @@
 // Called when node exits. Query |terminationStatus| to get the exit code.
 @property(retain) void(^onExit)(NodeTask*);
 
-// Path to "node" executable. Automatically resolved at program launch.
+// Path to "node" executable. Automatically resolved the first time NodeTask is
+// used: the user defaults, NODE_PATH and common locations are checked right
+// away, and if that fails, a login shell's "which node" runs on a background
+// thread (its answer is remembered in user defaults for later launches).
+// Waits for the shell, except on the main thread, which gets nil instead while
+// it's still running.
 + (NSString*)nodeExecutablePath;
 + (void)setNodeExecutablePath:(NSString*)path;
 
+// Run a short script in a pool of prewarmed node processes, avoiding the cost
+// of starting node for every script. |source| is the body of a function
+// taking |require|, |args| and |callback|; it either returns its result or
+// calls callback(err, result) later:
+//
+//   [NodeTask runScript:@"return require('path').join(args[0], args[1])"
+//             arguments:[NSArray arrayWithObjects:@"a", @"b", nil]
+//              callback:^(NSError* err, id result) { ... }];
+//
+// Processes keep compiled scripts, so running the same source again is
+// cheap. |callback| is called on the main thread. Returns false if the
+// pool has been stopped.
++ (BOOL)runScript:(NSString*)source
+        arguments:(NSArray*)arguments
+         callback:(NodeWorkerCallback)callback;
+
+// The pool used by |runScript:arguments:callback:|: |sharedPoolSize|
+// processes (defaults to one per CPU) with |libraryPaths| as NODE_PATH,
+// replaced after 1000 scripts or when using more than 256 MB.
++ (NodeWorkerPool*)sharedPool;
++ (NSUInteger)sharedPoolSize;
++ (void)setSharedPoolSize:(NSUInteger)size;  // before the pool is used
+
+// Start the shared pool's processes now (in the background) rather than on
+// the first |runScript:arguments:callback:|.
++ (void)prewarmSharedPool;
+
 // Starting node, passing optional |arguments| to node. Returns false if node is
 // already running or +nodeExecutablePath is nil. May rise
 // NSInvalidArgumentException if process birth fail (kind of internal error).
@@ -60,3 +96,5 @@
 - (BOOL)sendSignal:(int)signal;
 
 @end
+
+#endif // NODECOCOA_NODE_TASK_H_
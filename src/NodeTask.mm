@@ -1,5 +1,7 @@
 #import "NodeTask.h"
 #import "NSTask+node.h"
+#import "NodeJS.h"
+#include <signal.h>
 
 #define BLOCK_EXCH(dst, src) {\
   id old = (dst);\
@@ -7,12 +9,70 @@
   if ((old)) [(old) release];\
 }
 
+// Evaluates scripts for +runScript:arguments:callback: in the shared pool
+static const char* kScriptModuleSource =
+"var cache = {}, cached = 0;\n"
+"exports.run = function (source, args, callback) {\n"
+"  var fn = cache[source];\n"
+"  if (!fn) {\n"
+"    if (cached === 256) { cache = {}; cached = 0; }\n"
+"    fn = cache[source] = new Function('require', 'args', 'callback',\n"
+"                                      source);\n"
+"    cached++;\n"
+"  }\n"
+"  return fn(require, args, callback);\n"
+"};\n";
+
+
+// The shared pool. Its module (kScriptModuleSource) is written to the script
+// path when the pool starts, failing the start if it can't be, and removed
+// when the pool stops.
+@interface NodeTaskPool : NodeWorkerPool
+@end
+
+@implementation NodeTaskPool
+
+- (void)_removeScriptModule {
+  [[NSFileManager defaultManager] removeItemAtPath:scriptPath_ error:nil];
+}
+
+- (BOOL)start:(NSError **)error {
+  if (started_) return [super start:error];
+  if (![[NSString stringWithUTF8String:kScriptModuleSource]
+      writeToFile:scriptPath_ atomically:YES encoding:NSUTF8StringEncoding
+            error:error]) {
+    return NO;
+  }
+  if ([super start:error]) return YES;
+  [self _removeScriptModule];
+  return NO;
+}
+
+- (void)stop {
+  [super stop];
+  [self _removeScriptModule];
+}
+
+@end
+
+
 @implementation NodeTask
 
 @synthesize libraryPaths = libraryPaths_;
 
 static NSString* kNodeExecutablePath = nil;
+static dispatch_group_t kResolving = NULL;
+static NSString* const kResolvedPathKey = @"NodeTaskResolvedNodeExecutablePath";
+
+static const NSUInteger kMaxScriptsPerProcess = 1000;
+static const uint64_t kMaxResidentSize = 256 * 1024 * 1024;
 
+static NodeWorkerPool* kSharedPool = nil;
+static NSUInteger kSharedPoolSize = 0;
+static dispatch_once_t kSharedPoolStarted;
+static volatile BOOL kSharedPoolRunning = NO;
+
+// Cheap checks only -- see +_whichNode for the slow one
 + (NSString*)findNodeExecutablePath {
   NSString* s = nil;
   NSFileManager* fm = [NSFileManager defaultManager];
@@ -23,6 +83,11 @@ static NSString* kNodeExecutablePath = nil;
   if (s && [fm isExecutableFileAtPath:s])
     return s;
   
+  // what we found last time
+  s = [defaults stringForKey:kResolvedPathKey];
+  if (s && [fm isExecutableFileAtPath:s])
+    return s;
+  
   // look for NODE_PATH in env
   // Note: Will only work if set in ~/.MacOSX/environment.plist or passed at
   // cocoa application launch (i.e. ~/.bashrc et. al. will not affect this)
@@ -50,31 +115,142 @@ static NSString* kNodeExecutablePath = nil;
     }
   }
   
-  // consult which (this uses a real login shell, so might be slow)
-  int status;
-  s = [NSTask outputForShellCommand:@"which node" status:&status];
-  if (status == 0) return s;
-  
   return nil;
 }
 
 
-+ (void)load {
-  NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+// Consult which (this uses a real login shell, so might be slow)
++ (NSString*)_whichNode {
+  int status;
+  NSString* s = [NSTask outputForShellCommand:@"which node" status:&status];
+  if (status != 0) return nil;
+  s = [s stringByTrimmingCharactersInSet:
+      [NSCharacterSet whitespaceAndNewlineCharacterSet]];
+  [[NSUserDefaults standardUserDefaults] setObject:s forKey:kResolvedPathKey];
+  return s;
+}
+
+
++ (void)initialize {
+  if (self != [NodeTask class]) return;
+  kResolving = dispatch_group_create();
   kNodeExecutablePath = [[self findNodeExecutablePath] retain];
-  [pool drain];
+  if (kNodeExecutablePath) return;
+  // Ask the shell in the background
+  dispatch_group_async(kResolving,
+      dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+    NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+    NSString* path = [[self _whichNode] retain];
+    @synchronized(self) {
+      if (!kNodeExecutablePath) kNodeExecutablePath = path;
+      else [path release];
+    }
+    [pool drain];
+  });
 }
 
 
 + (NSString*)nodeExecutablePath {
-  return kNodeExecutablePath;
+  // The main thread doesn't wait for the shell (see NodeTask.h)
+  if (![NSThread isMainThread])
+    dispatch_group_wait(kResolving, DISPATCH_TIME_FOREVER);
+  @synchronized(self) {
+    return [[kNodeExecutablePath retain] autorelease];
+  }
 }
 
 
 + (void)setNodeExecutablePath:(NSString*)path {
-  id old = kNodeExecutablePath;
-  kNodeExecutablePath = path ? [path retain] : nil;
-  if (old) [old release];
+  // Note: setting the path before resolution is done overrides it
+  @synchronized(self) {
+    id old = kNodeExecutablePath;
+    kNodeExecutablePath = path ? [path retain] : nil;
+    if (old) [old release];
+  }
+}
+
+
++ (NSUInteger)sharedPoolSize {
+  return kSharedPoolSize ? kSharedPoolSize
+                         : [[NSProcessInfo processInfo] activeProcessorCount];
+}
+
+
++ (void)setSharedPoolSize:(NSUInteger)size {
+  kSharedPoolSize = size;
+}
+
+
++ (NodeWorkerPool*)sharedPool {
+  static dispatch_once_t once;
+  dispatch_once(&once, ^{
+    NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent:
+        [NSString stringWithFormat:@"NodeTask-%d.js",
+            [[NSProcessInfo processInfo] processIdentifier]]];
+    kSharedPool = [[NodeTaskPool alloc] initWithScriptPath:path
+        workerCount:[self sharedPoolSize]];
+    kSharedPool.prewarm = YES;
+    kSharedPool.maxJobsPerProcess = kMaxScriptsPerProcess;
+    kSharedPool.maxResidentSize = kMaxResidentSize;
+    NodeTask* task = [[NodeTask alloc] init];
+    kSharedPool.searchPaths = task.libraryPaths;
+    [task release];
+  });
+  return kSharedPool;
+}
+
+
+// Starts the shared pool once the executable has been resolved, then calls
+// |block| (on a background queue) with the error it failed with, if any
++ (void)_withStartedSharedPool:(void(^)(NSError*))block {
+  NodeWorkerPool* sharedPool = [self sharedPool];
+  static NSError* startError = nil;
+  block = [block copy];
+  dispatch_group_notify(kResolving,
+      dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+    dispatch_once(&kSharedPoolStarted, ^{
+      NSError* error = nil;
+      sharedPool.nodeExecutablePath = [self nodeExecutablePath];
+      if ([sharedPool start:&error])
+        kSharedPoolRunning = YES;
+      else
+        startError = [error retain];
+    });
+    block(startError);
+    [block release];
+  });
+}
+
+
++ (void)prewarmSharedPool {
+  [self _withStartedSharedPool:^(NSError* error) {
+    if (error) NSLog(@"NodeTask: failed to start pool: %@", error);
+  }];
+}
+
+
++ (BOOL)runScript:(NSString*)source
+        arguments:(NSArray*)arguments
+         callback:(NodeWorkerCallback)callback {
+  NSArray* args = [NSArray arrayWithObjects:source,
+      arguments ? (id)arguments : (id)[NSArray array], nil];
+  if (kSharedPoolRunning)
+    return [kSharedPool dispatch:@"run" args:args callback:callback];
+  // first use -- dispatch once the pool has started
+  [args retain];
+  callback = [callback copy];
+  [self _withStartedSharedPool:^(NSError* error) {
+    if (!error &&
+        ![kSharedPool dispatch:@"run" args:args callback:callback]) {
+      error = [NSError nodeErrorWithLocalizedDescription:@"pool stopped"];
+    }
+    if (error && callback) {
+      dispatch_async(dispatch_get_main_queue(), ^{ callback(error, nil); });
+    }
+    [args release];
+    [callback release];
+  }];
+  return YES;
 }
 
 
@@ -110,7 +286,8 @@ static NSString* kNodeExecutablePath = nil;
 
 - (BOOL)startWithArguments:(NSArray*)arguments {
   // already started or node not found
-  if (self.isRunning || !kNodeExecutablePath) {
+  NSString* launchPath = [NodeTask nodeExecutablePath];
+  if (self.isRunning || !launchPath) {
     return NO;
   }
   
@@ -130,7 +307,7 @@ static NSString* kNodeExecutablePath = nil;
   task_ = [[NSTask alloc] init];
   if (oldTask) [oldTask release];
   // node -arg -arg -arg
-  task_.launchPath = kNodeExecutablePath;
+  task_.launchPath = launchPath;
   if (arguments)
     task_.arguments = arguments;
   // cd <bundle>/Resources
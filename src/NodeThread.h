@@ -0,0 +1,109 @@
+#ifndef NODECOCOA_NODE_THREAD_H_
+#define NODECOCOA_NODE_THREAD_H_
+
+#import <NodeCocoa/node.h>
+#import <NodeCocoa/NodeJSAtomic.h>
+
+typedef void (^NodeThreadCallback)(NSError *err, id result);
+
+struct NodeThreadRing;
+struct NodeThreadEntry;
+struct NodeThreadPendingTable;
+
+/// Counters reported by |-[NodeThread statistics]|.
+typedef struct {
+  uint64_t invocations;  // entries accepted by invoke:args:callback:
+  uint64_t rejected;     // invocations which found the queue full
+  uint64_t wakeups;      // node thread wakeups (ev_async callbacks)
+  uint64_t batches;      // calls to process.host.recv
+  uint64_t completions;  // callbacks completed (successfully or not)
+  uint64_t deliveries;   // completion batches handed to the main thread
+} NodeThreadStats;
+
+/**
+ * A background thread running node.
+ *
+ * Invocations from the host are queued in a bounded, lock-free ring which the
+ * node thread drains in batches. Each batch is passed to JavaScript as a single
+ * call to |process.host.recv(calls)| where |calls| is a flat array of
+ * alternating function names and argument arrays:
+ *
+ *   process.host.recv = function (calls) {
+ *     for (var i = 0; i < calls.length; i += 2)
+ *       this[calls[i]].apply(this, calls[i+1]);
+ *   }
+ *
+ * Invocations with a callback get a node-style |function (err, ...)| appended
+ * to their arguments. Completions are delivered on the main thread, and
+ * completions which arrive while a delivery is already pending are coalesced
+ * into that delivery. The callback receives an NSArray of the values passed
+ * after |err|. If |recv| throws, every invocation in the batch which hasn't
+ * completed yet fails with the exception (later callbacks are ignored).
+ *
+ * Arguments and results are converted with NodeJSConverter.
+ *
+ * Note: node can only run once per process, so a NodeThread can't be used
+ * together with NodeJSApplicationMain or another NodeThread.
+ */
+@interface NodeThread : NSThread {
+  NSString *scriptPath_;
+ @public  // accessed from the node thread's C callbacks
+  ev_async dequeueInputNotifier_;
+  ev_prepare idleCheck_;  // idle-time GC (see NodeJSHeap.h)
+  ev_timer idleTimer_;
+  BOOL idleTimedOut_;
+  struct NodeThreadRing *inputRing_;
+  volatile int32_t wakeupPending_;
+  volatile int32_t exited_;  // set once node::Start has returned
+  NSUInteger maxBatchSize_;
+  struct NodeThreadPendingTable *pending_;
+  v8::Persistent<v8::Object> nodeProcessHost_;
+  v8::Persistent<v8::Function> makeCallback_;
+
+  NodeJSSpinLock outputLock_;
+  struct NodeThreadEntry *outputHead_;
+  struct NodeThreadEntry *outputTail_;
+  BOOL deliveryScheduled_;
+
+  NodeThreadStats stats_;
+}
+
+/// Maximum number of invocations per |recv| call. Defaults to 256.
+@property(nonatomic) NSUInteger maxBatchSize;
+
++ (NodeThread*)mainNodeThread;
++ (void)setNodeSearchPaths:(NSArray*)paths;
++ (NodeThread*)detachNewNodeThreadRunningScript:(NSString *)scriptPath;
++ (NodeThread*)detachNewNodeThreadRunningScript:(NSString *)scriptPath
+                                withSearchPaths:(NSArray *)searchPaths;
+
+/// Queue capacity defaults to 4096 invocations.
+- (id)initWithScriptPath:(NSString *)scriptPath;
+
+/// |capacity| is rounded up to a power of two.
+- (id)initWithScriptPath:(NSString *)scriptPath
+           queueCapacity:(NSUInteger)capacity;
+
+/**
+ * Queue a call to |process.host[functionName]|. Blocks while the queue is full
+ * (or returns NO if called on the node thread itself). Returns NO if the thread
+ * has been cancelled.
+ */
+- (BOOL)invoke:(NSString*)functionName
+          args:(NSArray*)args
+      callback:(NodeThreadCallback)callback;
+
+/// Like |invoke:args:callback:| but returns NO instead of blocking.
+- (BOOL)tryInvoke:(NSString*)functionName
+             args:(NSArray*)args
+         callback:(NodeThreadCallback)callback;
+
+- (void)emit:(NSString *)name;
+- (void)emit:(NSArray*)args callback:(NodeThreadCallback)callback;
+
+/// Current counters (updated without locking, so approximate while running).
+- (NodeThreadStats)statistics;
+
+@end
+
+#endif // NODECOCOA_NODE_THREAD_H_
@@ -0,0 +1,721 @@
+#import "NodeThread.h"
+#import "NodeJS.h"
+#import "NodeJSConverter.h"
+#import "NodeJSInternTable.h"
+#import "NodeJSChannel.h"
+#import <node.h>
+#import <node_events.h>
+
+using namespace v8;
+
+static const NSUInteger kDefaultQueueCapacity = 4096;
+static const int kMaxBatchesPerWakeup = 8;  // then yield to other I/O
+static const uint32_t kMaxPendingSlots = 1 << 22;
+
+// Invocation (in the input ring, pending a JS callback or in the output list)
+struct NodeThreadEntry {
+  NSString* functionName;
+  NSArray* args;
+  id result;
+  NSError* error;
+  NodeThreadCallback callback;
+  NodeThreadEntry* next;
+};
+
+
+static void DisposeEntry(NodeThreadEntry* entry) {
+  [entry->functionName release];
+  [entry->args release];
+  [entry->result release];
+  [entry->error release];
+  [entry->callback release];
+  CFAllocatorDeallocate(NULL, entry);
+}
+
+
+// -----------------------------------------------------------------------------
+// Bounded multi-producer, single-consumer ring. Each cell carries a sequence
+// number telling whether it's free for the producer at a given position or
+// ready for the consumer (Vyukov's bounded queue).
+
+struct RingCell {
+  volatile int64_t sequence;
+  NodeThreadEntry* entry;
+};
+
+struct NodeThreadRing {
+  RingCell* cells;
+  int64_t mask;
+  volatile int64_t enqueuePos __attribute__((aligned(64)));
+  int64_t dequeuePos __attribute__((aligned(64)));  // node thread only
+};
+
+
+static NodeThreadRing* RingCreate(NSUInteger capacity) {
+  NSUInteger size = 2;
+  while (size < capacity) size <<= 1;
+  NodeThreadRing* ring = new NodeThreadRing;
+  ring->cells = (RingCell*)calloc(size, sizeof(RingCell));
+  for (NSUInteger i = 0; i < size; ++i)
+    ring->cells[i].sequence = i;
+  ring->mask = size - 1;
+  ring->enqueuePos = 0;
+  ring->dequeuePos = 0;
+  return ring;
+}
+
+
+static void RingDestroy(NodeThreadRing* ring) {
+  free(ring->cells);
+  delete ring;
+}
+
+
+// Returns false if the ring is full
+static bool RingPush(NodeThreadRing* ring, NodeThreadEntry* entry) {
+  int64_t pos = ring->enqueuePos;
+  RingCell* cell;
+  for (;;) {
+    cell = &ring->cells[pos & ring->mask];
+    int64_t seq = cell->sequence;
+    NodeJSMemoryBarrier();
+    int64_t dif = seq - pos;
+    if (dif == 0) {
+      if (NodeJSAtomicCompareAndSwap64(pos, pos + 1, &ring->enqueuePos))
+        break;
+    } else if (dif < 0) {
+      return false;
+    }
+    pos = ring->enqueuePos;
+  }
+  cell->entry = entry;
+  NodeJSMemoryBarrier();
+  cell->sequence = pos + 1;
+  return true;
+}
+
+
+// Returns NULL if the ring is empty. Must only be called from the node thread.
+static NodeThreadEntry* RingPop(NodeThreadRing* ring) {
+  int64_t pos = ring->dequeuePos;
+  RingCell* cell = &ring->cells[pos & ring->mask];
+  int64_t seq = cell->sequence;
+  NodeJSMemoryBarrier();
+  if (seq - (pos + 1) < 0)
+    return NULL;
+  NodeThreadEntry* entry = cell->entry;
+  NodeJSMemoryBarrier();
+  cell->sequence = pos + ring->mask + 1;
+  ring->dequeuePos = pos + 1;
+  return entry;
+}
+
+
+// -----------------------------------------------------------------------------
+// Entries waiting for a JS callback. JavaScript refers to an entry by an id
+// combining slot and generation, so stale or repeated callbacks are ignored.
+
+struct PendingSlot {
+  NodeThreadEntry* entry;
+  uint32_t generation;
+  uint32_t nextFree;
+};
+
+struct NodeThreadPendingTable {
+  PendingSlot* slots;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t freeHead;  // kMaxPendingSlots if none
+};
+
+
+static NodeThreadPendingTable* PendingCreate() {
+  NodeThreadPendingTable* t = new NodeThreadPendingTable;
+  t->slots = NULL;
+  t->count = t->capacity = 0;
+  t->freeHead = kMaxPendingSlots;
+  return t;
+}
+
+
+static void PendingDestroy(NodeThreadPendingTable* t) {
+  free(t->slots);
+  delete t;
+}
+
+
+// Returns the id for |entry| or -1 if the table is full
+static double PendingAdd(NodeThreadPendingTable* t, NodeThreadEntry* entry) {
+  uint32_t slot;
+  if (t->freeHead != kMaxPendingSlots) {
+    slot = t->freeHead;
+    t->freeHead = t->slots[slot].nextFree;
+  } else {
+    if (t->count == t->capacity) {
+      if (t->capacity == kMaxPendingSlots) return -1;
+      t->capacity = t->capacity ? t->capacity * 2 : 256;
+      t->slots = (PendingSlot*)realloc(t->slots,
+                                       sizeof(PendingSlot) * t->capacity);
+    }
+    slot = t->count++;
+    t->slots[slot].generation = 0;
+  }
+  t->slots[slot].entry = entry;
+  return (double)t->slots[slot].generation * kMaxPendingSlots + slot;
+}
+
+
+// Removes and returns the entry identified by |id| or NULL
+static NodeThreadEntry* PendingTake(NodeThreadPendingTable* t, double id) {
+  if (id < 0) return NULL;
+  uint32_t slot = (uint32_t)fmod(id, kMaxPendingSlots);
+  uint32_t generation = (uint32_t)(id / kMaxPendingSlots);
+  if (slot >= t->count) return NULL;
+  PendingSlot* s = &t->slots[slot];
+  if (!s->entry || s->generation != generation) return NULL;
+  NodeThreadEntry* entry = s->entry;
+  s->entry = NULL;
+  s->generation++;
+  s->nextFree = t->freeHead;
+  t->freeHead = slot;
+  return entry;
+}
+
+
+// -----------------------------------------------------------------------------
+
+static NSError* ErrorFromV8Value(Local<Value> er) {
+  HandleScope scope;
+  Local<Value> msg = er;
+  if (er->IsObject()) {
+    Local<Value> m = er->ToObject()->Get(String::NewSymbol("message"));
+    if (!m->IsUndefined()) msg = m;
+  }
+  String::Utf8Value utf8(msg->ToString());
+  return [NSError nodeErrorWithLocalizedDescription:
+      [NSString stringWithUTF8String:*utf8 ? *utf8 : "unknown error"]];
+}
+
+
+@interface NodeThread (Private)
+- (void)_wakeup;
+- (void)_enqueueOutput:(NodeThreadEntry*)entry;
+- (void)_deliverOutput;
+@end
+
+
+// Complete |entry| with |error| or |result|
+static void CompleteEntry(NodeThread* self, NodeThreadEntry* entry,
+                          NSError* error, id result) {
+  [entry->error release];
+  entry->error = [error retain];
+  [entry->result release];
+  entry->result = [result retain];
+  self->stats_.completions++;
+  if (entry->callback) {
+    [self _enqueueOutput:entry];
+  } else {
+    // Note: Since there is no callback for this entry, we can't pass on the
+    // error to the caller. Instead, we report the error on stderr.
+    if (error)
+      fprintf(stderr, "%s\n", [[error localizedDescription] UTF8String]);
+    DisposeEntry(entry);
+  }
+}
+
+
+static void CompleteFromJS(NodeThread* self, const Arguments& args) {
+  if (args.Length() < 2 || !args[0]->IsNumber() || !args[1]->IsObject())
+    return;
+  NodeThreadEntry* entry = PendingTake(self->pending_, args[0]->NumberValue());
+  if (!entry) return;  // already completed
+
+  Local<Object> argv = args[1]->ToObject();
+  uint32_t argc = argv->Get(String::NewSymbol("length"))->Uint32Value();
+  NSError* error = nil;
+  NSMutableArray* result = nil;
+  Local<Value> err = argc > 0 ? argv->Get(0) : Local<Value>();
+  if (!err.IsEmpty() && !err->IsNull() && !err->IsUndefined()) {
+    error = ErrorFromV8Value(err);
+  } else {
+    NodeJSConverter* converter = [NodeJSConverter sharedConverter];
+    result = [NSMutableArray arrayWithCapacity:argc ? argc - 1 : 0];
+    for (uint32_t i = 1; i < argc && !error; ++i) {
+      id obj = [converter objectFromV8Value:argv->Get(i) options:0
+                                      error:&error];
+      [result addObject:obj ? obj : [NSNull null]];
+    }
+    if (error) result = nil;
+  }
+  CompleteEntry(self, entry, error, result);
+}
+
+
+// process.host callback: done(id, arguments)
+static v8::Handle<Value> CallbackDone(const Arguments& args) {
+  HandleScope scope;
+  NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+  CompleteFromJS((NodeThread*)External::Unwrap(args.Data()), args);
+  [pool drain];
+  return Undefined();
+}
+
+
+// Call process.host.recv once for |count| entries
+static void DispatchBatch(NodeThread* self, NodeThreadEntry** batch,
+                          int count) {
+  HandleScope scope;
+  static Persistent<String> recv_symbol;
+  if (recv_symbol.IsEmpty())
+    recv_symbol = NODE_PSYMBOL("recv");
+  Local<Value> recv_v = self->nodeProcessHost_->Get(recv_symbol);
+  if (!recv_v->IsFunction()) {
+    NSError* error = [NSError nodeErrorWithLocalizedDescription:
+        @"process.host.recv is not a function"];
+    for (int i = 0; i < count; ++i)
+      CompleteEntry(self, batch[i], error, nil);
+    return;
+  }
+  Local<Function> recv = Local<Function>::Cast(recv_v);
+
+  // Encode calls as [name, args, name, args, ...]
+  NodeJSConverter* converter = [NodeJSConverter sharedConverter];
+  double* ids = (double*)alloca(sizeof(double) * count);
+  Local<Array> calls = Array::New(count * 2);
+  uint32_t n = 0;
+  for (int i = 0; i < count; ++i) {
+    NodeThreadEntry* entry = batch[i];
+    ids[i] = -1;
+    NSError* error = nil;
+    Local<Array> args;
+    if (entry->args) {
+      Local<Value> args_v =
+          [converter v8ValueFromObject:entry->args error:&error];
+      if (!args_v.IsEmpty()) args = Local<Array>::Cast(args_v);
+    } else {
+      args = Array::New(0);
+    }
+    if (args.IsEmpty()) {
+      CompleteEntry(self, entry, error, nil);
+      batch[i] = NULL;
+      continue;
+    }
+    if (entry->callback) {
+      ids[i] = PendingAdd(self->pending_, entry);
+      if (ids[i] < 0) {
+        CompleteEntry(self, entry, [NSError nodeErrorWithLocalizedDescription:
+            @"too many pending callbacks"], nil);
+        batch[i] = NULL;
+        continue;
+      }
+      Local<Value> id = Number::New(ids[i]);
+      args->Set(args->Length(), self->makeCallback_->Call(
+          self->nodeProcessHost_, 1, &id));
+    }
+    calls->Set(n++, NodeJSInternedSymbol(entry->functionName));
+    calls->Set(n++, args);
+  }
+  if (n == 0) return;
+  if (n < (uint32_t)count * 2)
+    calls->Set(String::NewSymbol("length"), Integer::New(n));
+
+  // Invoke
+  self->stats_.batches++;
+  TryCatch try_catch;
+  Local<Value> argv[1] = { calls };
+  recv->Call(self->nodeProcessHost_, 1, argv);
+  NSError* error = nil;
+  if (try_catch.HasCaught()) {
+    // formatted now, as entries complete on other threads
+    error = [NSError errorFromV8TryCatch:try_catch detail:
+        [NodeJS errorDetail] == NodeJSErrorDetailMessage ?
+            NodeJSErrorDetailMessage : NodeJSErrorDetailFull];
+  }
+
+  for (int i = 0; i < count; ++i) {
+    NodeThreadEntry* entry = batch[i];
+    if (!entry) continue;
+    if (!entry->callback) {
+      // no callback -- report exception (once) and dispose of entry
+      CompleteEntry(self, entry, error, nil);
+      error = nil;
+    } else if (error) {
+      // fail entries which haven't completed yet
+      if (PendingTake(self->pending_, ids[i]) == entry)
+        CompleteEntry(self, entry, error, nil);
+    }
+    // else: callback will be invoked in the future
+  }
+}
+
+
+// Fail everything still queued (the thread has been cancelled)
+static void DrainCancelled(NodeThread* self) {
+  NSError* error = [NSError nodeErrorWithLocalizedDescription:@"cancelled"];
+  NodeThreadEntry* entry;
+  while ((entry = RingPop(self->inputRing_)))
+    CompleteEntry(self, entry, entry->callback ? error : nil, nil);
+}
+
+
+// Triggered by host program, executed by node (in its thread), to dequeue
+static void DequeueInput(EV_P_ ev_async *watcher, int revents) {
+  assert(watcher->data != NULL);
+  NodeThread* self = (NodeThread*)watcher->data;
+  self->stats_.wakeups++;
+
+  // Producers which enqueue after this point will send a new wakeup
+  NodeJSAtomicCompareAndSwap32(1, 0, &self->wakeupPending_);
+
+  if ([self isCancelled]) {
+    // Stopping the watcher releases its reference to the runloop, causing node
+    // to exit as soon as it's otherwise idle.
+    ev_async_stop(EV_DEFAULT_UC_ watcher);
+    NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+    DrainCancelled(self);
+    [pool drain];
+    return;
+  }
+
+  int maxBatch = (int)MAX(self->maxBatchSize_, (NSUInteger)1);
+  NodeThreadEntry** batch =
+      (NodeThreadEntry**)alloca(sizeof(NodeThreadEntry*) * maxBatch);
+  for (int b = 0; b < kMaxBatchesPerWakeup; ++b) {
+    int count = 0;
+    while (count < maxBatch && (batch[count] = RingPop(self->inputRing_)))
+      ++count;
+    if (count == 0) return;
+    // The thread's outer pool is never drained while node runs
+    NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+    DispatchBatch(self, batch, count);
+    [pool drain];
+  }
+
+  // More input might be queued -- come back after other events had a chance
+  [self _wakeup];
+}
+
+
+// Runs before libev waits for events. The loop is idle if the only thing
+// which happened since the last wait is the idle timer expiring.
+static void IdleCheck(EV_P_ ev_prepare *watcher, int revents) {
+  NodeThread* self = (NodeThread*)watcher->data;
+  bool busy = !self->idleTimedOut_;
+  self->idleTimedOut_ = NO;
+  double timeout = NodeJSHeapIdleCheck(busy);
+  // Neither watcher keeps the loop alive, so references are balanced by hand
+  // around starting and stopping the timer
+  if (ev_is_active(&self->idleTimer_)) {
+    ev_ref(EV_DEFAULT_UC);
+    ev_timer_stop(EV_DEFAULT_UC_ &self->idleTimer_);
+  }
+  if (timeout >= 0) {
+    ev_timer_set(&self->idleTimer_, timeout, 0.);
+    ev_timer_start(EV_DEFAULT_UC_ &self->idleTimer_);
+    ev_unref(EV_DEFAULT_UC);
+  }
+}
+
+
+static void IdleTimeout(EV_P_ ev_timer *watcher, int revents) {
+  NodeThread* self = (NodeThread*)watcher->data;
+  ev_ref(EV_DEFAULT_UC);  // libev stopped the timer
+  self->idleTimedOut_ = YES;
+}
+
+
+// called when node has been setup and is about to enter its runloop
+static void NodeThreadMain(const Arguments& args) {
+  HandleScope scope;
+  NodeThread* self = (NodeThread*)[NSThread currentThread];
+
+  NodeJSHeapAttach();
+
+  // Create process.host
+  Local<FunctionTemplate> t = FunctionTemplate::New();
+  node::EventEmitter::Initialize(t);
+  Local<Object> processHost = t->GetFunction()->NewInstance();
+  NSString *bundlePath = [[NSBundle mainBundle] bundlePath];
+  processHost->Set(String::NewSymbol("bundlePath"),
+                   String::New([bundlePath UTF8String]));
+  Local<Object> global = Context::GetCurrent()->Global();
+  Local<Object> process =
+      Local<Object>::Cast(global->Get(String::NewSymbol("process")));
+  process->Set(String::NewSymbol("host"), processHost);
+  self->nodeProcessHost_ = Persistent<Object>::New(processHost);
+  [[NodeJSChannel sharedChannel] installOnHostObject:processHost];
+
+  // Callbacks are cheap closures around a single native function
+  Local<Value> factory_v = Script::Compile(String::New(
+      "(function (done) { return function (id) {"
+      "  return function () { return done(id, arguments); }; }; })"))->Run();
+  Local<Value> done =
+      FunctionTemplate::New(&CallbackDone, External::Wrap(self))->GetFunction();
+  Local<Value> makeCallback =
+      Local<Function>::Cast(factory_v)->Call(global, 1, &done);
+  self->makeCallback_ =
+      Persistent<Function>::New(Local<Function>::Cast(makeCallback));
+
+  // Start receiving input. The pending flag was set at init, so producers
+  // haven't tried to wake us before the watcher existed.
+  self->dequeueInputNotifier_.data = self;
+  ev_async_init(&self->dequeueInputNotifier_, &DequeueInput);
+  ev_async_start(EV_DEFAULT_UC_ &self->dequeueInputNotifier_);
+  ev_async_send(EV_DEFAULT_UC_ &self->dequeueInputNotifier_);
+
+  // Tell V8 when the thread has been idle for a while. This also hands
+  // external memory changes made on other threads to V8.
+  self->idleCheck_.data = self;
+  self->idleTimer_.data = self;
+  ev_prepare_init(&self->idleCheck_, &IdleCheck);
+  ev_timer_init(&self->idleTimer_, &IdleTimeout, 0., 0.);
+  ev_prepare_start(EV_DEFAULT_UC_ &self->idleCheck_);
+  ev_unref(EV_DEFAULT_UC);
+
+  // Note: The async watcher holds a reference to the runloop, released in
+  // DequeueInput after -cancel.
+  ev_run(EV_DEFAULT_UC_ 0);
+}
+
+static NodeThread* gMainInstance_ = nil;
+
+@implementation NodeThread
+
+@synthesize maxBatchSize = maxBatchSize_;
+
++ (NodeThread*)mainNodeThread {
+  if (!gMainInstance_) {
+    [self detachNewNodeThreadRunningScript:@"main.js"];
+  }
+  return gMainInstance_;
+}
+
++ (void)setNodeSearchPaths:(NSArray*)paths {
+  assert([NSThread isMainThread]);  // since setenv is not thread safe
+  setenv("NODE_PATH", [[paths componentsJoinedByString:@":"] UTF8String], 1);
+}
+
+
++ (NodeThread*)detachNewNodeThreadRunningScript:(NSString *)scriptPath {
+  // searchPaths defaults to ["<bundle>/Resources/lib"]
+  NSString *libPath = [[[NSBundle mainBundle] resourcePath]
+      stringByAppendingPathComponent:@"lib"];
+  NSArray *searchPaths = [NSArray arrayWithObject:libPath];
+  return [self detachNewNodeThreadRunningScript:scriptPath
+                                withSearchPaths:searchPaths];
+}
+
+
++ (NodeThread*)detachNewNodeThreadRunningScript:(NSString *)scriptPath
+                                withSearchPaths:(NSArray *)searchPaths {
+  if (searchPaths) {
+    // Note: Starting multiple node threads with different search paths might
+    // lead to a race condition since we setenv() in the calling thread but
+    // -main might get called async. to the setenv()s.
+    [NodeThread setNodeSearchPaths:searchPaths];
+  }
+  if (scriptPath && ![scriptPath isAbsolutePath]) {
+    // we need an absolute path, so assume the basename to the relative path is
+    // "<bundle>/Resources"
+    scriptPath = [[[NSBundle mainBundle] resourcePath]
+        stringByAppendingPathComponent:scriptPath];
+  }
+  NodeThread *t = [[self alloc] initWithScriptPath:scriptPath];
+  [t start];
+  return [t autorelease];
+}
+
+
+- (id)initWithScriptPath:(NSString *)scriptPath {
+  return [self initWithScriptPath:scriptPath
+                    queueCapacity:kDefaultQueueCapacity];
+}
+
+
+- (id)initWithScriptPath:(NSString *)scriptPath
+           queueCapacity:(NSUInteger)capacity {
+  if (!(self = [super init])) return nil;
+  if (scriptPath) {
+    // defaults to "<bundle>/Resources/main.js" (controller in -main)
+    scriptPath_ = [scriptPath retain];
+  }
+  inputRing_ = RingCreate(capacity);
+  pending_ = PendingCreate();
+  wakeupPending_ = 1;  // until the node thread is ready (see NodeThreadMain)
+  maxBatchSize_ = 256;
+  outputLock_ = NODEJS_SPINLOCK_INIT;
+  if (!gMainInstance_) {
+    gMainInstance_ = self;
+  }
+  return self;
+}
+
+
+- (void)dealloc {
+  if (gMainInstance_ == self)
+    gMainInstance_ = nil;
+  if (scriptPath_)
+    [scriptPath_ release];
+  NodeThreadEntry* entry;
+  while ((entry = RingPop(inputRing_)))
+    DisposeEntry(entry);
+  RingDestroy(inputRing_);
+  for (uint32_t i = 0; i < pending_->count; ++i) {
+    if (pending_->slots[i].entry)
+      DisposeEntry(pending_->slots[i].entry);
+  }
+  PendingDestroy(pending_);
+  [super dealloc];
+}
+
+
+- (void)_wakeup {
+  if (NodeJSAtomicCompareAndSwap32(0, 1, &wakeupPending_))
+    ev_async_send(EV_DEFAULT_UC_ &dequeueInputNotifier_);
+}
+
+
+- (BOOL)_invoke:(NSString*)functionName
+           args:(NSArray*)args
+       callback:(NodeThreadCallback)callback
+          block:(BOOL)block {
+  if ([self isCancelled] || exited_) return NO;
+  NodeThreadEntry* entry = (NodeThreadEntry*)CFAllocatorAllocate(
+      NULL, sizeof(NodeThreadEntry), 0);
+  memset(entry, 0, sizeof(NodeThreadEntry));
+  entry->functionName = [functionName copy];
+  entry->args = [args copy];
+  entry->callback = [callback copy];
+  if (!RingPush(inputRing_, entry)) {
+    NodeJSAtomicIncrement64((volatile int64_t*)&stats_.rejected);
+    BOOL queued = NO;
+    // never wait for ourselves
+    if (block && [NSThread currentThread] != self) {
+      // Backpressure: make sure the consumer is awake and wait for room. Give
+      // up if node stops (cancelled or exited on its own) while we wait.
+      while (![self isCancelled] && !exited_) {
+        [self _wakeup];
+        usleep(50);
+        if ((queued = RingPush(inputRing_, entry)))
+          break;
+      }
+    }
+    if (!queued) {
+      // never made it into the ring, so it's still ours to dispose of
+      DisposeEntry(entry);
+      return NO;
+    }
+  }
+  NodeJSAtomicIncrement64((volatile int64_t*)&stats_.invocations);
+  [self _wakeup];
+  return YES;
+}
+
+
+- (BOOL)invoke:(NSString*)functionName
+          args:(NSArray*)args
+      callback:(NodeThreadCallback)callback {
+  return [self _invoke:functionName args:args callback:callback block:YES];
+}
+
+
+- (BOOL)tryInvoke:(NSString*)functionName
+             args:(NSArray*)args
+         callback:(NodeThreadCallback)callback {
+  return [self _invoke:functionName args:args callback:callback block:NO];
+}
+
+
+- (void)emit:(NSString *)name {
+  [self invoke:@"emit" args:[NSArray arrayWithObject:name] callback:nil];
+}
+
+- (void)emit:(NSArray*)args callback:(NodeThreadCallback)callback {
+  [self invoke:@"emit" args:args callback:callback];
+}
+
+
+- (NodeThreadStats)statistics {
+  return stats_;
+}
+
+
+// Called on the node thread
+- (void)_enqueueOutput:(NodeThreadEntry*)entry {
+  BOOL schedule;
+  entry->next = NULL;
+  NodeJSSpinLockLock(&outputLock_);
+  if (outputTail_)
+    outputTail_->next = entry;
+  else
+    outputHead_ = entry;
+  outputTail_ = entry;
+  schedule = !deliveryScheduled_;
+  deliveryScheduled_ = YES;
+  NodeJSSpinLockUnlock(&outputLock_);
+  if (schedule) {
+    // Completions arriving before the block runs join this delivery
+    stats_.deliveries++;
+    CFRunLoopRef runloop = CFRunLoopGetMain();
+    CFRunLoopPerformBlock(runloop, kCFRunLoopCommonModes, ^{
+      [self _deliverOutput];
+    });
+    CFRunLoopWakeUp(runloop);
+  }
+}
+
+
+// Called on the main thread
+- (void)_deliverOutput {
+  NodeJSSpinLockLock(&outputLock_);
+  NodeThreadEntry* entry = outputHead_;
+  outputHead_ = outputTail_ = NULL;
+  deliveryScheduled_ = NO;
+  NodeJSSpinLockUnlock(&outputLock_);
+  while (entry) {
+    NodeThreadEntry* next = entry->next;
+    entry->callback(entry->error, entry->result);
+    DisposeEntry(entry);
+    entry = next;
+  }
+}
+
+
+- (void)cancel {
+  [super cancel];
+  // Have the node thread notice the cancellation
+  [self _wakeup];
+}
+
+
+- (void)main {
+  NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+
+  // Set name
+  [[NSThread currentThread] setName:NSStringFromClass([self class])];
+
+  // Setup node arguments
+  const char *argv[2] = {"node", NULL};
+  if (scriptPath_) {
+    argv[1] = [scriptPath_ UTF8String];
+  } else {
+    // defaults to "<bundle>/Resources/main.js"
+    argv[1] = [[[[NSBundle mainBundle] resourcePath]
+        stringByAppendingPathComponent:@"main.js"] UTF8String];
+  }
+
+  // Have node call us when it's ready to enter its runloop
+  node::Main = &NodeThreadMain;
+
+  // Start node
+  int ec = node::Start(2, (char**)argv);
+  // Make blocked and future -invoke:... calls give up instead of waiting for
+  // a runloop which is gone
+  NodeJSAtomicCompareAndSwap32(0, 1, &exited_);
+  if (ec != 0)
+    NSLog(@"%@: node exited with status %d", self, ec);
+  [pool drain];
+}
+
+
+@end
@@ -0,0 +1,134 @@
+#ifndef NODECOCOA_NODE_WORKER_POOL_H_
+#define NODECOCOA_NODE_WORKER_POOL_H_
+
+#import <Foundation/Foundation.h>
+#include <pthread.h>
+
+typedef void (^NodeWorkerCallback)(NSError *err, id result);
+
+struct NodeWorker;
+
+/// Counters reported by |-[NodeWorkerPool statisticsForWorker:]|.
+typedef struct {
+  NSUInteger queued;      // jobs currently waiting in the worker's deque
+  uint64_t dispatched;    // jobs pushed onto the worker's deque
+  uint64_t completed;     // jobs run by the worker (including failures)
+  uint64_t stolen;        // jobs the worker took from other deques
+  uint64_t restarts;      // node processes started for the worker
+  uint64_t recycled;      // ... which replaced a process over its limits
+  uint64_t timeouts;      // jobs which ran longer than |jobTimeout|
+  double totalLatency;    // seconds from dispatch to completion, summed
+  double maxLatency;
+} NodeWorkerStats;
+
+/**
+ * A pool of node worker processes running CPU-heavy JavaScript off the main
+ * thread and across cores.
+ *
+ * Node can only run once per process (libev's default loop and node's own
+ * state are process globals), so each worker is a node child process with its
+ * own V8 heap, context and module search path. Every worker loads the module
+ * at |scriptPath| and a job calls one of its exports:
+ *
+ *   // render.js
+ *   exports.render = function (template, vars, callback) {
+ *     callback(null, compile(template)(vars));
+ *   }
+ *
+ *   [pool dispatch:@"render" args:[NSArray arrayWithObjects:tpl, vars, nil]
+ *         callback:^(NSError *err, id html) { ... }];
+ *
+ * Functions get a node-style callback appended to their arguments. A function
+ * which returns something other than undefined completes with that value.
+ *
+ * Each worker has its own deque. Jobs are dispatched round-robin, workers take
+ * jobs from the front of their own deque and, when it's empty, steal from the
+ * back of other workers' deques. Arguments and results are encoded with the
+ * NodeJS wire format (see NodeJSWireFormat.h) on the worker's I/O thread.
+ * Callbacks are invoked on the main thread.
+ *
+ * A worker keeps its process (and the process its loaded modules and warm
+ * code) for as long as it can. With |prewarm| processes are started with the
+ * pool rather than by the first job, and |maxJobsPerProcess| and
+ * |maxResidentSize| bound how long a process is kept: once over either limit
+ * it's replaced after its current job.
+ *
+ * Note: Workers use stdout for framing, so console.log in worker code is
+ * redirected to stderr. SIGPIPE is ignored once the pool has been started.
+ */
+@interface NodeWorkerPool : NSObject {
+  NSString *scriptPath_;
+  NSString *nodeExecutablePath_;
+  NSArray *searchPaths_;
+  NSString *bootstrapPath_;
+  NSUInteger workerCount_;
+  struct NodeWorker *workers_;
+  volatile int32_t nextWorker_;
+  volatile BOOL running_;
+  BOOL started_;
+  BOOL prewarm_;
+  NSUInteger maxJobsPerProcess_;
+  uint64_t maxResidentSize_;
+  NSTimeInterval jobTimeout_;
+  pthread_mutex_t idleMutex_;
+  pthread_cond_t idleCond_;
+}
+
+/// Number of workers (fixed at init).
+@property(readonly) NSUInteger workerCount;
+
+/**
+ * Module search paths (NODE_PATH). Either an array of paths used by all
+ * workers, or an array of arrays of paths where worker N uses item N modulo
+ * the count. Must be set before |start:|.
+ */
+@property(retain) NSArray *searchPaths;
+
+/// Path to the node executable. Defaults to the first found of
+/// /usr/local/bin/node, /usr/bin/node and /opt/local/bin/node.
+@property(retain) NSString *nodeExecutablePath;
+
+/// Start node processes ahead of jobs: when the pool starts and right after a
+/// process is recycled. Defaults to NO (processes start on demand).
+@property BOOL prewarm;
+
+/// Replace a process after it has run this many jobs. 0 (the default) for no
+/// limit.
+@property NSUInteger maxJobsPerProcess;
+
+/// Replace a process once its resident size (reported with every reply)
+/// exceeds this many bytes. 0 (the default) for no limit.
+@property uint64_t maxResidentSize;
+
+/// Fail a job which hasn't replied within this many seconds and kill its
+/// process (the next job starts a new one). 0 (the default) for no limit.
+@property NSTimeInterval jobTimeout;
+
+/// Pool with one worker per active CPU.
+- (id)initWithScriptPath:(NSString *)scriptPath;
+
+- (id)initWithScriptPath:(NSString *)scriptPath
+             workerCount:(NSUInteger)workerCount;
+
+/// Start the worker threads. Node processes are started lazily unless
+/// |prewarm| is set. A pool can only be started once.
+- (BOOL)start:(NSError **)error;
+
+/// Stop accepting jobs, let workers finish their current job and exit.
+/// Queued jobs fail with an error.
+- (void)stop;
+
+/**
+ * Queue a call to |functionName| exported by the worker module. |args| should
+ * not be mutated after being passed. Returns NO if the pool isn't running.
+ */
+- (BOOL)dispatch:(NSString *)functionName
+            args:(NSArray *)args
+        callback:(NodeWorkerCallback)callback;
+
+/// Counters of worker |index| (approximate while running).
+- (NodeWorkerStats)statisticsForWorker:(NSUInteger)index;
+
+@end
+
+#endif // NODECOCOA_NODE_WORKER_POOL_H_
@@ -0,0 +1,703 @@
+#import "NodeWorkerPool.h"
+#import "NodeJS.h"
+#import "NodeJSWireFormat.h"
+#import "NodeJSAtomic.h"
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+
+// Run by every worker process: loads the module given as argv[2] and answers
+// framed [id, name, args] requests on stdin with [id, error, result, rss] on
+// stdout.
+// The codec mirrors NodeJSWireFormat.mm.
+static const char* kBootstrapSource =
+"var script = require(process.argv[2]);\n"
+"var out = process.stdout;\n"
+"console.log = console.info = console.warn = console.error;\n"
+"\n"
+"function Writer() { this.buf = new Buffer(1024); this.pos = 4; }\n"
+"Writer.prototype.reserve = function (n) {\n"
+"  if (this.pos + n <= this.buf.length) return;\n"
+"  var size = this.buf.length * 2;\n"
+"  while (size < this.pos + n) size *= 2;\n"
+"  var b = new Buffer(size);\n"
+"  this.buf.copy(b, 0, 0, this.pos);\n"
+"  this.buf = b;\n"
+"};\n"
+"Writer.prototype.u8 = function (v) {\n"
+"  this.reserve(1);\n"
+"  this.buf[this.pos++] = v;\n"
+"};\n"
+"Writer.prototype.u32 = function (v) {\n"
+"  this.reserve(4);\n"
+"  var b = this.buf, p = this.pos;\n"
+"  b[p] = (v >>> 24) & 255; b[p+1] = (v >>> 16) & 255;\n"
+"  b[p+2] = (v >>> 8) & 255; b[p+3] = v & 255;\n"
+"  this.pos += 4;\n"
+"};\n"
+"// IEEE-754 double, big endian (no typed arrays in this V8)\n"
+"Writer.prototype.f64 = function (tag, v) {\n"
+"  var s = v < 0 || (v === 0 && 1 / v < 0) ? 1 : 0, e = 0, m = 0;\n"
+"  if (s) v = -v;\n"
+"  if (v !== v) {\n"
+"    e = 2047; m = 2251799813685248;\n"
+"  } else if (v === Infinity) {\n"
+"    e = 2047;\n"
+"  } else if (v !== 0) {\n"
+"    e = Math.floor(Math.log(v) / Math.LN2);\n"
+"    if (e > 1023) e = 1023;\n"
+"    if (e >= -1022 && v / Math.pow(2, e) >= 2) e++;\n"
+"    if (e >= -1022 && v / Math.pow(2, e) < 1) e--;\n"
+"    if (e < -1022) {  // subnormal\n"
+"      e = 0; m = v * Math.pow(2, 1022) * 4503599627370496;\n"
+"    } else {\n"
+"      m = (v / Math.pow(2, e) - 1) * 4503599627370496; e += 1023;\n"
+"    }\n"
+"  }\n"
+"  var hi = Math.floor(m / 4294967296);\n"
+"  this.u8(tag);\n"
+"  this.u32(s * 2147483648 + e * 1048576 + hi);\n"
+"  this.u32(m - hi * 4294967296);\n"
+"};\n"
+"Writer.prototype.str = function (tag, s) {\n"
+"  var n = Buffer.byteLength(s, 'utf8');\n"
+"  this.u8(tag); this.u32(n); this.reserve(n);\n"
+"  if (n) this.buf.write(s, this.pos, 'utf8');\n"
+"  this.pos += n;\n"
+"};\n"
+"Writer.prototype.value = function (v, depth) {\n"
+"  if (depth > 512) throw new Error('maximum depth exceeded');\n"
+"  if (v === null || v === undefined || typeof v === 'function')\n"
+"    return this.u8(122);\n"
+"  switch (typeof v) {\n"
+"    case 'boolean': return this.u8(v ? 116 : 102);\n"
+"    case 'number':\n"
+"      if ((v | 0) === v) { this.u8(105); return this.u32(v >>> 0); }\n"
+"      return this.f64(100, v);\n"
+"    case 'string': return this.str(115, v);\n"
+"  }\n"
+"  var i, keys;\n"
+"  if (v instanceof Buffer) {\n"
+"    this.u8(98); this.u32(v.length); this.reserve(v.length);\n"
+"    v.copy(this.buf, this.pos, 0, v.length);\n"
+"    this.pos += v.length;\n"
+"  } else if (v instanceof Date) {\n"
+"    this.f64(68, v.getTime());\n"
+"  } else if (Array.isArray(v)) {\n"
+"    this.u8(97); this.u32(v.length);\n"
+"    for (i = 0; i < v.length; ++i) this.value(v[i], depth + 1);\n"
+"  } else {\n"
+"    keys = Object.keys(v);\n"
+"    this.u8(111); this.u32(keys.length);\n"
+"    for (i = 0; i < keys.length; ++i) {\n"
+"      this.str(115, keys[i]);\n"
+"      this.value(v[keys[i]], depth + 1);\n"
+"    }\n"
+"  }\n"
+"};\n"
+"Writer.prototype.frame = function () {\n"
+"  var n = this.pos - 4, b = this.buf;\n"
+"  b[0] = (n >>> 24) & 255; b[1] = (n >>> 16) & 255;\n"
+"  b[2] = (n >>> 8) & 255; b[3] = n & 255;\n"
+"  return b.slice(0, this.pos);\n"
+"};\n"
+"\n"
+"function Reader(buf) { this.buf = buf; this.pos = 0; }\n"
+"Reader.prototype.u32 = function () {\n"
+"  var b = this.buf, p = this.pos;\n"
+"  this.pos += 4;\n"
+"  return ((b[p] << 24) >>> 0) + (b[p+1] << 16) + (b[p+2] << 8) + b[p+3];\n"
+"};\n"
+"Reader.prototype.f64 = function () {\n"
+"  var hi = this.u32(), lo = this.u32(), s = hi >>> 31 ? -1 : 1;\n"
+"  var e = (hi >>> 20) & 2047, m = (hi & 1048575) * 4294967296 + lo;\n"
+"  if (e === 2047) return m ? NaN : s * Infinity;\n"
+"  if (e === 0)  // subnormal\n"
+"    return s * (m / 4503599627370496) * Math.pow(2, -1022);\n"
+"  return s * (1 + m / 4503599627370496) * Math.pow(2, e - 1023);\n"
+"};\n"
+"Reader.prototype.str = function () {\n"
+"  var n = this.u32(), s = n ? this.buf.toString('utf8', this.pos,\n"
+"                                                this.pos + n) : '';\n"
+"  this.pos += n;\n"
+"  return s;\n"
+"};\n"
+"Reader.prototype.value = function () {\n"
+"  var tag = this.buf[this.pos++], n, i, v;\n"
+"  switch (tag) {\n"
+"    case 122: return null;\n"
+"    case 116: return true;\n"
+"    case 102: return false;\n"
+"    case 105: return this.u32() | 0;\n"
+"    case 100: return this.f64();\n"
+"    case 68: return new Date(this.f64());\n"
+"    case 115: return this.str();\n"
+"    case 98:\n"
+"      n = this.u32();\n"
+"      v = this.buf.slice(this.pos, this.pos + n);\n"
+"      this.pos += n;\n"
+"      return v;\n"
+"    case 97:\n"
+"      n = this.u32(); v = new Array(n);\n"
+"      for (i = 0; i < n; ++i) v[i] = this.value();\n"
+"      return v;\n"
+"    case 111:\n"
+"      n = this.u32(); v = {};\n"
+"      for (i = 0; i < n; ++i) { this.pos++; var k = this.str();\n"
+"                                v[k] = this.value(); }\n"
+"      return v;\n"
+"  }\n"
+"  throw new Error('malformed message');\n"
+"};\n"
+"\n"
+"function send(msg) {\n"
+"  var w = new Writer();\n"
+"  msg.push(process.memoryUsage().rss);\n"
+"  try {\n"
+"    w.value(msg, 0);\n"
+"  } catch (e) {\n"
+"    w = new Writer();\n"
+"    w.value([msg[0], String(e), null, msg[3]], 0);\n"
+"  }\n"
+"  out.write(w.frame());\n"
+"}\n"
+"\n"
+"function run(msg) {\n"
+"  var id = msg[0], name = msg[1], args = msg[2] || [], done = false;\n"
+"  function reply(err, result) {\n"
+"    if (done) return;\n"
+"    done = true;\n"
+"    send([id, err ? String(err.stack || err) : null, result]);\n"
+"  }\n"
+"  var fn = script[name];\n"
+"  if (typeof fn !== 'function') return reply('no such function: ' + name);\n"
+"  try {\n"
+"    var result = fn.apply(script, args.concat([reply]));\n"
+"    if (result !== undefined) reply(null, result);\n"
+"  } catch (e) {\n"
+"    reply(e);\n"
+"  }\n"
+"}\n"
+"\n"
+"var input = null;\n"
+"var stdin = process.openStdin();\n"
+"stdin.on('data', function (chunk) {\n"
+"  if (input) {\n"
+"    var b = new Buffer(input.length + chunk.length);\n"
+"    input.copy(b, 0, 0, input.length);\n"
+"    chunk.copy(b, input.length, 0, chunk.length);\n"
+"    input = b;\n"
+"  } else {\n"
+"    input = chunk;\n"
+"  }\n"
+"  while (input && input.length >= 4) {\n"
+"    var n = new Reader(input).u32();\n"
+"    if (input.length < 4 + n) break;\n"
+"    var msg = new Reader(input.slice(4, 4 + n)).value();\n"
+"    input = input.length > 4 + n ? input.slice(4 + n) : null;\n"
+"    run(msg);\n"
+"  }\n"
+"});\n"
+"stdin.on('end', function () { process.exit(0); });\n";
+
+static const uint32_t kMaxFrameLength = 256 * 1024 * 1024;
+
+struct Job {
+  NSString* name;
+  NSArray* args;
+  NodeWorkerCallback callback;
+  CFAbsoluteTime dispatched;
+};
+
+struct NodeWorker {
+  NSUInteger index;
+
+  // Deque of jobs (a ring buffer) and counters, guarded by |lock|
+  NodeJSSpinLock lock;
+  Job** jobs;
+  NSUInteger head;
+  NSUInteger count;
+  NSUInteger capacity;
+  NodeWorkerStats stats;
+
+  // Node process, only touched by the worker's thread
+  NSTask* task;
+  int writeFd;
+  int readFd;
+  uint32_t nextId;
+  NSUInteger jobsRun;      // by the current process
+  uint64_t residentSize;   // of the current process, as of its last reply
+};
+
+
+// -----------------------------------------------------------------------------
+// Deques. The owner takes jobs from the front, thieves from the back.
+
+static void PushBack(NodeWorker* w, Job* job) {
+  NodeJSSpinLockLock(&w->lock);
+  if (w->count == w->capacity) {
+    NSUInteger capacity = w->capacity ? w->capacity * 2 : 64;
+    Job** jobs = (Job**)malloc(sizeof(Job*) * capacity);
+    for (NSUInteger i = 0; i < w->count; ++i)
+      jobs[i] = w->jobs[(w->head + i) % w->capacity];
+    free(w->jobs);
+    w->jobs = jobs;
+    w->head = 0;
+    w->capacity = capacity;
+  }
+  w->jobs[(w->head + w->count++) % w->capacity] = job;
+  w->stats.dispatched++;
+  NodeJSSpinLockUnlock(&w->lock);
+}
+
+
+static Job* PopFront(NodeWorker* w) {
+  Job* job = NULL;
+  NodeJSSpinLockLock(&w->lock);
+  if (w->count) {
+    job = w->jobs[w->head];
+    w->head = (w->head + 1) % w->capacity;
+    w->count--;
+  }
+  NodeJSSpinLockUnlock(&w->lock);
+  return job;
+}
+
+
+static Job* PopBack(NodeWorker* w) {
+  Job* job = NULL;
+  NodeJSSpinLockLock(&w->lock);
+  if (w->count)
+    job = w->jobs[(w->head + --w->count) % w->capacity];
+  NodeJSSpinLockUnlock(&w->lock);
+  return job;
+}
+
+
+static Job* TakeJob(NodeWorker* workers, NSUInteger count, NodeWorker* w) {
+  Job* job = PopFront(w);
+  if (job) return job;
+  for (NSUInteger k = 1; k < count; ++k) {
+    if ((job = PopBack(&workers[(w->index + k) % count]))) {
+      NodeJSSpinLockLock(&w->lock);
+      w->stats.stolen++;
+      NodeJSSpinLockUnlock(&w->lock);
+      return job;
+    }
+  }
+  return NULL;
+}
+
+// -----------------------------------------------------------------------------
+
+static BOOL WriteAll(int fd, const void* bytes, size_t length) {
+  const char* p = (const char*)bytes;
+  while (length) {
+    ssize_t n = write(fd, p, length);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return NO;
+    p += n;
+    length -= n;
+  }
+  return YES;
+}
+
+
+// Waits until |fd| is readable (or closed). Returns NO once |deadline| (0 for
+// none) has passed.
+static BOOL WaitReadable(int fd, CFAbsoluteTime deadline) {
+  if (!deadline) return YES;
+  while (1) {
+    CFAbsoluteTime remaining = deadline - CFAbsoluteTimeGetCurrent();
+    if (remaining <= 0) return NO;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int n = poll(&pfd, 1, (int)ceil(remaining * 1000));
+    if (n > 0 || (n < 0 && errno != EINTR))
+      return YES;  // read() reports hangups and errors
+  }
+}
+
+
+static BOOL ReadAll(int fd, void* bytes, size_t length,
+                    CFAbsoluteTime deadline, BOOL* timedOut) {
+  char* p = (char*)bytes;
+  while (length) {
+    if (!WaitReadable(fd, deadline)) {
+      *timedOut = YES;
+      return NO;
+    }
+    ssize_t n = read(fd, p, length);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return NO;
+    p += n;
+    length -= n;
+  }
+  return YES;
+}
+
+
+// Reads one frame, returning nil if the pipe was closed or |deadline| passed
+static NSData* ReadFrame(int fd, CFAbsoluteTime deadline, BOOL* timedOut) {
+  uint32_t length;
+  if (!ReadAll(fd, &length, 4, deadline, timedOut)) return nil;
+  length = CFSwapInt32BigToHost(length);
+  if (length > kMaxFrameLength) return nil;
+  NSMutableData* frame = [NSMutableData dataWithLength:length];
+  if (!ReadAll(fd, [frame mutableBytes], length, deadline, timedOut))
+    return nil;
+  return frame;
+}
+
+
+static NSString* DefaultNodeExecutablePath() {
+  static NSString* locations[] = {
+    @"/usr/local/bin/node",
+    @"/usr/bin/node",
+    @"/opt/local/bin/node"
+  };
+  NSFileManager* fm = [NSFileManager defaultManager];
+  for (size_t i = 0; i < sizeof(locations) / sizeof(locations[0]); ++i) {
+    if ([fm isExecutableFileAtPath:locations[i]])
+      return locations[i];
+  }
+  return nil;
+}
+
+
+@interface NodeWorkerPool (Private)
+- (void)_workerMain:(NSValue*)worker;
+@end
+
+
+@implementation NodeWorkerPool
+
+@synthesize workerCount = workerCount_,
+            searchPaths = searchPaths_,
+            nodeExecutablePath = nodeExecutablePath_,
+            prewarm = prewarm_,
+            maxJobsPerProcess = maxJobsPerProcess_,
+            maxResidentSize = maxResidentSize_,
+            jobTimeout = jobTimeout_;
+
+
+- (id)initWithScriptPath:(NSString *)scriptPath {
+  return [self initWithScriptPath:scriptPath workerCount:
+      [[NSProcessInfo processInfo] activeProcessorCount]];
+}
+
+
+- (id)initWithScriptPath:(NSString *)scriptPath
+             workerCount:(NSUInteger)workerCount {
+  if (!(self = [super init])) return nil;
+  if (![scriptPath isAbsolutePath]) {
+    // relative to "<bundle>/Resources", like NodeThread
+    scriptPath = [[[NSBundle mainBundle] resourcePath]
+        stringByAppendingPathComponent:scriptPath];
+  }
+  scriptPath_ = [scriptPath retain];
+  nodeExecutablePath_ = [DefaultNodeExecutablePath() retain];
+  workerCount_ = MAX(workerCount, (NSUInteger)1);
+  workers_ = (NodeWorker*)calloc(workerCount_, sizeof(NodeWorker));
+  for (NSUInteger i = 0; i < workerCount_; ++i) {
+    workers_[i].index = i;
+    workers_[i].lock = NODEJS_SPINLOCK_INIT;
+    workers_[i].writeFd = workers_[i].readFd = -1;
+  }
+  pthread_mutex_init(&idleMutex_, NULL);
+  pthread_cond_init(&idleCond_, NULL);
+  return self;
+}
+
+
+- (void)dealloc {
+  // Note: worker threads retain the pool, so they have all exited by now
+  for (NSUInteger i = 0; i < workerCount_; ++i)
+    free(workers_[i].jobs);
+  free(workers_);
+  if (bootstrapPath_) {
+    [[NSFileManager defaultManager] removeItemAtPath:bootstrapPath_ error:nil];
+    [bootstrapPath_ release];
+  }
+  pthread_mutex_destroy(&idleMutex_);
+  pthread_cond_destroy(&idleCond_);
+  [scriptPath_ release];
+  [nodeExecutablePath_ release];
+  [searchPaths_ release];
+  [super dealloc];
+}
+
+
+- (BOOL)start:(NSError **)error {
+  if (started_) return running_;
+  if (!nodeExecutablePath_) {
+    if (error) {
+      *error = [NSError nodeErrorWithLocalizedDescription:
+          @"node executable not found"];
+    }
+    return NO;
+  }
+  NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent:
+      [NSString stringWithFormat:@"NodeWorkerPool-%d-%p.js",
+          [[NSProcessInfo processInfo] processIdentifier], self]];
+  if (![[NSString stringWithUTF8String:kBootstrapSource]
+      writeToFile:path atomically:YES encoding:NSUTF8StringEncoding
+            error:error]) {
+    return NO;
+  }
+  bootstrapPath_ = [path retain];
+
+  // A worker which dies while we write to it must not take us down with it
+  signal(SIGPIPE, SIG_IGN);
+
+  started_ = YES;
+  running_ = YES;
+  for (NSUInteger i = 0; i < workerCount_; ++i) {
+    [NSThread detachNewThreadSelector:@selector(_workerMain:) toTarget:self
+        withObject:[NSValue valueWithPointer:&workers_[i]]];
+  }
+  return YES;
+}
+
+
+static void CompleteJob(NodeWorker* w, Job* job, NSError* error, id result) {
+  CFAbsoluteTime latency = CFAbsoluteTimeGetCurrent() - job->dispatched;
+  NodeJSSpinLockLock(&w->lock);
+  w->stats.completed++;
+  w->stats.totalLatency += latency;
+  if (latency > w->stats.maxLatency) w->stats.maxLatency = latency;
+  NodeJSSpinLockUnlock(&w->lock);
+
+  NodeWorkerCallback callback = job->callback;
+  if (callback) {
+    // Note: The block retains |callback|, |error| and |result|
+    CFRunLoopRef runloop = CFRunLoopGetMain();
+    CFRunLoopPerformBlock(runloop, kCFRunLoopCommonModes, ^{
+      callback(error, result);
+    });
+    CFRunLoopWakeUp(runloop);
+  }
+  [job->name release];
+  [job->args release];
+  [job->callback release];
+  delete job;
+}
+
+
+- (void)stop {
+  pthread_mutex_lock(&idleMutex_);
+  running_ = NO;
+  pthread_cond_broadcast(&idleCond_);
+  pthread_mutex_unlock(&idleMutex_);
+  NSError* error = [NSError nodeErrorWithLocalizedDescription:@"pool stopped"];
+  for (NSUInteger i = 0; i < workerCount_; ++i) {
+    Job* job;
+    while ((job = PopFront(&workers_[i])))
+      CompleteJob(&workers_[i], job, error, nil);
+  }
+}
+
+
+- (BOOL)dispatch:(NSString *)functionName
+            args:(NSArray *)args
+        callback:(NodeWorkerCallback)callback {
+  Job* job = new Job;
+  job->name = [functionName copy];
+  job->args = [args retain];
+  job->callback = [callback copy];
+  job->dispatched = CFAbsoluteTimeGetCurrent();
+  uint32_t i = (uint32_t)NodeJSAtomicIncrement32(&nextWorker_);
+  // Checked and pushed under the lock |stop| takes, so a job is either pushed
+  // before |stop| drains the deques or not at all
+  pthread_mutex_lock(&idleMutex_);
+  BOOL running = running_;
+  if (running) {
+    PushBack(&workers_[i % workerCount_], job);
+    // wake an idle worker (which might steal the job)
+    pthread_cond_signal(&idleCond_);
+  }
+  pthread_mutex_unlock(&idleMutex_);
+  if (!running) {
+    [job->name release];
+    [job->args release];
+    [job->callback release];
+    delete job;
+  }
+  return running;
+}
+
+
+- (NodeWorkerStats)statisticsForWorker:(NSUInteger)index {
+  assert(index < workerCount_);
+  NodeWorker* w = &workers_[index];
+  NodeJSSpinLockLock(&w->lock);
+  NodeWorkerStats stats = w->stats;
+  stats.queued = w->count;
+  NodeJSSpinLockUnlock(&w->lock);
+  return stats;
+}
+
+
+// -----------------------------------------------------------------------------
+// Worker thread
+
+- (Job*)_takeJobForWorker:(NodeWorker*)w {
+  Job* job = running_ ? TakeJob(workers_, workerCount_, w) : NULL;
+  if (job || !running_) return job;
+  pthread_mutex_lock(&idleMutex_);
+  while (running_ && !(job = TakeJob(workers_, workerCount_, w)))
+    pthread_cond_wait(&idleCond_, &idleMutex_);
+  pthread_mutex_unlock(&idleMutex_);
+  return job;
+}
+
+
+- (NSArray*)_searchPathsForWorker:(NodeWorker*)w {
+  if (![searchPaths_ count]) return nil;
+  id paths = [searchPaths_ objectAtIndex:w->index % [searchPaths_ count]];
+  return [paths isKindOfClass:[NSArray class]] ? paths : searchPaths_;
+}
+
+
+- (BOOL)_launchWorker:(NodeWorker*)w error:(NSError**)error {
+  NSTask* task = [[NSTask alloc] init];
+  [task setLaunchPath:nodeExecutablePath_];
+  [task setArguments:[NSArray arrayWithObjects:bootstrapPath_, scriptPath_,
+                                               nil]];
+  NSArray* paths = [self _searchPathsForWorker:w];
+  if (paths) {
+    NSMutableDictionary* env = [NSMutableDictionary dictionaryWithDictionary:
+        [[NSProcessInfo processInfo] environment]];
+    [env setObject:[paths componentsJoinedByString:@":"] forKey:@"NODE_PATH"];
+    [task setEnvironment:env];
+  }
+  NSPipe* input = [NSPipe pipe];
+  NSPipe* output = [NSPipe pipe];
+  [task setStandardInput:input];
+  [task setStandardOutput:output];
+  @try {
+    [task launch];
+  } @catch (NSException* e) {
+    if (error)
+      *error = [NSError nodeErrorWithLocalizedDescription:[e reason]];
+    [task release];
+    return NO;
+  }
+  // Keep our own descriptors (the pipes close theirs when deallocated)
+  w->writeFd = dup([[input fileHandleForWriting] fileDescriptor]);
+  w->readFd = dup([[output fileHandleForReading] fileDescriptor]);
+  [[input fileHandleForReading] closeFile];
+  [[output fileHandleForWriting] closeFile];
+  w->task = task;
+  w->jobsRun = 0;
+  w->residentSize = 0;
+  NodeJSSpinLockLock(&w->lock);
+  w->stats.restarts++;
+  NodeJSSpinLockUnlock(&w->lock);
+  return YES;
+}
+
+
+- (void)_terminateWorker:(NodeWorker*)w {
+  if (!w->task) return;
+  close(w->writeFd);
+  close(w->readFd);
+  w->writeFd = w->readFd = -1;
+  if ([w->task isRunning])
+    [w->task terminate];
+  [w->task release];
+  w->task = nil;
+}
+
+
+- (id)_runJob:(Job*)job onWorker:(NodeWorker*)w error:(NSError**)error {
+  if (!w->task && ![self _launchWorker:w error:error])
+    return nil;
+
+  // Request: [id, name, args]
+  uint32_t jobId = ++w->nextId;
+  NSArray* request = [NSArray arrayWithObjects:
+      [NSNumber numberWithUnsignedInt:jobId], job->name,
+      job->args ? (id)job->args : (id)[NSArray array], nil];
+  NSMutableData* frame = [NSMutableData dataWithLength:4];
+  if (!NodeJSWireEncode(request, frame, error))
+    return nil;
+  uint32_t length = CFSwapInt32HostToBig((uint32_t)[frame length] - 4);
+  memcpy([frame mutableBytes], &length, 4);
+
+  // Reply: [id, error, result, rss]
+  CFAbsoluteTime deadline =
+      jobTimeout_ > 0 ? CFAbsoluteTimeGetCurrent() + jobTimeout_ : 0;
+  BOOL timedOut = NO;
+  NSData* replyFrame = nil;
+  if (WriteAll(w->writeFd, [frame bytes], [frame length]))
+    replyFrame = ReadFrame(w->readFd, deadline, &timedOut);
+  NSArray* reply = replyFrame ? NodeJSWireDecodeData(replyFrame, NULL) : nil;
+  if (![reply isKindOfClass:[NSArray class]] || [reply count] < 3 ||
+      [[reply objectAtIndex:0] unsignedIntValue] != jobId) {
+    // the process died, hangs or we're out of sync -- start over with a new one
+    if (timedOut) {
+      // it might be spinning (or handling SIGTERM), so don't ask politely
+      kill([w->task processIdentifier], SIGKILL);
+      NodeJSSpinLockLock(&w->lock);
+      w->stats.timeouts++;
+      NodeJSSpinLockUnlock(&w->lock);
+    }
+    [self _terminateWorker:w];
+    if (error) {
+      *error = [NSError nodeErrorWithLocalizedDescription:
+          timedOut ? @"job timed out" : @"worker process exited"];
+    }
+    return nil;
+  }
+  w->jobsRun++;
+  if ([reply count] > 3)
+    w->residentSize = [[reply objectAtIndex:3] unsignedLongLongValue];
+  id err = [reply objectAtIndex:1];
+  if (err != [NSNull null]) {
+    if (error)
+      *error = [NSError nodeErrorWithLocalizedDescription:[err description]];
+    return nil;
+  }
+  return [reply objectAtIndex:2];
+}
+
+
+// Replaces the worker's process if it's over its limits
+- (void)_recycleWorkerIfNeeded:(NodeWorker*)w {
+  if (!w->task) return;
+  if ((!maxJobsPerProcess_ || w->jobsRun < maxJobsPerProcess_) &&
+      (!maxResidentSize_ || w->residentSize <= maxResidentSize_)) {
+    return;
+  }
+  [self _terminateWorker:w];
+  NodeJSSpinLockLock(&w->lock);
+  w->stats.recycled++;
+  NodeJSSpinLockUnlock(&w->lock);
+  if (prewarm_ && running_)
+    [self _launchWorker:w error:NULL];
+}
+
+
+- (void)_workerMain:(NSValue*)worker {
+  NodeWorker* w = (NodeWorker*)[worker pointerValue];
+  NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+  [[NSThread currentThread] setName:
+      [NSString stringWithFormat:@"NodeWorkerPool worker %u",
+                                 (unsigned)w->index]];
+  // a failure here is reported by the first job, which tries again
+  if (prewarm_)
+    [self _launchWorker:w error:NULL];
+  [pool drain];
+  Job* job;
+  while ((job = [self _takeJobForWorker:w])) {
+    pool = [[NSAutoreleasePool alloc] init];
+    NSError* error = nil;
+    id result = [self _runJob:job onWorker:w error:&error];
+    CompleteJob(w, job, error, result);
+    [self _recycleWorkerIfNeeded:w];
+    [pool drain];
+  }
+  [self _terminateWorker:w];
+}
+
+@end